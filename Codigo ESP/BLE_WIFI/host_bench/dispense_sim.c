@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "medication_storage.h"
+#include "medication_scheduler.h"
+#include "medication_clock.h"
+#include "medication_hardware.h"
+#include "medication_dispense_job.h"
+#include "host_nvs.h"
+#include "host_esp.h"
+#include "hal_sim.h"
+
+// Simulación del recorrido completo horario -> dispensación -> aviso sobre
+// el backend simulado del HAL. El planificador entrega las dosis vencidas,
+// medication_dispense_job ejecuta la máquina de estados real del hardware
+// (recipiente, servos, bomba, buzzer) y el resultado se registra como en
+// medication_dispenser.c. Las esperas adelantan un reloj virtual, así que
+// semanas de tomas se simulan en milisegundos. La salida es estable para
+// compararla con diff; el tiempo real va a stderr.
+
+#define MS_PER_MINUTE   (60 * 1000LL)
+#define MS_PER_HOUR     (60 * MS_PER_MINUTE)
+#define MS_PER_DAY      (24 * MS_PER_HOUR)
+
+#define SIM_MAX_JOBS    10000
+
+// Error máximo del volumen de líquido de un trabajo respecto al pedido
+#define SIM_VOLUME_TOLERANCE_PERMILLE 30
+
+typedef struct {
+    const char *name;
+    const char *start;              // Hora UTC "AAAA-MM-DD HH:MM"
+    int days;
+    int64_t window_ms;              // Ventana de agrupación de dosis
+    uint32_t reaction_ms;           // Desde el vencimiento hasta que se coloca el recipiente
+    uint32_t reaction_jitter_ms;    // Se suma un valor aleatorio en [0, jitter)
+    uint16_t absent_permille;       // Tomas en las que nadie coloca el recipiente
+    bool calibrate_pump;            // Calibrar la bomba antes de la primera dosis
+    int64_t manual_lead_ms;         // Dosis manual así de antes de la primera programada (0 = ninguna)
+    hal_sim_config_t hal;
+    const char *medications;        // Arreglo JSON de medicamentos
+} sim_scenario_t;
+
+static const char daily_medications[] =
+    "[{\"id\":\"med-a\",\"name\":\"Manana y noche\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+    "\"totalPills\":1000,\"schedules\":["
+    "{\"id\":\"diario-0800\",\"time\":480,\"days\":[1,2,3,4,5,6,7]},"
+    "{\"id\":\"diario-2000\",\"time\":1200,\"days\":[1,2,3,4,5,6,7]}]},"
+    "{\"id\":\"med-b\",\"name\":\"Desayuno\",\"compartment\":2,\"type\":\"pill\",\"pillsPerDose\":2,"
+    "\"totalPills\":1000,\"schedules\":["
+    "{\"id\":\"diario-0800b\",\"time\":480,\"days\":[1,2,3,4,5,6,7]}]},"
+    "{\"id\":\"med-c\",\"name\":\"Laborables\",\"compartment\":3,\"type\":\"pill\",\"pillsPerDose\":1,"
+    "\"totalPills\":1000,\"schedules\":["
+    "{\"id\":\"lv-1300\",\"time\":780,\"days\":[1,2,3,4,5]}]},"
+    "{\"id\":\"med-l\",\"name\":\"Jarabe\",\"compartment\":4,\"type\":\"liquid\",\"pillsPerDose\":2.5,"
+    "\"totalPills\":0,\"schedules\":["
+    "{\"id\":\"diario-1400\",\"time\":840,\"days\":[1,2,3,4,5,6,7]}]}]";
+
+static const char interval_medications[] =
+    "[{\"id\":\"med-i\",\"name\":\"Cada 8 horas\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+    "\"totalPills\":1000,\"schedules\":["
+    "{\"id\":\"int-8h\",\"time\":480,\"intervalMode\":true,\"intervalHours\":8}]}]";
+
+static const sim_scenario_t scenarios[] = {
+    {
+        .name = "nominal",
+        .start = "2025-01-06 00:00",
+        .days = 14,
+        .reaction_ms = 20000,
+        .reaction_jitter_ms = 30000,
+        .hal = { .seed = 1 },
+        .medications = daily_medications,
+    },
+    {
+        .name = "faults",
+        .start = "2025-01-06 00:00",
+        .days = 14,
+        .reaction_ms = 40000,
+        .reaction_jitter_ms = 40000,
+        .absent_permille = 100,
+        .calibrate_pump = true,
+        .hal = {
+            .seed = 7,
+            .servo_latency_ms = 40,
+            .echo_latency_us = 200,
+            .display_byte_us = 1042,
+            .echo_loss_permille = 150,
+            .servo_stall_permille = 30,
+            .echo_noise_mm = 8,
+            // Bomba más débil que la de fábrica: sin calibrar faltaría líquido
+            .pump_max_ul_s = 1700,
+            .pump_stall_duty = 20,
+        },
+        .medications = daily_medications,
+    },
+    {
+        // Dosis manual cinco minutos antes de la automática: no se repite
+        .name = "manual",
+        .start = "2025-01-06 00:00",
+        .days = 3,
+        .reaction_ms = 20000,
+        .manual_lead_ms = 5 * MS_PER_MINUTE,
+        .hal = { .seed = 3 },
+        .medications = interval_medications,
+    },
+};
+#define SCENARIO_COUNT ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+// ---------------------------------------------------------------------------
+// Resultados e invariantes
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int doses;
+    int ok;
+    int no_container;
+    int errors;
+    uint32_t pills_expected;        // Píldoras de las dosis con ESP_OK
+    uint32_t liquid_doses;
+    int64_t liquid_ul_expected;     // Volumen pedido por las dosis con ESP_OK
+    uint32_t volume_error_permille; // Peor error de volumen de un trabajo
+    uint32_t calibration_runs;
+    int64_t hardware_ms;            // Tiempo simulado dentro de los trabajos
+} sim_totals_t;
+
+static sim_totals_t totals;
+static bool container_absent;
+static int failures = 0;
+static const char *current_scenario = "";
+
+// Última dosis dispensada de cada horario, para detectar dosis repetidas
+#define SIM_MAX_SCHEDULES 16
+static struct {
+    char schedule_id[32];
+    int64_t time_ms;
+} last_doses[SIM_MAX_SCHEDULES];
+static int last_doses_count;
+
+// Simula una dosis que entra en cola mientras corre el autotest
+static bool dose_queued(void) {
+    return true;
+}
+
+static void fail(const char *scenario, const char *what) {
+    printf("FALLO %s: %s\n", scenario, what);
+    failures++;
+}
+
+static void format_utc(int64_t ms, char *buf, size_t size) {
+    time_t secs = (time_t)(ms / 1000);
+    struct tm utc;
+    gmtime_r(&secs, &utc);
+    strftime(buf, size, "%Y-%m-%d %H:%M", &utc);
+}
+
+static int64_t parse_utc(const char *text) {
+    struct tm utc = { 0 };
+    if (sscanf(text, "%d-%d-%d %d:%d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday,
+               &utc.tm_hour, &utc.tm_min) != 5) {
+        return 0;
+    }
+    utc.tm_year -= 1900;
+    utc.tm_mon -= 1;
+    return (int64_t)timegm(&utc) * 1000;
+}
+
+// Dos dosis del mismo horario nunca van más juntas de lo que una manual
+// puede adelantarse a la programada
+static void check_repeated_dose(const char *schedule_id, int64_t now_ms) {
+    int i = 0;
+    while (i < last_doses_count && strcmp(last_doses[i].schedule_id, schedule_id) != 0) {
+        i++;
+    }
+    if (i == last_doses_count) {
+        if (last_doses_count == SIM_MAX_SCHEDULES) {
+            return;
+        }
+        snprintf(last_doses[i].schedule_id, sizeof(last_doses[i].schedule_id), "%s", schedule_id);
+        last_doses_count++;
+    } else if (now_ms - last_doses[i].time_ms < MEDICATION_MANUAL_DOSE_ADVANCE_MS) {
+        fail(current_scenario, "dosis repetida del mismo horario");
+    }
+    last_doses[i].time_ms = now_ms;
+}
+
+// Aviso del resultado: igual que dispense_job_done() en medication_dispenser.c
+static void sim_job_done(const medication_dispense_job_t *job, const esp_err_t *results) {
+    for (int i = 0; i < job->item_count; i++) {
+        const medication_dispense_item_t *item = &job->items[i];
+        esp_err_t result = results[i];
+
+        totals.doses++;
+        if (result == ESP_OK) {
+            totals.ok++;
+            check_repeated_dose(item->schedule_id, hal_sim_now_ms());
+            if (item->is_liquid) {
+                totals.liquid_doses++;
+                totals.liquid_ul_expected += item->amount;
+            } else {
+                totals.pills_expected += item->amount;
+            }
+        } else if (result == ESP_ERR_TIMEOUT) {
+            totals.no_container++;
+        } else {
+            totals.errors++;
+        }
+
+        // Solo las dosis con ESP_OK descuentan pastillas
+        medication_t *med = medication_storage_get_medication_by_handle(item->med_handle);
+        esp_err_t ret = ESP_ERR_NOT_FOUND;
+        if (med && result != ESP_OK) {
+            ret = medication_storage_mark_failed(med->id, item->schedule_id, NULL);
+        } else if (med) {
+            ret = job->manual ? medication_storage_mark_manual_dispensed(med->id, item->schedule_id)
+                              : medication_storage_mark_dispensed(med->id, item->schedule_id);
+        }
+        if (ret != ESP_OK) {
+            printf("FALLO: no se pudo registrar %s\n", item->schedule_id);
+            failures++;
+        }
+
+        printf("  %s/%s comp=%d %s=%lu -> %s\n", med ? med->id : "?", item->schedule_id,
+               item->compartment, item->is_liquid ? "ul" : "pildoras",
+               (unsigned long)item->amount, esp_err_to_name(result));
+    }
+}
+
+// Cantidad de una dosis: igual que prepare_dispense_item() en medication_dispenser.c
+static bool prepare_item(const medication_due_dose_t *dose, medication_dispense_item_t *item) {
+    const medication_t *medication = dose->medication;
+    bool is_liquid = strcmp(medication->type, COMPARTMENT_TYPE_LIQUID) == 0;
+    uint32_t amount;
+
+    if (is_liquid) {
+        int32_t volume_ul = medication->dose_volume_ul;
+        if (volume_ul < MEDICATION_PUMP_MIN_DOSE_UL) volume_ul = MEDICATION_PUMP_MIN_DOSE_UL;
+        if (volume_ul > MEDICATION_PUMP_MAX_DOSE_UL) volume_ul = MEDICATION_PUMP_MAX_DOSE_UL;
+        amount = (uint32_t)volume_ul;
+    } else {
+        amount = medication->pills_per_dose < 1 ? 1 : medication->pills_per_dose;
+    }
+
+    memset(item, 0, sizeof(*item));
+    item->med_handle = medication_storage_get_handle(medication->id);
+    item->compartment = medication->compartment;
+    item->is_liquid = is_liquid;
+    item->amount = amount;
+    snprintf(item->schedule_id, sizeof(item->schedule_id), "%s", dose->schedule->id);
+    return item->med_handle != MEDICATION_HANDLE_INVALID;
+}
+
+// Calibración como la haría el usuario: una pasada por punto de la tabla,
+// midiendo el volumen bombeado (aquí, el del modelo del simulador)
+static void calibrate_pump(const char *scenario) {
+    medication_pump_point_t points[MEDICATION_PUMP_CAL_POINTS];
+    medication_pump_get_table(points);
+
+    printf("calibración de la bomba:");
+    for (int i = 0; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        hal_sim_stats_t before, after;
+        hal_sim_get_stats(&before);
+        esp_err_t err = medication_hardware_pump_calibration_run(points[i].duty);
+        hal_sim_get_stats(&after);
+        totals.calibration_runs++;
+
+        uint32_t measured_ul = (uint32_t)(after.pump_volume_ul - before.pump_volume_ul);
+        if (err != ESP_OK ||
+            medication_pump_calibrate_point(points[i].duty, MEDICATION_PUMP_CAL_RUN_MS, measured_ul) != ESP_OK) {
+            fail(scenario, "no se pudo calibrar la bomba");
+            return;
+        }
+        printf(" %d%%=%lu", points[i].duty, (unsigned long)medication_pump_flow(points[i].duty));
+    }
+    printf(" ul/s\n");
+}
+
+// ---------------------------------------------------------------------------
+// Escenarios
+// ---------------------------------------------------------------------------
+
+// Pastillas que quedan en todos los compartimentos de píldoras
+static int64_t pills_in_stock(void) {
+    int count = 0;
+    medication_t *meds = medication_storage_get_all_medications(&count);
+    int64_t pills = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(meds[i].type, COMPARTMENT_TYPE_LIQUID) != 0) {
+            pills += meds[i].total_pills;
+        }
+    }
+    return pills;
+}
+
+// Dosis manual del horario que vence en deadline, pedida lead_ms antes. Como
+// medication_dispenser_manual_dispense(): un trabajo de una dosis marcado manual.
+static void run_manual_dose(const sim_scenario_t *sc, int64_t deadline, int med_idx, int sched_idx) {
+    hal_sim_advance_to_ms(deadline - sc->manual_lead_ms);
+    int64_t now_ms = hal_sim_now_ms();
+
+    int count = 0;
+    medication_t *meds = medication_storage_get_all_medications(&count);
+    medication_due_dose_t dose = {
+        .medication = &meds[med_idx],
+        .schedule = &meds[med_idx].schedules[sched_idx],
+    };
+    medication_dispense_job_t job = { .item_count = 1, .manual = true, .done_cb = sim_job_done };
+    if (!prepare_item(&dose, &job.items[0])) {
+        fail(sc->name, "no se pudo preparar la dosis manual");
+        return;
+    }
+
+    char now_str[32];
+    format_utc(now_ms, now_str, sizeof(now_str));
+    printf("%s manual: %s\n", now_str, dose.schedule->id);
+
+    hal_sim_place_container(now_ms + sc->reaction_ms);
+    medication_dispense_job_run(&job, NULL);
+    hal_sim_remove_container();
+
+    // La programada queda sustituida: el horario ya no vence en deadline
+    int64_t next = INT64_MAX;
+    int next_med = -1;
+    int next_sched = -1;
+    medication_scheduler_peek(&next, &next_med, &next_sched);
+    if (dose.schedule->next_dispense_time <= deadline ||
+        (next <= deadline && next_med == med_idx && next_sched == sched_idx)) {
+        fail(sc->name, "la dosis programada se repite tras la manual");
+    }
+}
+
+static void load_medications(const char *medications) {
+    medication_storage_process_json(
+        "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":[]}}");
+    host_nvs_reset();
+    medication_storage_init();
+
+    static char payload[8192];
+    snprintf(payload, sizeof(payload),
+             "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":%s}}",
+             medications);
+    medication_storage_process_json(payload);
+}
+
+static void run_scenario(const sim_scenario_t *sc) {
+    int64_t start_ms = parse_utc(sc->start);
+    int64_t end_ms = start_ms + sc->days * MS_PER_DAY;
+
+    hal_sim_reset(&sc->hal, start_ms);
+    memset(&totals, 0, sizeof(totals));
+    current_scenario = sc->name;
+    last_doses_count = 0;
+    load_medications(sc->medications);
+    int64_t stock_before = pills_in_stock();
+
+    char now_str[32];
+    format_utc(start_ms, now_str, sizeof(now_str));
+    printf("== %s (desde %s UTC, %d días, semilla %lu)\n", sc->name, now_str, sc->days,
+           (unsigned long)sc->hal.seed);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Arranque rápido: solo la puesta en marcha del hardware
+    if (medication_hardware_init() != ESP_OK) {
+        fail(sc->name, "no se pudo inicializar el hardware simulado");
+        return;
+    }
+    printf("arranque del hardware: %.2f s\n", (hal_sim_now_ms() - start_ms) / 1000.0);
+
+    // El autotest diferido cede el hardware si llega una dosis y se repite
+    // después, como en la tarea de dispensación con la cola vacía
+    int64_t test_ms = hal_sim_now_ms();
+    if (medication_hardware_self_test(dose_queued) != ESP_ERR_NOT_FINISHED) {
+        fail(sc->name, "el autotest no cedió el hardware a una dosis");
+    }
+    printf("autotest interrumpido por una dosis: %.2f s\n", (hal_sim_now_ms() - test_ms) / 1000.0);
+    test_ms = hal_sim_now_ms();
+    esp_err_t self_test = medication_hardware_self_test(NULL);
+    printf("autotest: %s en %.2f s\n", esp_err_to_name(self_test), (hal_sim_now_ms() - test_ms) / 1000.0);
+    if (sc->hal.servo_stall_permille == 0 && sc->hal.echo_loss_permille == 0 && self_test != ESP_OK) {
+        fail(sc->name, "autotest fallido sin fallos simulados");
+    }
+
+    if (sc->calibrate_pump) {
+        calibrate_pump(sc->name);
+    }
+
+    int jobs = 0;
+    bool manual_pending = sc->manual_lead_ms > 0;
+    while (jobs < SIM_MAX_JOBS) {
+        int64_t deadline = INT64_MAX;
+        int med_idx = -1;
+        int sched_idx = -1;
+        medication_scheduler_peek(&deadline, &med_idx, &sched_idx);
+        if (deadline == INT64_MAX || deadline > end_ms) {
+            break;
+        }
+        if (manual_pending) {
+            manual_pending = false;
+            run_manual_dose(sc, deadline, med_idx, sched_idx);
+            jobs++;
+            continue;
+        }
+        hal_sim_advance_to_ms(deadline);
+
+        int64_t now_ms = hal_sim_now_ms();
+        medication_due_dose_t doses[MEDICATION_DOSE_GROUP_MAX];
+        int count = medication_storage_collect_due(now_ms, sc->window_ms, doses, MEDICATION_DOSE_GROUP_MAX);
+        if (count == 0) {
+            fail(sc->name, "vencimiento sin dosis");
+            break;
+        }
+
+        medication_dispense_job_t job = { .item_count = 0, .done_cb = sim_job_done };
+        for (int i = 0; i < count; i++) {
+            if (prepare_item(&doses[i], &job.items[job.item_count])) {
+                job.item_count++;
+            }
+        }
+        if (job.item_count == 0) {
+            continue;
+        }
+
+        // El usuario coloca el recipiente al rato, o no aparece
+        container_absent = hal_sim_random(1000) < sc->absent_permille;
+        hal_sim_place_container(container_absent ? INT64_MAX
+                                : now_ms + sc->reaction_ms + hal_sim_random(sc->reaction_jitter_ms));
+
+        format_utc(now_ms, now_str, sizeof(now_str));
+        printf("%s trabajo %d: %d dosis%s\n", now_str, jobs + 1, job.item_count,
+               container_absent ? " (sin recipiente)" : "");
+
+        int ok_before = totals.ok;
+        int64_t liquid_before = totals.liquid_ul_expected;
+        hal_sim_stats_t before, after;
+        hal_sim_get_stats(&before);
+        medication_dispense_job_run(&job, NULL);
+        hal_sim_get_stats(&after);
+        totals.hardware_ms += hal_sim_now_ms() - now_ms;
+        if (container_absent && totals.ok != ok_before) {
+            fail(sc->name, "dosis dispensada sin recipiente");
+        }
+
+        // Volumen bombeado frente al pedido por las dosis de líquido del trabajo
+        int64_t requested_ul = totals.liquid_ul_expected - liquid_before;
+        if (requested_ul > 0) {
+            int64_t pumped_ul = after.pump_volume_ul - before.pump_volume_ul;
+            int64_t error_ul = pumped_ul > requested_ul ? pumped_ul - requested_ul : requested_ul - pumped_ul;
+            uint32_t error_permille = (uint32_t)(error_ul * 1000 / requested_ul);
+            if (error_permille > totals.volume_error_permille) {
+                totals.volume_error_permille = error_permille;
+            }
+        }
+
+        hal_sim_remove_container();
+        jobs++;
+    }
+
+    medication_hardware_deinit();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall_ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    hal_sim_stats_t stats;
+    hal_sim_get_stats(&stats);
+
+    printf("-- dosis: %d (ok %d, sin recipiente %d, error %d) en %d trabajos\n",
+           totals.doses, totals.ok, totals.no_container, totals.errors, jobs);
+    printf("-- servos: %lu movimientos, %lu atascos, %lu esperas agotadas\n",
+           (unsigned long)stats.servo_moves, (unsigned long)stats.servo_stalls,
+           (unsigned long)stats.servo_timeouts);
+    printf("-- pildoras liberadas: %lu de %lu\n",
+           (unsigned long)stats.pill_releases, (unsigned long)totals.pills_expected);
+    printf("-- bomba: %lu arranques, %lld ms, %lld ul (pedidos %lld ul, error máximo %.1f %%)\n",
+           (unsigned long)stats.pump_starts, (long long)stats.pump_on_ms, (long long)stats.pump_volume_ul,
+           (long long)totals.liquid_ul_expected, totals.volume_error_permille / 10.0);
+    printf("-- sensor: %lu lecturas, %lu sin eco\n",
+           (unsigned long)stats.echo_reads, (unsigned long)stats.echo_lost);
+    printf("-- avisos: %lu secuencias de buzzer\n", (unsigned long)stats.buzzer_sequences);
+    printf("-- hardware ocupado: %.1f s simulados\n", totals.hardware_ms / 1000.0);
+    fprintf(stderr, "%s: %d trabajos, %.1f s de hardware en %.2f ms\n",
+            sc->name, jobs, totals.hardware_ms / 1000.0, wall_ms);
+
+    // Nunca más píldoras de las pedidas; sin atascos, exactamente las pedidas
+    if (stats.pill_releases > totals.pills_expected ||
+        (sc->hal.servo_stall_permille == 0 && stats.pill_releases != totals.pills_expected)) {
+        fail(sc->name, "las píldoras liberadas no cuadran con las dosis");
+    }
+    if (stock_before - pills_in_stock() != totals.pills_expected) {
+        fail(sc->name, "el recuento de pastillas no cuadra con las dosis dispensadas");
+    }
+    if (stats.pump_starts != totals.liquid_doses + totals.calibration_runs) {
+        fail(sc->name, "la bomba no cuadra con las dosis de líquido");
+    }
+    if (totals.volume_error_permille > SIM_VOLUME_TOLERANCE_PERMILLE) {
+        fail(sc->name, "el volumen bombeado no cuadra con el pedido");
+    }
+    if (sc->absent_permille == 0 && totals.ok != totals.doses) {
+        fail(sc->name, "dosis fallidas con el recipiente colocado");
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--list") == 0) {
+            for (int s = 0; s < SCENARIO_COUNT; s++) {
+                printf("%s\n", scenarios[s].name);
+            }
+            return 0;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            esp_log_level_set("*", ESP_LOG_INFO);
+        } else {
+            fprintf(stderr, "Uso: %s [--scenario NOMBRE] [--list] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (esp_log_level_get("*") != ESP_LOG_INFO) {
+        esp_log_level_set("*", ESP_LOG_NONE);
+    }
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    medication_clock_set_source(hal_sim_now_ms);
+    host_esp_set_time_source(hal_sim_now_us);
+
+    int ran = 0;
+    for (int s = 0; s < SCENARIO_COUNT; s++) {
+        if (only && strcmp(only, scenarios[s].name) != 0) {
+            continue;
+        }
+        run_scenario(&scenarios[s]);
+        ran++;
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "Escenario desconocido: %s\n", only);
+        return 2;
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%d invariantes incumplidos\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_err.h"
+#include "medication_hal.h"
+#include "medication_servo.h"
+#include "hal_sim.h"
+
+#define SIM_SERVO_FRAME_MS      20
+#define SIM_OUTPUTS             40
+#define SIM_CONTAINER_CM        3.0f
+#define SIM_EMPTY_CM            20.0f
+#define SIM_US_PER_CM           (2 / 0.034f)
+#define SIM_PUMP_MAX_UL_S       2000
+#define SIM_PUMP_STALL_DUTY     15
+
+typedef struct {
+    uint32_t pulse_us;
+    int64_t done_us;            // Fin del movimiento en curso; INT64_MAX si se atascó
+} sim_servo_t;
+
+static hal_sim_config_t config;
+static hal_sim_stats_t stats;
+static int64_t now_us;
+static uint32_t rng_state;
+
+static sim_servo_t servos[MEDICATION_SERVO_CHANNELS];
+static int servo_count;
+static uint8_t pump_duty;
+static int64_t pump_on_since_us;
+static int64_t pump_changed_us;
+static int64_t pump_volume_pl;      // µl/s * us = pl
+static bool echo_ready;
+static int64_t container_at_ms;
+static bool outputs[SIM_OUTPUTS];
+
+// xorshift32: reproducible e independiente de la libc
+uint32_t hal_sim_random(uint32_t range) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return range ? rng_state % range : 0;
+}
+
+static bool fault(uint16_t permille) {
+    return permille > 0 && hal_sim_random(1000) < permille;
+}
+
+static void advance_us(int64_t us) {
+    if (us > 0) {
+        now_us += us;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Servos: el movimiento dura lo mismo que la rampa de medication_servo.c
+// ---------------------------------------------------------------------------
+
+static esp_err_t sim_servo_init(const int *gpios, int count, uint32_t initial_us) {
+    if (!gpios || count <= 0 || count > MEDICATION_SERVO_CHANNELS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    servo_count = count;
+    for (int i = 0; i < count; i++) {
+        servos[i] = (sim_servo_t){ .pulse_us = initial_us, .done_us = now_us };
+    }
+    return ESP_OK;
+}
+
+static void sim_servo_deinit(void) {
+    servo_count = 0;
+}
+
+static esp_err_t sim_servo_move(int channel, uint32_t pulse_us, uint32_t duration_ms) {
+    if (channel < 0 || channel >= servo_count) {
+        return servo_count ? ESP_ERR_INVALID_ARG : ESP_ERR_INVALID_STATE;
+    }
+    if (pulse_us < MEDICATION_SERVO_MIN_US) pulse_us = MEDICATION_SERVO_MIN_US;
+    if (pulse_us > MEDICATION_SERVO_MAX_US) pulse_us = MEDICATION_SERVO_MAX_US;
+
+    sim_servo_t *servo = &servos[channel];
+    uint32_t distance = pulse_us > servo->pulse_us ? pulse_us - servo->pulse_us : servo->pulse_us - pulse_us;
+    if (distance == 0) {
+        if (servo->done_us != INT64_MAX) {
+            servo->done_us = now_us;
+        }
+        return ESP_OK;
+    }
+
+    stats.servo_moves++;
+    if (fault(config.servo_stall_permille)) {
+        stats.servo_stalls++;
+        servo->done_us = INT64_MAX;
+        return ESP_OK;
+    }
+
+    uint32_t ms = duration_ms ? duration_ms
+                              : distance * MEDICATION_SERVO_FULL_TRAVEL_MS /
+                                (MEDICATION_SERVO_MAX_US - MEDICATION_SERVO_MIN_US);
+    uint32_t frames = (ms + SIM_SERVO_FRAME_MS - 1) / SIM_SERVO_FRAME_MS;
+    if (frames == 0) {
+        frames = 1;
+    }
+    servo->pulse_us = pulse_us;
+    servo->done_us = now_us + ((int64_t)frames * SIM_SERVO_FRAME_MS + MEDICATION_SERVO_SETTLE_MS +
+                               config.servo_latency_ms) * 1000;
+    if (pulse_us == MEDICATION_SERVO_MAX_US) {
+        stats.pill_releases++;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sim_servo_wait(uint32_t channel_mask, uint32_t timeout_ms) {
+    int64_t done_us = now_us;
+    for (int i = 0; i < servo_count; i++) {
+        if ((channel_mask & (1u << i)) && servos[i].done_us > done_us) {
+            done_us = servos[i].done_us;
+        }
+    }
+
+    int64_t deadline_us = now_us + (int64_t)timeout_ms * 1000;
+    if (done_us > deadline_us) {
+        now_us = deadline_us;
+        stats.servo_timeouts++;
+        return ESP_ERR_TIMEOUT;
+    }
+    now_us = done_us;
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Bomba
+// ---------------------------------------------------------------------------
+
+static esp_err_t sim_pump_init(int gpio, uint32_t frequency_hz) {
+    pump_duty = 0;
+    return frequency_hz ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// Caudal real de la bomba simulada, distinto en general de la tabla de fábrica
+static uint32_t sim_pump_flow(uint8_t duty) {
+    if (duty <= config.pump_stall_duty) {
+        return 0;
+    }
+    return config.pump_max_ul_s * (duty - config.pump_stall_duty) / (100 - config.pump_stall_duty);
+}
+
+static void pump_accumulate(void) {
+    pump_volume_pl += (int64_t)sim_pump_flow(pump_duty) * (now_us - pump_changed_us);
+    pump_changed_us = now_us;
+}
+
+static void sim_pump_set_duty(uint8_t duty_percent) {
+    pump_accumulate();
+    if (duty_percent > 0 && pump_duty == 0) {
+        stats.pump_starts++;
+        pump_on_since_us = now_us;
+    } else if (duty_percent == 0 && pump_duty > 0) {
+        stats.pump_on_ms += (now_us - pump_on_since_us) / 1000;
+    }
+    pump_duty = duty_percent;
+}
+
+static void sim_pump_deinit(void) {
+    sim_pump_set_duty(0);
+}
+
+// ---------------------------------------------------------------------------
+// Sensor ultrasónico: la distancia depende de si el recipiente ya llegó
+// ---------------------------------------------------------------------------
+
+static esp_err_t sim_echo_init(int trigger_gpio, int echo_gpio) {
+    echo_ready = true;
+    return ESP_OK;
+}
+
+static void sim_echo_deinit(void) {
+    echo_ready = false;
+}
+
+static esp_err_t sim_echo_capture(uint32_t *width_us, uint32_t timeout_ms) {
+    if (!echo_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    stats.echo_reads++;
+    if (fault(config.echo_loss_permille)) {
+        stats.echo_lost++;
+        advance_us((int64_t)timeout_ms * 1000);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    bool present = now_us / 1000 >= container_at_ms;
+    float distance_cm = present ? config.container_cm : config.empty_cm;
+    if (config.echo_noise_mm > 0) {
+        int noise_mm = (int)hal_sim_random(2 * config.echo_noise_mm + 1) - config.echo_noise_mm;
+        distance_cm += noise_mm / 10.0f;
+    }
+
+    *width_us = (uint32_t)(distance_cm * SIM_US_PER_CM);
+    advance_us(*width_us + config.echo_latency_us);
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Salidas, buzzer y pantalla
+// ---------------------------------------------------------------------------
+
+static esp_err_t sim_output_init(int gpio) {
+    if (gpio < 0 || gpio >= SIM_OUTPUTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    outputs[gpio] = false;
+    return ESP_OK;
+}
+
+static void sim_output_set(int gpio, bool level) {
+    if (gpio >= 0 && gpio < SIM_OUTPUTS && outputs[gpio] != level) {
+        outputs[gpio] = level;
+        stats.output_changes++;
+    }
+}
+
+// La secuencia "suena" en segundo plano: no consume tiempo de quien la pide
+static void sim_buzzer_play(int gpio, const uint32_t *sequence, size_t length) {
+    stats.buzzer_sequences++;
+}
+
+static void sim_buzzer_stop(int gpio) {
+    sim_output_set(gpio, false);
+}
+
+static esp_err_t sim_display_init(int tx_gpio, int rx_gpio, uint32_t baud_rate) {
+    return ESP_OK;
+}
+
+static int sim_display_write(const void *data, size_t length) {
+    stats.display_bytes += length;
+    advance_us((int64_t)length * config.display_byte_us);
+    return (int)length;
+}
+
+// La pantalla simulada no envía nada: la lectura agota el tiempo
+static int sim_display_read(void *data, size_t max_length, uint32_t timeout_ms) {
+    advance_us((int64_t)timeout_ms * 1000);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Tiempo virtual
+// ---------------------------------------------------------------------------
+
+static void sim_delay_ms(uint32_t ms) {
+    advance_us((int64_t)ms * 1000);
+}
+
+static void sim_delay_us(uint32_t us) {
+    advance_us(us);
+}
+
+int64_t hal_sim_now_us(void) {
+    return now_us;
+}
+
+int64_t hal_sim_now_ms(void) {
+    return now_us / 1000;
+}
+
+void hal_sim_advance_to_ms(int64_t time_ms) {
+    if (time_ms * 1000 > now_us) {
+        now_us = time_ms * 1000;
+    }
+}
+
+void hal_sim_place_container(int64_t at_ms) {
+    container_at_ms = at_ms;
+}
+
+void hal_sim_remove_container(void) {
+    container_at_ms = INT64_MAX;
+}
+
+void hal_sim_reset(const hal_sim_config_t *new_config, int64_t start_ms) {
+    memset(&config, 0, sizeof(config));
+    if (new_config) {
+        config = *new_config;
+    }
+    if (config.container_cm <= 0) config.container_cm = SIM_CONTAINER_CM;
+    if (config.empty_cm <= 0) config.empty_cm = SIM_EMPTY_CM;
+    if (config.pump_max_ul_s == 0) config.pump_max_ul_s = SIM_PUMP_MAX_UL_S;
+    if (config.pump_stall_duty == 0 || config.pump_stall_duty >= 100) config.pump_stall_duty = SIM_PUMP_STALL_DUTY;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(servos, 0, sizeof(servos));
+    memset(outputs, 0, sizeof(outputs));
+    servo_count = 0;
+    pump_duty = 0;
+    pump_volume_pl = 0;
+    echo_ready = false;
+    container_at_ms = INT64_MAX;
+    rng_state = config.seed ? config.seed : 1;
+    now_us = start_ms * 1000;
+    pump_changed_us = now_us;
+}
+
+void hal_sim_get_stats(hal_sim_stats_t *out) {
+    *out = stats;
+    if (pump_duty > 0) {
+        out->pump_on_ms += (now_us - pump_on_since_us) / 1000;
+    }
+    pump_accumulate();
+    out->pump_volume_ul = pump_volume_pl / 1000000;
+}
+
+const medication_hal_t medication_hal_platform = {
+    .name = "sim",
+    .servo_init = sim_servo_init,
+    .servo_deinit = sim_servo_deinit,
+    .servo_move = sim_servo_move,
+    .servo_wait = sim_servo_wait,
+    .pump_init = sim_pump_init,
+    .pump_deinit = sim_pump_deinit,
+    .pump_set_duty = sim_pump_set_duty,
+    .echo_init = sim_echo_init,
+    .echo_deinit = sim_echo_deinit,
+    .echo_capture = sim_echo_capture,
+    .output_init = sim_output_init,
+    .output_set = sim_output_set,
+    .buzzer_play = sim_buzzer_play,
+    .buzzer_stop = sim_buzzer_stop,
+    .display_init = sim_display_init,
+    .display_write = sim_display_write,
+    .display_read = sim_display_read,
+    .now_us = hal_sim_now_us,
+    .delay_ms = sim_delay_ms,
+    .delay_us = sim_delay_us,
+};
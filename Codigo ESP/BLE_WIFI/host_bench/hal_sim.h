@@ -0,0 +1,95 @@
+#ifndef HAL_SIM_H
+#define HAL_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Backend simulado de medication_hal_t para Linux. El tiempo es virtual:
+// las esperas del firmware lo adelantan en lugar de dormir, así que una
+// dispensación de varios segundos se simula en microsegundos. Todo lo
+// aleatorio sale de un generador con semilla: misma configuración, misma
+// ejecución.
+
+/**
+ * @brief Latencias y fallos del hardware simulado
+ */
+typedef struct {
+    uint32_t seed;
+    // Latencias
+    uint32_t servo_latency_ms;      // Retardo de cada movimiento además de la rampa
+    uint32_t echo_latency_us;       // Disparo y procesado de cada lectura, además del eco
+    uint32_t display_byte_us;       // Transmisión de un byte por la UART
+    // Fallos (por mil)
+    uint16_t echo_loss_permille;    // Lecturas sin eco (ESP_ERR_TIMEOUT)
+    uint16_t servo_stall_permille;  // Movimientos que no terminan
+    uint16_t echo_noise_mm;         // Ruido uniforme de ±echo_noise_mm en cada lectura
+    // Escena (0 = valores por defecto)
+    float container_cm;             // Distancia medida con recipiente
+    float empty_cm;                 // Distancia medida sin recipiente
+    // Bomba: caudal lineal entre pump_stall_duty (0 µl/s) y 100 % (pump_max_ul_s)
+    uint32_t pump_max_ul_s;
+    uint8_t pump_stall_duty;
+} hal_sim_config_t;
+
+/**
+ * @brief Contadores de actividad del hardware simulado
+ */
+typedef struct {
+    uint32_t servo_moves;
+    uint32_t servo_stalls;          // Movimientos que no terminaron
+    uint32_t servo_timeouts;        // Esperas de servo agotadas
+    uint32_t pill_releases;         // Aperturas completas (pulso máximo alcanzado)
+    uint32_t echo_reads;
+    uint32_t echo_lost;
+    uint32_t pump_starts;
+    int64_t pump_on_ms;             // Tiempo total con la bomba en marcha
+    int64_t pump_volume_ul;         // Volumen bombeado según el modelo de caudal
+    uint32_t buzzer_sequences;
+    uint32_t output_changes;        // Cambios de nivel de LEDs y buzzer
+    uint32_t display_bytes;
+} hal_sim_stats_t;
+
+/**
+ * @brief Reinicia el estado, los contadores y el reloj virtual
+ * @param config Latencias y fallos (NULL para un hardware ideal)
+ * @param start_ms Hora inicial en ms desde EPOCH
+ */
+void hal_sim_reset(const hal_sim_config_t *config, int64_t start_ms);
+
+/**
+ * @brief Reloj virtual en us (fuente de esp_timer_get_time() en la simulación)
+ */
+int64_t hal_sim_now_us(void);
+
+/**
+ * @brief Reloj virtual en ms desde EPOCH (fuente de medication_clock)
+ */
+int64_t hal_sim_now_ms(void);
+
+/**
+ * @brief Adelanta el reloj virtual hasta time_ms (no retrocede)
+ */
+void hal_sim_advance_to_ms(int64_t time_ms);
+
+/**
+ * @brief Programa la llegada del recipiente bajo el dispensador
+ * @param at_ms Hora en ms desde EPOCH; INT64_MAX si nadie lo coloca
+ */
+void hal_sim_place_container(int64_t at_ms);
+
+/**
+ * @brief Retira el recipiente
+ */
+void hal_sim_remove_container(void);
+
+/**
+ * @brief Número aleatorio reproducible en [0, range)
+ */
+uint32_t hal_sim_random(uint32_t range);
+
+/**
+ * @brief Copia los contadores acumulados
+ */
+void hal_sim_get_stats(hal_sim_stats_t *stats);
+
+#endif /* HAL_SIM_H */
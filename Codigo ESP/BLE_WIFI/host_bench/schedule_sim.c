@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "medication_storage.h"
+#include "medication_scheduler.h"
+#include "medication_clock.h"
+#include "host_nvs.h"
+
+// Simulación acelerada del motor de horarios en Linux.
+// Cada escenario carga un syncSchedules, avanza un reloj simulado de
+// vencimiento en vencimiento (con saltos de NTP si los hay) y escribe cada
+// decisión de dispensación en una línea estable, apta para comparar la salida
+// entre versiones con diff. Además comprueba invariantes y termina con código
+// distinto de cero si alguno falla.
+
+#define MS_PER_MINUTE   (60 * 1000LL)
+#define MS_PER_HOUR     (60 * MS_PER_MINUTE)
+#define MS_PER_DAY      (24 * MS_PER_HOUR)
+
+#define SIM_MAX_JUMPS        4
+#define SIM_MAX_DECISIONS    100000
+#define SIM_GROUP_MAX        8
+#define SIM_MAX_TRACKED      64
+
+// Ajuste de hora durante la simulación (corrección de NTP)
+typedef struct {
+    int64_t at_ms;          // Desde el inicio del escenario
+    int64_t delta_ms;       // Positivo: el reloj salta hacia delante
+} sim_jump_t;
+
+typedef struct {
+    const char *name;
+    const char *tz;                 // Formato POSIX de TZ
+    const char *start;              // Hora local "AAAA-MM-DD HH:MM"
+    int days;
+    int64_t window_ms;              // Ventana de agrupación de dosis
+    const char *medications;        // Arreglo JSON de medicamentos
+    sim_jump_t jumps[SIM_MAX_JUMPS];
+    int jump_count;
+    bool confirm;                   // Confirmar cada dosis como el dispensador al terminar
+} sim_scenario_t;
+
+#define TZ_MADRID "CET-1CEST,M3.5.0,M10.5.0/3"
+
+static const sim_scenario_t scenarios[] = {
+    {
+        .name = "weekday",
+        .tz = "UTC0",
+        .start = "2025-01-06 00:00",
+        .days = 28,
+        .medications =
+            "[{\"id\":\"med-a\",\"name\":\"Semanal\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"lmv-0800\",\"time\":480,\"days\":[1,3,5]},"
+            "{\"id\":\"diario-2130\",\"time\":1290,\"days\":[1,2,3,4,5,6,7]}]},"
+            "{\"id\":\"med-b\",\"name\":\"Finde\",\"compartment\":2,\"type\":\"pill\",\"pillsPerDose\":2,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"sd-1000\",\"time\":600,\"days\":[6,7]}]}]",
+    },
+    {
+        .name = "interval",
+        .tz = "UTC0",
+        .start = "2025-02-03 05:00",
+        .days = 21,
+        .medications =
+            "[{\"id\":\"med-i\",\"name\":\"Antibiotico\",\"compartment\":3,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"cada-8h\",\"time\":360,\"intervalMode\":true,\"intervalHours\":8,\"treatmentDays\":10}]},"
+            "{\"id\":\"med-j\",\"name\":\"Jarabe\",\"compartment\":4,\"type\":\"liquid\",\"pillsPerDose\":2,"
+            "\"totalPills\":0,\"schedules\":["
+            "{\"id\":\"cada-12h\",\"time\":420,\"intervalMode\":true,\"intervalHours\":12}]}]",
+    },
+    {
+        .name = "dst_spring",
+        .tz = TZ_MADRID,
+        .start = "2025-03-27 00:00",
+        .days = 7,
+        .medications =
+            "[{\"id\":\"med-d\",\"name\":\"Madrugada\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0230\",\"time\":150,\"days\":[1,2,3,4,5,6,7]},"
+            "{\"id\":\"diario-0800\",\"time\":480,\"days\":[1,2,3,4,5,6,7]}]}]",
+    },
+    {
+        .name = "dst_autumn",
+        .tz = TZ_MADRID,
+        .start = "2025-10-23 00:00",
+        .days = 7,
+        .medications =
+            "[{\"id\":\"med-d\",\"name\":\"Madrugada\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0230\",\"time\":150,\"days\":[1,2,3,4,5,6,7]},"
+            "{\"id\":\"cada-6h\",\"time\":60,\"intervalMode\":true,\"intervalHours\":6}]}]",
+    },
+    {
+        .name = "ntp_jump",
+        .tz = "UTC0",
+        .start = "2025-05-05 00:00",
+        .days = 7,
+        .window_ms = 2 * MS_PER_MINUTE,
+        .medications =
+            "[{\"id\":\"med-n\",\"name\":\"Manana\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0800\",\"time\":480,\"days\":[1,2,3,4,5,6,7]},"
+            "{\"id\":\"diario-2000\",\"time\":1200,\"days\":[1,2,3,4,5,6,7]}]},"
+            "{\"id\":\"med-m\",\"name\":\"Grupo\",\"compartment\":2,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0801\",\"time\":481,\"days\":[1,2,3,4,5,6,7]}]}]",
+        // Día 2: el reloj retrocede 3 h; día 4: adelanta 6 h
+        .jumps = {
+            { 1 * MS_PER_DAY + 10 * MS_PER_HOUR, -3 * MS_PER_HOUR },
+            { 3 * MS_PER_DAY + 7 * MS_PER_HOUR,  6 * MS_PER_HOUR },
+        },
+        .jump_count = 2,
+    },
+    {
+        // La dosis de las 08:01 sale con la de las 08:00; al confirmarla no
+        // debe volver a programarse para las 08:01
+        .name = "group_confirm",
+        .tz = "UTC0",
+        .start = "2025-06-02 00:00",
+        .days = 7,
+        .window_ms = 2 * MS_PER_MINUTE,
+        .medications =
+            "[{\"id\":\"med-n\",\"name\":\"Manana\",\"compartment\":1,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0800\",\"time\":480,\"days\":[1,2,3,4,5,6,7]}]},"
+            "{\"id\":\"med-m\",\"name\":\"Grupo\",\"compartment\":2,\"type\":\"pill\",\"pillsPerDose\":1,"
+            "\"totalPills\":1000,\"schedules\":["
+            "{\"id\":\"diario-0801\",\"time\":481,\"days\":[1,2,3,4,5,6,7]}]}]",
+        .confirm = true,
+    },
+};
+#define SCENARIO_COUNT ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+// ---------------------------------------------------------------------------
+// Reloj simulado
+// ---------------------------------------------------------------------------
+
+static int64_t sim_now_ms = 0;
+
+static int64_t sim_clock(void) {
+    return sim_now_ms;
+}
+
+static void format_local(int64_t ms, char *buf, size_t size) {
+    if (ms <= 0 || ms == INT64_MAX) {
+        snprintf(buf, size, "%s", ms == INT64_MAX ? "nunca" : "-");
+        return;
+    }
+    time_t secs = (time_t)(ms / 1000);
+    struct tm local;
+    localtime_r(&secs, &local);
+    strftime(buf, size, "%Y-%m-%d %H:%M %Z", &local);
+}
+
+static int64_t parse_local(const char *text) {
+    struct tm local = { 0 };
+    if (sscanf(text, "%d-%d-%d %d:%d", &local.tm_year, &local.tm_mon, &local.tm_mday,
+               &local.tm_hour, &local.tm_min) != 5) {
+        return 0;
+    }
+    local.tm_year -= 1900;
+    local.tm_mon -= 1;
+    local.tm_isdst = -1;
+    return (int64_t)mktime(&local) * 1000;
+}
+
+// ---------------------------------------------------------------------------
+// Invariantes
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const medication_schedule_t *schedule;
+    int64_t last_due;
+    int dispensed;
+} sim_tracked_t;
+
+static sim_tracked_t tracked[SIM_MAX_TRACKED];
+static int tracked_count = 0;
+static int failures = 0;
+
+static sim_tracked_t *track(const medication_schedule_t *schedule) {
+    for (int i = 0; i < tracked_count; i++) {
+        if (tracked[i].schedule == schedule) {
+            return &tracked[i];
+        }
+    }
+    if (tracked_count == SIM_MAX_TRACKED) {
+        return NULL;
+    }
+    tracked[tracked_count] = (sim_tracked_t){ .schedule = schedule };
+    return &tracked[tracked_count++];
+}
+
+static void fail(const char *scenario, const char *what, const medication_schedule_t *schedule) {
+    printf("FALLO %s: %s (horario %s)\n", scenario, what, schedule->id);
+    failures++;
+}
+
+static void check_dose(const char *scenario, const medication_due_dose_t *dose, int64_t now_ms,
+                       int64_t window_ms) {
+    const medication_schedule_t *schedule = dose->schedule;
+    sim_tracked_t *t = track(schedule);
+
+    if (dose->due_time > now_ms + window_ms) {
+        fail(scenario, "dosis dispensada antes de su ventana", schedule);
+    }
+    if (schedule->next_dispense_time <= dose->due_time) {
+        fail(scenario, "la próxima dosis no avanza", schedule);
+    }
+    if (schedule->treatment_end_date > 0 && dose->due_time > schedule->treatment_end_date) {
+        fail(scenario, "dosis después del fin del tratamiento", schedule);
+    }
+    if (t) {
+        if (t->dispensed > 0 && dose->due_time <= t->last_due) {
+            fail(scenario, "la misma toma se dispensa dos veces", schedule);
+        }
+        t->last_due = dose->due_time;
+        t->dispensed++;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Escenarios
+// ---------------------------------------------------------------------------
+
+static void load_medications(const char *medications) {
+    // Se parte de un almacenamiento vacío en cada escenario
+    medication_storage_process_json(
+        "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":[]}}");
+    host_nvs_reset();
+    medication_storage_init();
+
+    static char payload[8192];
+    snprintf(payload, sizeof(payload),
+             "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":%s}}",
+             medications);
+    medication_storage_process_json(payload);
+}
+
+static int run_scenario(const sim_scenario_t *sc) {
+    setenv("TZ", sc->tz, 1);
+    tzset();
+
+    int64_t start_ms = parse_local(sc->start);
+    int64_t end_ms = start_ms + sc->days * MS_PER_DAY;
+    sim_now_ms = start_ms;
+    tracked_count = 0;
+
+    load_medications(sc->medications);
+
+    char now_str[40];
+    format_local(sim_now_ms, now_str, sizeof(now_str));
+    printf("== %s (TZ=%s, desde %s, %d días)\n", sc->name, sc->tz, now_str, sc->days);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int decisions = 0;
+    int next_jump = 0;
+    // Días simulados transcurridos según el reloj de referencia (sin saltos)
+    int64_t elapsed_offset = 0;
+
+    while (decisions < SIM_MAX_DECISIONS) {
+        int64_t deadline = INT64_MAX;
+        medication_scheduler_peek(&deadline, NULL, NULL);
+
+        int64_t jump_at = next_jump < sc->jump_count
+            ? start_ms + sc->jumps[next_jump].at_ms + elapsed_offset : INT64_MAX;
+
+        int64_t target = deadline < jump_at ? deadline : jump_at;
+        if (target == INT64_MAX || target - elapsed_offset > end_ms) {
+            break;
+        }
+        if (target > sim_now_ms) {
+            sim_now_ms = target;
+        }
+
+        if (target == jump_at && jump_at <= deadline) {
+            const sim_jump_t *jump = &sc->jumps[next_jump++];
+            char from[40], to[40];
+            format_local(sim_now_ms, from, sizeof(from));
+            sim_now_ms += jump->delta_ms;
+            elapsed_offset += jump->delta_ms;
+            format_local(sim_now_ms, to, sizeof(to));
+            printf("%s NTP -> %s\n", from, to);
+            continue;
+        }
+
+        medication_due_dose_t doses[SIM_GROUP_MAX];
+        int count = medication_storage_collect_due(sim_now_ms, sc->window_ms, doses, SIM_GROUP_MAX);
+        if (count == 0) {
+            // El planificador anuncia un vencimiento que el almacenamiento no entrega
+            printf("FALLO %s: vencimiento sin dosis en %lld\n", sc->name, (long long)deadline);
+            failures++;
+            break;
+        }
+
+        format_local(sim_now_ms, now_str, sizeof(now_str));
+        for (int i = 0; i < count; i++) {
+            char due_str[40], next_str[40];
+            format_local(doses[i].due_time, due_str, sizeof(due_str));
+            format_local(doses[i].schedule->next_dispense_time, next_str, sizeof(next_str));
+            printf("%s DISPENSE %s/%s grupo=%d/%d debido=%s retraso=%llds siguiente=%s\n",
+                   now_str, doses[i].medication->id, doses[i].schedule->id, i + 1, count,
+                   due_str, (long long)((sim_now_ms - doses[i].due_time) / 1000), next_str);
+            check_dose(sc->name, &doses[i], sim_now_ms, sc->window_ms);
+        }
+        for (int i = 0; sc->confirm && i < count; i++) {
+            int64_t next_time = doses[i].schedule->next_dispense_time;
+            medication_storage_mark_dispensed(doses[i].medication->id, doses[i].schedule->id);
+            if (doses[i].schedule->next_dispense_time != next_time) {
+                fail(sc->name, "la confirmación reprograma la próxima dosis", doses[i].schedule);
+            }
+        }
+        decisions += count;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed_ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    for (int i = 0; i < tracked_count; i++) {
+        printf("-- %s: %d dosis\n", tracked[i].schedule->id, tracked[i].dispensed);
+    }
+    // El tiempo real va a stderr para que stdout sea estable entre ejecuciones
+    fprintf(stderr, "%s: %d decisiones en %.2f ms\n", sc->name, decisions, elapsed_ms);
+    return decisions;
+}
+
+int main(int argc, char **argv) {
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--list") == 0) {
+            for (int s = 0; s < SCENARIO_COUNT; s++) {
+                printf("%s\n", scenarios[s].name);
+            }
+            return 0;
+        } else {
+            fprintf(stderr, "Uso: %s [--scenario NOMBRE] [--list]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    esp_log_level_set("*", ESP_LOG_NONE);
+    medication_clock_set_source(sim_clock);
+
+    int ran = 0;
+    for (int s = 0; s < SCENARIO_COUNT; s++) {
+        if (only && strcmp(only, scenarios[s].name) != 0) {
+            continue;
+        }
+        run_scenario(&scenarios[s]);
+        ran++;
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "Escenario desconocido: %s\n", only);
+        return 2;
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%d invariantes incumplidos\n", failures);
+        return 1;
+    }
+    return 0;
+}
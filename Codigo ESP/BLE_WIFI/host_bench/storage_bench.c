@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "medication_storage.h"
+#include "medication_json_stream.h"
+#include "host_nvs.h"
+
+// Banco de medidas de medication_storage en Linux.
+// Para cada operación y tamaño informa: tiempo medio, asignaciones de heap por
+// llamada, pico de heap sobre el nivel inicial, heap retenido al terminar y
+// escrituras/commits de NVS por llamada.
+
+// 128 supera el índice del firmware: CMakeLists.txt compila el banco con
+// MEDICATION_INDEX_CAPACITY=128
+static const int BENCH_SIZES[] = {1, 8, 32, 128};
+#define BENCH_DEFAULT_ITERS      200
+#define BENCH_PAYLOAD_MAX        (256 * 1024)
+
+// ---------------------------------------------------------------------------
+// Contabilidad de heap: el enlazador redirige malloc/calloc/realloc/free
+// (-Wl,--wrap) para todos los objetos del banco, incluido cJSON
+// ---------------------------------------------------------------------------
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+typedef union {
+    size_t size;
+    max_align_t align;
+} alloc_header_t;
+
+static size_t heap_in_use = 0;
+static size_t heap_peak = 0;
+static unsigned long alloc_count = 0;
+
+static void heap_account(size_t old_size, size_t new_size) {
+    heap_in_use = heap_in_use - old_size + new_size;
+    if (heap_in_use > heap_peak) {
+        heap_peak = heap_in_use;
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    alloc_header_t *header = __real_malloc(sizeof(*header) + size);
+    if (!header) {
+        return NULL;
+    }
+    header->size = size;
+    alloc_count++;
+    heap_account(0, size);
+    return header + 1;
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    if (size && count > (SIZE_MAX - sizeof(alloc_header_t)) / size) {
+        return NULL;
+    }
+    alloc_header_t *header = __real_calloc(1, sizeof(*header) + count * size);
+    if (!header) {
+        return NULL;
+    }
+    header->size = count * size;
+    alloc_count++;
+    heap_account(0, header->size);
+    return header + 1;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return __wrap_malloc(size);
+    }
+
+    alloc_header_t *header = (alloc_header_t *)ptr - 1;
+    size_t old_size = header->size;
+    alloc_header_t *grown = __real_realloc(header, sizeof(*grown) + size);
+    if (!grown) {
+        return NULL;
+    }
+    grown->size = size;
+    alloc_count++;
+    heap_account(old_size, size);
+    return grown + 1;
+}
+
+void __wrap_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    alloc_header_t *header = (alloc_header_t *)ptr - 1;
+    heap_account(header->size, 0);
+    __real_free(header);
+}
+
+// ---------------------------------------------------------------------------
+// Medición
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char *op;
+    int meds;
+    int iters;
+    double start_us;
+    size_t heap_start;
+    unsigned long allocs_start;
+    host_nvs_stats_t nvs_start;
+} probe_t;
+
+static bool csv_output = false;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void probe_begin(probe_t *probe, const char *op, int meds, int iters) {
+    probe->op = op;
+    probe->meds = meds;
+    probe->iters = iters;
+    probe->heap_start = heap_in_use;
+    probe->allocs_start = alloc_count;
+    host_nvs_get_stats(&probe->nvs_start);
+    heap_peak = heap_in_use;
+    probe->start_us = now_us();
+}
+
+static void probe_end(const probe_t *probe) {
+    double elapsed_us = now_us() - probe->start_us;
+
+    host_nvs_stats_t nvs;
+    host_nvs_get_stats(&nvs);
+
+    int stored = 0;
+    medication_storage_get_all_medications(&stored);
+
+    double iters = probe->iters;
+    double us_per_op = elapsed_us / iters;
+    double allocs_per_op = (alloc_count - probe->allocs_start) / iters;
+    long peak = (long)(heap_peak - probe->heap_start);
+    long retained = (long)heap_in_use - (long)probe->heap_start;
+    double writes_per_op = (nvs.writes - probe->nvs_start.writes) / iters;
+    double commits_per_op = (nvs.commits - probe->nvs_start.commits) / iters;
+
+    if (csv_output) {
+        printf("%s,%d,%d,%d,%.2f,%.2f,%ld,%ld,%.2f,%.2f\n",
+               probe->op, probe->meds, stored, probe->iters, us_per_op, allocs_per_op,
+               peak, retained, writes_per_op, commits_per_op);
+    } else {
+        printf("%-26s %5d %6d %6d %11.2f %9.2f %10ld %10ld %9.2f %8.2f\n",
+               probe->op, probe->meds, stored, probe->iters, us_per_op, allocs_per_op,
+               peak, retained, writes_per_op, commits_per_op);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Datos de prueba
+// ---------------------------------------------------------------------------
+
+// Dos variantes del mismo mensaje: alternarlas obliga a actualizar todo. La
+// tercera tiene los mismos medicamentos con otros IDs: los reemplaza todos.
+#define PAYLOAD_NEW_IDS 2
+static char payloads[3][BENCH_PAYLOAD_MAX];
+
+static int failures = 0;
+
+// Genera un syncSchedules con IDs tipo UUID; variant cambia la dosis de todos
+// los medicamentos (PAYLOAD_NEW_IDS cambia además sus IDs)
+static void build_payload(int meds, int variant) {
+    char *payload = payloads[variant];
+    size_t payload_size = sizeof(payloads[variant]);
+    unsigned id_prefix = variant == PAYLOAD_NEW_IDS ? 0x7a31d04bu : 0x5f0c1e2au;
+    size_t len = 0;
+    len += snprintf(payload + len, payload_size - len,
+                    "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":[");
+
+    for (int i = 0; i < meds && len < payload_size; i++) {
+        len += snprintf(payload + len, payload_size - len,
+                        "%s{\"id\":\"%08x-%04x-4000-8000-%012d\",\"name\":\"Medicamento %d\","
+                        "\"compartment\":%d,\"type\":\"pill\",\"pillsPerDose\":%d,\"totalPills\":1000000,"
+                        "\"schedules\":["
+                        "{\"id\":\"sch-%d-a\",\"time\":%d,\"days\":[1,3,5]},"
+                        "{\"id\":\"sch-%d-b\",\"time\":%d,\"days\":[1,2,3,4,5,6,7]},"
+                        "{\"id\":\"sch-%d-c\",\"time\":%d,\"intervalMode\":true,\"intervalHours\":8,\"treatmentDays\":30}"
+                        "]}",
+                        i ? "," : "", id_prefix, i, i, i,
+                        i % 4 + 1, 1 + variant,
+                        i, (i * 7) % 1440,
+                        i, (480 + i * 13) % 1440,
+                        i, (60 + i * 11) % 1440);
+    }
+
+    snprintf(payload + len, payload_size - len, "]}}");
+}
+
+// ---------------------------------------------------------------------------
+// Operaciones
+// ---------------------------------------------------------------------------
+
+// Cada tamaño parte de un almacenamiento vacío: init() no descarta lo que ya
+// hay en memoria, así que primero se sincroniza una lista vacía
+static void reset_storage(void) {
+    medication_storage_process_json(
+        "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":[]}}");
+    host_nvs_reset();
+    medication_storage_init();
+}
+
+// Todos los medicamentos activos deben tener handle y resolverse por él
+static void check_handles(const char *op, int meds) {
+    int count = 0;
+    medication_t *all = medication_storage_get_all_medications(&count);
+    for (int i = 0; i < count; i++) {
+        medication_handle_t handle = medication_storage_get_handle(all[i].id);
+        if (handle == MEDICATION_HANDLE_INVALID || medication_storage_get_medication_by_handle(handle) != &all[i]) {
+            printf("FALLO %s (%d medicamentos): %s sin handle\n", op, meds, all[i].id);
+            failures++;
+            return;
+        }
+    }
+}
+
+// Sin dispensaciones que recuperar, arrancar no escribe en NVS (ni siquiera
+// valores idénticos, que en la flash también gastan)
+static void check_boot_writes(int meds, const host_nvs_stats_t *before) {
+    host_nvs_stats_t after;
+    host_nvs_get_stats(&after);
+    if (after.writes != before->writes || after.commits != before->commits) {
+        printf("FALLO load_medications_from_nvs (%d medicamentos): %lu escrituras y %lu commits en NVS\n",
+               meds, (unsigned long)(after.writes - before->writes),
+               (unsigned long)(after.commits - before->commits));
+        failures++;
+    }
+}
+
+static void bench_size(int meds, int iters) {
+    build_payload(meds, 0);
+    build_payload(meds, 1);
+    build_payload(meds, PAYLOAD_NEW_IDS);
+    reset_storage();
+
+    // Un tamaño que el almacenamiento no admite no se mide: sus filas no
+    // medirían nada
+    int stored = 0;
+    medication_storage_process_json(payloads[1]);
+    medication_storage_get_all_medications(&stored);
+    if (stored != meds) {
+        if (csv_output) {
+            printf("rejected,%d,%d,0,,,,,,\n", meds, stored);
+        } else {
+            printf("%-26s %5d %6d  rechazado: la sincronización no admite %d medicamentos\n",
+                   "process_json", meds, stored, meds);
+        }
+        return;
+    }
+
+    // Sincronización con todos los medicamentos modificados en cada llamada
+    probe_t probe;
+    probe_begin(&probe, "process_json(update_all)", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_storage_process_json(payloads[i & 1]);
+    }
+    probe_end(&probe);
+
+    // Sincronización que reemplaza todos los IDs: los handles de los
+    // eliminados deben quedar libres para los nuevos
+    probe_begin(&probe, "process_json(replace_ids)", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_storage_process_json(payloads[(i & 1) ? 1 : PAYLOAD_NEW_IDS]);
+    }
+    probe_end(&probe);
+    check_handles("process_json(replace_ids)", meds);
+    medication_storage_process_json(payloads[PAYLOAD_NEW_IDS]);
+    check_handles("process_json(replace_ids)", meds);
+    medication_storage_process_json(payloads[(iters - 1) & 1]);
+
+    // Sincronización idéntica a la anterior (solo diferencias)
+    const char *last = payloads[(iters - 1) & 1];
+    probe_begin(&probe, "process_json(unchanged)", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_storage_process_json(last);
+    }
+    probe_end(&probe);
+
+    // Arranque: índice, diario y registros desde NVS
+    probe_begin(&probe, "load_medications_from_nvs", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_storage_init();
+    }
+    probe_end(&probe);
+    check_boot_writes(meds, &probe.nvs_start);
+
+    // Cada llamada dispensa la dosis más próxima (todas vencidas)
+    int64_t far_future = (int64_t)time(NULL) * 1000 + 400LL * 24 * 60 * 60 * 1000;
+    probe_begin(&probe, "check_dispense", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_schedule_t *schedule = NULL;
+        medication_storage_check_dispense(far_future, &schedule);
+    }
+    probe_end(&probe);
+
+    int count = 0;
+    medication_t *all = medication_storage_get_all_medications(&count);
+    probe_begin(&probe, "mark_dispensed", meds, iters);
+    for (int i = 0; i < iters && count > 0; i++) {
+        const medication_t *med = &all[i % count];
+        medication_storage_mark_dispensed(med->id, med->schedules[i % med->schedules_count].id);
+    }
+    probe_end(&probe);
+
+    probe_begin(&probe, "save", meds, iters);
+    for (int i = 0; i < iters; i++) {
+        medication_storage_save();
+    }
+    probe_end(&probe);
+}
+
+// Un medicamento con más horarios de los que caben en su registro anula la
+// sincronización entera, con cualquiera de los dos parsers
+static void check_schedule_limit(void) {
+    static char payload[4096];
+    for (int schedules = MEDICATION_MAX_SCHEDULES; schedules <= MEDICATION_MAX_SCHEDULES + 1; schedules++) {
+        int len = snprintf(payload, sizeof(payload),
+                           "{\"type\":\"command\",\"payload\":{\"cmd\":\"syncSchedules\",\"medications\":["
+                           "{\"id\":\"med-limite\",\"name\":\"Limite\",\"compartment\":1,\"type\":\"pill\","
+                           "\"schedules\":[");
+        for (int i = 0; i < schedules; i++) {
+            len += snprintf(payload + len, sizeof(payload) - len, "%s{\"id\":\"h%d\",\"time\":%d}",
+                            i ? "," : "", i, i * 30);
+        }
+        snprintf(payload + len, sizeof(payload) - len, "]}]}}");
+        bool accepted = schedules <= MEDICATION_MAX_SCHEDULES;
+
+        for (int streamed = 0; streamed <= 1; streamed++) {
+            reset_storage();
+            esp_err_t err;
+            if (streamed) {
+                medication_json_stream_begin();
+                medication_json_stream_feed(payload, strlen(payload));
+                err = medication_json_stream_finish(NULL);
+                esp_err_t end_err = medication_storage_sync_end(err == ESP_OK);
+                if (err == ESP_OK) {
+                    err = end_err;
+                }
+            } else {
+                err = medication_storage_process_json(payload);
+            }
+
+            int count = 0;
+            medication_t *all = medication_storage_get_all_medications(&count);
+            bool stored = count == 1 && all[0].schedules_count == schedules;
+            if ((err == ESP_OK) != accepted || stored != accepted) {
+                printf("FALLO %s con %d horarios: %s, %d medicamentos guardados\n",
+                       streamed ? "medication_json_stream" : "process_json", schedules,
+                       esp_err_to_name(err), count);
+                failures++;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int iters = BENCH_DEFAULT_ITERS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv_output = true;
+        } else if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc) {
+            iters = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Uso: %s [--iters N] [--csv]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iters <= 0) {
+        iters = 1;
+    }
+
+    // Resultados independientes de la zona horaria de la máquina
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    esp_log_level_set("*", ESP_LOG_NONE);
+
+    if (csv_output) {
+        printf("op,meds,stored,iters,us_per_op,allocs_per_op,peak_heap_bytes,"
+               "retained_heap_bytes,nvs_writes_per_op,nvs_commits_per_op\n");
+    } else {
+        printf("%-26s %5s %6s %6s %11s %9s %10s %10s %9s %8s\n",
+               "op", "meds", "stored", "iters", "us/op", "allocs/op",
+               "peak_B", "retained_B", "writes/op", "commit/op");
+    }
+
+    for (size_t i = 0; i < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]); i++) {
+        bench_size(BENCH_SIZES[i], iters);
+    }
+    check_schedule_limit();
+    if (failures > 0) {
+        fprintf(stderr, "%d comprobaciones fallidas\n", failures);
+        return 1;
+    }
+    return 0;
+}
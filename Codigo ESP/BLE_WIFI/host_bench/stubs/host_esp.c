@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "lwip/apps/sntp.h"
+#include "host_esp.h"
+
+// Implementaciones mínimas de ESP-IDF para ejecutar los módulos en Linux.
+// Nada de lo que hay aquí reserva memoria dinámica.
+
+static esp_log_level_t log_level = ESP_LOG_WARN;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    (void)tag;
+    log_level = level;
+}
+
+esp_log_level_t esp_log_level_get(const char *tag) {
+    (void)tag;
+    return log_level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    static const char letters[] = "NEWIDV";
+    if (level > log_level) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c (%s) ", letters[level], tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:                        return "ESP_OK";
+        case ESP_FAIL:                      return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:                return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:           return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:         return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:          return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:             return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_TIMEOUT:               return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NOT_FINISHED:          return "ESP_ERR_NOT_FINISHED";
+        case ESP_ERR_NVS_NOT_FOUND:         return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_INVALID_HANDLE:    return "ESP_ERR_NVS_INVALID_HANDLE";
+        case ESP_ERR_NVS_INVALID_NAME:      return "ESP_ERR_NVS_INVALID_NAME";
+        case ESP_ERR_NVS_KEY_TOO_LONG:      return "ESP_ERR_NVS_KEY_TOO_LONG";
+        case ESP_ERR_NVS_INVALID_LENGTH:    return "ESP_ERR_NVS_INVALID_LENGTH";
+        case ESP_ERR_NVS_NOT_ENOUGH_SPACE:  return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+        default:                            return "UNKNOWN ERROR";
+    }
+}
+
+uint32_t esp_get_free_heap_size(void) {
+    return 200 * 1024;
+}
+
+void esp_restart(void) {
+    fprintf(stderr, "esp_restart() en el banco de pruebas\n");
+    abort();
+}
+
+// Temporizadores: se aceptan pero nunca disparan
+#define HOST_MAX_TIMERS 32
+
+struct esp_timer {
+    bool used;
+    esp_timer_create_args_t args;
+};
+
+static struct esp_timer timers[HOST_MAX_TIMERS];
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle) {
+    for (int i = 0; i < HOST_MAX_TIMERS; i++) {
+        if (!timers[i].used) {
+            timers[i].used = true;
+            timers[i].args = *args;
+            *out_handle = &timers[i];
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    (void)timeout_us;
+    return timer ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    (void)period;
+    return timer ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    return timer ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    if (!timer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    timer->used = false;
+    return ESP_OK;
+}
+
+static host_esp_time_source_t time_source = NULL;
+
+void host_esp_set_time_source(host_esp_time_source_t source) {
+    time_source = source;
+}
+
+int64_t esp_timer_get_time(void) {
+    if (time_source) {
+        return time_source();
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FreeRTOS
+void vTaskDelay(TickType_t ticks) {
+    (void)ticks;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                       void *param, UBaseType_t priority, TaskHandle_t *created_task) {
+    (void)task; (void)name; (void)stack_depth; (void)param; (void)priority;
+    if (created_task) {
+        *created_task = NULL;
+    }
+    return pdFAIL;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    (void)task;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks) {
+    (void)clear_on_exit; (void)ticks;
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    (void)task;
+    return pdPASS;
+}
+
+struct host_semaphore {
+    int unused;
+};
+
+static struct host_semaphore mutex;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return &mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    (void)semaphore; (void)ticks;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    (void)semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+    return &mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    return xSemaphoreTake(semaphore, ticks);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+    return xSemaphoreGive(semaphore);
+}
+
+struct host_event_group {
+    EventBits_t bits;
+};
+
+static struct host_event_group event_group;
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    return &event_group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    group->bits |= bits;
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    EventBits_t previous = group->bits;
+    group->bits &= ~bits;
+    return previous;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks) {
+    (void)bits; (void)clear_on_exit; (void)wait_for_all; (void)ticks;
+    return group->bits;
+}
+
+// Red: sin conexión en el banco
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+esp_err_t esp_event_loop_create_default(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t base, int32_t id,
+                                              esp_event_handler_t handler, void *arg,
+                                              esp_event_handler_instance_t *instance) {
+    (void)base; (void)id; (void)handler; (void)arg; (void)instance;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void) {
+    return NULL;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+    (void)config;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    (void)mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *conf) {
+    (void)interface; (void)conf;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info) {
+    (void)ap_info;
+    return ESP_FAIL;
+}
+
+void sntp_setoperatingmode(uint8_t operating_mode) {
+    (void)operating_mode;
+}
+
+void sntp_setservername(uint8_t idx, const char *server) {
+    (void)idx; (void)server;
+}
+
+void sntp_init(void) {
+}
+
+void sntp_stop(void) {
+}
@@ -0,0 +1,15 @@
+#ifndef HOST_ESP_H
+#define HOST_ESP_H
+
+#include <stdint.h>
+
+typedef int64_t (*host_esp_time_source_t)(void);
+
+/**
+ * @brief Sustituye el reloj de esp_timer_get_time() y xTaskGetTickCount()
+ *        (por defecto, CLOCK_MONOTONIC)
+ * @param source Tiempo en us, o NULL para volver al reloj del sistema
+ */
+void host_esp_set_time_source(host_esp_time_source_t source);
+
+#endif /* HOST_ESP_H */
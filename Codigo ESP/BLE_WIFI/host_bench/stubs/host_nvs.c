@@ -0,0 +1,250 @@
+#include <stdbool.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "host_nvs.h"
+
+// NVS en memoria estática: no reserva memoria dinámica para no alterar las
+// mediciones de heap del código que se está probando
+
+#define HOST_NVS_MAX_ENTRIES     512
+#define HOST_NVS_MAX_VALUE       4000    // Blob máximo de una entrada real
+#define HOST_NVS_KEY_MAX_LEN     15      // Igual que NVS_KEY_NAME_MAX_SIZE - 1
+#define HOST_NVS_MAX_NAMESPACES  8
+
+typedef enum {
+    ENTRY_FREE,
+    ENTRY_U8,
+    ENTRY_U16,
+    ENTRY_U32,
+    ENTRY_I64,
+    ENTRY_STR,
+    ENTRY_BLOB,
+} entry_type_t;
+
+typedef struct {
+    entry_type_t type;
+    nvs_handle_t ns;
+    char key[HOST_NVS_KEY_MAX_LEN + 1];
+    size_t length;
+    uint8_t data[HOST_NVS_MAX_VALUE];
+} entry_t;
+
+static entry_t entries[HOST_NVS_MAX_ENTRIES];
+static char namespaces[HOST_NVS_MAX_NAMESPACES][HOST_NVS_KEY_MAX_LEN + 1];
+static host_nvs_stats_t stats;
+
+void host_nvs_reset(void) {
+    memset(entries, 0, sizeof(entries));
+    memset(namespaces, 0, sizeof(namespaces));
+    memset(&stats, 0, sizeof(stats));
+}
+
+void host_nvs_get_stats(host_nvs_stats_t *out) {
+    stats.entries = 0;
+    for (int i = 0; i < HOST_NVS_MAX_ENTRIES; i++) {
+        if (entries[i].type != ENTRY_FREE) {
+            stats.entries++;
+        }
+    }
+    *out = stats;
+}
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    host_nvs_reset();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    if (!name || !out_handle || strlen(name) > HOST_NVS_KEY_MAX_LEN) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+
+    // El handle es la posición del espacio de nombres + 1
+    for (int i = 0; i < HOST_NVS_MAX_NAMESPACES; i++) {
+        if (namespaces[i][0] == '\0') {
+            strcpy(namespaces[i], name);
+        }
+        if (strcmp(namespaces[i], name) == 0) {
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    (void)handle;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    if (handle == 0 || handle > HOST_NVS_MAX_NAMESPACES) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    stats.commits++;
+    return ESP_OK;
+}
+
+static esp_err_t check_key(nvs_handle_t handle, const char *key) {
+    if (handle == 0 || handle > HOST_NVS_MAX_NAMESPACES) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (!key || key[0] == '\0') {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+    if (strlen(key) > HOST_NVS_KEY_MAX_LEN) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    return ESP_OK;
+}
+
+static entry_t *find_entry(nvs_handle_t handle, const char *key) {
+    for (int i = 0; i < HOST_NVS_MAX_ENTRIES; i++) {
+        if (entries[i].type != ENTRY_FREE && entries[i].ns == handle &&
+            strcmp(entries[i].key, key) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t set_value(nvs_handle_t handle, const char *key, entry_type_t type,
+                           const void *value, size_t length) {
+    esp_err_t err = check_key(handle, key);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (length > HOST_NVS_MAX_VALUE) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+
+    entry_t *entry = find_entry(handle, key);
+    if (entry && entry->type == type && entry->length == length &&
+        memcmp(entry->data, value, length) == 0) {
+        return ESP_OK;  // La NVS real tampoco reescribe un valor idéntico
+    }
+
+    if (!entry) {
+        for (int i = 0; i < HOST_NVS_MAX_ENTRIES && !entry; i++) {
+            if (entries[i].type == ENTRY_FREE) {
+                entry = &entries[i];
+            }
+        }
+        if (!entry) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+        entry->ns = handle;
+        strcpy(entry->key, key);
+    }
+
+    entry->type = type;
+    entry->length = length;
+    memcpy(entry->data, value, length);
+
+    stats.writes++;
+    stats.bytes_written += length;
+    return ESP_OK;
+}
+
+static esp_err_t get_value(nvs_handle_t handle, const char *key, entry_type_t type,
+                           void *out, size_t *length, bool variable) {
+    esp_err_t err = check_key(handle, key);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    entry_t *entry = find_entry(handle, key);
+    if (!entry || entry->type != type) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    if (!variable) {
+        memcpy(out, entry->data, entry->length);
+        return ESP_OK;
+    }
+
+    // Cadenas y blobs: con out == NULL solo se informa del tamaño
+    if (!out) {
+        *length = entry->length;
+        return ESP_OK;
+    }
+    if (*length < entry->length) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out, entry->data, entry->length);
+    *length = entry->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t err = check_key(handle, key);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    entry_t *entry = find_entry(handle, key);
+    if (!entry) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    entry->type = ENTRY_FREE;
+    stats.erases++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    for (int i = 0; i < HOST_NVS_MAX_ENTRIES; i++) {
+        if (entries[i].type != ENTRY_FREE && entries[i].ns == handle) {
+            entries[i].type = ENTRY_FREE;
+            stats.erases++;
+        }
+    }
+    return ESP_OK;
+}
+
+#define DEFINE_SCALAR(suffix, ctype, entry_type)                                        \
+    esp_err_t nvs_set_##suffix(nvs_handle_t handle, const char *key, ctype value) {     \
+        return set_value(handle, key, entry_type, &value, sizeof(value));               \
+    }                                                                                   \
+    esp_err_t nvs_get_##suffix(nvs_handle_t handle, const char *key, ctype *out) {      \
+        if (!out) {                                                                     \
+            return ESP_ERR_INVALID_ARG;                                                 \
+        }                                                                               \
+        return get_value(handle, key, entry_type, out, NULL, false);                    \
+    }
+
+DEFINE_SCALAR(u8, uint8_t, ENTRY_U8)
+DEFINE_SCALAR(u16, uint16_t, ENTRY_U16)
+DEFINE_SCALAR(u32, uint32_t, ENTRY_U32)
+DEFINE_SCALAR(i64, int64_t, ENTRY_I64)
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+    if (!value) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return set_value(handle, key, ENTRY_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length) {
+    if (!length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return get_value(handle, key, ENTRY_STR, out_value, length, true);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    if (!value && length > 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return set_value(handle, key, ENTRY_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    if (!length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return get_value(handle, key, ENTRY_BLOB, out_value, length, true);
+}
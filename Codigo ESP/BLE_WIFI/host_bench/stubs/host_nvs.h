@@ -0,0 +1,28 @@
+#ifndef HOST_NVS_STATS_H
+#define HOST_NVS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Contadores de la NVS en memoria (aproximan el desgaste de la flash)
+ */
+typedef struct {
+    uint32_t writes;          // nvs_set_* que cambiaron el valor guardado
+    uint32_t bytes_written;   // Bytes de esas escrituras
+    uint32_t erases;          // nvs_erase_key de claves existentes
+    uint32_t commits;         // nvs_commit
+    uint32_t entries;         // Claves almacenadas
+} host_nvs_stats_t;
+
+/**
+ * @brief Borra todo el contenido (equivale a nvs_flash_erase) y los contadores
+ */
+void host_nvs_reset(void);
+
+/**
+ * @brief Copia los contadores acumulados
+ */
+void host_nvs_get_stats(host_nvs_stats_t *stats);
+
+#endif /* HOST_NVS_STATS_H */
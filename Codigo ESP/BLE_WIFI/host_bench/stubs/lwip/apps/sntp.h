@@ -0,0 +1,13 @@
+#ifndef HOST_LWIP_SNTP_H
+#define HOST_LWIP_SNTP_H
+
+#include <stdint.h>
+
+#define SNTP_OPMODE_POLL 0
+
+void sntp_setoperatingmode(uint8_t operating_mode);
+void sntp_setservername(uint8_t idx, const char *server);
+void sntp_init(void);
+void sntp_stop(void);
+
+#endif /* HOST_LWIP_SNTP_H */
@@ -0,0 +1,6 @@
+#ifndef HOST_LWIP_SYS_H
+#define HOST_LWIP_SYS_H
+
+// Sin contenido: ntp_func.c solo lo incluye
+
+#endif /* HOST_LWIP_SYS_H */
@@ -0,0 +1,7 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_MEDICATION_FAST_BOOT 1
+
+#endif /* HOST_SDKCONFIG_H */
@@ -12,6 +12,7 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 #include <freertos/event_groups.h>
 
 #include <esp_log.h>
@@ -19,11 +20,19 @@
 #include <esp_timer.h>
 #include <esp_wifi.h> 
 #include <esp_intr_alloc.h>
+#include <esp_sntp.h>
+#include <sdkconfig.h>
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#endif
 
 #include "wifi_provisioning.h"
 #include "mqtt/mqtt_app.h"
 #include "medication/medication_storage.h"
 #include "medication/medication_dispenser.h"
+#include "medication/medication_hal.h"
+#include "medication/medication_boot.h"
 #include "ntp_func.h"
 #include "buzzer_driver.h"
 #include "nextion_driver.h" // Ensure this header includes the declaration for nextion_time_updater_start
@@ -55,36 +64,69 @@ static bool gpio_interrupt_enabled = true;
 static void wifi_connection_callback(char *ip);
 static void wifi_failure_callback(void);
 
+// Cada ajuste del SNTP, también los periódicos que hace por su cuenta, mueve
+// el reloj: el dispensador rearma sus temporizadores con la nueva hora
+static void ntp_time_sync_callback(struct timeval *tv)
+{
+    medication_dispenser_notify_time_changed();
+}
+
 // Función para configurar los LEDs
 static void configure_leds(void)
 {
     ESP_LOGI(TAG, "Configurando pines GPIO para LEDs");
     
-    // Configurar pin para LED A
-    gpio_reset_pin(LED_GPIO_PIN_A);
-    gpio_set_direction(LED_GPIO_PIN_A, GPIO_MODE_OUTPUT);
-    gpio_set_pull_mode(LED_GPIO_PIN_A, GPIO_PULLDOWN_ONLY);  // Añadir resistencia pull-down
-
-    // Configurar pin para LED B
-    gpio_reset_pin(LED_GPIO_PIN_B);
-    gpio_set_direction(LED_GPIO_PIN_B, GPIO_MODE_OUTPUT);
-    gpio_set_pull_mode(LED_GPIO_PIN_B, GPIO_PULLDOWN_ONLY);  // Añadir resistencia pull-down
+    // Salidas con pull-down; inicialmente todos los LEDs apagados
+    medication_hal_platform.output_init(LED_GPIO_PIN_A);
+    medication_hal_platform.output_init(LED_GPIO_PIN_B);
+    medication_hal_platform.output_init(LED_GPIO_PIN_C);
+}
 
-    // Configurar pin para LED C
-    gpio_reset_pin(LED_GPIO_PIN_C);
-    gpio_set_direction(LED_GPIO_PIN_C, GPIO_MODE_OUTPUT);
-    gpio_set_pull_mode(LED_GPIO_PIN_C, GPIO_PULLDOWN_ONLY);  // Añadir resistencia pull-down
+// Fija el estado de los tres LEDs
+static void set_leds(bool a, bool b, bool c)
+{
+    medication_hal_platform.output_set(LED_GPIO_PIN_A, a);
+    medication_hal_platform.output_set(LED_GPIO_PIN_B, b);
+    medication_hal_platform.output_set(LED_GPIO_PIN_C, c);
+}
 
-    // Inicialmente todos los LEDs apagados
-    gpio_set_level(LED_GPIO_PIN_A, 0);
-    gpio_set_level(LED_GPIO_PIN_B, 0);
-    gpio_set_level(LED_GPIO_PIN_C, 0);
+// Gestión de energía: frecuencia dinámica y, con tickless idle, light sleep
+// automático mientras ninguna tarea tenga trabajo pendiente
+static void configure_power_management(void)
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = 40,  // Frecuencia del cristal
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No se pudo configurar la gestión de energía: %s", esp_err_to_name(err));
+        return;
+    }
+    
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    // En light sleep las interrupciones por flanco no despiertan al chip: el
+    // botón pasa a dispararse por nivel bajo (la ISR se deshabilita en cada
+    // disparo, así que no se repite mientras se mantiene pulsado)
+    gpio_wakeup_enable(RESET_BUTTON_GPIO_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+#endif
+    
+    ESP_LOGI(TAG, "Gestión de energía activa (%d-%d MHz)", pm_config.min_freq_mhz, pm_config.max_freq_mhz);
+#endif
 }
 
 // Manejador de la interrupción del botón
 static void IRAM_ATTR gpio_isr_handler(void* arg)
 {
     uint32_t gpio_num = (uint32_t) arg;
+    // Un evento por pulsación: la tarea rehabilita la interrupción tras el
+    // antirrebote (necesario también si el botón se configura por nivel)
+    gpio_intr_disable(gpio_num);
     xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
 }
 
@@ -121,13 +163,9 @@ static void gpio_button_task(void* arg)
                     
                     // Parpadear LEDs para indicar reinicio
                     for (int i = 0; i < 5; i++) {
-                        gpio_set_level(LED_GPIO_PIN_A, 1);
-                        gpio_set_level(LED_GPIO_PIN_B, 1);
-                        gpio_set_level(LED_GPIO_PIN_C, 1);
+                        set_leds(true, true, true);
                         vTaskDelay(100 / portTICK_PERIOD_MS);
-                        gpio_set_level(LED_GPIO_PIN_A, 0);
-                        gpio_set_level(LED_GPIO_PIN_B, 0);
-                        gpio_set_level(LED_GPIO_PIN_C, 0);
+                        set_leds(false, false, false);
                         vTaskDelay(100 / portTICK_PERIOD_MS);
                     }
                     
@@ -148,11 +186,11 @@ static void gpio_button_task(void* arg)
                     ESP_LOGI(TAG, "Reiniciando el dispositivo para un nuevo provisioning limpio");
                     esp_restart();
                 }
-                
-                // Habilitar la interrupción nuevamente después de un tiempo para evitar rebotes
-                vTaskDelay(debounce_time_ms / portTICK_PERIOD_MS);
-                gpio_intr_enable(RESET_BUTTON_GPIO_PIN);
             }
+            
+            // Habilitar la interrupción nuevamente después de un tiempo para evitar rebotes
+            vTaskDelay(debounce_time_ms / portTICK_PERIOD_MS);
+            gpio_intr_enable(RESET_BUTTON_GPIO_PIN);
         }
     }
 }
@@ -165,27 +203,21 @@ void process_led_command(char command)
     switch (command) {
         case 'A':
             // Encender LED A, apagar los demás
-            gpio_set_level(LED_GPIO_PIN_A, 1);
-            gpio_set_level(LED_GPIO_PIN_B, 0);
-            gpio_set_level(LED_GPIO_PIN_C, 0);
+            set_leds(true, false, false);
             current_active_led = 1;
             ESP_LOGI(TAG, "LED A encendido");
             break;
             
         case 'B':
             // Encender LED B, apagar los demás
-            gpio_set_level(LED_GPIO_PIN_A, 0);
-            gpio_set_level(LED_GPIO_PIN_B, 1);
-            gpio_set_level(LED_GPIO_PIN_C, 0);
+            set_leds(false, true, false);
             current_active_led = 2;
             ESP_LOGI(TAG, "LED B encendido");
             break;
             
         case 'C':
             // Encender LED C, apagar los demás
-            gpio_set_level(LED_GPIO_PIN_A, 0);
-            gpio_set_level(LED_GPIO_PIN_B, 0);
-            gpio_set_level(LED_GPIO_PIN_C, 1);
+            set_leds(false, false, true);
             current_active_led = 3;
             ESP_LOGI(TAG, "LED C encendido");
             break;
@@ -220,9 +252,7 @@ static void wifi_connection_callback(char *ip) {
     wifi_retry_count = 0;  // Importante: resetear el contador de intentos
     
     // Indicación visual - LED A encendido para mostrar conexión exitosa
-    gpio_set_level(LED_GPIO_PIN_A, 1);
-    gpio_set_level(LED_GPIO_PIN_B, 0);
-    gpio_set_level(LED_GPIO_PIN_C, 0);
+    set_leds(true, false, false);
     
     // Reproducir sonido de conexión WiFi exitosa
     buzzer_play_pattern(BUZZER_PATTERN_WIFI_CONNECTED);
@@ -231,6 +261,7 @@ static void wifi_connection_callback(char *ip) {
     
     // Sincronizar NTP con múltiples intentos
     ESP_LOGI(TAG, "Sincronizando hora por NTP");
+    sntp_set_time_sync_notification_cb(ntp_time_sync_callback);
     bool ntp_success = sync_ntp_time_with_retry("EST4", 3);
     
     if (ntp_success) {
@@ -242,6 +273,9 @@ static void wifi_connection_callback(char *ip) {
         set_default_time("EST4");
     }
     
+    // Con la hora ajustada el planificador puede empezar ya
+    medication_dispenser_notify_time_changed();
+    
     // Crear tarea de sincronización periódica
     static bool sync_task_created = false;
     if (!sync_task_created) {
@@ -273,15 +307,20 @@ static void wifi_connection_callback(char *ip) {
         ESP_LOGI(TAG, "Pantalla Nextion inicializada correctamente");
     }
     
-    // Inicializar sistemas
-    ESP_LOGI(TAG, "Inicializando almacenamiento de medicamentos");
-    medication_storage_init();
+    // El dispensador arranca en app_main sin esperar a la red; MQTT entrega
+    // horarios y comandos, así que espera a que termine. Sin plazo: el
+    // autotest sin FAST_BOOT puede tardar más de 6 s. Solo se reintenta si
+    // medication_dispenser_init() devolvió un error.
+    if (!medication_boot_wait(MEDICATION_BOOT_DISPENSER, MEDICATION_BOOT_WAIT_FOREVER)) {
+        ESP_LOGW(TAG, "El dispensador no arrancó; reintentando");
+        if (medication_dispenser_init() != ESP_OK) {
+            ESP_LOGE(TAG, "El dispensador sigue sin arrancar");
+        }
+    }
     
     ESP_LOGI(TAG, "Iniciando MQTT");
     mqtt_app_init();
-    
-    ESP_LOGI(TAG, "Inicializando dispensador de medicamentos");
-    medication_dispenser_init();
+    medication_boot_mark(MEDICATION_BOOT_NETWORK);
     
     // Publicar estado cuando todo esté listo
     publish_device_status("online");
@@ -296,9 +335,7 @@ static void wifi_failure_callback(void) {
     static bool led_state = false;
     led_state = !led_state;
     
-    gpio_set_level(LED_GPIO_PIN_A, led_state);
-    gpio_set_level(LED_GPIO_PIN_B, 0);
-    gpio_set_level(LED_GPIO_PIN_C, 0);
+    set_leds(led_state, false, false);
     
     // Reproducir sonido de fallo WiFi (solo cada 5 intentos para no molestar)
     if (wifi_retry_count % 5 == 1) {
@@ -314,6 +351,7 @@ void app_main(void)
 {
     // Variables e inicialización
     ESP_LOGI(TAG, "Inicializando aplicación...");
+    medication_boot_init();
 
     // 1. Configurar LEDs
     configure_leds();
@@ -344,6 +382,9 @@ void app_main(void)
     // Conectar el manejador de la interrupción con el GPIO específico
     ESP_ERROR_CHECK(gpio_isr_handler_add(RESET_BUTTON_GPIO_PIN, gpio_isr_handler, (void*) RESET_BUTTON_GPIO_PIN));
     
+    // Gestión de energía (solo con CONFIG_PM_ENABLE)
+    configure_power_management();
+    
     // Imprimir estado inicial del botón
     ESP_LOGI(TAG, "Estado inicial del botón: %d", gpio_get_level(RESET_BUTTON_GPIO_PIN));
     
@@ -358,5 +399,17 @@ void app_main(void)
     ESP_LOGI(TAG, "Iniciando provisioning WiFi con callbacks personalizados");
     wifi_event_group = wifi_provisioning_init();
     
-    // La lógica principal se ejecutará en los callbacks
+    // 5. Dispensador en paralelo con la conexión WiFi y el NTP: los horarios
+    // y las dispensaciones interrumpidas se recuperan de NVS (ya inicializada
+    // por el provisioning) y el autotest del hardware queda para después
+    ESP_LOGI(TAG, "Inicializando almacenamiento de medicamentos");
+    medication_storage_init();
+    medication_boot_mark(MEDICATION_BOOT_STORAGE);
+    
+    ESP_LOGI(TAG, "Inicializando dispensador de medicamentos");
+    if (medication_dispenser_init() != ESP_OK) {
+        medication_boot_fail(MEDICATION_BOOT_DISPENSER);
+    }
+    
+    // La lógica de red se ejecutará en los callbacks
 }
\ No newline at end of file
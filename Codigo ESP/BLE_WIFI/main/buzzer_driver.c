@@ -1,65 +1,15 @@
 #include "buzzer_driver.h"
-#include "esp_rom_sys.h"
+#include "medication/medication_hal.h"
 
 static const char *TAG = "BUZZER";
-static TaskHandle_t buzzer_task_handle = NULL;
-
-// Estructura para pasar datos a la tarea del buzzer
-typedef struct {
-    const uint32_t *sequence;
-    size_t length;
-} buzzer_task_params_t;
-
-/**
- * @brief Tarea para reproducir secuencias de sonido
- * 
- * La secuencia es un array de duraciones en ms: 
- * [sonido1, pausa1, sonido2, pausa2, ...]
- */
-static void buzzer_task(void *pvParameters) {
-    buzzer_task_params_t *params = (buzzer_task_params_t *)pvParameters;
-    
-    for (size_t i = 0; i < params->length; i++) {
-        if (i % 2 == 0) {
-            // Encender buzzer
-            gpio_set_level(BUZZER_GPIO_PIN, 1);
-        } else {
-            // Apagar buzzer
-            gpio_set_level(BUZZER_GPIO_PIN, 0);
-        }
-        
-        // Esperar la duración especificada
-        vTaskDelay(params->sequence[i] / portTICK_PERIOD_MS);
-    }
-    
-    // Asegurarse de que el buzzer quede apagado al finalizar
-    gpio_set_level(BUZZER_GPIO_PIN, 0);
-    
-    // Liberar la memoria y eliminar la referencia de la tarea
-    free(params->sequence);
-    free(params);
-    buzzer_task_handle = NULL;
-    
-    // Eliminar la tarea
-    vTaskDelete(NULL);
-}
+static const medication_hal_t *const hal = &medication_hal_platform;
 
 /**
  * @brief Inicializar el buzzer
  */
 void buzzer_init(void) {
-    // Configurar el pin del buzzer como salida
-    gpio_config_t io_conf = {
-        .pin_bit_mask = (1ULL << BUZZER_GPIO_PIN),
-        .mode = GPIO_MODE_OUTPUT,
-        .pull_up_en = GPIO_PULLUP_DISABLE,
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE,
-    };
-    gpio_config(&io_conf);
-    
-    // Asegurarse de que el buzzer inicie apagado
-    gpio_set_level(BUZZER_GPIO_PIN, 0);
+    // Configurar el pin del buzzer como salida (arranca apagado)
+    hal->output_init(BUZZER_GPIO_PIN);
     
     ESP_LOGI(TAG, "Buzzer inicializado en GPIO %d", BUZZER_GPIO_PIN);
 }
@@ -68,77 +18,33 @@ void buzzer_init(void) {
  * @brief Detener cualquier sonido actual
  */
 void buzzer_stop(void) {
-    if (buzzer_task_handle != NULL) {
-        vTaskDelete(buzzer_task_handle);
-        buzzer_task_handle = NULL;
-    }
-    
-    gpio_set_level(BUZZER_GPIO_PIN, 0);
+    hal->buzzer_stop(BUZZER_GPIO_PIN);
 }
 
 /**
  * @brief Reproducir un tono simple
  */
 void buzzer_beep(uint32_t duration_ms) {
-    // Detener cualquier sonido actual primero
-    buzzer_stop();
-    
-    // Crear una secuencia simple: encender, apagar
-    uint32_t *sequence = malloc(2 * sizeof(uint32_t));
-    if (sequence == NULL) {
-        ESP_LOGE(TAG, "Error de memoria al crear secuencia");
-        return;
-    }
-    
-    sequence[0] = duration_ms;  // Duración del sonido
-    sequence[1] = 0;            // Sin pausa al final
-    
-    buzzer_task_params_t *params = malloc(sizeof(buzzer_task_params_t));
-    if (params == NULL) {
-        ESP_LOGE(TAG, "Error de memoria al crear parámetros");
-        free(sequence);
-        return;
-    }
-    
-    params->sequence = sequence;
-    params->length = 2;
-    
-    xTaskCreate(buzzer_task, "buzzer_task", 2048, params, 5, &buzzer_task_handle);
+    // Secuencia simple: sonido y sin pausa al final
+    const uint32_t sequence[] = { duration_ms, 0 };
+    buzzer_play_sequence(sequence, 2);
 }
 
 /**
  * @brief Reproducir una secuencia personalizada
+ * 
+ * La secuencia es un array de duraciones en ms: 
+ * [sonido1, pausa1, sonido2, pausa2, ...]
  */
 void buzzer_play_sequence(const uint32_t *input_sequence, size_t length) {
-    // Detener cualquier sonido actual primero
-    buzzer_stop();
-    
     // Verificar parámetros
     if (input_sequence == NULL || length == 0) {
         ESP_LOGE(TAG, "Secuencia inválida");
         return;
     }
     
-    // Copiar la secuencia para que no cambie mientras se reproduce
-    uint32_t *sequence = malloc(length * sizeof(uint32_t));
-    if (sequence == NULL) {
-        ESP_LOGE(TAG, "Error de memoria al copiar secuencia");
-        return;
-    }
-    
-    memcpy(sequence, input_sequence, length * sizeof(uint32_t));
-    
-    buzzer_task_params_t *params = malloc(sizeof(buzzer_task_params_t));
-    if (params == NULL) {
-        ESP_LOGE(TAG, "Error de memoria al crear parámetros");
-        free(sequence);
-        return;
-    }
-    
-    params->sequence = sequence;
-    params->length = length;
-    
-    xTaskCreate(buzzer_task, "buzzer_task", 2048, params, 5, &buzzer_task_handle);
+    // La plataforma copia la secuencia y la reproduce en segundo plano
+    hal->buzzer_play(BUZZER_GPIO_PIN, input_sequence, length);
 }
 
 /**
@@ -160,18 +66,12 @@ void buzzer_beep_with_frequency(uint32_t duration_ms, uint32_t freq_hz) {
     // Calcular cuántos ciclos necesitamos
     uint32_t cycles = (duration_ms * 1000) / period_us;
     
-    esp_err_t ret = gpio_set_direction(BUZZER_GPIO_PIN, GPIO_MODE_OUTPUT);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error al configurar pin: %d", ret);
-        return;
-    }
-    
     // Generar la onda cuadrada manualmente
     for (uint32_t i = 0; i < cycles; i++) {
-        gpio_set_level(BUZZER_GPIO_PIN, 1);
-        esp_rom_delay_us(half_period_us);  // Reemplazar ets_delay_us por esp_rom_delay_us
-        gpio_set_level(BUZZER_GPIO_PIN, 0);
-        esp_rom_delay_us(half_period_us);  // Reemplazar ets_delay_us por esp_rom_delay_us
+        hal->output_set(BUZZER_GPIO_PIN, true);
+        hal->delay_us(half_period_us);
+        hal->output_set(BUZZER_GPIO_PIN, false);
+        hal->delay_us(half_period_us);
     }
 }
 
@@ -4,9 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "driver/gpio.h"
+#include <stdint.h>
 #include "esp_log.h"
 
 // Definir el pin GPIO para el buzzer (ajustar según tu hardware)
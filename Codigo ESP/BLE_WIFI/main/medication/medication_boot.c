@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "medication_boot.h"
+
+static const char *TAG = "MED_BOOT";
+
+static const char *const stage_names[MEDICATION_BOOT_STAGE_COUNT] = {
+    [MEDICATION_BOOT_HARDWARE]  = "hardware",
+    [MEDICATION_BOOT_STORAGE]   = "storage",
+    [MEDICATION_BOOT_DISPENSER] = "dispenser",
+    [MEDICATION_BOOT_READY]     = "ready",
+    [MEDICATION_BOOT_NETWORK]   = "network",
+    [MEDICATION_BOOT_SELF_TEST] = "selfTest",
+};
+
+static int64_t stage_us[MEDICATION_BOOT_STAGE_COUNT];   // 0 = no alcanzado
+static esp_err_t self_test_result = ESP_OK;
+static uint32_t self_test_ms = 0;
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Un bit por hito para quien tenga que esperar a otro subsistema, y otro
+// por hito fallido para no esperar a algo que ya no va a llegar
+#define STAGE_BIT(stage) ((EventBits_t)1 << (stage))
+#define STAGE_FAIL_BIT(stage) ((EventBits_t)1 << (MEDICATION_BOOT_STAGE_COUNT + (stage)))
+_Static_assert(2 * MEDICATION_BOOT_STAGE_COUNT <= 24, "Los grupos de eventos tienen 24 bits");
+static StaticEventGroup_t boot_events_buffer;
+static EventGroupHandle_t boot_events = NULL;
+
+static const char *reset_reason_name(esp_reset_reason_t reason) {
+    switch (reason) {
+        case ESP_RST_POWERON:   return "power_on";
+        case ESP_RST_EXT:       return "external";
+        case ESP_RST_SW:        return "software";
+        case ESP_RST_PANIC:     return "panic";
+        case ESP_RST_INT_WDT:   return "interrupt_wdt";
+        case ESP_RST_TASK_WDT:  return "task_wdt";
+        case ESP_RST_WDT:       return "wdt";
+        case ESP_RST_DEEPSLEEP: return "deep_sleep";
+        case ESP_RST_BROWNOUT:  return "brownout";
+        case ESP_RST_SDIO:      return "sdio";
+        default:                return "unknown";
+    }
+}
+
+void medication_boot_init(void) {
+    if (!boot_events) {
+        boot_events = xEventGroupCreateStatic(&boot_events_buffer);
+    }
+}
+
+void medication_boot_mark(medication_boot_stage_t stage) {
+    if (stage < 0 || stage >= MEDICATION_BOOT_STAGE_COUNT) {
+        return;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    bool first = false;
+
+    portENTER_CRITICAL(&boot_lock);
+    if (stage_us[stage] == 0) {
+        stage_us[stage] = now_us;
+        first = true;
+    }
+    portEXIT_CRITICAL(&boot_lock);
+
+    if (!first) {
+        return;
+    }
+    if (boot_events) {
+        xEventGroupSetBits(boot_events, STAGE_BIT(stage));
+    }
+
+    if (stage == MEDICATION_BOOT_READY) {
+        ESP_LOGI(TAG, "Dispensador listo a los %lld ms del reinicio (motivo: %s)",
+                 now_us / 1000, reset_reason_name(esp_reset_reason()));
+    } else {
+        ESP_LOGI(TAG, "Arranque: %s a los %lld ms", stage_names[stage], now_us / 1000);
+    }
+}
+
+void medication_boot_fail(medication_boot_stage_t stage) {
+    if (stage < 0 || stage >= MEDICATION_BOOT_STAGE_COUNT) {
+        return;
+    }
+
+    ESP_LOGW(TAG, "Arranque: %s falló", stage_names[stage]);
+    if (boot_events) {
+        xEventGroupSetBits(boot_events, STAGE_FAIL_BIT(stage));
+    }
+}
+
+bool medication_boot_wait(medication_boot_stage_t stage, uint32_t timeout_ms) {
+    if (stage < 0 || stage >= MEDICATION_BOOT_STAGE_COUNT) {
+        return false;
+    }
+    if (!boot_events) {
+        return medication_boot_stage_ms(stage) >= 0;
+    }
+
+    TickType_t ticks = timeout_ms == MEDICATION_BOOT_WAIT_FOREVER ? portMAX_DELAY
+                                                                  : pdMS_TO_TICKS(timeout_ms);
+    EventBits_t bits = xEventGroupWaitBits(boot_events, STAGE_BIT(stage) | STAGE_FAIL_BIT(stage),
+                                           pdFALSE, pdFALSE, ticks);
+    return (bits & STAGE_BIT(stage)) != 0;
+}
+
+int64_t medication_boot_stage_ms(medication_boot_stage_t stage) {
+    if (stage < 0 || stage >= MEDICATION_BOOT_STAGE_COUNT) {
+        return -1;
+    }
+
+    portENTER_CRITICAL(&boot_lock);
+    int64_t us = stage_us[stage];
+    portEXIT_CRITICAL(&boot_lock);
+
+    return us ? us / 1000 : -1;
+}
+
+void medication_boot_self_test_done(esp_err_t result, uint32_t elapsed_ms) {
+    portENTER_CRITICAL(&boot_lock);
+    self_test_result = result;
+    self_test_ms = elapsed_ms;
+    portEXIT_CRITICAL(&boot_lock);
+
+    if (result != ESP_OK) {
+        ESP_LOGW(TAG, "Autotest del hardware con fallos (%s) en %lu ms",
+                 esp_err_to_name(result), (unsigned long)elapsed_ms);
+    }
+    medication_boot_mark(MEDICATION_BOOT_SELF_TEST);
+}
+
+void medication_boot_to_json(cJSON *parent) {
+    if (!parent) {
+        return;
+    }
+
+    int64_t snapshot[MEDICATION_BOOT_STAGE_COUNT];
+    portENTER_CRITICAL(&boot_lock);
+    for (int i = 0; i < MEDICATION_BOOT_STAGE_COUNT; i++) {
+        snapshot[i] = stage_us[i];
+    }
+    esp_err_t result = self_test_result;
+    uint32_t duration_ms = self_test_ms;
+    portEXIT_CRITICAL(&boot_lock);
+
+    cJSON *boot = cJSON_AddObjectToObject(parent, "boot");
+    if (!boot) {
+        return;
+    }
+
+    cJSON_AddStringToObject(boot, "resetReason", reset_reason_name(esp_reset_reason()));
+    if (snapshot[MEDICATION_BOOT_READY]) {
+        cJSON_AddNumberToObject(boot, "readyMs", snapshot[MEDICATION_BOOT_READY] / 1000);
+    } else {
+        cJSON_AddNullToObject(boot, "readyMs");
+    }
+
+    cJSON *stages = cJSON_AddObjectToObject(boot, "stagesMs");
+    for (int i = 0; stages && i < MEDICATION_BOOT_STAGE_COUNT; i++) {
+        if (snapshot[i]) {
+            cJSON_AddNumberToObject(stages, stage_names[i], snapshot[i] / 1000);
+        } else {
+            cJSON_AddNullToObject(stages, stage_names[i]);
+        }
+    }
+
+    cJSON *self_test = cJSON_AddObjectToObject(boot, "selfTest");
+    if (self_test) {
+        bool done = snapshot[MEDICATION_BOOT_SELF_TEST] != 0;
+        cJSON_AddStringToObject(self_test, "result",
+                                !done ? "pending" : (result == ESP_OK ? "ok" : "failed"));
+        if (done) {
+            cJSON_AddNumberToObject(self_test, "durationMs", duration_ms);
+        }
+    }
+}
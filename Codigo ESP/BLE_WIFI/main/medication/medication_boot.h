@@ -0,0 +1,65 @@
+#ifndef MEDICATION_BOOT_H
+#define MEDICATION_BOOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+// Hitos del arranque, medidos desde el reinicio (esp_timer_get_time)
+typedef enum {
+    MEDICATION_BOOT_HARDWARE = 0,   // Servos, bomba y sensor configurados (sin autotest)
+    MEDICATION_BOOT_STORAGE,        // Horarios cargados y dispensaciones interrumpidas recuperadas
+    MEDICATION_BOOT_DISPENSER,      // Tareas, planificador y recordatorios creados
+    MEDICATION_BOOT_READY,          // Hora fiable con el planificador en marcha: ya salen dosis
+    MEDICATION_BOOT_NETWORK,        // MQTT iniciado
+    MEDICATION_BOOT_SELF_TEST,      // Autotest diferido del hardware terminado
+    MEDICATION_BOOT_STAGE_COUNT
+} medication_boot_stage_t;
+
+// Espera sin límite en medication_boot_wait()
+#define MEDICATION_BOOT_WAIT_FOREVER UINT32_MAX
+
+/**
+ * @brief Prepara el registro de hitos; llamar al principio de app_main()
+ */
+void medication_boot_init(void);
+
+/**
+ * @brief Anota un hito la primera vez que se alcanza (las siguientes se ignoran)
+ */
+void medication_boot_mark(medication_boot_stage_t stage);
+
+/**
+ * @brief Anota que un hito no se alcanzará (su inicialización devolvió un
+ *        error) y despierta a quien lo espera
+ */
+void medication_boot_fail(medication_boot_stage_t stage);
+
+/**
+ * @brief Espera a que un hito se alcance o falle
+ * @param stage Hito esperado
+ * @param timeout_ms Espera máxima, o MEDICATION_BOOT_WAIT_FOREVER
+ * @return true si el hito ya se alcanzó; false si falló o se agotó la espera
+ */
+bool medication_boot_wait(medication_boot_stage_t stage, uint32_t timeout_ms);
+
+/**
+ * @brief Milisegundos desde el reinicio hasta el hito, o -1 si aún no se alcanzó
+ */
+int64_t medication_boot_stage_ms(medication_boot_stage_t stage);
+
+/**
+ * @brief Registra el resultado del autotest diferido y marca MEDICATION_BOOT_SELF_TEST
+ * @param result Resultado de medication_hardware_self_test()
+ * @param elapsed_ms Duración del autotest
+ */
+void medication_boot_self_test_done(esp_err_t result, uint32_t elapsed_ms);
+
+/**
+ * @brief Añade a parent un objeto "boot" con el motivo del último reinicio,
+ *        el tiempo hasta estar listo, cada hito y el resultado del autotest
+ */
+void medication_boot_to_json(cJSON *parent);
+
+#endif /* MEDICATION_BOOT_H */
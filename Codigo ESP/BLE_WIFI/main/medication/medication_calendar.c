@@ -0,0 +1,193 @@
+#include <time.h>
+#include "medication_calendar.h"
+
+#define MS_PER_MINUTE  (60 * 1000LL)
+#define MS_PER_HOUR    (60 * MS_PER_MINUTE)
+#define MS_PER_DAY     (24 * MS_PER_HOUR)
+
+// La referencia se rehace al menos cada hora: acota el efecto de un cambio de
+// zona horaria (TZ) o de horario de verano sin tocar libc en cada cálculo
+#define CALENDAR_MAX_AGE_MS MS_PER_HOUR
+
+bool medication_calendar_refresh(medication_calendar_t *cal, int64_t now_ms) {
+    if (now_ms >= cal->valid_from_ms && now_ms < cal->valid_until_ms) {
+        return false;
+    }
+
+    time_t now_secs = (time_t)(now_ms / 1000);
+    struct tm today;
+    localtime_r(&now_secs, &today);
+
+    cal->weekday = today.tm_wday == 0 ? 7 : today.tm_wday;
+
+    // mktime normaliza tm_mday fuera de rango y aplica el horario de verano de cada día.
+    // Se calcula una medianoche más para conocer la duración del último día.
+    int64_t midnight_ms[MEDICATION_CALENDAR_DAYS + 1];
+    for (int k = 0; k <= MEDICATION_CALENDAR_DAYS; k++) {
+        struct tm day = today;
+        day.tm_mday += k;
+        day.tm_hour = 0;
+        day.tm_min = 0;
+        day.tm_sec = 0;
+        day.tm_isdst = -1;
+        midnight_ms[k] = (int64_t)mktime(&day) * 1000;
+    }
+
+    cal->dst_days_mask = 0;
+    for (int k = 0; k < MEDICATION_CALENDAR_DAYS; k++) {
+        cal->midnight_ms[k] = midnight_ms[k];
+        if (midnight_ms[k + 1] - midnight_ms[k] != MS_PER_DAY) {
+            cal->dst_days_mask |= 1 << k;
+        }
+    }
+
+    cal->valid_from_ms = cal->midnight_ms[0];
+    cal->valid_until_ms = now_ms + CALENDAR_MAX_AGE_MS;
+    if (cal->valid_until_ms > cal->midnight_ms[1]) {
+        cal->valid_until_ms = cal->midnight_ms[1];
+    }
+    return true;
+}
+
+void medication_calendar_compile(medication_schedule_t *schedule) {
+    uint8_t mask = 0;
+    for (int i = 0; i < schedule->days_count && i < 7; i++) {
+        if (schedule->days[i] >= 1 && schedule->days[i] <= 7) {
+            mask |= 1 << (schedule->days[i] - 1);
+        }
+    }
+    schedule->days_mask = mask;
+}
+
+// Hora local del día de cambio de hora: solo aquí se recurre a mktime()
+static int64_t dst_day_time(const medication_calendar_t *cal, int day, uint16_t minutes) {
+    time_t midnight_secs = (time_t)(cal->midnight_ms[day] / 1000);
+    struct tm local;
+    localtime_r(&midnight_secs, &local);
+    local.tm_hour = minutes / 60;
+    local.tm_min = minutes % 60;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return (int64_t)mktime(&local) * 1000;
+}
+
+static inline int64_t day_time(const medication_calendar_t *cal, int day, uint16_t minutes) {
+    if (cal->dst_days_mask & (1 << day)) {
+        return dst_day_time(cal, day, minutes);
+    }
+    return cal->midnight_ms[day] + (int64_t)minutes * MS_PER_MINUTE;
+}
+
+static inline bool day_selected(const medication_calendar_t *cal, uint8_t mask, int day) {
+    return mask & (1 << ((cal->weekday - 1 + day) % 7));
+}
+
+int64_t medication_calendar_next(const medication_calendar_t *cal,
+                                 const medication_schedule_t *schedule, int64_t now_ms) {
+    // Si el tratamiento ha finalizado
+    if (schedule->treatment_end_date > 0 && now_ms >= schedule->treatment_end_date) {
+        return INT64_MAX;
+    }
+
+    int64_t today_ms = day_time(cal, 0, schedule->time_in_minutes);
+
+    // MODO INTERVALO
+    if (schedule->interval_mode) {
+        // Si la hora del día no ha pasado, programar para hoy
+        if (today_ms > now_ms) {
+            return today_ms;
+        }
+
+        int64_t interval_ms = (int64_t)schedule->interval_hours * MS_PER_HOUR;
+        int64_t next_ms;
+
+        // Primera dispensación o la última ya cumplió el intervalo: mañana a la hora programada
+        if (schedule->last_dispensed_time == 0 ||
+            now_ms - schedule->last_dispensed_time >= interval_ms) {
+            next_ms = day_time(cal, 1, schedule->time_in_minutes);
+        } else {
+            next_ms = schedule->last_dispensed_time + interval_ms;
+        }
+
+        if (schedule->treatment_end_date > 0 && next_ms > schedule->treatment_end_date) {
+            return INT64_MAX;
+        }
+        return next_ms;
+    }
+
+    // MODO DÍAS DE SEMANA: rotar la máscara para que el bit 0 sea hoy
+    uint8_t mask = schedule->days_mask & 0x7F;
+    if (!mask) {
+        return INT64_MAX;
+    }
+
+    int today = cal->weekday - 1;
+    uint8_t ahead = ((mask >> today) | (mask << (7 - today))) & 0x7F;
+    if (today_ms <= now_ms) {
+        ahead &= ~1;  // La toma de hoy ya pasó
+    }
+
+    // Sin otro día en la semana: el mismo día de la semana siguiente
+    int days_ahead = ahead ? __builtin_ctz(ahead) : 7;
+    return day_time(cal, days_ahead, schedule->time_in_minutes);
+}
+
+// Siguiente toma de un horario semanal estrictamente posterior a after_ms
+static int64_t weekly_after(const medication_calendar_t *cal,
+                            const medication_schedule_t *schedule, int64_t after_ms) {
+    for (int k = 0; k < MEDICATION_CALENDAR_DAYS; k++) {
+        int64_t t = day_time(cal, k, schedule->time_in_minutes);
+        if (t > after_ms && day_selected(cal, schedule->days_mask, k)) {
+            return t;
+        }
+    }
+    return INT64_MAX;
+}
+
+int medication_calendar_project(const medication_calendar_t *cal,
+                                const medication_schedule_table_t *table,
+                                medication_upcoming_dose_t *doses, int max_doses) {
+    if (!table || !doses || max_doses <= 0) {
+        return 0;
+    }
+
+    int64_t horizon = cal->midnight_ms[MEDICATION_CALENDAR_DAYS - 1] + MS_PER_DAY;
+    int count = 0;
+
+    for (int row = 0; row < table->count; row++) {
+        const medication_schedule_t *schedule = &table->schedules[row];
+        int64_t interval_ms = (int64_t)schedule->interval_hours * MS_PER_HOUR;
+        int64_t t = table->next_dispense_time[row];
+
+        while (t > 0 && t < horizon) {
+            if (schedule->treatment_end_date > 0 && t > schedule->treatment_end_date) {
+                break;
+            }
+            // Las tomas siguientes de esta fila solo pueden ser más tardías
+            if (count == max_doses && t >= doses[count - 1].time) {
+                break;
+            }
+
+            // Inserción ordenada; si está lleno se descarta la última
+            int pos = count < max_doses ? count++ : max_doses - 1;
+            while (pos > 0 && doses[pos - 1].time > t) {
+                doses[pos] = doses[pos - 1];
+                pos--;
+            }
+            doses[pos].time = t;
+            doses[pos].med_index = table->med_index[row];
+            doses[pos].sched_index = table->sched_index[row];
+
+            if (schedule->interval_mode) {
+                if (interval_ms <= 0) {
+                    break;
+                }
+                t += interval_ms;
+            } else {
+                t = weekly_after(cal, schedule, t);
+            }
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,63 @@
+#ifndef MEDICATION_CALENDAR_H
+#define MEDICATION_CALENDAR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "medication_storage.h"
+
+// Días cubiertos por el calendario (hoy y los 7 siguientes)
+#define MEDICATION_CALENDAR_DAYS 8
+
+/**
+ * @brief Referencia de hora local para evaluar horarios sin llamar a
+ *        localtime_r()/mktime() en cada cálculo. Se reconstruye como mucho una
+ *        vez por hora (o al cambiar de día, o si el reloj salta).
+ *        Cada tarea debe usar su propia instancia.
+ */
+typedef struct {
+    int64_t midnight_ms[MEDICATION_CALENDAR_DAYS];  // 00:00 local de hoy + k días
+    int64_t valid_from_ms;        // Intervalo en el que la referencia es válida
+    int64_t valid_until_ms;
+    uint8_t weekday;              // Día de hoy: 1=lunes, 7=domingo
+    uint8_t dst_days_mask;        // Bit k: el día k no dura 24 h (cambio de hora)
+} medication_calendar_t;
+
+/**
+ * @brief Actualiza el calendario si now_ms está fuera de su intervalo de validez
+ * @return true si se reconstruyó
+ */
+bool medication_calendar_refresh(medication_calendar_t *cal, int64_t now_ms);
+
+/**
+ * @brief Compila days[] en la máscara days_mask del horario.
+ *        Debe llamarse cada vez que cambian los días de un horario.
+ */
+void medication_calendar_compile(medication_schedule_t *schedule);
+
+/**
+ * @brief Calcula la próxima dispensación de un horario
+ *
+ * @param cal Calendario actualizado para now_ms
+ * @param schedule Horario compilado
+ * @param now_ms Hora actual (ms)
+ * @return Timestamp en ms, o INT64_MAX si el horario ya no tiene dosis
+ */
+int64_t medication_calendar_next(const medication_calendar_t *cal,
+                                 const medication_schedule_t *schedule, int64_t now_ms);
+
+/**
+ * @brief Proyecta las próximas dosis de todos los horarios en una sola pasada,
+ *        ordenadas por hora. Parte de la próxima dispensación de cada fila y
+ *        no va más allá del último día del calendario.
+ *
+ * @param cal Calendario actualizado
+ * @param table Tabla de horarios del almacenamiento
+ * @param doses Arreglo de salida
+ * @param max_doses Capacidad de doses
+ * @return Número de dosis escritas
+ */
+int medication_calendar_project(const medication_calendar_t *cal,
+                                const medication_schedule_table_t *table,
+                                medication_upcoming_dose_t *doses, int max_doses);
+
+#endif /* MEDICATION_CALENDAR_H */
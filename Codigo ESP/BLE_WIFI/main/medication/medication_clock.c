@@ -0,0 +1,17 @@
+#include <stddef.h>
+#include "medication_clock.h"
+#include "../ntp_func.h"
+
+static medication_clock_source_t clock_source = NULL;
+
+int64_t medication_clock_now_ms(void) {
+    return clock_source ? clock_source() : get_time_ms();
+}
+
+bool medication_clock_is_reliable(void) {
+    return medication_clock_now_ms() >= MEDICATION_CLOCK_RELIABLE_MS;
+}
+
+void medication_clock_set_source(medication_clock_source_t source) {
+    clock_source = source;
+}
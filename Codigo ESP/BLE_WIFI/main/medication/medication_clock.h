@@ -0,0 +1,36 @@
+#ifndef MEDICATION_CLOCK_H
+#define MEDICATION_CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Antes de esta fecha (2022-01-01 UTC) el reloj no viene del NTP ni de la
+// hora por defecto: sigue en la época tras el arranque
+#define MEDICATION_CLOCK_RELIABLE_MS 1640995200000LL
+
+/**
+ * @brief Fuente de la hora de pared en ms desde EPOCH
+ */
+typedef int64_t (*medication_clock_source_t)(void);
+
+/**
+ * @brief Hora actual que usan el almacenamiento, el planificador, los
+ *        recordatorios y el dispensador (por defecto, get_time_ms())
+ * @return Timestamp en ms
+ */
+int64_t medication_clock_now_ms(void);
+
+/**
+ * @brief Indica si la hora actual ya es válida para programar dosis
+ * @return true a partir de MEDICATION_CLOCK_RELIABLE_MS
+ */
+bool medication_clock_is_reliable(void);
+
+/**
+ * @brief Sustituye la fuente de la hora. Pensado para la simulación en el
+ *        host; en el equipo no se llama.
+ * @param source Nueva fuente, o NULL para volver a get_time_ms()
+ */
+void medication_clock_set_source(medication_clock_source_t source);
+
+#endif /* MEDICATION_CLOCK_H */
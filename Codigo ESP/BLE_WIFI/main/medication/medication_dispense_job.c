@@ -0,0 +1,446 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#include "medication_dispense_job.h"
+#include "medication_latency.h"
+
+static const char *TAG = "MED_DISPENSE_JOB";
+
+#define DISPENSE_JOB_TASK_STACK     4096
+#define DISPENSE_JOB_TASK_PRIORITY  5
+
+// Cola circular de trabajos pendientes
+static medication_dispense_job_t job_queue[MEDICATION_DISPENSE_QUEUE_LEN];
+static int queue_head = 0;
+static int queue_count = 0;
+static uint32_t next_job_id = 1;
+static portMUX_TYPE job_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Trabajo en curso (solo lo modifica la tarea; los demás lo leen con job_lock)
+static medication_dispense_job_t current_job;
+static dispense_operation_t current_op;
+static bool job_active = false;
+
+static TaskHandle_t job_task_handle = NULL;
+
+// Autotest diferido: se ejecuta con la cola vacía y cede el paso a las dosis
+static bool self_test_pending = false;
+static medication_dispense_self_test_cb_t self_test_cb = NULL;
+
+// Pasada de calibración de la bomba pendiente (0 = ninguna)
+static uint8_t pump_cal_duty = 0;
+static medication_dispense_pump_cal_cb_t pump_cal_cb = NULL;
+
+#if CONFIG_PM_ENABLE
+// Mantiene la APB (PWM de servos y bomba) mientras hay un trabajo, el
+// autotest o una calibración en curso
+static esp_pm_lock_handle_t job_pm_lock = NULL;
+static bool job_pm_held = false;
+#endif
+
+static void job_pm_acquire(void) {
+#if CONFIG_PM_ENABLE
+    if (job_pm_lock && !job_pm_held) {
+        esp_pm_lock_acquire(job_pm_lock);
+        job_pm_held = true;
+    }
+#endif
+}
+
+static void job_pm_release(void) {
+#if CONFIG_PM_ENABLE
+    if (job_pm_lock && job_pm_held) {
+        esp_pm_lock_release(job_pm_lock);
+        job_pm_held = false;
+    }
+#endif
+}
+
+static bool queue_pop(medication_dispense_job_t *out) {
+    bool found = false;
+
+    portENTER_CRITICAL(&job_lock);
+    if (queue_count > 0) {
+        *out = job_queue[queue_head];
+        queue_head = (queue_head + 1) % MEDICATION_DISPENSE_QUEUE_LEN;
+        queue_count--;
+        found = true;
+    }
+    portEXIT_CRITICAL(&job_lock);
+
+    return found;
+}
+
+// Ejecuta un trabajo completo. Solo esta tarea espera al recipiente o a los
+// servos: el dispensador, los recordatorios y MQTT siguen atendiéndose.
+// El recipiente se espera una vez; el resto de dosis del grupo lo reutilizan.
+static void run_job(const medication_dispense_job_t *job) {
+    esp_err_t results[MEDICATION_DOSE_GROUP_MAX];
+    dispense_operation_t op = { .state = DISPENSE_STATE_IDLE };
+    bool have_container = false;
+
+    portENTER_CRITICAL(&job_lock);
+    current_job = *job;
+    current_op = op;
+    job_active = true;
+    portEXIT_CRITICAL(&job_lock);
+
+    ESP_LOGI(TAG, "Trabajo %lu: %d dosis", (unsigned long)job->id, job->item_count);
+
+    for (int i = 0; i < job->item_count; i++) {
+        const medication_dispense_item_t *item = &job->items[i];
+        esp_err_t err = have_container
+            ? medication_hardware_dispense_next(&op, item->compartment, item->is_liquid, item->amount)
+            : medication_hardware_dispense_begin(&op, item->compartment, item->is_liquid, item->amount);
+
+        ESP_LOGI(TAG, "Trabajo %lu [%d/%d]: compartimento %d, %s %lu", (unsigned long)job->id, i + 1,
+                 job->item_count, item->compartment,
+                 item->is_liquid ? "µl" : "píldoras", (unsigned long)item->amount);
+
+        // Marcas de cada fase; la primera dosis parte de la detección del
+        // recipiente y las siguientes del cierre de la anterior
+        int64_t ready_ms = medication_latency_now_ms();
+        int64_t open_ms = 0;
+        int64_t released_ms = 0;
+        bool started = false;
+
+        while (err == ESP_OK && op.state != DISPENSE_STATE_DONE && op.state != DISPENSE_STATE_FAILED) {
+            // Antes de mover el servo o la bomba queda constancia en NVS: tras
+            // un corte a partir de aquí la dosis no se vuelve a dispensar
+            if (op.state == DISPENSE_STATE_OPENING && !started) {
+                started = true;
+                if (medication_storage_dispense_started(item->med_handle, item->schedule_id) != ESP_OK) {
+                    ESP_LOGW(TAG, "Trabajo %lu: no se pudo anotar el inicio de %s",
+                             (unsigned long)job->id, item->schedule_id);
+                }
+            }
+
+            dispense_state_t prev_state = op.state;
+            uint32_t delay_ms = medication_hardware_dispense_step(&op);
+            if (op.state != prev_state) {
+                int64_t now_ms = medication_latency_now_ms();
+                if (prev_state == DISPENSE_STATE_WAIT_CONTAINER && op.state == DISPENSE_STATE_OPENING) {
+                    have_container = true;
+                    ready_ms = now_ms;
+                    medication_latency_record(MEDICATION_LATENCY_QUEUE_TO_CONTAINER, item->compartment,
+                                              now_ms - job->queued_ms);
+                } else if (op.state == DISPENSE_STATE_DISPENSING && !open_ms) {
+                    open_ms = now_ms;
+                    medication_latency_record(MEDICATION_LATENCY_CONTAINER_TO_OPEN, item->compartment,
+                                              now_ms - ready_ms);
+                } else if (op.state == DISPENSE_STATE_CLOSING) {
+                    released_ms = now_ms;
+                    medication_latency_record(MEDICATION_LATENCY_OPEN_TO_RELEASED, item->compartment,
+                                              now_ms - open_ms);
+                }
+            }
+
+            portENTER_CRITICAL(&job_lock);
+            current_op = op;
+            portEXIT_CRITICAL(&job_lock);
+
+            if (op.state != DISPENSE_STATE_DONE && op.state != DISPENSE_STATE_FAILED) {
+                medication_hardware_dispense_wait(&op, delay_ms);
+            }
+        }
+
+        results[i] = (err == ESP_OK) ? op.result : err;
+        if (results[i] == ESP_OK && released_ms) {
+            medication_latency_record(MEDICATION_LATENCY_RELEASED_TO_CLOSED, item->compartment,
+                                      medication_latency_now_ms() - released_ms);
+        }
+
+        // Sin recipiente no tiene sentido seguir: el resto del grupo falla igual
+        if (results[i] == ESP_ERR_TIMEOUT && !have_container) {
+            for (int j = i + 1; j < job->item_count; j++) {
+                results[j] = ESP_ERR_TIMEOUT;
+            }
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "Trabajo %lu terminado", (unsigned long)job->id);
+
+    if (job->done_cb) {
+        job->done_cb(job, results);
+    }
+
+    portENTER_CRITICAL(&job_lock);
+    job_active = false;
+    portEXIT_CRITICAL(&job_lock);
+}
+
+static bool job_waiting(void) {
+    return medication_dispense_job_queued() > 0;
+}
+
+// Ejecuta el autotest pendiente, si lo hay. Devuelve ESP_ERR_NOT_FINISHED si
+// lo interrumpió una dosis: sigue pendiente para cuando se vacíe la cola.
+static esp_err_t run_pending_self_test(void) {
+    portENTER_CRITICAL(&job_lock);
+    bool pending = self_test_pending;
+    medication_dispense_self_test_cb_t cb = self_test_cb;
+    portEXIT_CRITICAL(&job_lock);
+
+    if (!pending) {
+        return ESP_OK;
+    }
+
+    int64_t start_ms = medication_latency_now_ms();
+    esp_err_t result = medication_hardware_self_test(job_waiting);
+    if (result == ESP_ERR_NOT_FINISHED) {
+        ESP_LOGI(TAG, "Autotest aplazado: hay dosis en cola");
+        return result;
+    }
+
+    portENTER_CRITICAL(&job_lock);
+    self_test_pending = false;
+    self_test_cb = NULL;
+    portEXIT_CRITICAL(&job_lock);
+
+    if (cb) {
+        cb(result, (uint32_t)(medication_latency_now_ms() - start_ms));
+    }
+    return result;
+}
+
+// Ejecuta la pasada de calibración pendiente, si la hay
+static void run_pending_pump_calibration(void) {
+    portENTER_CRITICAL(&job_lock);
+    uint8_t duty = pump_cal_duty;
+    medication_dispense_pump_cal_cb_t cb = pump_cal_cb;
+    pump_cal_duty = 0;
+    pump_cal_cb = NULL;
+    portEXIT_CRITICAL(&job_lock);
+
+    if (duty == 0) {
+        return;
+    }
+
+    esp_err_t result = medication_hardware_pump_calibration_run(duty);
+    if (cb) {
+        cb(result, duty, MEDICATION_PUMP_CAL_RUN_MS);
+    }
+}
+
+static void dispense_job_task(void *pvParameters) {
+    medication_dispense_job_t job;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        job_pm_acquire();
+        do {
+            while (queue_pop(&job)) {
+                run_job(&job);
+            }
+            run_pending_pump_calibration();
+        } while (run_pending_self_test() == ESP_ERR_NOT_FINISHED);
+        job_pm_release();
+    }
+}
+
+esp_err_t medication_dispense_job_init(void) {
+    if (job_task_handle) {
+        return ESP_OK;
+    }
+
+#if CONFIG_PM_ENABLE
+    if (!job_pm_lock) {
+        esp_err_t pm_err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "med_dispense_job", &job_pm_lock);
+        if (pm_err != ESP_OK) {
+            ESP_LOGW(TAG, "No se pudo crear el bloqueo de energía: %s", esp_err_to_name(pm_err));
+        }
+    }
+#endif
+
+    portENTER_CRITICAL(&job_lock);
+    queue_head = 0;
+    queue_count = 0;
+    job_active = false;
+    self_test_pending = false;
+    self_test_cb = NULL;
+    pump_cal_duty = 0;
+    pump_cal_cb = NULL;
+    portEXIT_CRITICAL(&job_lock);
+
+    BaseType_t created = xTaskCreate(dispense_job_task, "med_dispense", DISPENSE_JOB_TASK_STACK,
+                                     NULL, DISPENSE_JOB_TASK_PRIORITY, &job_task_handle);
+    if (created != pdPASS) {
+        ESP_LOGE(TAG, "Error al crear la tarea de dispensación");
+        job_task_handle = NULL;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Cola de dispensación inicializada");
+    return ESP_OK;
+}
+
+void medication_dispense_job_deinit(void) {
+    if (job_task_handle) {
+        vTaskDelete(job_task_handle);
+        job_task_handle = NULL;
+    }
+
+    portENTER_CRITICAL(&job_lock);
+    queue_head = 0;
+    queue_count = 0;
+    job_active = false;
+    self_test_pending = false;
+    self_test_cb = NULL;
+    pump_cal_duty = 0;
+    pump_cal_cb = NULL;
+    portEXIT_CRITICAL(&job_lock);
+
+    // La tarea ya no existe: soltar el bloqueo si se quedó con él
+    job_pm_release();
+}
+
+esp_err_t medication_dispense_job_submit(const medication_dispense_job_t *job, uint32_t *job_id) {
+    if (!job || job->item_count == 0 || job->item_count > MEDICATION_DOSE_GROUP_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!job_task_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    uint32_t id = 0;
+
+    portENTER_CRITICAL(&job_lock);
+    if (queue_count < MEDICATION_DISPENSE_QUEUE_LEN) {
+        int tail = (queue_head + queue_count) % MEDICATION_DISPENSE_QUEUE_LEN;
+        job_queue[tail] = *job;
+        id = next_job_id++;
+        job_queue[tail].id = id;
+        job_queue[tail].queued_ms = medication_latency_now_ms();
+        queue_count++;
+    } else {
+        ret = ESP_ERR_NO_MEM;
+    }
+    portEXIT_CRITICAL(&job_lock);
+
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Cola de dispensación llena (%d trabajos)", MEDICATION_DISPENSE_QUEUE_LEN);
+        return ret;
+    }
+
+    if (job_id) {
+        *job_id = id;
+    }
+    xTaskNotifyGive(job_task_handle);
+    return ESP_OK;
+}
+
+esp_err_t medication_dispense_job_run(const medication_dispense_job_t *job, uint32_t *job_id) {
+    if (!job || job->item_count == 0 || job->item_count > MEDICATION_DOSE_GROUP_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    medication_dispense_job_t local = *job;
+    portENTER_CRITICAL(&job_lock);
+    local.id = next_job_id++;
+    portEXIT_CRITICAL(&job_lock);
+    local.queued_ms = medication_latency_now_ms();
+
+    if (job_id) {
+        *job_id = local.id;
+    }
+    run_job(&local);
+    return ESP_OK;
+}
+
+esp_err_t medication_dispense_job_request_self_test(medication_dispense_self_test_cb_t done_cb) {
+    if (!job_task_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    portENTER_CRITICAL(&job_lock);
+    self_test_pending = true;
+    self_test_cb = done_cb;
+    portEXIT_CRITICAL(&job_lock);
+
+    xTaskNotifyGive(job_task_handle);
+    return ESP_OK;
+}
+
+esp_err_t medication_dispense_job_request_pump_calibration(uint8_t duty, medication_dispense_pump_cal_cb_t done_cb) {
+    if (!medication_pump_is_cal_duty(duty)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!job_task_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t ret = ESP_OK;
+    portENTER_CRITICAL(&job_lock);
+    if (pump_cal_duty != 0) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        pump_cal_duty = duty;
+        pump_cal_cb = done_cb;
+    }
+    portEXIT_CRITICAL(&job_lock);
+
+    if (ret == ESP_OK) {
+        xTaskNotifyGive(job_task_handle);
+    }
+    return ret;
+}
+
+static bool job_matches(const medication_dispense_job_t *job, medication_handle_t med_handle,
+                        const char *schedule_id) {
+    for (int i = 0; i < job->item_count; i++) {
+        const medication_dispense_item_t *item = &job->items[i];
+        if (item->med_handle == med_handle &&
+            strncmp(item->schedule_id, schedule_id, sizeof(item->schedule_id)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool medication_dispense_job_pending(medication_handle_t med_handle, const char *schedule_id) {
+    if (!schedule_id) {
+        return false;
+    }
+
+    bool pending = false;
+
+    portENTER_CRITICAL(&job_lock);
+    if (job_active && job_matches(&current_job, med_handle, schedule_id)) {
+        pending = true;
+    }
+    for (int i = 0; i < queue_count && !pending; i++) {
+        const medication_dispense_job_t *job = &job_queue[(queue_head + i) % MEDICATION_DISPENSE_QUEUE_LEN];
+        pending = job_matches(job, med_handle, schedule_id);
+    }
+    portEXIT_CRITICAL(&job_lock);
+
+    return pending;
+}
+
+dispense_state_t medication_dispense_job_state(uint32_t *job_id) {
+    dispense_state_t state = DISPENSE_STATE_IDLE;
+
+    portENTER_CRITICAL(&job_lock);
+    if (job_active) {
+        state = current_op.state;
+        if (job_id) *job_id = current_job.id;
+    }
+    portEXIT_CRITICAL(&job_lock);
+
+    return state;
+}
+
+int medication_dispense_job_queued(void) {
+    portENTER_CRITICAL(&job_lock);
+    int queued = queue_count;
+    portEXIT_CRITICAL(&job_lock);
+    return queued;
+}
@@ -0,0 +1,142 @@
+#ifndef MEDICATION_DISPENSE_JOB_H
+#define MEDICATION_DISPENSE_JOB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "medication_storage.h"
+#include "medication_hardware.h"
+
+// Trabajos de dispensación en espera (además del que está en curso)
+#define MEDICATION_DISPENSE_QUEUE_LEN 8
+// Dosis de un mismo grupo (una por compartimento)
+#define MEDICATION_DOSE_GROUP_MAX     (MAX_PILL_COMPARTMENTS + 1)
+
+typedef struct medication_dispense_job medication_dispense_job_t;
+
+/**
+ * @brief Callback de finalización de un trabajo. Se ejecuta en la tarea de
+ *        dispensación; no debe bloquear durante mucho tiempo.
+ * @param job Trabajo terminado
+ * @param results Resultado de cada dosis (job->item_count): ESP_OK,
+ *                ESP_ERR_TIMEOUT si no se colocó recipiente, u otro error
+ */
+typedef void (*medication_dispense_done_cb_t)(const medication_dispense_job_t *job, const esp_err_t *results);
+
+/**
+ * @brief Callback de fin del autotest diferido (en la tarea de dispensación)
+ * @param result Resultado de medication_hardware_self_test()
+ * @param elapsed_ms Duración del autotest
+ */
+typedef void (*medication_dispense_self_test_cb_t)(esp_err_t result, uint32_t elapsed_ms);
+
+/**
+ * @brief Callback de fin de una pasada de calibración de la bomba (en la tarea de dispensación)
+ * @param result Resultado de medication_hardware_pump_calibration_run()
+ * @param duty Duty cycle de la pasada
+ * @param run_ms Tiempo que estuvo la bomba en marcha
+ */
+typedef void (*medication_dispense_pump_cal_cb_t)(esp_err_t result, uint8_t duty, uint32_t run_ms);
+
+/**
+ * @brief Una dosis dentro de un trabajo
+ */
+typedef struct {
+    medication_handle_t med_handle;       // Medicamento (handle del índice)
+    char schedule_id[32];                 // Horario que origina la dosis
+    uint8_t compartment;
+    bool is_liquid;
+    uint32_t amount;                      // Píldoras, o µl de líquido
+} medication_dispense_item_t;
+
+/**
+ * @brief Trabajo de dispensación: un grupo de dosis servidas en una sola
+ *        sesión (una detección de recipiente y los compartimentos en orden)
+ */
+struct medication_dispense_job {
+    uint32_t id;                          // Asignado al encolar
+    medication_dispense_item_t items[MEDICATION_DOSE_GROUP_MAX];
+    uint8_t item_count;
+    int64_t queued_ms;                    // Marca monotónica al encolar (latencias)
+    bool manual;                          // Pedido por comando, no por horario
+    medication_dispense_done_cb_t done_cb;
+    void *arg;                            // Contexto libre para done_cb
+};
+
+/**
+ * @brief Crea la tarea de dispensación y su cola de trabajos
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_dispense_job_init(void);
+
+/**
+ * @brief Detiene la tarea de dispensación y descarta los trabajos pendientes
+ */
+void medication_dispense_job_deinit(void);
+
+/**
+ * @brief Encola un trabajo; vuelve de inmediato
+ *
+ * @param job Trabajo a copiar en la cola (id se ignora; 1..MEDICATION_DOSE_GROUP_MAX dosis)
+ * @param job_id Si no es NULL, recibe el id asignado
+ * @return ESP_OK si se encoló, ESP_ERR_NO_MEM si la cola está llena,
+ *         ESP_ERR_INVALID_ARG si el número de dosis no es válido,
+ *         ESP_ERR_INVALID_STATE si la tarea no está inicializada
+ */
+esp_err_t medication_dispense_job_submit(const medication_dispense_job_t *job, uint32_t *job_id);
+
+/**
+ * @brief Ejecuta un trabajo en la tarea que llama, sin pasar por la cola.
+ *        Pensado para la simulación en el host; en el equipo se usa
+ *        medication_dispense_job_submit().
+ *
+ * @param job Trabajo a ejecutar (1..MEDICATION_DOSE_GROUP_MAX dosis); se
+ *            llama a job->done_cb antes de volver
+ * @param job_id Si no es NULL, recibe el id asignado
+ * @return ESP_OK si se ejecutó, ESP_ERR_INVALID_ARG si el número de dosis no es válido
+ */
+esp_err_t medication_dispense_job_run(const medication_dispense_job_t *job, uint32_t *job_id);
+
+/**
+ * @brief Pide el autotest del hardware en la tarea de dispensación. Se
+ *        ejecuta cuando la cola está vacía y, si entra una dosis, se
+ *        interrumpe y se repite después; nunca retrasa una dispensación
+ *        más que el recorrido de un servo.
+ *
+ * @param done_cb Se llama al terminar (puede ser NULL)
+ * @return ESP_OK si quedó pendiente, ESP_ERR_INVALID_STATE si la tarea no
+ *         está inicializada
+ */
+esp_err_t medication_dispense_job_request_self_test(medication_dispense_self_test_cb_t done_cb);
+
+/**
+ * @brief Pide una pasada de calibración de la bomba en la tarea de
+ *        dispensación. Se ejecuta con la cola vacía y no se interrumpe: una
+ *        dosis que llegue mientras tanto espera como mucho
+ *        MEDICATION_PUMP_CAL_RUN_MS.
+ *
+ * @param duty Punto de la tabla de calibración
+ * @param done_cb Se llama al terminar (puede ser NULL)
+ * @return ESP_OK si quedó pendiente, ESP_ERR_INVALID_ARG si duty no es un
+ *         punto de la tabla, ESP_ERR_INVALID_STATE si la tarea no está
+ *         inicializada o ya hay otra pasada pendiente
+ */
+esp_err_t medication_dispense_job_request_pump_calibration(uint8_t duty, medication_dispense_pump_cal_cb_t done_cb);
+
+/**
+ * @brief Indica si ya hay un trabajo en curso o en cola con una dosis de ese horario
+ */
+bool medication_dispense_job_pending(medication_handle_t med_handle, const char *schedule_id);
+
+/**
+ * @brief Fase del trabajo en curso (DISPENSE_STATE_IDLE si no hay ninguno)
+ * @param job_id Si no es NULL, recibe el id del trabajo en curso
+ */
+dispense_state_t medication_dispense_job_state(uint32_t *job_id);
+
+/**
+ * @brief Número de trabajos en cola, sin contar el que está en curso
+ */
+int medication_dispense_job_queued(void);
+
+#endif /* MEDICATION_DISPENSE_JOB_H */
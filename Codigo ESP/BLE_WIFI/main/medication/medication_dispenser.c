@@ -5,182 +5,146 @@
 #include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "sdkconfig.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 #include "medication_storage.h"
 #include "medication_dispenser.h"
+#include "medication_scheduler.h"
+#include "medication_reminders.h"
 #include "../mqtt/mqtt_app.h"
 #include "../ntp_func.h" // Para acceder a las funciones de tiempo NTP
+#include "medication_clock.h"
 #include "medication_hardware.h"  // Añadir esta línea al inicio
+#include "medication_dispense_job.h"
+#include "medication_missed.h"
+#include "medication_latency.h"
+#include "medication_intent.h"
+#include "medication_inventory.h"
+#include "medication_boot.h"
 #include "buzzer_driver.h" // Añadir el include al principio
 
 static const char *TAG = "MED_DISPENSER";
 static TaskHandle_t dispenser_task_handle = NULL;
-static esp_timer_handle_t check_timer = NULL;
 static bool dispenser_initialized = false;
 static bool auto_dispense_enabled = true;
+static int64_t dose_group_window_ms = MEDICATION_DOSE_GROUP_WINDOW_MS;
 
 // Prototipo para la tarea de dispensación
 static void medication_dispenser_task(void *pvParameters);
-static void check_timer_callback(void* arg);
-static void publish_med_notification(medication_t *medication, medication_schedule_t *schedule);
-void medication_reminder_callback(void *arg); // modificado de static a público
-void schedule_medication_reminders(void); // nueva función para programar los recordatorios
+static void dose_due_callback(void);
+static void reminder_due_callback(void);
+static char *build_med_notification(const medication_t *medication, const medication_schedule_t *schedule);
+static void publish_telemetry_string(char *json_str);
+static void medication_reminder_callback(int med_index, int sched_index);
 
 // Añadir este prototipo al inicio junto con los otros
 esp_err_t medication_dispenser_confirm_taken(const char* medication_id, const char* schedule_id);
 
-// Añadir esta estructura para gestionar temporizadores de recordatorios
+// Eventos del bucle del dispensador (bits de la notificación de su tarea)
+#define DISPENSER_EVT_DOSE_DUE          (1 << 0)  // Venció la dosis más próxima
+#define DISPENSER_EVT_REMINDER          (1 << 1)  // Venció el primer recordatorio
+#define DISPENSER_EVT_SCHEDULE_CHANGED  (1 << 2)  // Sincronización, dispensación o confirmación
+#define DISPENSER_EVT_TIME_CHANGED      (1 << 3)  // Hora ajustada (NTP o por defecto)
+#define DISPENSER_EVT_JOB_DONE          (1 << 4)  // Terminó un trabajo de dispensación
+
+// Pausa entre las dos alertas de un recordatorio
+#define REMINDER_REPEAT_MS 2000
+// Reintento mientras la hora aún no es fiable
+#define TIME_UNRELIABLE_RETRY_MS 30000
+
+// Resultado de un trabajo terminado. La tarea med_dispense solo lo encola: el
+// almacenamiento se actualiza en el bucle del dispensador.
 typedef struct {
-    esp_timer_handle_t timer_handle;
-    char medication_id[MEDICATION_ID_MAX_LEN];
-    char schedule_id[MEDICATION_ID_MAX_LEN];
-} reminder_timer_t;
-
-// Arreglo para almacenar los temporizadores de recordatorios activos
-#define MAX_REMINDER_TIMERS 10
-static reminder_timer_t reminder_timers[MAX_REMINDER_TIMERS] = {0};
-static int active_reminder_count = 0;
-
-// Tiempo de anticipación para el recordatorio (en milisegundos)
-#define REMINDER_ADVANCE_TIME (5 * 60 * 1000)  // 5 minutos antes
-
-// Esta función programa recordatorios para todos los medicamentos
-void schedule_medication_reminders(void) {
-    ESP_LOGI(TAG, "Programando recordatorios para medicamentos");
-    
-    // Limpiar recordatorios anteriores
-    for (int i = 0; i < active_reminder_count; i++) {
-        if (reminder_timers[i].timer_handle != NULL) {
-            esp_timer_stop(reminder_timers[i].timer_handle);
-            esp_timer_delete(reminder_timers[i].timer_handle);
-            reminder_timers[i].timer_handle = NULL;
-        }
+    medication_dispense_item_t items[MEDICATION_DOSE_GROUP_MAX];
+    esp_err_t results[MEDICATION_DOSE_GROUP_MAX];
+    uint8_t item_count;
+    bool manual;
+} dispense_job_result_t;
+
+// Un resultado por trabajo que puede haber a la vez (en cola y en curso)
+#define JOB_RESULT_QUEUE_LEN (MEDICATION_DISPENSE_QUEUE_LEN + 1)
+static QueueHandle_t job_result_queue = NULL;
+
+// Segunda alerta del último recordatorio: el bucle la reproduce al vencer la
+// pausa en vez de bloquearse. Se mide en ticks para que no la mueva un ajuste
+// de hora.
+static bool reminder_repeat_pending = false;
+static TickType_t reminder_repeat_start = 0;
+
+#if CONFIG_PM_ENABLE
+// Impide el light sleep y la bajada de APB mientras se atiende un evento
+// (MCPWM del servo, sensores y temporizaciones del buzzer)
+static esp_pm_lock_handle_t dispenser_pm_lock = NULL;
+#endif
+
+static inline void dispenser_pm_acquire(void) {
+#if CONFIG_PM_ENABLE
+    if (dispenser_pm_lock) {
+        esp_pm_lock_acquire(dispenser_pm_lock);
     }
-    active_reminder_count = 0;
-    
-    // Obtener el tiempo actual
-    int64_t current_time = get_time_ms();
-    
-    // Obtener todos los medicamentos
-    int count;
-    medication_t *meds = medication_storage_get_all_medications(&count);
-    
-    if (!meds || count == 0) {
-        ESP_LOGI(TAG, "No hay medicamentos para programar recordatorios");
-        return;
+#endif
+}
+
+static inline void dispenser_pm_release(void) {
+#if CONFIG_PM_ENABLE
+    if (dispenser_pm_lock) {
+        esp_pm_lock_release(dispenser_pm_lock);
     }
-    
-    // Iterar sobre todos los medicamentos y sus horarios
-    for (int i = 0; i < count; i++) {
-        for (int j = 0; j < meds[i].schedules_count; j++) {
-            medication_schedule_t *schedule = &meds[i].schedules[j];
-            
-            // Verificar si el próximo tiempo de dispensación es en el futuro
-            if (schedule->next_dispense_time > current_time) {
-                // Calcular cuándo debe activarse el recordatorio (5 minutos antes)
-                int64_t reminder_time = schedule->next_dispense_time - REMINDER_ADVANCE_TIME;
-                
-                // Si el tiempo ya pasó, programar para la próxima vez
-                if (reminder_time <= current_time) {
-                    ESP_LOGI(TAG, "El tiempo de recordatorio ya pasó, se programará para el siguiente ciclo");
-                    continue;
-                }
-                
-                // Comprobar si hay espacio para un nuevo recordatorio
-                if (active_reminder_count >= MAX_REMINDER_TIMERS) {
-                    ESP_LOGW(TAG, "Alcanzado el límite máximo de recordatorios");
-                    break;
-                }
-                
-                // Crear contexto para el recordatorio
-                medication_schedule_t *reminder_ctx = malloc(sizeof(medication_schedule_t));
-                if (!reminder_ctx) {
-                    ESP_LOGE(TAG, "Error de memoria al crear contexto de recordatorio");
-                    continue;
-                }
-                memcpy(reminder_ctx, schedule, sizeof(medication_schedule_t));
-                
-                // Crear temporizador para el recordatorio
-                esp_timer_create_args_t timer_args = {
-                    .callback = medication_reminder_callback,
-                    .arg = reminder_ctx,
-                    .name = "med_reminder"
-                };
-                
-                esp_timer_handle_t timer_handle;
-                esp_err_t ret = esp_timer_create(&timer_args, &timer_handle);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Error al crear temporizador para recordatorio: %s", esp_err_to_name(ret));
-                    free(reminder_ctx);
-                    continue;
-                }
-                
-                // Calcular cuánto tiempo falta (en microsegundos)
-                int64_t time_to_reminder_us = (reminder_time - current_time) * 1000;
-                
-                // Iniciar el temporizador
-                ret = esp_timer_start_once(timer_handle, time_to_reminder_us);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Error al iniciar temporizador para recordatorio: %s", esp_err_to_name(ret));
-                    esp_timer_delete(timer_handle);
-                    free(reminder_ctx);
-                    continue;
-                }
-                
-                // Guardar información del temporizador
-                reminder_timers[active_reminder_count].timer_handle = timer_handle;
-                strncpy(reminder_timers[active_reminder_count].medication_id, meds[i].id, MEDICATION_ID_MAX_LEN-1);
-                strncpy(reminder_timers[active_reminder_count].schedule_id, schedule->id, MEDICATION_ID_MAX_LEN-1);
-                active_reminder_count++;
-                
-                char time_str[32];
-                format_time(reminder_time, time_str, sizeof(time_str));
-                ESP_LOGI(TAG, "Recordatorio programado para %s: %s (medicamento: %s)", 
-                         time_str, schedule->id, meds[i].name);
-            }
-        }
+#endif
+}
+
+// Despierta el bucle del dispensador con un evento
+static void dispenser_post_event(uint32_t event) {
+    if (dispenser_task_handle != NULL) {
+        xTaskNotify(dispenser_task_handle, event, eSetBits);
     }
-    
-    ESP_LOGI(TAG, "Total de recordatorios programados: %d", active_reminder_count);
 }
 
-// Modificar el callback para que libere la memoria del contexto
-void medication_reminder_callback(void *arg) {
-    medication_schedule_t *schedule = (medication_schedule_t *)arg;
-    
-    // Necesitamos encontrar el medicamento al que pertenece este horario
-    int count;
+// Atiende en la tarea del dispensador un recordatorio retirado de la cola
+// (faltan MEDICATION_REMINDER_ADVANCE_MS para la dosis del horario)
+static void medication_reminder_callback(int med_index, int sched_index) {
+    char med_name[sizeof(((medication_t *)0)->name)];
+    char schedule_id[sizeof(((medication_schedule_t *)0)->id)];
+    int64_t dispense_time;
+    
+    // Se copia lo necesario: los avisos no se hacen con el almacenamiento bloqueado
+    medication_storage_lock();
+    int count = 0;
     medication_t *meds = medication_storage_get_all_medications(&count);
-    const char *med_name = "desconocido"; // Valor por defecto
-    
-    // Buscar el medicamento que contiene este horario
-    for (int i = 0; i < count; i++) {
-        for (int j = 0; j < meds[i].schedules_count; j++) {
-            if (strcmp(meds[i].schedules[j].id, schedule->id) == 0) {
-                med_name = meds[i].name;
-                break;
-            }
-        }
+    if (med_index >= count || sched_index >= meds[med_index].schedules_count) {
+        medication_storage_unlock();
+        ESP_LOGW(TAG, "Recordatorio de un horario que ya no existe");
+        return;
     }
+    const medication_t *med = &meds[med_index];
+    const medication_schedule_t *schedule = &med->schedules[sched_index];
+    snprintf(med_name, sizeof(med_name), "%s", med->name);
+    snprintf(schedule_id, sizeof(schedule_id), "%s", schedule->id);
+    dispense_time = schedule->next_dispense_time;
+    medication_storage_unlock();
     
-    ESP_LOGI(TAG, "⏰ RECORDATORIO DE MEDICAMENTO: %s (horario %s)", med_name, schedule->id);
+    ESP_LOGI(TAG, "⏰ RECORDATORIO DE MEDICAMENTO: %s (horario %s)", med_name, schedule_id);
     
     // Reproducir alerta de recordatorio
     buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_READY);
     
-    // Reproducir una segunda vez para asegurar que se escuche
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_READY);
+    // Y una segunda vez para asegurar que se escuche (la reproduce el bucle)
+    reminder_repeat_pending = true;
+    reminder_repeat_start = xTaskGetTickCount();
     
     // Publicar notificación MQTT para recordatorio
     cJSON *root = cJSON_CreateObject();
     if (root) {
         cJSON_AddStringToObject(root, "type", "medication_reminder");
-        cJSON_AddStringToObject(root, "scheduleId", schedule->id);
+        cJSON_AddStringToObject(root, "scheduleId", schedule_id);
         cJSON_AddStringToObject(root, "medicationName", med_name);
-        cJSON_AddNumberToObject(root, "reminderTime", get_time_ms());
-        cJSON_AddNumberToObject(root, "dispenseTime", schedule->next_dispense_time);
+        cJSON_AddNumberToObject(root, "reminderTime", medication_clock_now_ms());
+        cJSON_AddNumberToObject(root, "dispenseTime", dispense_time);
         
         char *json_str = cJSON_Print(root);
         if (json_str) {
@@ -190,34 +154,113 @@ void medication_reminder_callback(void *arg) {
         
         cJSON_Delete(root);
     }
-    
-    // Liberar la memoria del contexto
-    free(arg);
 }
 
-// Función para verificar si el tiempo está sincronizado correctamente
-static bool is_time_reliable(void) {
-    struct tm timeinfo;
-    time_t now = 0;
-    time(&now);
-    localtime_r(&now, &timeinfo);
-    
-    // Si el año es menor a 2022, probable que NTP no esté sincronizado
-    return (timeinfo.tm_year >= (2022 - 1900));
+// Fin de un trabajo en la tarea med_dispense: solo pasa el resultado al bucle
+// del dispensador, que es quien actualiza el almacenamiento
+static void dispense_job_done(const medication_dispense_job_t *job, const esp_err_t *results) {
+    dispense_job_result_t result = { .item_count = job->item_count, .manual = job->manual };
+    memcpy(result.items, job->items, job->item_count * sizeof(job->items[0]));
+    memcpy(result.results, results, job->item_count * sizeof(results[0]));
+    
+    // Si el bucle aún no la vació, se espera: el bucle nunca espera a esta tarea
+    xQueueSend(job_result_queue, &result, portMAX_DELAY);
+    dispenser_post_event(DISPENSER_EVT_JOB_DONE);
 }
 
-// Añadir esta función para dispensar físicamente un medicamento
-bool dispensar_medicamento_fisicamente(medication_t *medication) {
-    if (!medication) {
+// Registra una dosis que el hardware no llegó a dispensar (almacenamiento bloqueado)
+static void record_failed_dose(const medication_t *med, const medication_schedule_t *schedule) {
+    int64_t due_time = 0;
+    esp_err_t ret = medication_storage_mark_failed(med->id, schedule->id, &due_time);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "❌ Error al registrar la dosis fallida: %s", esp_err_to_name(ret));
+    }
+    // Las dosis manuales ya reciben su confirmación con el error
+    if (due_time > 0) {
+        medication_missed_report_failed(medication_storage_get_handle(med->id), schedule->id,
+                                        due_time, medication_clock_now_ms());
+    }
+}
+
+// Registra el resultado físico de un trabajo terminado (tarea del dispensador)
+static void handle_job_result(const dispense_job_result_t *job) {
+    for (int i = 0; i < job->item_count; i++) {
+        const medication_dispense_item_t *item = &job->items[i];
+        esp_err_t result = job->results[i];
+        
+        if (result == ESP_OK) {
+            ESP_LOGI(TAG, "✅ Medicamento dispensado físicamente con éxito (compartimento %d)", item->compartment);
+        } else {
+            switch (result) {
+                case ESP_ERR_INVALID_STATE:
+                case ESP_ERR_TIMEOUT:
+                    ESP_LOGW(TAG, "❌ No se detecta recipiente para recibir el medicamento");
+                    break;
+                case ESP_ERR_INVALID_ARG:
+                    ESP_LOGE(TAG, "❌ Parámetros inválidos para dispensar");
+                    break;
+                default:
+                    ESP_LOGE(TAG, "❌ Error al dispensar medicamento: %s", esp_err_to_name(result));
+                    break;
+            }
+        }
+        
+        medication_storage_lock();
+        medication_t *med = medication_storage_get_medication_by_handle(item->med_handle);
+        medication_schedule_t *schedule = med ? medication_storage_get_schedule(med, item->schedule_id) : NULL;
+        if (!med || !schedule) {
+            // Una sincronización eliminó el medicamento o el horario mientras tanto
+            medication_storage_dispense_discard(item->med_handle, item->schedule_id);
+            medication_storage_unlock();
+            ESP_LOGW(TAG, "El horario %s ya no existe; no se registra la dispensación", item->schedule_id);
+            continue;
+        }
+        
+        if (result == ESP_OK) {
+            esp_err_t ret = job->manual ? medication_storage_mark_manual_dispensed(med->id, schedule->id)
+                                        : medication_storage_mark_dispensed(med->id, schedule->id);
+            if (ret == ESP_OK) {
+                ESP_LOGI(TAG, "✅ Medicamento dispensado correctamente");
+            } else {
+                ESP_LOGW(TAG, "❌ Error al marcar medicamento como dispensado: %s", esp_err_to_name(ret));
+            }
+        } else {
+            // Ni descuenta la dosis ni consta como dispensada: pasa al seguimiento de perdidas
+            record_failed_dose(med, schedule);
+        }
+        
+        char *notification = NULL;
+        if (job->manual) {
+            notification = build_med_notification(med, schedule);
+            ESP_LOGI(TAG, "Medicamento %s dispensado manualmente", med->name);
+        }
+        medication_storage_unlock();
+        
+        if (job->manual) {
+            publish_telemetry_string(notification);
+            mqtt_app_publish_med_confirmation(result == ESP_OK,
+                                              result == ESP_OK ? "Medicamento dispensado manualmente"
+                                                               : "Error al dispensar medicamento", 0);
+        }
+    }
+}
+
+static void handle_job_results(void) {
+    dispense_job_result_t result;
+    while (job_result_queue && xQueueReceive(job_result_queue, &result, 0) == pdTRUE) {
+        handle_job_result(&result);
+    }
+}
+
+// Valida el compartimento y calcula la cantidad de una dosis
+static esp_err_t prepare_dispense_item(medication_t *medication, const char *schedule_id,
+                                       medication_dispense_item_t *item) {
+    if (!medication || !schedule_id) {
         ESP_LOGE(TAG, "Medicamento inválido");
-        return false;
+        return ESP_ERR_INVALID_ARG;
     }
     
-    ESP_LOGI(TAG, "Dispensando medicamento físicamente: %s (compartimento %d)",
-             medication->name, medication->compartment);
-    
     bool is_liquid = (strcmp(medication->type, COMPARTMENT_TYPE_LIQUID) == 0);
-    bool success = false;
     
     // Comprobar que el compartimento es válido
     if (medication->compartment < 1 || 
@@ -225,44 +268,46 @@ bool dispensar_medicamento_fisicamente(medication_t *medication) {
         (!is_liquid && medication->compartment > MAX_PILL_COMPARTMENTS)) {
         
         ESP_LOGE(TAG, "Compartimento inválido para tipo de medicamento: %d", medication->compartment);
-        return false;
+        return ESP_ERR_INVALID_ARG;
     }
     
     // Preparar parámetros para la dispensación
     uint32_t amount;
     if (is_liquid) {
-        // Para líquidos, calculamos un tiempo en ms basado en dosis
-        // Ej: 500ms por cada unidad de dosis
-        amount = medication->pills_per_dose * 500;
-        if (amount < 500) amount = 500;  // mínimo 500ms
-        if (amount > 5000) amount = 5000;  // máximo 5 segundos
+        // Para líquidos, el volumen de la dosis en µl; la calibración de la
+        // bomba lo convierte en tiempo al dispensar
+        int32_t volume_ul = medication->dose_volume_ul;
+        if (volume_ul < MEDICATION_PUMP_MIN_DOSE_UL) volume_ul = MEDICATION_PUMP_MIN_DOSE_UL;
+        if (volume_ul > MEDICATION_PUMP_MAX_DOSE_UL) volume_ul = MEDICATION_PUMP_MAX_DOSE_UL;
+        amount = (uint32_t)volume_ul;
     } else {
         // Para píldoras, usamos la cantidad de píldoras por dosis
         amount = medication->pills_per_dose;
         if (amount < 1) amount = 1;  // mínimo 1 píldora
     }
     
-    // Intentar dispensar el medicamento
-    esp_err_t result = medication_hardware_dispense(medication->compartment, is_liquid, amount);
+    memset(item, 0, sizeof(*item));
+    item->med_handle = medication_storage_get_handle(medication->id);
+    item->compartment = medication->compartment;
+    item->is_liquid = is_liquid;
+    item->amount = amount;
+    strncpy(item->schedule_id, schedule_id, sizeof(item->schedule_id) - 1);
+    return ESP_OK;
+}
+
+// Encola la dispensación física de un grupo de dosis; vuelve sin esperar al hardware
+static esp_err_t submit_dispense_job(medication_dispense_job_t *job) {
+    job->done_cb = dispense_job_done;
     
-    if (result == ESP_OK) {
-        ESP_LOGI(TAG, "✅ Medicamento dispensado físicamente con éxito");
-        success = true;
-    } else {
-        switch (result) {
-            case ESP_ERR_INVALID_STATE:
-                ESP_LOGW(TAG, "❌ No se detecta recipiente para recibir el medicamento");
-                break;
-            case ESP_ERR_INVALID_ARG:
-                ESP_LOGE(TAG, "❌ Parámetros inválidos para dispensar");
-                break;
-            default:
-                ESP_LOGE(TAG, "❌ Error al dispensar medicamento: %s", esp_err_to_name(result));
-                break;
-        }
+    uint32_t job_id = 0;
+    esp_err_t ret = medication_dispense_job_submit(job, &job_id);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "No se pudo encolar la dispensación: %s", esp_err_to_name(ret));
+        return ret;
     }
     
-    return success;
+    ESP_LOGI(TAG, "Dispensación encolada (trabajo %lu, %d dosis)", (unsigned long)job_id, job->item_count);
+    return ESP_OK;
 }
 
 // Inicializa el sistema de dispensación de medicamentos
@@ -274,12 +319,47 @@ esp_err_t medication_dispenser_init(void) {
 
     ESP_LOGI(TAG, "Inicializando dispensador de medicamentos");
 
+#if CONFIG_PM_ENABLE
+    if (!dispenser_pm_lock) {
+        esp_err_t pm_err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "med_dispenser", &dispenser_pm_lock);
+        if (pm_err != ESP_OK) {
+            ESP_LOGW(TAG, "No se pudo crear el bloqueo de energía: %s", esp_err_to_name(pm_err));
+        }
+    }
+#endif
+
     // Inicializar el hardware de dispensación
     esp_err_t hw_init = medication_hardware_init();
     if (hw_init != ESP_OK) {
         ESP_LOGE(TAG, "Error al inicializar hardware de dispensación: %s", esp_err_to_name(hw_init));
         return hw_init;
     }
+    medication_boot_mark(MEDICATION_BOOT_HARDWARE);
+
+    // Resultados de los trabajos terminados, de vuelta a este bucle
+    if (!job_result_queue) {
+        job_result_queue = xQueueCreate(JOB_RESULT_QUEUE_LEN, sizeof(dispense_job_result_t));
+        if (!job_result_queue) {
+            ESP_LOGE(TAG, "Error al crear la cola de resultados de dispensación");
+            medication_hardware_deinit();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    // Cola de trabajos: el hardware se mueve en su propia tarea
+    esp_err_t job_init = medication_dispense_job_init();
+    if (job_init != ESP_OK) {
+        ESP_LOGE(TAG, "Error al inicializar la cola de dispensación: %s", esp_err_to_name(job_init));
+        medication_hardware_deinit();
+        return job_init;
+    }
+
+#if CONFIG_MEDICATION_FAST_BOOT
+    // El autotest del hardware espera a que no haya dosis en cola
+    if (medication_dispense_job_request_self_test(medication_boot_self_test_done) != ESP_OK) {
+        ESP_LOGW(TAG, "No se pudo programar el autotest del hardware");
+    }
+#endif
 
     // Crear la tarea de dispensación
     BaseType_t task_created = xTaskCreate(
@@ -292,42 +372,52 @@ esp_err_t medication_dispenser_init(void) {
         
     if (task_created != pdPASS) {
         ESP_LOGE(TAG, "Error al crear la tarea del dispensador");
+        medication_dispense_job_deinit();
         medication_hardware_deinit();
         return ESP_FAIL;
     }
 
-    // Configurar un timer para comprobar medicamentos periódicamente
-    esp_timer_create_args_t timer_args = {
-        .callback = &check_timer_callback,
-        .name = "med_check_timer"
-    };
-    
-    esp_err_t ret = esp_timer_create(&timer_args, &check_timer);
+    // Las colas se construyen a partir de los horarios del almacenamiento
+    medication_storage_lock();
+
+    // Planificador de dosis: un único timer one-shot para el próximo vencimiento
+    esp_err_t ret = medication_scheduler_init(dose_due_callback);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error al crear el timer de comprobación: %s", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Error al inicializar el planificador de dosis: %s", esp_err_to_name(ret));
+        medication_storage_unlock();
         vTaskDelete(dispenser_task_handle);
         dispenser_task_handle = NULL;
+        medication_dispense_job_deinit();
         medication_hardware_deinit();
         return ret;
     }
-    
-    // Iniciar el timer para verificar cada 30 segundos
-    ret = esp_timer_start_periodic(check_timer, 30 * 1000000); // 30 segundos en microsegundos
+
+    // Recordatorios: cola ordenada con un único timer para el más próximo
+    ret = medication_reminders_init(reminder_due_callback);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error al iniciar el timer: %s", esp_err_to_name(ret));
-        esp_timer_delete(check_timer);
-        check_timer = NULL;
+        ESP_LOGE(TAG, "Error al inicializar los recordatorios: %s", esp_err_to_name(ret));
+        medication_storage_unlock();
+        medication_scheduler_deinit();
         vTaskDelete(dispenser_task_handle);
         dispenser_task_handle = NULL;
+        medication_dispense_job_deinit();
         medication_hardware_deinit();
         return ret;
     }
 
+    // Los medicamentos perdidos no usan timer: el bucle calcula su próximo
+    // umbral o paso de escalado. Sin memoria se reintenta en cada comprobación.
+    if (medication_missed_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Seguimiento de dosis perdidas sin inicializar");
+    }
+    
+    // Previsión de existencias: se actualiza con cada dispensación o sincronización
+    medication_inventory_init();
+    medication_storage_unlock();
+    
     dispenser_initialized = true;
     auto_dispense_enabled = true;
-    
-    // Programar recordatorios iniciales
-    schedule_medication_reminders();
+    medication_boot_mark(MEDICATION_BOOT_DISPENSER);
     
     ESP_LOGI(TAG, "Dispensador inicializado correctamente");
     return ESP_OK;
@@ -339,12 +429,10 @@ void medication_dispenser_deinit(void) {
         return;
     }
     
-    // Detener y eliminar el timer
-    if (check_timer != NULL) {
-        esp_timer_stop(check_timer);
-        esp_timer_delete(check_timer);
-        check_timer = NULL;
-    }
+    medication_reminders_deinit();
+    medication_scheduler_deinit();
+    medication_missed_deinit();
+    medication_inventory_deinit();
     
     // Detener la tarea
     if (dispenser_task_handle != NULL) {
@@ -352,6 +440,9 @@ void medication_dispenser_deinit(void) {
         dispenser_task_handle = NULL;
     }
     
+    // Descartar los trabajos pendientes antes de soltar el hardware
+    medication_dispense_job_deinit();
+    
     // Deinicializar el hardware
     medication_hardware_deinit();
     
@@ -365,54 +456,37 @@ void medication_dispenser_set_auto_dispense(bool enable) {
     ESP_LOGI(TAG, "Dispensación automática %s", enable ? "habilitada" : "deshabilitada");
 }
 
-// Modificar el callback del timer para que también verifique medicamentos perdidos
-static void check_timer_callback(void* arg) {
-    ESP_LOGI(TAG, "Timer de verificación activado");
-    
-    // Verificar medicamentos no tomados
-    static int missed_counter = 0;
-    missed_counter++;
-    
-    // Verificar medicamentos perdidos cada 5 minutos (10 ciclos de 30 segundos)
-    if (missed_counter >= 10) {
-        ESP_LOGI(TAG, "Verificando medicamentos perdidos...");
-        check_missed_medications();
-        missed_counter = 0;
-    }
-    
-    // Reprogramar recordatorios (cada 10 minutos - 20 ciclos de 30 segundos)
-    static int reminder_counter = 0;
-    reminder_counter++;
-    if (reminder_counter >= 20) {
-        ESP_LOGI(TAG, "Reprogramando recordatorios...");
-        schedule_medication_reminders();
-        reminder_counter = 0;
-    }
-    
-    // Notificar a la tarea para que verifique los medicamentos a dispensar
+// Ajusta cuánto se adelantan las dosis próximas para servirlas con la que vence
+void medication_dispenser_set_dose_group_window(uint32_t window_ms) {
+    dose_group_window_ms = window_ms;
+    ESP_LOGI(TAG, "Ventana de agrupación de dosis: %lu ms", (unsigned long)window_ms);
+}
+
+// Avisa al bucle de que cambiaron los horarios (p. ej. tras una sincronización)
+void medication_dispenser_notify_schedule_changed(void) {
+    dispenser_post_event(DISPENSER_EVT_SCHEDULE_CHANGED);
+}
+
+void medication_dispenser_notify_time_changed(void) {
+    dispenser_post_event(DISPENSER_EVT_TIME_CHANGED);
+}
+
+// Llamado por el planificador cuando vence la dosis más próxima
+static void dose_due_callback(void) {
     if (dispenser_task_handle != NULL) {
-        xTaskNotifyGive(dispenser_task_handle);
+        dispenser_post_event(DISPENSER_EVT_DOSE_DUE);
     } else {
         ESP_LOGW(TAG, "La tarea del dispensador no está disponible");
     }
 }
 
-// Publica una notificación de medicamento a dispensar vía MQTT
-static void publish_med_notification(medication_t *medication, medication_schedule_t *schedule) {
-    if (!medication || !schedule) {
-        return;
-    }
-    
-    cJSON *root = cJSON_CreateObject();
-    if (!root) {
-        ESP_LOGE(TAG, "Error creando JSON para notificación de medicamento");
-        return;
-    }
-    
-    // Datos básicos del mensaje
-    cJSON_AddStringToObject(root, "type", "medication_alert");
-    cJSON_AddNumberToObject(root, "timestamp", get_time_ms()); // Usar la función del módulo NTP
-    
+// Llamado por la cola de recordatorios cuando vence el primero
+static void reminder_due_callback(void) {
+    dispenser_post_event(DISPENSER_EVT_REMINDER);
+}
+
+// Añade a parent los objetos "medication" y "schedule" de una dosis
+static void add_dose_objects(cJSON *parent, const medication_t *medication, const medication_schedule_t *schedule) {
     // Datos del medicamento
     cJSON *med_obj = cJSON_CreateObject();
     cJSON_AddStringToObject(med_obj, "id", medication->id);
@@ -430,19 +504,119 @@ static void publish_med_notification(medication_t *medication, medication_schedu
     cJSON_AddStringToObject(sched_obj, "id", schedule->id);
     cJSON_AddNumberToObject(sched_obj, "timeInMinutes", schedule->time_in_minutes);
     
-    // Añadir objetos al mensaje principal
-    cJSON_AddItemToObject(root, "medication", med_obj);
-    cJSON_AddItemToObject(root, "schedule", sched_obj);
-    
-    // Convertir a string y publicar
-    char *json_str = cJSON_Print(root);
+    cJSON_AddItemToObject(parent, "medication", med_obj);
+    cJSON_AddItemToObject(parent, "schedule", sched_obj);
+}
+
+// Publica en telemetría un mensaje ya serializado y lo libera. Los mensajes
+// se construyen con el almacenamiento bloqueado y se publican después.
+static void publish_telemetry_string(char *json_str) {
     if (json_str) {
-        // Usamos el tópico de telemetría para enviar la notificación
         mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
         free(json_str);
     }
+}
+
+// Notificación de medicamento a dispensar (medication_alert)
+static char *build_med_notification(const medication_t *medication, const medication_schedule_t *schedule) {
+    if (!medication || !schedule) {
+        return NULL;
+    }
+    
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        ESP_LOGE(TAG, "Error creando JSON para notificación de medicamento");
+        return NULL;
+    }
     
+    // Datos básicos del mensaje
+    cJSON_AddStringToObject(root, "type", "medication_alert");
+    cJSON_AddNumberToObject(root, "timestamp", medication_clock_now_ms()); // Usar la función del módulo NTP
+    add_dose_objects(root, medication, schedule);
+    
+    char *json_str = cJSON_Print(root);
     cJSON_Delete(root);
+    return json_str;
+}
+
+// Una sola notificación para todas las dosis de un grupo. Con una sola dosis
+// se mantiene el mensaje medication_alert de siempre.
+static char *build_dose_group_notification(const medication_due_dose_t *doses, int count) {
+    if (count == 1) {
+        return build_med_notification(doses[0].medication, doses[0].schedule);
+    }
+    
+    cJSON *root = cJSON_CreateObject();
+    cJSON *doses_arr = root ? cJSON_AddArrayToObject(root, "doses") : NULL;
+    if (!doses_arr) {
+        ESP_LOGE(TAG, "Error creando JSON para notificación de grupo");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    
+    cJSON_AddStringToObject(root, "type", "medication_group_alert");
+    cJSON_AddNumberToObject(root, "timestamp", medication_clock_now_ms());
+    
+    for (int i = 0; i < count; i++) {
+        cJSON *dose_obj = cJSON_CreateObject();
+        add_dose_objects(dose_obj, doses[i].medication, doses[i].schedule);
+        cJSON_AddNumberToObject(dose_obj, "dueTime", doses[i].due_time);
+        cJSON_AddItemToArray(doses_arr, dose_obj);
+    }
+    
+    char *json_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json_str;
+}
+
+// Informa de las dispensaciones interrumpidas que se resolvieron al arrancar.
+// Devuelve false si hay algo pendiente que no se pudo publicar todavía.
+static bool publish_recovered_doses(void) {
+    medication_recovered_dose_t doses[MEDICATION_INTENT_SLOTS];
+    int count = medication_storage_get_recovered(doses, MEDICATION_INTENT_SLOTS);
+    if (count == 0) {
+        return true;
+    }
+    
+    cJSON *root = cJSON_CreateObject();
+    cJSON *doses_arr = root ? cJSON_AddArrayToObject(root, "doses") : NULL;
+    if (!doses_arr) {
+        cJSON_Delete(root);
+        return false;
+    }
+    
+    cJSON_AddStringToObject(root, "type", "medication_dispense_recovered");
+    cJSON_AddNumberToObject(root, "timestamp", medication_clock_now_ms());
+    
+    for (int i = 0; i < count; i++) {
+        const char *outcome = "skipped";
+        if (doses[i].outcome == MEDICATION_RECOVERY_ASSUMED_DISPENSED) {
+            outcome = "assumed_dispensed";
+        } else if (doses[i].outcome == MEDICATION_RECOVERY_RETRIED) {
+            outcome = "retried";
+        }
+        
+        cJSON *dose_obj = cJSON_CreateObject();
+        cJSON_AddStringToObject(dose_obj, "medicationId", doses[i].medication_id);
+        cJSON_AddStringToObject(dose_obj, "scheduleId", doses[i].schedule_id);
+        cJSON_AddNumberToObject(dose_obj, "dueTime", doses[i].due_time);
+        cJSON_AddStringToObject(dose_obj, "outcome", outcome);
+        cJSON_AddItemToArray(doses_arr, dose_obj);
+    }
+    
+    esp_err_t ret = ESP_FAIL;
+    char *json_str = cJSON_PrintUnformatted(root);
+    if (json_str) {
+        ret = mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
+        free(json_str);
+    }
+    cJSON_Delete(root);
+    
+    if (ret != ESP_OK) {
+        return false;
+    }
+    medication_storage_clear_recovered();
+    return true;
 }
 
 // Dispensar un medicamento manualmente
@@ -451,48 +625,38 @@ esp_err_t medication_dispenser_manual_dispense(const char* medication_id, const
         return ESP_ERR_INVALID_ARG;
     }
     
+    medication_storage_lock();
+    esp_err_t ret = ESP_OK;
+    
     // Obtener el medicamento
     medication_t *med = medication_storage_get_medication(medication_id);
-    if (!med) {
-        ESP_LOGW(TAG, "Medicamento no encontrado: %s", medication_id);
-        return ESP_ERR_NOT_FOUND;
-    }
     
     // Buscar el horario
-    medication_schedule_t *schedule = NULL;
-    for (int i = 0; i < med->schedules_count; i++) {
-        if (strcmp(med->schedules[i].id, schedule_id) == 0) {
-            schedule = &med->schedules[i];
-            break;
-        }
-    }
+    medication_schedule_t *schedule = med ? medication_storage_get_schedule(med, schedule_id) : NULL;
     
-    if (!schedule) {
+    medication_dispense_job_t job = { .item_count = 1, .manual = true };
+    if (!med) {
+        ESP_LOGW(TAG, "Medicamento no encontrado: %s", medication_id);
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (!schedule) {
         ESP_LOGW(TAG, "Horario no encontrado para medicamento %s: %s", 
                 medication_id, schedule_id);
-        return ESP_ERR_NOT_FOUND;
-    }
-    
-    // Dispensar físicamente el medicamento
-    bool dispensed = dispensar_medicamento_fisicamente(med);
-    if (!dispensed) {
-        ESP_LOGW(TAG, "Error en dispensación física del medicamento %s", med->name);
-        // Opcionalmente puedes decidir no continuar, pero aquí continuamos para actualizar el estado
-        // return ESP_FAIL;
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (medication_dispense_job_pending(medication_storage_get_handle(medication_id), schedule_id)) {
+        // Una dosis ya en cola o en curso no se repite
+        ESP_LOGW(TAG, "Ya hay una dispensación pendiente para %s (horario %s)", med->name, schedule_id);
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        ret = prepare_dispense_item(med, schedule->id, &job.items[0]);
     }
+    medication_storage_unlock();
     
-    // Marcar como dispensado en el almacenamiento
-    esp_err_t ret = medication_storage_mark_dispensed(medication_id, schedule_id);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error al marcar medicamento como dispensado: %s", esp_err_to_name(ret));
         return ret;
     }
     
-    // Publicar confirmación
-    publish_med_notification(med, schedule);
-    
-    ESP_LOGI(TAG, "Medicamento %s dispensado manualmente", med->name);
-    return ESP_OK;
+    // La confirmación se publica al terminar el trabajo (handle_job_result)
+    return submit_dispense_job(&job);
 }
 
 // Implementar la función 
@@ -504,273 +668,305 @@ esp_err_t medication_dispenser_confirm_taken(const char* medication_id, const ch
     ESP_LOGI(TAG, "Recibida confirmación de medicamento tomado: %s, horario: %s", 
              medication_id, schedule_id);
     
+    medication_storage_lock();
+    
     // Obtener el medicamento
     medication_t *med = medication_storage_get_medication(medication_id);
     if (!med) {
+        medication_storage_unlock();
         ESP_LOGW(TAG, "Medicamento no encontrado: %s", medication_id);
         return ESP_ERR_NOT_FOUND;
     }
     
     // Buscar el horario específico
-    medication_schedule_t *schedule = NULL;
-    for (int i = 0; i < med->schedules_count; i++) {
-        if (strcmp(med->schedules[i].id, schedule_id) == 0) {
-            schedule = &med->schedules[i];
-            break;
-        }
-    }
+    medication_schedule_t *schedule = medication_storage_get_schedule(med, schedule_id);
     
     if (!schedule) {
+        medication_storage_unlock();
         ESP_LOGW(TAG, "Horario no encontrado: %s", schedule_id);
         return ESP_ERR_NOT_FOUND;
     }
     
-    int64_t current_time = get_time_ms();
+    char med_name[sizeof(med->name)];
+    snprintf(med_name, sizeof(med_name), "%s", med->name);
+    int64_t current_time = medication_clock_now_ms();
     
     // Solo actualizamos si el medicamento ya fue dispensado
-    if (schedule->last_dispensed_time >= schedule->next_dispense_time) {
-        // Publicar confirmación MQTT
-        cJSON *root = cJSON_CreateObject();
-        if (root) {
-            cJSON_AddStringToObject(root, "type", "medication_taken_confirmed");
-            cJSON_AddStringToObject(root, "medicationId", medication_id);
-            cJSON_AddStringToObject(root, "name", med->name);
-            cJSON_AddStringToObject(root, "scheduleId", schedule_id);
-            cJSON_AddNumberToObject(root, "timestamp", current_time);
-            
-            char *json_str = cJSON_Print(root);
-            if (json_str) {
-                mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
-                free(json_str);
-            }
-            cJSON_Delete(root);
-        }
+    if (schedule->last_dispensed_time < schedule->next_dispense_time) {
+        medication_storage_unlock();
+        ESP_LOGW(TAG, "⚠️ El medicamento %s no ha sido dispensado todavía", med_name);
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    medication_latency_record(MEDICATION_LATENCY_DISPENSED_TO_TAKEN, med->compartment,
+                              current_time - schedule->last_dispensed_time);
+    
+    // Actualizar last_taken_time y anotarlo en el diario de dosis
+    esp_err_t ret = medication_storage_mark_taken(medication_id, schedule_id, current_time);
+    medication_storage_unlock();
+    
+    // Publicar confirmación MQTT
+    cJSON *root = cJSON_CreateObject();
+    if (root) {
+        cJSON_AddStringToObject(root, "type", "medication_taken_confirmed");
+        cJSON_AddStringToObject(root, "medicationId", medication_id);
+        cJSON_AddStringToObject(root, "name", med_name);
+        cJSON_AddStringToObject(root, "scheduleId", schedule_id);
+        cJSON_AddNumberToObject(root, "timestamp", current_time);
         
-        // Actualizar el campo last_taken_time
-        schedule->last_taken_time = current_time;
+        publish_telemetry_string(cJSON_Print(root));
+        cJSON_Delete(root);
+    }
+    
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error al guardar confirmación: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    dispenser_post_event(DISPENSER_EVT_SCHEDULE_CHANGED);
+    
+    ESP_LOGI(TAG, "✅ Confirmación de medicamento tomado registrada: %s", med_name);
+    return ESP_OK;
+}
+
+// Encola las dosis de un grupo como un solo trabajo; las que no se pueden
+// encolar se registran como fallidas (almacenamiento bloqueado)
+static void queue_due_doses(medication_due_dose_t *doses, int count) {
+    // Una detección de recipiente y después los compartimentos en orden
+    medication_dispense_job_t job = { .item_count = 0, .manual = false };
+    medication_t *unqueued[MEDICATION_DOSE_GROUP_MAX];
+    medication_schedule_t *unqueued_sched[MEDICATION_DOSE_GROUP_MAX];
+    int unqueued_count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        medication_t *medication = doses[i].medication;
+        medication_schedule_t *schedule = doses[i].schedule;
         
-        // Guardar cambios en almacenamiento
-        esp_err_t ret = medication_storage_save();
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Error al guardar confirmación: %s", esp_err_to_name(ret));
-            return ret;
+        if (medication_dispense_job_pending(medication_storage_get_handle(medication->id), schedule->id)) {
+            ESP_LOGW(TAG, "La dosis %s ya está en la cola de dispensación", schedule->id);
+            continue;
         }
         
-        ESP_LOGI(TAG, "✅ Confirmación de medicamento tomado registrada: %s", med->name);
-        return ESP_OK;
+        if (prepare_dispense_item(medication, schedule->id, &job.items[job.item_count]) == ESP_OK) {
+            job.item_count++;
+        } else {
+            unqueued[unqueued_count] = medication;
+            unqueued_sched[unqueued_count] = schedule;
+            unqueued_count++;
+        }
+    }
+    
+    if (job.item_count > 0) {
+        ESP_LOGI(TAG, "Dispensando automáticamente %d dosis en una sesión", job.item_count);
+        if (submit_dispense_job(&job) != ESP_OK) {
+            for (int i = 0; i < job.item_count; i++) {
+                medication_t *medication = medication_storage_get_medication_by_handle(job.items[i].med_handle);
+                medication_schedule_t *schedule = medication ?
+                    medication_storage_get_schedule(medication, job.items[i].schedule_id) : NULL;
+                if (schedule) {
+                    unqueued[unqueued_count] = medication;
+                    unqueued_sched[unqueued_count] = schedule;
+                    unqueued_count++;
+                }
+            }
+        }
+    }
+    
+    // Sin trabajo no habrá callback: se registran ya como fallidas
+    for (int i = 0; i < unqueued_count; i++) {
+        ESP_LOGW(TAG, "❌ Error en dispensación física del medicamento %s", unqueued[i]->name);
+        record_failed_dose(unqueued[i], unqueued_sched[i]);
+    }
+}
+
+// Atiende el vencimiento de la dosis más próxima. Los punteros de las dosis
+// solo valen con el almacenamiento bloqueado; la notificación se publica al final.
+static void handle_due_dose(int64_t current_time) {
+    medication_storage_lock();
+    
+    // Todas las dosis que vencen dentro de la ventana forman un solo grupo
+    medication_due_dose_t doses[MEDICATION_DOSE_GROUP_MAX];
+    int count = medication_storage_collect_due(current_time, dose_group_window_ms,
+                                               doses, MEDICATION_DOSE_GROUP_MAX);
+    
+    if (count == 0) {
+        medication_storage_unlock();
+        ESP_LOGD(TAG, "No hay medicamentos listos para dispensar en este momento");
+        return;
+    }
+    
+    int64_t pickup_ms = medication_latency_now_ms();
+    uint8_t compartments[MEDICATION_DOSE_GROUP_MAX];
+    for (int i = 0; i < count; i++) {
+        ESP_LOGI(TAG, "¡Medicamento listo para dispensar: %s (compartimento %d, horario %s)!",
+                doses[i].medication->name, doses[i].medication->compartment, doses[i].schedule->id);
+        compartments[i] = doses[i].medication->compartment;
+        // Las dosis adelantadas por la ventana de grupo cuentan como 0
+        medication_latency_record(MEDICATION_LATENCY_DUE_TO_PICKUP, compartments[i],
+                                  current_time - doses[i].due_time);
+    }
+    
+    // Una sola notificación MQTT para el grupo
+    char *notification = build_dose_group_notification(doses, count);
+    
+    if (!auto_dispense_enabled) {
+        ESP_LOGW(TAG, "⚠️ Dispensación automática desactivada, esperando confirmación manual");
+        // Como antes, la toma cuenta como entregada y su intención se confirma
+        for (int i = 0; i < count; i++) {
+            medication_storage_mark_dispensed(doses[i].medication->id, doses[i].schedule->id);
+        }
     } else {
-        ESP_LOGW(TAG, "⚠️ El medicamento %s no ha sido dispensado todavía", med->name);
-        return ESP_ERR_INVALID_STATE;
+        queue_due_doses(doses, count);
+    }
+    medication_storage_unlock();
+    
+    publish_telemetry_string(notification);
+    
+    int64_t notify_ms = medication_latency_now_ms() - pickup_ms;
+    for (int i = 0; i < count; i++) {
+        medication_latency_record(MEDICATION_LATENCY_PICKUP_TO_NOTIFY, compartments[i], notify_ms);
+    }
+}
+
+// Atiende los recordatorios vencidos
+static void handle_due_reminders(int64_t current_time) {
+    int med_index;
+    int sched_index;
+    while (medication_reminders_pop_due(current_time, &med_index, &sched_index)) {
+        medication_reminder_callback(med_index, sched_index);
+    }
+}
+
+// Ticks que faltan para la segunda alerta del recordatorio (portMAX_DELAY si no hay)
+static TickType_t reminder_repeat_wait(void) {
+    if (!reminder_repeat_pending) {
+        return portMAX_DELAY;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - reminder_repeat_start;
+    TickType_t pause = pdMS_TO_TICKS(REMINDER_REPEAT_MS);
+    return elapsed < pause ? pause - elapsed : 0;
+}
+
+// Reproduce la segunda alerta del recordatorio si ya venció la pausa
+static void handle_reminder_repeat(void) {
+    if (reminder_repeat_pending && reminder_repeat_wait() == 0) {
+        reminder_repeat_pending = false;
+        buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_READY);
     }
 }
 
-// Tarea principal del dispensador
+// Tras un ajuste de hora los temporizadores de dosis y recordatorios siguen
+// contando con la hora anterior: se rearman con los mismos vencimientos
+static void handle_time_changed(void) {
+    medication_storage_lock();
+    medication_scheduler_rebuild();
+    medication_reminders_rebuild();
+    medication_storage_unlock();
+}
+
+// Tarea principal del dispensador: un único bucle de eventos que duerme hasta
+// el siguiente evento real (dosis, recordatorio, umbral de dosis perdida,
+// cambio de horarios o de hora). Entre eventos no hay timers periódicos, así
+// que con CONFIG_PM_ENABLE y tickless idle la CPU puede entrar en light sleep.
 static void medication_dispenser_task(void *pvParameters) {
     ESP_LOGI(TAG, "Tarea del dispensador iniciada");
     
+    int64_t next_missed_check = INT64_MAX;
+    
+    // Confirmar lo que la recuperación del arranque no alcanzó a escribir
+    if (medication_storage_recover_dispenses(0) > 0) {
+        ESP_LOGW(TAG, "Quedan dispensaciones interrumpidas sin confirmar");
+    }
+    bool recovery_report_pending = true;
+    uint32_t deferred_events = 0;
+    
     while (1) {
-        // Verificar que el tiempo esté sincronizado correctamente
-        if (!is_time_reliable()) {
+        // Verificar que el tiempo esté sincronizado correctamente. Cualquier
+        // evento (el ajuste de hora tras el NTP, sobre todo) vuelve a
+        // comprobarlo; los demás se guardan para cuando la hora sea fiable.
+        if (!medication_clock_is_reliable()) {
             ESP_LOGW(TAG, "Tiempo no sincronizado correctamente, esperando...");
-            vTaskDelay(30000 / portTICK_PERIOD_MS); // Esperar 30 segundos
+            uint32_t early_events = 0;
+            xTaskNotifyWait(0, UINT32_MAX, &early_events, pdMS_TO_TICKS(TIME_UNRELIABLE_RETRY_MS));
+            deferred_events |= early_events;
+            next_missed_check = INT64_MAX;
             continue;
         }
+        // Los próximos tiempos aplazados en el arranque se calculan con la
+        // primera hora fiable, antes de atender los eventos guardados
+        medication_storage_resume_schedule();
+        medication_boot_mark(MEDICATION_BOOT_READY);
         
-        // Log para saber que estamos esperando notificación
-        ESP_LOGI(TAG, "Esperando notificación del timer o timeout...");
-        
-        // Esperar notificación del timer o timeout
-        uint32_t notification_value = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(60000)); // 1 minuto máximo
-        
-        if (notification_value > 0) {
-            ESP_LOGI(TAG, "Notificación recibida, verificando medicamentos...");
-        } else {
-            ESP_LOGI(TAG, "Timeout alcanzado, verificando medicamentos de todas formas");
+        int64_t current_time = medication_clock_now_ms();
+        if (next_missed_check == INT64_MAX) {
+            next_missed_check = medication_missed_next_check(current_time);
         }
         
-        // Obtener si hay medicamentos para optimizar el tiempo de espera
-        int count;
-        medication_t *meds = medication_storage_get_all_medications(&count);
-        
-        ESP_LOGI(TAG, "Total de medicamentos encontrados: %d", count);
-        
-        if (count == 0) {
-            // No hay medicamentos, esperar más tiempo para ahorrar energía
-            ESP_LOGI(TAG, "No hay medicamentos programados, durmiendo más tiempo");
-            vTaskDelay(pdMS_TO_TICKS(300000)); // 5 minutos
-            continue;
+        // El informe de recuperación espera a que MQTT esté conectado
+        if (recovery_report_pending) {
+            recovery_report_pending = !publish_recovered_doses();
         }
         
-        // Mostrar información de todos los medicamentos y sus horarios
-        for (int i = 0; i < count; i++) {
-            ESP_LOGI(TAG, "Medicamento %d: %s (compartimento %d)", i+1, meds[i].name, meds[i].compartment);
-            
-            for (int j = 0; j < meds[i].schedules_count; j++) {
-                char time_str[32];
-                format_time(meds[i].schedules[j].next_dispense_time, time_str, sizeof(time_str));
-                ESP_LOGI(TAG, "  - Horario %s: próxima dispensación en %s", 
-                         meds[i].schedules[j].id, time_str);
+        // Esperar al próximo umbral de dosis perdida, a la segunda alerta de
+        // un recordatorio o a un evento
+        TickType_t wait_ticks = portMAX_DELAY;
+        if (next_missed_check != INT64_MAX) {
+            int64_t wait_ms = next_missed_check - current_time;
+            if (wait_ms < 0) {
+                wait_ms = 0;
             }
+            // Solo evita truncar la conversión a ticks; no es un despertar periódico
+            int64_t ticks = wait_ms * configTICK_RATE_HZ / 1000;
+            wait_ticks = ticks < portMAX_DELAY ? (TickType_t)ticks : portMAX_DELAY - 1;
+        }
+        TickType_t repeat_ticks = reminder_repeat_wait();
+        if (repeat_ticks < wait_ticks) {
+            wait_ticks = repeat_ticks;
+        }
+        if (recovery_report_pending && wait_ticks > pdMS_TO_TICKS(TIME_UNRELIABLE_RETRY_MS)) {
+            wait_ticks = pdMS_TO_TICKS(TIME_UNRELIABLE_RETRY_MS);
         }
         
-        // Obtener el tiempo actual
-        int64_t current_time = get_time_ms(); // Usar la función del módulo NTP
-        
-        // Convertir a formato legible y mostrar
-        char current_time_str[32];
-        format_time(current_time, current_time_str, sizeof(current_time_str));
-        ESP_LOGI(TAG, "Tiempo actual: %s", current_time_str);
+        uint32_t events = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &events, deferred_events ? 0 : wait_ticks);
+        events |= deferred_events;
+        deferred_events = 0;
         
-        // Verificar si hay medicamentos para dispensar
-        ESP_LOGI(TAG, "Verificando medicamentos para dispensar...");
-        medication_t *medication = medication_storage_check_dispense(current_time);
+        dispenser_pm_acquire();
+        current_time = medication_clock_now_ms();
         
-        if (medication != NULL) {
-            // Encontramos un medicamento para dispensar
-            ESP_LOGI(TAG, "¡Medicamento listo para dispensar: %s (compartimento %d)!",
-                    medication->name, medication->compartment);
-            
-            // Buscar el horario correspondiente (el más cercano a dispensar)
-            medication_schedule_t *active_schedule = NULL;
-
-            for (int i = 0; i < medication->schedules_count; i++) {
-                medication_schedule_t *schedule = &medication->schedules[i];
-                
-                // Convertir a formato legible
-                char next_time_str[32];
-                char last_time_str[32];
-                format_time(schedule->next_dispense_time, next_time_str, sizeof(next_time_str));
-                format_time(schedule->last_dispensed_time, last_time_str, sizeof(last_time_str));
-                
-                ESP_LOGI(TAG, "  - Horario %s: próxima=%s, última=%s", 
-                        schedule->id, next_time_str, last_time_str);
-                
-                // Verificar si este horario está listo para dispensar
-                // La condición principal es que la última dispensación sea anterior a la próxima programada
-                if (schedule->next_dispense_time > schedule->last_dispensed_time) {
-                    active_schedule = schedule;
-                    ESP_LOGI(TAG, "    * Horario seleccionado para dispensación");
-                    break; // Use the first schedule that matches
-                }
-            }
-            
-            if (active_schedule) {
-                ESP_LOGI(TAG, "Preparando notificación para medicamento %s (horario %s)",
-                        medication->name, active_schedule->id);
-                
-                // Enviar notificación MQTT
-                publish_med_notification(medication, active_schedule);
-                
-                // Si está habilitada la dispensación automática, marcar como dispensado
-                if (auto_dispense_enabled) {
-                    ESP_LOGI(TAG, "Dispensando automáticamente medicamento: %s", medication->name);
-                    
-                    // Añadir esta sección para dispensar físicamente:
-                    bool dispensed = dispensar_medicamento_fisicamente(medication);
-                    if (!dispensed) {
-                        ESP_LOGW(TAG, "❌ Error en dispensación física del medicamento");
-                        // Opcionalmente, puedes decidir no marcar como dispensado si falla la dispensación física
-                    } else {
-                        ESP_LOGI(TAG, "✅ Medicamento dispensado físicamente con éxito");
-                    }
-                    
-                    esp_err_t result = medication_storage_mark_dispensed(medication->id, active_schedule->id);
-                    
-                    if (result == ESP_OK) {
-                        ESP_LOGI(TAG, "✅ Medicamento dispensado correctamente");
-                    } else {
-                        ESP_LOGW(TAG, "❌ Error al marcar medicamento como dispensado: %s", esp_err_to_name(result));
-                    }
-                } else {
-                    ESP_LOGW(TAG, "⚠️ Dispensación automática desactivada, esperando confirmación manual");
-                }
-            } else {
-                ESP_LOGW(TAG, "No se encontró ningún horario activo para dispensar");
-            }
-        } else {
-            ESP_LOGI(TAG, "No hay medicamentos listos para dispensar en este momento");
+        if (events & DISPENSER_EVT_TIME_CHANGED) {
+            handle_time_changed();
+        }
+        if (events & DISPENSER_EVT_JOB_DONE) {
+            handle_job_results();
+        }
+        if (events & DISPENSER_EVT_DOSE_DUE) {
+            handle_due_dose(current_time);
+        }
+        if (events & DISPENSER_EVT_REMINDER) {
+            handle_due_reminders(current_time);
+        }
+        handle_reminder_repeat();
+        if (current_time >= next_missed_check) {
+            check_missed_medications();
         }
         
-        ESP_LOGI(TAG, "Ciclo de verificación completado, esperando próxima notificación");
+        // Avisos de existencias bajas que dejaron las dispensaciones o la sincronización
+        medication_inventory_publish_alerts();
+        
+        // Cualquier evento puede haber movido los umbrales: recalcular
+        next_missed_check = medication_missed_next_check(medication_clock_now_ms());
+        dispenser_pm_release();
     }
 }
 
-// Función que verifica medicamentos perdidos/no tomados
+// Función que verifica medicamentos perdidos/no tomados. El seguimiento
+// recuerda lo ya reportado, así que llamarla de más no repite alertas.
 void check_missed_medications(void) {
     ESP_LOGI(TAG, "Verificando medicamentos no tomados...");
     
-    // Obtener el tiempo actual
-    int64_t current_time = get_time_ms();
-    
-    // Obtener todos los medicamentos
-    int count;
-    medication_t *meds = medication_storage_get_all_medications(&count);
-    
-    if (!meds || count == 0) {
-        ESP_LOGI(TAG, "No hay medicamentos para verificar");
-        return;
-    }
-    
-    // Iterar sobre todos los medicamentos y sus horarios
-    for (int i = 0; i < count; i++) {
-        for (int j = 0; j < meds[i].schedules_count; j++) {
-            medication_schedule_t *schedule = &meds[i].schedules[j];
-            
-            // Tiempo después del cual consideramos que un medicamento está "perdido" (30 minutos)
-            int64_t threshold_time = 30 * 60 * 1000; // 30 minutos en ms
-            
-            bool should_have_been_dispensed = (schedule->next_dispense_time < current_time - threshold_time);
-            bool was_dispensed = (schedule->last_dispensed_time >= schedule->next_dispense_time);
-            bool was_taken = (schedule->last_taken_time >= schedule->last_dispensed_time);
-            
-            // Un medicamento se considera 'never_dispensed' si debió dispensarse pero no se hizo
-            bool never_dispensed = should_have_been_dispensed && !was_dispensed;
-            
-            // Un medicamento se considera 'dispensed_not_taken' si fue dispensado pero no tomado
-            bool dispensed_not_taken = should_have_been_dispensed && was_dispensed && !was_taken;
-            
-            // Si alguna de las condiciones se cumple, hay un problema que reportar
-            if (never_dispensed || dispensed_not_taken) {
-                const char* status = never_dispensed ? "never_dispensed" : "dispensed_not_taken";
-                
-                ESP_LOGW(TAG, "¡Medicamento no tomado detectado! %s, horario %s (%s)", 
-                         meds[i].name, schedule->id, status);
-                
-                // Convertir a formato legible
-                char next_time_str[32];
-                format_time(schedule->next_dispense_time, next_time_str, sizeof(next_time_str));
-                
-                ESP_LOGW(TAG, "  - Programado para: %s (hace %lld minutos)", 
-                         next_time_str, (current_time - schedule->next_dispense_time) / 60000);
-                
-                // Generar alerta sonora
-                medication_hardware_alert_missed();
-                
-                // Publicar notificación MQTT de medicamento perdido
-                cJSON *root = cJSON_CreateObject();
-                if (root) {
-                    cJSON_AddStringToObject(root, "type", "medication_missed");
-                    cJSON_AddStringToObject(root, "medicationId", meds[i].id);
-                    cJSON_AddStringToObject(root, "name", meds[i].name);
-                    cJSON_AddStringToObject(root, "scheduleId", schedule->id);
-                    cJSON_AddStringToObject(root, "status", status);
-                    cJSON_AddNumberToObject(root, "scheduledTime", schedule->next_dispense_time);
-                    cJSON_AddNumberToObject(root, "currentTime", current_time);
-                    
-                    // Solo añadir estos datos si es relevante
-                    if (dispensed_not_taken) {
-                        cJSON_AddNumberToObject(root, "dispensedTime", schedule->last_dispensed_time);
-                    }
-                    
-                    char *json_str = cJSON_Print(root);
-                    if (json_str) {
-                        mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
-                        free(json_str);
-                    }
-                    
-                    cJSON_Delete(root);
-                }
-            }
-        }
+    int active = medication_missed_check(medication_clock_now_ms());
+    if (active > 0) {
+        ESP_LOGW(TAG, "%d dosis perdidas sin resolver", active);
     }
 }
\ No newline at end of file
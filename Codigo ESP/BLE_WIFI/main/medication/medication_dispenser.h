@@ -3,6 +3,11 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+// Dosis que vencen hasta este tiempo después de la primera se dispensan con
+// ella en la misma sesión (un solo recipiente y una sola notificación)
+#define MEDICATION_DOSE_GROUP_WINDOW_MS (2 * 60 * 1000)
 
 /**
  * @brief Inicializa el sistema de dispensación de medicamentos
@@ -22,13 +27,33 @@ void medication_dispenser_deinit(void);
 void medication_dispenser_set_auto_dispense(bool enable);
 
 /**
- * @brief Dispensa manualmente un medicamento específico
+ * @brief Configura la ventana de agrupación de dosis
+ * @param window_ms Adelanto máximo en ms (0 agrupa solo las dosis ya vencidas)
+ */
+void medication_dispenser_set_dose_group_window(uint32_t window_ms);
+
+/**
+ * @brief Encola la dispensación manual de un medicamento específico.
+ *        La confirmación MQTT se publica cuando termina el trabajo.
  * @param medication_id ID del medicamento a dispensar
  * @param schedule_id ID del horario específico
- * @return ESP_OK si se dispensó correctamente, error en caso contrario
+ * @return ESP_OK si se encoló, ESP_ERR_INVALID_STATE si esa dosis ya está
+ *         pendiente, error en caso contrario
  */
 esp_err_t medication_dispenser_manual_dispense(const char* medication_id, const char* schedule_id);
 
+/**
+ * @brief Avisa al dispensador de que cambiaron los horarios (sincronización)
+ *        para que recalcule su próximo evento
+ */
+void medication_dispenser_notify_schedule_changed(void);
+
+/**
+ * @brief Avisa al dispensador de que se ajustó la hora (NTP) para que no
+ *        espere al siguiente reintento si aún no la consideraba fiable
+ */
+void medication_dispenser_notify_time_changed(void);
+
 // Añadir esta declaración junto con las demás
 void check_missed_medications(void);
 
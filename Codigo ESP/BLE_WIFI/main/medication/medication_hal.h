@@ -0,0 +1,60 @@
+#ifndef MEDICATION_HAL_H
+#define MEDICATION_HAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/**
+ * @brief Acceso al hardware del dispensador. Los módulos que mueven servos,
+ *        bomba, sensor, buzzer, LEDs o pantalla solo llaman a estas
+ *        funciones; cada plataforma enlaza una implementación:
+ *        medication_hal_esp32.c en el equipo y host_bench/hal_sim.c en Linux.
+ */
+typedef struct {
+    const char *name;
+
+    // Servos de los compartimentos de píldoras (ver medication_servo.h)
+    esp_err_t (*servo_init)(const int *gpios, int count, uint32_t initial_us);
+    void (*servo_deinit)(void);
+    esp_err_t (*servo_move)(int channel, uint32_t pulse_us, uint32_t duration_ms);
+    esp_err_t (*servo_wait)(uint32_t channel_mask, uint32_t timeout_ms);
+
+    // Bomba de líquido (PWM); arranca parada
+    esp_err_t (*pump_init)(int gpio, uint32_t frequency_hz);
+    void (*pump_deinit)(void);
+    void (*pump_set_duty)(uint8_t duty_percent);
+
+    // Sensor ultrasónico: un disparo y el ancho del eco en us. Sin filtrado
+    // ni espaciado entre disparos (eso lo hace medication_ultrasonic.c)
+    esp_err_t (*echo_init)(int trigger_gpio, int echo_gpio);
+    void (*echo_deinit)(void);
+    esp_err_t (*echo_capture)(uint32_t *width_us, uint32_t timeout_ms);
+
+    // Salidas digitales (LEDs y buzzer); arrancan a nivel bajo
+    esp_err_t (*output_init)(int gpio);
+    void (*output_set)(int gpio, bool level);
+
+    // Buzzer: reproduce en segundo plano una secuencia sonido/pausa en ms
+    // (se copia); sustituye a la que esté sonando
+    void (*buzzer_play)(int gpio, const uint32_t *sequence, size_t length);
+    void (*buzzer_stop)(int gpio);
+
+    // UART de la pantalla
+    esp_err_t (*display_init)(int tx_gpio, int rx_gpio, uint32_t baud_rate);
+    int (*display_write)(const void *data, size_t length);
+    int (*display_read)(void *data, size_t max_length, uint32_t timeout_ms);
+
+    // Tiempo monotónico y esperas de la tarea que llama
+    int64_t (*now_us)(void);
+    void (*delay_ms)(uint32_t ms);
+    void (*delay_us)(uint32_t us);
+} medication_hal_t;
+
+/**
+ * @brief Implementación de la plataforma para la que se compila
+ */
+extern const medication_hal_t medication_hal_platform;
+
+#endif /* MEDICATION_HAL_H */
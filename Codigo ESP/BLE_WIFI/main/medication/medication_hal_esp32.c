@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "driver/rmt_rx.h"
+#include "driver/mcpwm_prelude.h"
+#include "medication_hal.h"
+#include "medication_servo.h"
+
+static const char *TAG = "HAL_ESP32";
+
+// ---------------------------------------------------------------------------
+// Bomba: PWM en el segundo grupo MCPWM (los servos usan el grupo 0)
+// ---------------------------------------------------------------------------
+
+#define PUMP_MCPWM_GROUP         1
+#define PUMP_RESOLUTION_HZ       1000000
+
+static mcpwm_timer_handle_t pump_pwm_timer = NULL;
+static mcpwm_oper_handle_t pump_oper = NULL;
+static mcpwm_cmpr_handle_t pump_comparator = NULL;
+static mcpwm_gen_handle_t pump_generator = NULL;
+static uint32_t pump_period_ticks = 0;
+
+static void pump_deinit(void) {
+    if (pump_pwm_timer) {
+        mcpwm_timer_start_stop(pump_pwm_timer, MCPWM_TIMER_STOP_EMPTY);
+        mcpwm_timer_disable(pump_pwm_timer);
+    }
+    if (pump_generator) mcpwm_del_generator(pump_generator);
+    if (pump_comparator) mcpwm_del_comparator(pump_comparator);
+    if (pump_oper) mcpwm_del_operator(pump_oper);
+    if (pump_pwm_timer) mcpwm_del_timer(pump_pwm_timer);
+    pump_generator = NULL;
+    pump_comparator = NULL;
+    pump_oper = NULL;
+    pump_pwm_timer = NULL;
+}
+
+static esp_err_t pump_init(int gpio, uint32_t frequency_hz) {
+    if (frequency_hz == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pump_period_ticks = PUMP_RESOLUTION_HZ / frequency_hz;
+
+    mcpwm_timer_config_t timer_config = {
+        .group_id = PUMP_MCPWM_GROUP,
+        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
+        .resolution_hz = PUMP_RESOLUTION_HZ,
+        .period_ticks = pump_period_ticks,
+        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
+    };
+    esp_err_t err = mcpwm_new_timer(&timer_config, &pump_pwm_timer);
+
+    mcpwm_operator_config_t operator_config = {
+        .group_id = PUMP_MCPWM_GROUP,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_new_operator(&operator_config, &pump_oper);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_operator_connect_timer(pump_oper, pump_pwm_timer);
+    }
+
+    mcpwm_comparator_config_t comparator_config = {
+        .flags.update_cmp_on_tez = true,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_new_comparator(pump_oper, &comparator_config, &pump_comparator);
+    }
+
+    mcpwm_generator_config_t generator_config = {
+        .gen_gpio_num = gpio,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_new_generator(pump_oper, &generator_config, &pump_generator);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_generator_set_action_on_timer_event(pump_generator,
+                MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH));
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_generator_set_action_on_compare_event(pump_generator,
+                MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, pump_comparator, MCPWM_GEN_ACTION_LOW));
+    }
+    if (err == ESP_OK) {
+        // Salida forzada a nivel bajo hasta que se active la bomba
+        err = mcpwm_generator_set_force_level(pump_generator, 0, true);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_timer_enable(pump_pwm_timer);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_timer_start_stop(pump_pwm_timer, MCPWM_TIMER_START_NO_STOP);
+    }
+
+    if (err != ESP_OK) {
+        pump_deinit();
+    }
+    return err;
+}
+
+static void pump_set_duty(uint8_t duty_percent) {
+    if (!pump_generator) {
+        return;
+    }
+
+    if (duty_percent == 0) {
+        mcpwm_generator_set_force_level(pump_generator, 0, true);
+        return;
+    }
+    mcpwm_comparator_set_compare_value(pump_comparator, pump_period_ticks * duty_percent / 100);
+    mcpwm_generator_set_force_level(pump_generator, -1, true);
+}
+
+// ---------------------------------------------------------------------------
+// Eco del sensor ultrasónico: el periférico RMT mide el pulso
+// ---------------------------------------------------------------------------
+
+#define ECHO_RESOLUTION_HZ      1000000  // 1 tick = 1 us
+#define ECHO_RX_SYMBOLS         64
+#define ECHO_GLITCH_NS          1000     // Pulsos más cortos son ruido
+#define ECHO_MAX_US             12000    // ~2 m; un eco más largo no termina la captura
+
+static rmt_channel_handle_t rx_channel = NULL;
+static QueueHandle_t rx_queue = NULL;
+static rmt_symbol_word_t rx_symbols[ECHO_RX_SYMBOLS];
+static gpio_num_t trigger_gpio;
+
+// La captura termina cuando el eco lleva ECHO_MAX_US en reposo
+static const rmt_receive_config_t receive_config = {
+    .signal_range_min_ns = ECHO_GLITCH_NS,
+    .signal_range_max_ns = ECHO_MAX_US * 1000,
+};
+
+static bool IRAM_ATTR echo_received(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata,
+                                    void *user_ctx) {
+    BaseType_t task_woken = pdFALSE;
+    xQueueSendFromISR((QueueHandle_t)user_ctx, edata, &task_woken);
+    return task_woken == pdTRUE;
+}
+
+// Ancho del primer pulso alto capturado, 0 si el eco no terminó
+static uint32_t echo_width_us(const rmt_rx_done_event_data_t *event) {
+    for (size_t i = 0; i < event->num_symbols; i++) {
+        const rmt_symbol_word_t *symbol = &event->received_symbols[i];
+        if (symbol->level0 == 1) {
+            return symbol->duration0;
+        }
+        if (symbol->level1 == 1) {
+            return symbol->duration1;
+        }
+    }
+    return 0;
+}
+
+static void echo_deinit(void) {
+    if (rx_channel) {
+        rmt_disable(rx_channel);
+        rmt_del_channel(rx_channel);
+        rx_channel = NULL;
+    }
+    if (rx_queue) {
+        vQueueDelete(rx_queue);
+        rx_queue = NULL;
+    }
+}
+
+static esp_err_t echo_init(int trigger_pin, int echo_pin) {
+    if (rx_channel) {
+        return ESP_OK;
+    }
+
+    gpio_config_t io_conf = {};
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    io_conf.mode = GPIO_MODE_OUTPUT;
+    io_conf.pin_bit_mask = (1ULL << trigger_pin);
+    gpio_config(&io_conf);
+    gpio_set_level(trigger_pin, 0);
+    trigger_gpio = trigger_pin;
+
+    rx_queue = xQueueCreate(1, sizeof(rmt_rx_done_event_data_t));
+    if (!rx_queue) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    rmt_rx_channel_config_t rx_config = {
+        .gpio_num = echo_pin,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = ECHO_RESOLUTION_HZ,
+        .mem_block_symbols = ECHO_RX_SYMBOLS,
+    };
+    esp_err_t err = rmt_new_rx_channel(&rx_config, &rx_channel);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error creando canal RMT para el eco: %s", esp_err_to_name(err));
+        rx_channel = NULL;
+        echo_deinit();
+        return err;
+    }
+
+    rmt_rx_event_callbacks_t callbacks = {
+        .on_recv_done = echo_received,
+    };
+    err = rmt_rx_register_event_callbacks(rx_channel, &callbacks, rx_queue);
+    if (err == ESP_OK) {
+        err = rmt_enable(rx_channel);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error activando la captura del eco: %s", esp_err_to_name(err));
+        echo_deinit();
+    }
+    return err;
+}
+
+static esp_err_t echo_capture(uint32_t *width_us, uint32_t timeout_ms) {
+    if (!rx_channel) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Descartar una captura que llegase tarde tras un timeout anterior
+    rmt_rx_done_event_data_t event;
+    while (xQueueReceive(rx_queue, &event, 0) == pdTRUE) {
+    }
+
+    esp_err_t err = rmt_receive(rx_channel, rx_symbols, sizeof(rx_symbols), &receive_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Pulso de disparo de 10us
+    gpio_set_level(trigger_gpio, 1);
+    esp_rom_delay_us(10);
+    gpio_set_level(trigger_gpio, 0);
+
+    if (xQueueReceive(rx_queue, &event, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        // Sin flancos no hay fin de captura: reiniciar el canal para cancelarla
+        rmt_disable(rx_channel);
+        rmt_enable(rx_channel);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    *width_us = echo_width_us(&event);
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Salidas digitales y buzzer
+// ---------------------------------------------------------------------------
+
+static esp_err_t output_init(int gpio) {
+    gpio_reset_pin(gpio);
+    esp_err_t err = gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+    if (err == ESP_OK) {
+        gpio_set_pull_mode(gpio, GPIO_PULLDOWN_ONLY);
+        gpio_set_level(gpio, 0);
+    }
+    return err;
+}
+
+static void output_set(int gpio, bool level) {
+    gpio_set_level(gpio, level ? 1 : 0);
+}
+
+static TaskHandle_t buzzer_task_handle = NULL;
+
+// Estructura para pasar datos a la tarea del buzzer
+typedef struct {
+    int gpio;
+    size_t length;
+    uint32_t sequence[];
+} buzzer_task_params_t;
+
+/**
+ * @brief Tarea para reproducir secuencias de sonido
+ *
+ * La secuencia es un array de duraciones en ms:
+ * [sonido1, pausa1, sonido2, pausa2, ...]
+ */
+static void buzzer_task(void *pvParameters) {
+    buzzer_task_params_t *params = (buzzer_task_params_t *)pvParameters;
+
+    for (size_t i = 0; i < params->length; i++) {
+        // Sonido en las posiciones pares, pausa en las impares
+        gpio_set_level(params->gpio, (i % 2 == 0) ? 1 : 0);
+        vTaskDelay(params->sequence[i] / portTICK_PERIOD_MS);
+    }
+
+    // Asegurarse de que el buzzer quede apagado al finalizar
+    gpio_set_level(params->gpio, 0);
+
+    free(params);
+    buzzer_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+static void buzzer_stop(int gpio) {
+    if (buzzer_task_handle != NULL) {
+        vTaskDelete(buzzer_task_handle);
+        buzzer_task_handle = NULL;
+    }
+
+    gpio_set_level(gpio, 0);
+}
+
+static void buzzer_play(int gpio, const uint32_t *sequence, size_t length) {
+    buzzer_stop(gpio);
+
+    // Copiar la secuencia para que no cambie mientras se reproduce
+    buzzer_task_params_t *params = malloc(sizeof(*params) + length * sizeof(uint32_t));
+    if (params == NULL) {
+        ESP_LOGE(TAG, "Error de memoria al copiar secuencia del buzzer");
+        return;
+    }
+    params->gpio = gpio;
+    params->length = length;
+    memcpy(params->sequence, sequence, length * sizeof(uint32_t));
+
+    if (xTaskCreate(buzzer_task, "buzzer_task", 2048, params, 5, &buzzer_task_handle) != pdPASS) {
+        ESP_LOGE(TAG, "Error al crear la tarea del buzzer");
+        buzzer_task_handle = NULL;
+        free(params);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// UART de la pantalla
+// ---------------------------------------------------------------------------
+
+#define DISPLAY_UART_NUM          UART_NUM_2
+#define DISPLAY_UART_BUFFER_SIZE  1024
+
+static QueueHandle_t display_uart_queue;
+
+static esp_err_t display_init(int tx_gpio, int rx_gpio, uint32_t baud_rate) {
+    // Desinstalar el driver primero por si acaso está en uso
+    uart_driver_delete(DISPLAY_UART_NUM);
+
+    uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_DEFAULT,
+    };
+
+    esp_err_t ret = uart_param_config(DISPLAY_UART_NUM, &uart_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error configurando parámetros UART: %d (%s)", ret, esp_err_to_name(ret));
+        return ret;
+    }
+
+    ret = uart_set_pin(DISPLAY_UART_NUM, tx_gpio, rx_gpio, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error configurando pines UART: %d (%s)", ret, esp_err_to_name(ret));
+        return ret;
+    }
+
+    ret = uart_driver_install(DISPLAY_UART_NUM, DISPLAY_UART_BUFFER_SIZE,
+                              DISPLAY_UART_BUFFER_SIZE, 10, &display_uart_queue, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Error instalando driver UART: %d (%s)", ret, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+static int display_write(const void *data, size_t length) {
+    return uart_write_bytes(DISPLAY_UART_NUM, data, length);
+}
+
+static int display_read(void *data, size_t max_length, uint32_t timeout_ms) {
+    return uart_read_bytes(DISPLAY_UART_NUM, data, max_length, pdMS_TO_TICKS(timeout_ms));
+}
+
+// ---------------------------------------------------------------------------
+// Tiempo
+// ---------------------------------------------------------------------------
+
+static int64_t now_us(void) {
+    return esp_timer_get_time();
+}
+
+static void delay_ms(uint32_t ms) {
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+static void delay_us(uint32_t us) {
+    esp_rom_delay_us(us);
+}
+
+const medication_hal_t medication_hal_platform = {
+    .name = "esp32",
+    .servo_init = medication_servo_init,
+    .servo_deinit = medication_servo_deinit,
+    .servo_move = medication_servo_move,
+    .servo_wait = medication_servo_wait,
+    .pump_init = pump_init,
+    .pump_deinit = pump_deinit,
+    .pump_set_duty = pump_set_duty,
+    .echo_init = echo_init,
+    .echo_deinit = echo_deinit,
+    .echo_capture = echo_capture,
+    .output_init = output_init,
+    .output_set = output_set,
+    .buzzer_play = buzzer_play,
+    .buzzer_stop = buzzer_stop,
+    .display_init = display_init,
+    .display_write = display_write,
+    .display_read = display_read,
+    .now_us = now_us,
+    .delay_ms = delay_ms,
+    .delay_us = delay_us,
+};
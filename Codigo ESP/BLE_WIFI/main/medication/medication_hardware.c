@@ -3,11 +3,13 @@
 #include <freertos/FreeRTOS.h>
 #include "freertos/task.h"
 #include "esp_log.h"
-#include "driver/mcpwm.h"
-#include "soc/mcpwm_periph.h"
-#include "driver/gpio.h"
 #include "esp_timer.h"
+#include "sdkconfig.h"
 #include "medication_hardware.h"
+#include "medication_hal.h"
+#include "medication_ultrasonic.h"
+#include "medication_presence.h"
+#include "medication_servo.h"
 #include "buzzer_driver.h"
 
 static const char *TAG = "MED_HARDWARE";
@@ -21,35 +23,35 @@ static const char *TAG = "MED_HARDWARE";
 #define ULTRASONIC_ECHO     14   // Echo para sensor único
 
 // Definiciones para el control de servos
-#define SERVO_MIN_PULSEWIDTH     500     // Pulso mínimo en microsegundos (0 grados)
-#define SERVO_MAX_PULSEWIDTH     2500    // Pulso máximo en microsegundos (180 grados)
+#define SERVO_MIN_PULSEWIDTH     MEDICATION_SERVO_MIN_US  // Pulso mínimo en microsegundos (0 grados)
+#define SERVO_MAX_PULSEWIDTH     MEDICATION_SERVO_MAX_US  // Pulso máximo en microsegundos (180 grados)
 #define SERVO_OPEN_POSITION      1500    // Posición abierta (90 grados)
 #define SERVO_CLOSE_POSITION     500     // Posición cerrada (0 grados)
 
 // Definiciones para sensores ultrasónicos
-#define ULTRASONIC_TIMEOUT_US    30000   // Timeout en microsegundos
 #define PILL_DETECTION_THRESHOLD  5.0    // Distancia en cm para detectar objetos
 #define LIQUID_DETECTION_THRESHOLD 5.0  // Misma distancia para líquidos (ahora usa el mismo sensor)
-#define MIN_TIME_BETWEEN_READINGS_US 60000 // Tiempo mínimo entre lecturas (60ms)
 
 // Definiciones para bomba
 #define PUMP_FREQUENCY           500     // Frecuencia PWM para bomba (Hz)
 #define PUMP_DUTY_CYCLE_MIN      0       // Mínimo duty cycle (apagado)
 #define PUMP_DUTY_CYCLE_MAX       80     // Máximo duty cycle (para dispensación)
+#define PUMP_SAFETY_MARGIN_MS    500     // El temporizador corta la bomba si el perfil se alarga
 #define LIQUID_DISPENSE_BASE_TIME 1500000   // Tiempo base en ms para dispensar líquido
 
-// Definiciones para dispensación de píldoras
-#define PILL_DISPENSE_BASE_TIME   1000    // Tiempo base en ms por píldora
-#define PILL_DISPENSE_TIME_PER_PILL 1000  // Tiempo adicional en ms por píldora extra
+// Definiciones para dispensación de píldoras: los tiempos cuentan desde que
+// el servo termina su movimiento
+#define PILL_RELEASE_DWELL_MS     150     // Compuerta abierta para que caiga la píldora
+#define PILL_REFILL_DWELL_MS      200     // Espera a que la siguiente píldora llegue al hueco
 
 // Tiempos de espera
 #define CONTAINER_WAIT_TIMEOUT_MS 60000  // Tiempo máximo de espera para recipiente (60s)
 #define CONTAINER_CHECK_INTERVAL_MS 1000  // Intervalo de verificación para recipiente (1s)
+#define SERVO_MOVE_TIMEOUT_MS     1500   // Máximo para que un servo complete un movimiento
 
 // Variables para el control de hardware
 static bool hardware_initialized = false;
-static mcpwm_unit_t servo_mcpwm_unit = MCPWM_UNIT_0;
-static mcpwm_unit_t pump_mcpwm_unit = MCPWM_UNIT_1;
+static const medication_hal_t *const hal = &medication_hal_platform;
 
 // Definir un temporizador y una estructura para los parámetros
 static esp_timer_handle_t pump_timer = NULL;
@@ -57,9 +59,6 @@ static struct {
     bool in_use;
 } pump_context = {0};
 
-// Añadir variables para controlar el tiempo entre lecturas
-static int64_t last_reading_time = 0; // Una sola variable para el último tiempo de lectura
-
 // Callback del temporizador para apagar la bomba
 static void pump_timer_callback(void* arg) {
     medication_hardware_pump_stop();
@@ -67,46 +66,6 @@ static void pump_timer_callback(void* arg) {
     ESP_LOGI(TAG, "Bomba detenida automáticamente por temporizador");
 }
 
-// Reemplazar en la función measure_distance
-float measure_distance(uint8_t trigger_pin, uint8_t echo_pin) {
-    // Enviar un pulso de 10us al sensor
-    gpio_set_level(trigger_pin, 1);
-    esp_rom_delay_us(10);
-    gpio_set_level(trigger_pin, 0);
-
-    // Medir el tiempo hasta recibir el eco
-    int64_t timeout_start = esp_timer_get_time();
-    int64_t start_time = 0;
-    
-    // Esperar a que el pin ECHO se ponga en alto
-    while (gpio_get_level(echo_pin) == 0) {
-        // Verificar timeout
-        if ((esp_timer_get_time() - timeout_start) > ULTRASONIC_TIMEOUT_US) {
-            ESP_LOGW(TAG, "Timeout esperando señal ECHO alta");
-            return -1;
-        }
-    }
-    
-    // Capturar el tiempo de inicio cuando ECHO se pone en alto
-    start_time = esp_timer_get_time();
-    
-    // Esperar a que el pin ECHO se ponga en bajo
-    while (gpio_get_level(echo_pin) == 1) {
-        // Verificar timeout
-        if ((esp_timer_get_time() - start_time) > ULTRASONIC_TIMEOUT_US) {
-            ESP_LOGW(TAG, "Timeout esperando señal ECHO baja");
-            return -1;
-        }
-    }
-    
-    // Capturar el tiempo final cuando ECHO se pone en bajo
-    int64_t end_time = esp_timer_get_time();
-
-    // Calcular la distancia en cm
-    float distance = (end_time - start_time) * 0.034 / 2;
-    return distance;
-}
-
 // Añadir esta función para verificar la alimentación de los servos
 static bool check_servo_power_supply(void) {
     // Esta es una implementación básica de ejemplo
@@ -114,17 +73,27 @@ static bool check_servo_power_supply(void) {
     
     ESP_LOGI(TAG, "Verificando alimentación de servos");
     
-    // Intentar mover cada servo un poco y verificar si hay alguna señal
-    for (int i = 0; i < 3; i++) {
-        mcpwm_timer_t timer = i;
-        
-        // Intentar un pequeño movimiento
-        mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, MCPWM_OPR_A, SERVO_MIN_PULSEWIDTH + 100);
-        vTaskDelay(100 / portTICK_PERIOD_MS);
-        mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, MCPWM_OPR_A, SERVO_MIN_PULSEWIDTH);
+    // Pequeño movimiento de los tres servos a la vez, con rampa
+    for (int i = 0; i < MAX_PILL_COMPARTMENTS; i++) {
+        hal->servo_move(i, SERVO_MIN_PULSEWIDTH + 100, 0);
+    }
+    hal->servo_wait(MEDICATION_SERVO_ALL, SERVO_MOVE_TIMEOUT_MS);
+    for (int i = 0; i < MAX_PILL_COMPARTMENTS; i++) {
+        hal->servo_move(i, SERVO_MIN_PULSEWIDTH, 0);
     }
     
-    return true; // Asumimos que está bien por ahora
+    // Si un movimiento no termina, el PWM no avanza
+    return hal->servo_wait(MEDICATION_SERVO_ALL, SERVO_MOVE_TIMEOUT_MS) == ESP_OK;
+}
+
+// Cierra los tres compartimentos en paralelo y espera a que terminen
+static void close_all_compartments(void) {
+    for (int i = 0; i < MAX_PILL_COMPARTMENTS; i++) {
+        hal->servo_move(i, SERVO_CLOSE_POSITION, 0);
+    }
+    if (hal->servo_wait(MEDICATION_SERVO_ALL, SERVO_MOVE_TIMEOUT_MS) != ESP_OK) {
+        ESP_LOGW(TAG, "Los servos no completaron el cierre");
+    }
 }
 
 // Inicializar hardware de dispensación
@@ -139,94 +108,52 @@ esp_err_t medication_hardware_init(void) {
     // Inicializar buzzer primero para poder dar feedback de error si algo falla
     buzzer_init();
     
-    // 1. Configurar los pines del sensor ultrasónico
-    gpio_config_t io_conf = {};
-    io_conf.intr_type = GPIO_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = (1ULL << ULTRASONIC_TRIGGER);
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    gpio_config(&io_conf);
-    
-    io_conf.mode = GPIO_MODE_INPUT;
-    io_conf.pin_bit_mask = (1ULL << ULTRASONIC_ECHO);
-    io_conf.pull_up_en = 0;
-    gpio_config(&io_conf);
-    
-    // 2. Inicializar MCPWM para servos
-    ESP_LOGI(TAG, "Configurando servomotores");
-    mcpwm_gpio_init(servo_mcpwm_unit, MCPWM0A, SERVO_PIN_1);
-    mcpwm_gpio_init(servo_mcpwm_unit, MCPWM1A, SERVO_PIN_2);
-    mcpwm_gpio_init(servo_mcpwm_unit, MCPWM2A, SERVO_PIN_3);
-    
-    mcpwm_config_t servo_config;
-    servo_config.frequency = 50;  // 50Hz para servos estándar
-    servo_config.cmpr_a = 0;
-    servo_config.cmpr_b = 0;
-    servo_config.duty_mode = MCPWM_DUTY_MODE_0;
-    servo_config.counter_mode = MCPWM_UP_COUNTER;
-    
-    mcpwm_init(servo_mcpwm_unit, MCPWM_TIMER_0, &servo_config);
-    mcpwm_init(servo_mcpwm_unit, MCPWM_TIMER_1, &servo_config);
-    mcpwm_init(servo_mcpwm_unit, MCPWM_TIMER_2, &servo_config);
+    // 1. Configurar el sensor ultrasónico (el eco lo mide el periférico RMT)
+    if (medication_ultrasonic_init(ULTRASONIC_TRIGGER, ULTRASONIC_ECHO) != ESP_OK) {
+        ESP_LOGE(TAG, "Sensor ultrasónico no disponible");
+    }
     
-    // Añadir espera para estabilización
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    // 2. Inicializar PWM de los servos (arrancan en posición cerrada)
+    ESP_LOGI(TAG, "Configurando servomotores");
+    const int servo_pins[MAX_PILL_COMPARTMENTS] = { SERVO_PIN_1, SERVO_PIN_2, SERVO_PIN_3 };
+    esp_err_t err = hal->servo_init(servo_pins, MAX_PILL_COMPARTMENTS, SERVO_CLOSE_POSITION);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error inicializando servos: %s", esp_err_to_name(err));
+        return err;
+    }
     
-    // 3. Inicializar MCPWM para bomba
+    // 3. Inicializar PWM de la bomba
     ESP_LOGI(TAG, "Configurando bomba");
-    mcpwm_gpio_init(pump_mcpwm_unit, MCPWM0A, PUMP_PIN);
-    
-    mcpwm_config_t pump_config;
-    pump_config.frequency = PUMP_FREQUENCY;
-    pump_config.cmpr_a = PUMP_DUTY_CYCLE_MIN;
-    pump_config.cmpr_b = 0;
-    pump_config.duty_mode = MCPWM_DUTY_MODE_0;
-    pump_config.counter_mode = MCPWM_UP_COUNTER;
+    err = hal->pump_init(PUMP_PIN, PUMP_FREQUENCY);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error inicializando bomba: %s", esp_err_to_name(err));
+        hal->servo_deinit();
+        return err;
+    }
     
-    mcpwm_init(pump_mcpwm_unit, MCPWM_TIMER_0, &pump_config);
+    // Tabla de caudal para convertir las dosis de líquido en tiempo de bomba
+    medication_pump_init();
     
-    // Verificar alimentación antes de continuar
-    if (!check_servo_power_supply()) {
-        ESP_LOGE(TAG, "Problema detectado en alimentación de servos");
-        buzzer_play_pattern(BUZZER_PATTERN_ERROR);
-        // Podrías retornar error, pero permitimos continuar con advertencia
-    }
+    hardware_initialized = true;
     
     // Asegurarse que todos los dispositivos empiecen en posición segura
-    medication_hardware_close_compartment(1);
-    medication_hardware_close_compartment(2);
-    medication_hardware_close_compartment(3);
+    close_all_compartments();
     medication_hardware_pump_stop();
-    
-    hardware_initialized = true;
+
+#if !CONFIG_MEDICATION_FAST_BOOT
+    // Sin arranque rápido el autotest se hace aquí, antes de dar servicio
+    medication_hardware_self_test(NULL);
+#endif
+    
+    // Muestreo continuo del recipiente: las esperas vuelven en cuanto se coloca
+    if (medication_presence_start() != ESP_OK) {
+        ESP_LOGW(TAG, "Servicio de presencia no disponible; se consultará el sensor bajo demanda");
+    }
+
     ESP_LOGI(TAG, "Hardware de dispensación inicializado correctamente");
     
     // Sonido de confirmación
     buzzer_play_pattern(BUZZER_PATTERN_CONFIRM);
-    
-    // Test explícito de servomotores
-    ESP_LOGI(TAG, "Probando servomotores...");
-    for (int i = 1; i <= 3; i++) {
-        ESP_LOGI(TAG, "Probando servo %d", i);
-        
-        // Abrir el compartimento
-        ESP_LOGI(TAG, "  Abriendo compartimento %d", i);
-        mcpwm_set_duty_in_us(servo_mcpwm_unit, i-1, MCPWM_OPR_A, SERVO_OPEN_POSITION);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        
-        // Cerrar el compartimento
-        ESP_LOGI(TAG, "  Cerrando compartimento %d", i);
-        mcpwm_set_duty_in_us(servo_mcpwm_unit, i-1, MCPWM_OPR_A, SERVO_CLOSE_POSITION);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-    }
-    ESP_LOGI(TAG, "Prueba de servomotores completada");
-    ESP_LOGI(TAG, "Probando sensor ultrasónico...");
-    
-    float distance = measure_distance(ULTRASONIC_TRIGGER, ULTRASONIC_ECHO);
-    ESP_LOGI(TAG, "Sensor único - distancia: %.2f cm", distance);
-
-    ESP_LOGI(TAG, "Prueba de sensor completada");
 
     return ESP_OK;
 }
@@ -245,30 +172,14 @@ esp_err_t medication_hardware_open_compartment(uint8_t compartment_number) {
     
     ESP_LOGI(TAG, "Abriendo compartimento %d", compartment_number);
     
-    mcpwm_timer_t timer;
-    mcpwm_operator_t operator = MCPWM_OPR_A;
-    
-    switch (compartment_number) {
-        case 1:
-            timer = MCPWM_TIMER_0;
-            break;
-        case 2:
-            timer = MCPWM_TIMER_1;
-            break;
-        case 3:
-            timer = MCPWM_TIMER_2;
-            break;
-        default:
-            return ESP_ERR_INVALID_ARG;
+    // Mover servo a posición abierta con rampa y esperar a que termine
+    int channel = compartment_number - 1;
+    esp_err_t err = hal->servo_move(channel, SERVO_OPEN_POSITION, 0);
+    if (err == ESP_OK) {
+        err = hal->servo_wait(1u << channel, SERVO_MOVE_TIMEOUT_MS);
     }
     
-    // Mover servo a posición abierta
-    mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, operator, SERVO_OPEN_POSITION);
-    
-    // Añadir retraso para que el servo complete el movimiento
-    vTaskDelay(300 / portTICK_PERIOD_MS);
-    
-    return ESP_OK;
+    return err;
 }
 
 // Cerrar compartimento específico
@@ -285,30 +196,14 @@ esp_err_t medication_hardware_close_compartment(uint8_t compartment_number) {
     
     ESP_LOGI(TAG, "Cerrando compartimento %d", compartment_number);
     
-    mcpwm_timer_t timer;
-    mcpwm_operator_t operator = MCPWM_OPR_A;
-    
-    switch (compartment_number) {
-        case 1:
-            timer = MCPWM_TIMER_0;
-            break;
-        case 2:
-            timer = MCPWM_TIMER_1;
-            break;
-        case 3:
-            timer = MCPWM_TIMER_2;
-            break;
-        default:
-            return ESP_ERR_INVALID_ARG;
+    // Mover servo a posición cerrada con rampa y esperar a que termine
+    int channel = compartment_number - 1;
+    esp_err_t err = hal->servo_move(channel, SERVO_CLOSE_POSITION, 0);
+    if (err == ESP_OK) {
+        err = hal->servo_wait(1u << channel, SERVO_MOVE_TIMEOUT_MS);
     }
     
-    // Mover servo a posición cerrada
-    mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, operator, SERVO_CLOSE_POSITION);
-    
-    // Añadir retraso para que el servo complete el movimiento
-    vTaskDelay(300 / portTICK_PERIOD_MS);
-    
-    return ESP_OK;
+    return err;
 }
 
 // Activar bomba usando temporizador
@@ -331,8 +226,7 @@ esp_err_t medication_hardware_pump_start(uint8_t duty_percent, uint32_t duration
     ESP_LOGI(TAG, "Activando bomba con duty cycle %d%%", duty_percent);
     
     // Establecer duty cycle para la bomba
-    mcpwm_set_duty(pump_mcpwm_unit, MCPWM_TIMER_0, MCPWM_OPR_A, duty_percent);
-    mcpwm_set_duty_type(pump_mcpwm_unit, MCPWM_TIMER_0, MCPWM_OPR_A, MCPWM_DUTY_MODE_0);
+    hal->pump_set_duty(duty_percent);
     
     // Si se especificó un tiempo, configurar temporizador
     if (duration_ms > 0) {
@@ -352,7 +246,7 @@ esp_err_t medication_hardware_pump_start(uint8_t duty_percent, uint32_t duration
         // Iniciar temporizador
         pump_context.in_use = true;
         esp_timer_start_once(pump_timer, duration_ms * 1000);  // Convertir a microsegundos
-        ESP_LOGI(TAG, "Bomba programada para detenerse en %lu ms", duration_ms);
+        ESP_LOGI(TAG, "Bomba programada para detenerse en %lu ms", (unsigned long)duration_ms);
     }
     
     return ESP_OK;
@@ -368,31 +262,49 @@ esp_err_t medication_hardware_pump_stop(void) {
     ESP_LOGI(TAG, "Deteniendo bomba");
     
     // Establecer duty cycle a 0 para detener la bomba
-    mcpwm_set_duty(pump_mcpwm_unit, MCPWM_TIMER_0, MCPWM_OPR_A, PUMP_DUTY_CYCLE_MIN);
-    mcpwm_set_duty_type(pump_mcpwm_unit, MCPWM_TIMER_0, MCPWM_OPR_A, MCPWM_DUTY_MODE_0);
+    hal->pump_set_duty(PUMP_DUTY_CYCLE_MIN);
     
     return ESP_OK;
 }
 
-// Función unificada para verificar presencia de objetos
-sensor_state_t medication_hardware_check_object_presence(void) {
-    // Asegurar intervalo mínimo entre lecturas (60ms recomendado)
-    int64_t current_time = esp_timer_get_time();
-    if ((current_time - last_reading_time) < MIN_TIME_BETWEEN_READINGS_US) {
-        // Esperar hasta completar el intervalo mínimo
-        int64_t wait_time = MIN_TIME_BETWEEN_READINGS_US - (current_time - last_reading_time);
-        esp_rom_delay_us(wait_time > 0 ? wait_time : 0);
+esp_err_t medication_hardware_pump_calibration_run(uint8_t duty_percent) {
+    if (!medication_pump_is_cal_duty(duty_percent)) {
+        ESP_LOGE(TAG, "%d%% no es un punto de la tabla de calibración", duty_percent);
+        return ESP_ERR_INVALID_ARG;
     }
     
-    // Realizar la medición
-    float distance = measure_distance(ULTRASONIC_TRIGGER, ULTRASONIC_ECHO);
-    last_reading_time = esp_timer_get_time();
-    
-    if (distance < 0) {
-        ESP_LOGW(TAG, "Error midiendo distancia en sensor");
+    ESP_LOGI(TAG, "Calibración: bomba a %d%% durante %d ms", duty_percent, MEDICATION_PUMP_CAL_RUN_MS);
+    esp_err_t err = medication_hardware_pump_start(duty_percent,
+                                                   MEDICATION_PUMP_CAL_RUN_MS + PUMP_SAFETY_MARGIN_MS);
+    if (err != ESP_OK) {
+        return err;
+    }
+    hal->delay_ms(MEDICATION_PUMP_CAL_RUN_MS);
+    medication_hardware_pump_stop();
+    buzzer_play_pattern(BUZZER_PATTERN_CONFIRM);
+    return ESP_OK;
+}
+
+// Recorre una rampa de la bomba escalón a escalón (subida o bajada)
+static void pump_ramp(const medication_pump_plan_t *plan, bool up) {
+    for (uint8_t i = 0; i < plan->ramp_steps; i++) {
+        uint8_t step = up ? i : (uint8_t)(plan->ramp_steps - 1 - i);
+        hal->pump_set_duty(medication_pump_ramp_duty(plan, step));
+        hal->delay_ms(MEDICATION_PUMP_RAMP_STEP_MS);
+    }
+}
+
+// Función unificada para verificar presencia de objetos
+sensor_state_t medication_hardware_check_object_presence(void) {
+    // Mediana de varias lecturas; la espera entre disparos no ocupa la CPU
+    ultrasonic_measurement_t measurement;
+    if (medication_ultrasonic_measure(&measurement) != ESP_OK) {
+        ESP_LOGW(TAG, "Error midiendo distancia en sensor (%d de %d lecturas válidas)",
+                 measurement.valid_samples, ULTRASONIC_SAMPLES);
         return SENSOR_ERROR;
     }
     
+    float distance = measurement.distance_cm;
     sensor_state_t state = (distance < PILL_DETECTION_THRESHOLD) ? OBJECT_PRESENT : OBJECT_NOT_PRESENT;
     ESP_LOGI(TAG, "Distancia sensor: %.2f cm - Objeto %s", 
              distance, (state == OBJECT_PRESENT) ? "detectado" : "no detectado");
@@ -412,6 +324,24 @@ sensor_state_t medication_hardware_check_liquid_presence(void) {
     return medication_hardware_check_object_presence();
 }
 
+// Estado del recipiente: el filtrado del servicio de presencia si está en
+// marcha (no toca el sensor) o una medida directa si no
+static sensor_state_t read_container_state(void) {
+    if (medication_presence_running()) {
+        return medication_presence_get();
+    }
+    return medication_hardware_check_object_presence();
+}
+
+// Espera hasta timeout_ms o hasta que se coloque el recipiente
+static void wait_container_interval(uint32_t timeout_ms) {
+    if (medication_presence_running()) {
+        medication_presence_wait(OBJECT_PRESENT, timeout_ms);
+    } else {
+        hal->delay_ms(timeout_ms);
+    }
+}
+
 // Modificar la función de espera para usar mensajes específicos
 sensor_state_t wait_for_container_with_alerts(bool is_liquid, uint32_t max_wait_time_ms) {
     const uint32_t check_interval_ms = CONTAINER_CHECK_INTERVAL_MS;
@@ -422,8 +352,8 @@ sensor_state_t wait_for_container_with_alerts(bool is_liquid, uint32_t max_wait_
     
     // Bucle de espera activa
     while (elapsed_time < max_wait_time_ms) {
-        // Verificar presencia del recipiente con la única función
-        container_state = medication_hardware_check_object_presence();
+        // Verificar presencia del recipiente
+        container_state = read_container_state();
         
         // Si se detecta el recipiente, retornar éxito
         if (container_state == OBJECT_PRESENT) {
@@ -436,115 +366,239 @@ sensor_state_t wait_for_container_with_alerts(bool is_liquid, uint32_t max_wait_
                  is_liquid ? "vaso para líquido" : "recipiente para píldoras");
         buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_READY);
         
-        // Esperar el intervalo de verificación
-        vTaskDelay(pdMS_TO_TICKS(check_interval_ms));
+        // Esperar el intervalo de verificación (vuelve antes si aparece el recipiente)
+        wait_container_interval(check_interval_ms);
         elapsed_time += check_interval_ms;
     }
     
     // Si llegamos aquí, se agotó el tiempo de espera
     ESP_LOGW(TAG, "Tiempo de espera agotado. No se detectó recipiente");
+    medication_presence_log_history(16);
     return OBJECT_NOT_PRESENT;
 }
 
-// Reemplazar en medication_hardware_dispense
-esp_err_t medication_hardware_dispense(uint8_t compartment_number, bool is_liquid, uint32_t amount) {
-    esp_err_t result = ESP_OK;
+// Mueve el servo de un compartimento de píldoras sin esperar; el siguiente
+// paso empieza cuando termina el movimiento y pasan dwell_ms
+static uint32_t dispense_move(dispense_operation_t *op, uint32_t pulse_us, uint16_t dwell_ms) {
+    int channel = op->compartment - 1;
+    if (hal->servo_move(channel, pulse_us, 0) == ESP_OK) {
+        op->servo_mask = 1u << channel;
+    }
+    op->dwell_ms = dwell_ms;
+    return SERVO_MOVE_TIMEOUT_MS;
+}
+
+static uint32_t dispense_finish(dispense_operation_t *op, esp_err_t result) {
+    op->result = result;
+    op->state = (result == ESP_OK) ? DISPENSE_STATE_DONE : DISPENSE_STATE_FAILED;
+    return 0;
+}
+
+// Valida los parámetros y deja la operación lista para su primera fase
+static esp_err_t dispense_prepare(dispense_operation_t *op, uint8_t compartment_number,
+                                  bool is_liquid, uint32_t amount) {
+    if (!op) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    memset(op, 0, sizeof(*op));
+    op->state = DISPENSE_STATE_FAILED;
+    op->result = ESP_ERR_INVALID_ARG;
     
     if (!hardware_initialized) {
         ESP_LOGE(TAG, "Hardware no inicializado");
-        return ESP_ERR_INVALID_STATE;
+        op->result = ESP_ERR_INVALID_STATE;
+        return op->result;
     }
     
     if (compartment_number < 1 || compartment_number > 4) {
         ESP_LOGE(TAG, "Número de compartimento inválido: %d", compartment_number);
-        return ESP_ERR_INVALID_ARG;
+        return op->result;
     }
     
     // Si es líquido, debe ser el compartimento 4
-    if (is_liquid) {
-        // Código existente para dispensación de líquidos, no cambia
-        if (compartment_number != LIQUID_COMPARTMENT_NUM) {
-            ESP_LOGE(TAG, "El medicamento líquido solo puede dispensarse del compartimento 4");
-            buzzer_play_pattern(BUZZER_PATTERN_ERROR);
-            return ESP_ERR_INVALID_ARG;
-        }
-        
-        // Esperar hasta 60 segundos (1 minuto) a que se coloque un recipiente para líquido
-        if (wait_for_container_with_alerts(true, CONTAINER_WAIT_TIMEOUT_MS) != OBJECT_PRESENT) {
-            buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_MISSED);
-            return ESP_ERR_TIMEOUT;
-        }
-        
-        buzzer_play_pattern(BUZZER_PATTERN_CONFIRM);
-        
-        ESP_LOGI(TAG, "Dispensando medicamento líquido por %lu ms", (unsigned long)amount);
-        result = medication_hardware_pump_start(PUMP_DUTY_CYCLE_MAX, amount);
-        
-        if (result == ESP_OK) {
-            vTaskDelay(pdMS_TO_TICKS(amount + 100));
-            buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_TAKEN);
-        }
-    } else {
-        // Dispensación de píldoras - lógica modificada para dispensación incremental
-        if (compartment_number > MAX_PILL_COMPARTMENTS) {
-            ESP_LOGE(TAG, "Las píldoras solo pueden dispensarse de los compartimentos 1-3");
-            buzzer_play_pattern(BUZZER_PATTERN_ERROR);
-            return ESP_ERR_INVALID_ARG;
-        }
-        
-        // Esperar hasta 60 segundos a que se coloque un recipiente para píldoras
-        if (wait_for_container_with_alerts(false, CONTAINER_WAIT_TIMEOUT_MS) != OBJECT_PRESENT) {
-            buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_MISSED);
-            return ESP_ERR_TIMEOUT;
-        }
-        
-        buzzer_play_pattern(BUZZER_PATTERN_CONFIRM);
-        
-        ESP_LOGI(TAG, "Dispensando %lu píldoras del compartimento %d", (unsigned long)amount, compartment_number);
-        
-        // Dispensar cada píldora individualmente
-        for (uint32_t i = 0; i < amount; i++) {
-            ESP_LOGI(TAG, "Dispensando píldora %lu de %lu", (unsigned long)(i+1), (unsigned long)amount);
+    if (is_liquid && compartment_number != LIQUID_COMPARTMENT_NUM) {
+        ESP_LOGE(TAG, "El medicamento líquido solo puede dispensarse del compartimento 4");
+        buzzer_play_pattern(BUZZER_PATTERN_ERROR);
+        return op->result;
+    }
+    
+    if (!is_liquid && (compartment_number > MAX_PILL_COMPARTMENTS || amount == 0)) {
+        ESP_LOGE(TAG, "Las píldoras solo pueden dispensarse de los compartimentos 1-3");
+        buzzer_play_pattern(BUZZER_PATTERN_ERROR);
+        return op->result;
+    }
+    
+    op->compartment = compartment_number;
+    op->is_liquid = is_liquid;
+    op->amount = amount;
+    op->result = ESP_OK;
+    return ESP_OK;
+}
+
+esp_err_t medication_hardware_dispense_begin(dispense_operation_t *op, uint8_t compartment_number,
+                                             bool is_liquid, uint32_t amount) {
+    esp_err_t err = dispense_prepare(op, compartment_number, is_liquid, amount);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    op->state = DISPENSE_STATE_WAIT_CONTAINER;
+    ESP_LOGI(TAG, "Esperando recipiente para %s...", is_liquid ? "líquido" : "píldoras");
+    return ESP_OK;
+}
+
+esp_err_t medication_hardware_dispense_next(dispense_operation_t *op, uint8_t compartment_number,
+                                            bool is_liquid, uint32_t amount) {
+    esp_err_t err = dispense_prepare(op, compartment_number, is_liquid, amount);
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    // El recipiente ya se detectó para la dosis anterior de la sesión
+    op->state = DISPENSE_STATE_OPENING;
+    return ESP_OK;
+}
+
+uint32_t medication_hardware_dispense_step(dispense_operation_t *op) {
+    op->servo_mask = 0;
+    op->dwell_ms = 0;
+    
+    switch (op->state) {
+        case DISPENSE_STATE_WAIT_CONTAINER:
+            // Esperar hasta CONTAINER_WAIT_TIMEOUT_MS a que se coloque un recipiente
+            if (read_container_state() == OBJECT_PRESENT) {
+                ESP_LOGI(TAG, "Recipiente detectado, procediendo con dispensación");
+                buzzer_play_pattern(BUZZER_PATTERN_CONFIRM);
+                op->state = DISPENSE_STATE_OPENING;
+                return 0;
+            }
+            
+            if (op->waited_ms >= CONTAINER_WAIT_TIMEOUT_MS) {
+                ESP_LOGW(TAG, "Tiempo de espera agotado. No se detectó recipiente");
+                medication_presence_log_history(16);
+                buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_MISSED);
+                return dispense_finish(op, ESP_ERR_TIMEOUT);
+            }
             
-            // 1. Mover a posición abierta (180°) para liberar la píldora actual
-            mcpwm_timer_t timer;
-            mcpwm_operator_t operator = MCPWM_OPR_A;
+            // Alertar al usuario que falta el recipiente
+            ESP_LOGW(TAG, "No se detecta recipiente. Por favor, coloque un %s", 
+                     op->is_liquid ? "vaso para líquido" : "recipiente para píldoras");
+            buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_READY);
+            op->waited_ms += CONTAINER_CHECK_INTERVAL_MS;
+            return CONTAINER_CHECK_INTERVAL_MS;
             
-            switch (compartment_number) {
-                case 1: timer = MCPWM_TIMER_0; break;
-                case 2: timer = MCPWM_TIMER_1; break;
-                case 3: timer = MCPWM_TIMER_2; break;
-                default: return ESP_ERR_INVALID_ARG;
+        case DISPENSE_STATE_OPENING:
+            if (op->is_liquid) {
+                // Volumen -> perfil según la calibración: rampa, tramo al
+                // duty más alto que cabe en la dosis y rampa de bajada
+                esp_err_t err = medication_pump_plan(op->amount, PUMP_DUTY_CYCLE_MAX, &op->pump);
+                if (err != ESP_OK) {
+                    return dispense_finish(op, err);
+                }
+                ESP_LOGI(TAG, "Dispensando %lu µl de líquido: %lu ms de bomba (%d%% durante %lu ms)",
+                         (unsigned long)op->amount, (unsigned long)op->pump.total_ms,
+                         op->pump.peak_duty, (unsigned long)op->pump.hold_ms);
+                
+                // El temporizador solo corta la bomba si el perfil no termina a tiempo
+                err = medication_hardware_pump_start(medication_pump_ramp_duty(&op->pump, 0),
+                                                     op->pump.total_ms + PUMP_SAFETY_MARGIN_MS);
+                if (err != ESP_OK) {
+                    return dispense_finish(op, err);
+                }
+                pump_ramp(&op->pump, true);
+                hal->pump_set_duty(op->pump.peak_duty);
+                op->state = DISPENSE_STATE_DISPENSING;
+                return op->pump.hold_ms;
             }
             
-            // Abrir - girar a 180°
-            ESP_LOGI(TAG, "  Abriendo compartimento para liberar píldora");
-            mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, operator, SERVO_MAX_PULSEWIDTH); // 180°
-            vTaskDelay(PILL_DISPENSE_BASE_TIME / portTICK_PERIOD_MS);
+            if (op->pills_done == 0) {
+                ESP_LOGI(TAG, "Dispensando %lu píldoras del compartimento %d",
+                         (unsigned long)op->amount, op->compartment);
+            }
+            ESP_LOGI(TAG, "Dispensando píldora %lu de %lu",
+                     (unsigned long)(op->pills_done + 1), (unsigned long)op->amount);
+            
+            // Abrir - girar a 180° para liberar la píldora actual
+            op->state = DISPENSE_STATE_DISPENSING;
+            return dispense_move(op, SERVO_MAX_PULSEWIDTH, PILL_RELEASE_DWELL_MS);
             
-            // 2. Volver a posición cerrada (0°) para recibir la siguiente píldora
-            ESP_LOGI(TAG, "  Cerrando compartimento para recibir siguiente píldora");
-            mcpwm_set_duty_in_us(servo_mcpwm_unit, timer, operator, SERVO_MIN_PULSEWIDTH); // 0°
+        case DISPENSE_STATE_DISPENSING:
+            if (op->is_liquid) {
+                pump_ramp(&op->pump, false);
+                op->state = DISPENSE_STATE_CLOSING;
+                return 0;
+            }
             
-            // Esperar a que la siguiente píldora caiga al hueco
-            vTaskDelay(PILL_DISPENSE_TIME_PER_PILL / portTICK_PERIOD_MS);
+            // Volver a 0° para recibir la siguiente píldora y esperar a que caiga al hueco
+            op->pills_done++;
+            op->state = (op->pills_done < op->amount) ? DISPENSE_STATE_OPENING : DISPENSE_STATE_CLOSING;
+            return dispense_move(op, SERVO_MIN_PULSEWIDTH, PILL_REFILL_DWELL_MS);
             
-            // Si no es la última píldora, añadir una pequeña pausa entre ciclos
-            if (i < amount - 1) {
-                vTaskDelay(200 / portTICK_PERIOD_MS);
+        case DISPENSE_STATE_CLOSING:
+            if (op->is_liquid) {
+                medication_hardware_pump_stop();
+            } else {
+                // Asegurarse de que el servo quede en posición cerrada
+                dispense_move(op, SERVO_CLOSE_POSITION, 0);
             }
-        }
-        
-        // Asegurarse de que el servo quede en posición cerrada (0°)
-        result = medication_hardware_close_compartment(compartment_number);
-        
-        // Sonido de confirmación cuando termina
-        if (result == ESP_OK) {
+            
+            // Sonido de confirmación cuando termina
             buzzer_play_pattern(BUZZER_PATTERN_MEDICATION_TAKEN);
+            dispense_finish(op, ESP_OK);
+            return op->servo_mask ? SERVO_MOVE_TIMEOUT_MS : 0;
+            
+        default:
+            return 0;
+    }
+}
+
+void medication_hardware_dispense_wait(const dispense_operation_t *op, uint32_t delay_ms) {
+    if (delay_ms == 0) {
+        return;
+    }
+    if (op->state == DISPENSE_STATE_WAIT_CONTAINER) {
+        wait_container_interval(delay_ms);
+    } else if (op->servo_mask) {
+        // Termina al completar el movimiento, no tras un tiempo fijo
+        if (hal->servo_wait(op->servo_mask, delay_ms) != ESP_OK) {
+            ESP_LOGW(TAG, "El servo del compartimento %d no completó el movimiento", op->compartment);
+        }
+        if (op->dwell_ms > 0) {
+            hal->delay_ms(op->dwell_ms);
         }
+    } else {
+        hal->delay_ms(delay_ms);
+    }
+}
+
+const char *medication_hardware_dispense_state_name(dispense_state_t state) {
+    switch (state) {
+        case DISPENSE_STATE_IDLE:           return "idle";
+        case DISPENSE_STATE_WAIT_CONTAINER: return "waiting_container";
+        case DISPENSE_STATE_OPENING:        return "opening";
+        case DISPENSE_STATE_DISPENSING:     return "dispensing";
+        case DISPENSE_STATE_CLOSING:        return "closing";
+        case DISPENSE_STATE_DONE:           return "done";
+        case DISPENSE_STATE_FAILED:         return "failed";
+        default:                            return "unknown";
+    }
+}
+
+// Versión bloqueante: recorre la máquina de estados en la tarea que llama
+esp_err_t medication_hardware_dispense(uint8_t compartment_number, bool is_liquid, uint32_t amount) {
+    dispense_operation_t op;
+    esp_err_t err = medication_hardware_dispense_begin(&op, compartment_number, is_liquid, amount);
+    if (err != ESP_OK) {
+        return err;
     }
     
-    return result;
+    while (op.state != DISPENSE_STATE_DONE && op.state != DISPENSE_STATE_FAILED) {
+        uint32_t delay_ms = medication_hardware_dispense_step(&op);
+        medication_hardware_dispense_wait(&op, delay_ms);
+    }
+    
+    return op.result;
 }
 
 // Liberar recursos del hardware
@@ -554,13 +608,14 @@ void medication_hardware_deinit(void) {
     }
     
     // Cerrar todos los compartimentos
-    medication_hardware_close_compartment(1);
-    medication_hardware_close_compartment(2);
-    medication_hardware_close_compartment(3);
+    close_all_compartments();
     medication_hardware_pump_stop();
+    medication_presence_stop();
+    medication_ultrasonic_deinit();
     
-    // Opcional: De-inicializar MCPWM si hay una API para ello
-    // Actualmente ESP-IDF no proporciona una función mcpwm_deinit
+    // Liberar los PWM de servos y bomba
+    hal->servo_deinit();
+    hal->pump_deinit();
     
     hardware_initialized = false;
     ESP_LOGI(TAG, "Hardware de dispensación deinicializado");
@@ -575,31 +630,83 @@ esp_err_t medication_hardware_alert_missed(void) {
     return ESP_OK;
 }
 
-// Añadir esta función para poder diagnosticar problemas desde el menú MQTT
-esp_err_t medication_hardware_servo_diagnostic(void) {
-    if (!hardware_initialized) {
-        ESP_LOGE(TAG, "Hardware no inicializado");
-        return ESP_ERR_INVALID_STATE;
-    }
-    
-    ESP_LOGI(TAG, "Ejecutando diagnóstico de servomotores");
+// Recorrido completo de cada servo, uno a uno. Entre servos consulta
+// should_yield y, si hay que ceder el hardware, para con todo cerrado.
+static esp_err_t servo_sweep(medication_hardware_yield_cb_t should_yield) {
+    esp_err_t result = ESP_OK;
     
-    // Test simple de cada servo: movimiento completo y luego regreso
-    for (int i = 1; i <= 3; i++) {
-        // Posición actual (cerrada)
-        ESP_LOGI(TAG, "Servo %d - posición inicial", i);
+    for (int i = 1; i <= MAX_PILL_COMPARTMENTS; i++) {
+        if (should_yield && should_yield()) {
+            ESP_LOGI(TAG, "Recorrido de servos interrumpido antes del servo %d", i);
+            return ESP_ERR_NOT_FINISHED;
+        }
         
         // Abrir completamente
         ESP_LOGI(TAG, "Servo %d - abriendo completamente", i);
-        medication_hardware_open_compartment(i);
-        vTaskDelay(1500 / portTICK_PERIOD_MS);
+        if (medication_hardware_open_compartment(i) != ESP_OK) {
+            ESP_LOGW(TAG, "Servo %d - no completó la apertura", i);
+            result = ESP_FAIL;
+        }
+        hal->delay_ms(1500);
         
         // Cerrar completamente
         ESP_LOGI(TAG, "Servo %d - cerrando completamente", i);
-        medication_hardware_close_compartment(i);
-        vTaskDelay(1500 / portTICK_PERIOD_MS);
+        if (medication_hardware_close_compartment(i) != ESP_OK) {
+            ESP_LOGW(TAG, "Servo %d - no completó el cierre", i);
+            result = ESP_FAIL;
+        }
+        hal->delay_ms(1500);
+    }
+    
+    return result;
+}
+
+esp_err_t medication_hardware_self_test(medication_hardware_yield_cb_t should_yield) {
+    if (!hardware_initialized) {
+        ESP_LOGE(TAG, "Hardware no inicializado");
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    ESP_LOGI(TAG, "Autotest del hardware");
+    esp_err_t result = ESP_OK;
+    
+    if (!check_servo_power_supply()) {
+        ESP_LOGE(TAG, "Problema detectado en alimentación de servos");
+        result = ESP_FAIL;
+    }
+    
+    esp_err_t sweep = servo_sweep(should_yield);
+    if (sweep == ESP_ERR_NOT_FINISHED) {
+        return sweep;
+    }
+    if (sweep != ESP_OK) {
+        result = sweep;
+    }
+    
+    ultrasonic_measurement_t measurement;
+    if (medication_ultrasonic_measure(&measurement) == ESP_OK) {
+        ESP_LOGI(TAG, "Sensor único - distancia: %.2f cm", measurement.distance_cm);
+    } else {
+        ESP_LOGW(TAG, "Sensor único sin lecturas coherentes (%d válidas)", measurement.valid_samples);
+        result = ESP_FAIL;
+    }
+    
+    if (result != ESP_OK) {
+        buzzer_play_pattern(BUZZER_PATTERN_ERROR);
+    }
+    ESP_LOGI(TAG, "Autotest del hardware completado: %s", result == ESP_OK ? "correcto" : "con fallos");
+    return result;
+}
+
+// Añadir esta función para poder diagnosticar problemas desde el menú MQTT
+esp_err_t medication_hardware_servo_diagnostic(void) {
+    if (!hardware_initialized) {
+        ESP_LOGE(TAG, "Hardware no inicializado");
+        return ESP_ERR_INVALID_STATE;
     }
     
+    ESP_LOGI(TAG, "Ejecutando diagnóstico de servomotores");
+    servo_sweep(NULL);
     ESP_LOGI(TAG, "Diagnóstico de servomotores completado");
     return ESP_OK;
-}
\ No newline at end of file
+}
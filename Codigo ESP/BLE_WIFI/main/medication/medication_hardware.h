@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include "esp_err.h"
+#include "medication_pump.h"
 
 // Definiciones de tipos de compartimentos
 #define COMPARTMENT_TYPE_PILL    "pill"
@@ -17,6 +18,34 @@ typedef enum {
     OBJECT_PRESENT = 1
 } sensor_state_t;
 
+// Fases de una dispensación
+typedef enum {
+    DISPENSE_STATE_IDLE = 0,
+    DISPENSE_STATE_WAIT_CONTAINER,  // Esperando recipiente (con alertas)
+    DISPENSE_STATE_OPENING,         // Abriendo compuerta / arrancando bomba
+    DISPENSE_STATE_DISPENSING,      // Cayendo la píldora / bombeando
+    DISPENSE_STATE_CLOSING,         // Cerrando compuerta / deteniendo bomba
+    DISPENSE_STATE_DONE,
+    DISPENSE_STATE_FAILED
+} dispense_state_t;
+
+/**
+ * @brief Dispensación en curso. Se avanza con medication_hardware_dispense_step()
+ *        sin bloquear: cada paso indica cuánto esperar antes del siguiente.
+ */
+typedef struct {
+    dispense_state_t state;
+    uint8_t compartment;
+    bool is_liquid;
+    uint32_t amount;              // Píldoras, o µl para líquidos
+    uint32_t pills_done;          // Píldoras ya liberadas
+    medication_pump_plan_t pump;  // Perfil de bombeo de la dosis de líquido
+    uint32_t waited_ms;           // Tiempo esperando el recipiente
+    uint8_t servo_mask;           // Servos cuyo movimiento debe terminar antes del siguiente paso
+    uint16_t dwell_ms;            // Espera adicional tras ese movimiento
+    esp_err_t result;             // Resultado al llegar a DONE/FAILED
+} dispense_operation_t;
+
 /**
  * @brief Inicializa el hardware del dispensador de medicamentos
  * @return ESP_OK si se inicializó correctamente
@@ -51,6 +80,17 @@ esp_err_t medication_hardware_pump_start(uint8_t duty_percent, uint32_t duration
  */
 esp_err_t medication_hardware_pump_stop(void);
 
+/**
+ * @brief Pasada de calibración: mantiene la bomba a duty_percent durante
+ *        MEDICATION_PUMP_CAL_RUN_MS (sin rampa) para medir el volumen
+ *        recogido y guardarlo con medication_pump_calibrate_point().
+ *        Bloquea hasta terminar; en el equipo se pide a la tarea de
+ *        dispensación con medication_dispense_job_request_pump_calibration().
+ * @param duty_percent Uno de los puntos de la tabla de calibración
+ * @return ESP_OK, ESP_ERR_INVALID_ARG si duty_percent no es un punto de la tabla
+ */
+esp_err_t medication_hardware_pump_calibration_run(uint8_t duty_percent);
+
 /**
  * @brief Verifica si hay un recipiente para píldoras usando el sensor ultrasónico
  * @return OBJECT_PRESENT si se detecta un objeto, OBJECT_NOT_PRESENT si no hay objeto,
@@ -82,14 +122,78 @@ void medication_hardware_deinit(void);
  * @brief Dispensa un medicamento específico según el tipo y número de compartimento
  * @param compartment_number Número de compartimento (1-4, donde 4 es el compartimento de líquido)
  * @param is_liquid Indica si es un medicamento líquido (true) o una píldora (false)
- * @param amount Para píldoras: número de píldoras; Para líquidos: duración en ms
+ * @param amount Para píldoras: número de píldoras; Para líquidos: volumen en µl
  * @return ESP_OK si se dispensó correctamente
  */
 esp_err_t medication_hardware_dispense(uint8_t compartment_number, bool is_liquid, uint32_t amount);
 
+/**
+ * @brief Valida los parámetros y prepara una dispensación paso a paso
+ * @param op Operación a preparar
+ * @param compartment_number Número de compartimento (1-4)
+ * @param is_liquid true para líquido, false para píldoras
+ * @param amount Para píldoras: número de píldoras; para líquidos: volumen en µl
+ * @return ESP_OK si la operación queda en DISPENSE_STATE_WAIT_CONTAINER
+ */
+esp_err_t medication_hardware_dispense_begin(dispense_operation_t *op, uint8_t compartment_number,
+                                             bool is_liquid, uint32_t amount);
+
+/**
+ * @brief Prepara la siguiente dosis de una sesión cuyo recipiente ya se
+ *        detectó: empieza directamente en DISPENSE_STATE_OPENING
+ * @param op Operación a preparar (puede ser la de la dosis anterior)
+ * @param compartment_number Número de compartimento (1-4)
+ * @param is_liquid true para líquido, false para píldoras
+ * @param amount Para píldoras: número de píldoras; para líquidos: volumen en µl
+ * @return ESP_OK si los parámetros son válidos
+ */
+esp_err_t medication_hardware_dispense_next(dispense_operation_t *op, uint8_t compartment_number,
+                                            bool is_liquid, uint32_t amount);
+
+/**
+ * @brief Ejecuta el siguiente paso de una dispensación sin bloquear
+ * @param op Operación en curso
+ * @return Milisegundos a esperar antes del siguiente paso. La operación
+ *         termina cuando op->state es DISPENSE_STATE_DONE o DISPENSE_STATE_FAILED.
+ */
+uint32_t medication_hardware_dispense_step(dispense_operation_t *op);
+
+/**
+ * @brief Espera el tiempo indicado por medication_hardware_dispense_step().
+ *        Mientras se espera el recipiente vuelve en cuanto el servicio de
+ *        presencia lo detecta; tras mover un servo, en cuanto termina el
+ *        movimiento (delay_ms es entonces el máximo).
+ * @param op Operación en curso
+ * @param delay_ms Milisegundos devueltos por el paso anterior
+ */
+void medication_hardware_dispense_wait(const dispense_operation_t *op, uint32_t delay_ms);
+
+/**
+ * @brief Nombre legible de una fase de dispensación
+ */
+const char *medication_hardware_dispense_state_name(dispense_state_t state);
+
 // Añadir esta declaración junto con las demás
 esp_err_t medication_hardware_alert_missed(void);
 
+/**
+ * @brief Consulta si el autotest debe ceder el hardware (p. ej. hay una dosis en cola)
+ */
+typedef bool (*medication_hardware_yield_cb_t)(void);
+
+/**
+ * @brief Autotest del hardware: alimentación de servos, recorrido de cada
+ *        servo (el de medication_hardware_servo_diagnostic) y lectura del
+ *        sensor. Con CONFIG_MEDICATION_FAST_BOOT no se ejecuta en
+ *        medication_hardware_init() sino más tarde, desde la tarea de
+ *        dispensación.
+ * @param should_yield Se consulta entre servos; si devuelve true el autotest
+ *                     para con los compartimentos cerrados (puede ser NULL)
+ * @return ESP_OK si todo respondió, ESP_FAIL si alguna prueba falló,
+ *         ESP_ERR_NOT_FINISHED si se interrumpió para ceder el hardware
+ */
+esp_err_t medication_hardware_self_test(medication_hardware_yield_cb_t should_yield);
+
 /**
  * @brief Ejecuta un diagnóstico completo de los servomotores
  * @return ESP_OK si el diagnóstico se ejecutó correctamente
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "medication_index.h"
+
+static const char *TAG = "MED_INDEX";
+
+static const char *NVS_INDEX_KEY = "id_index";
+static const char *NVS_LEGACY_MAP_COUNT_KEY = "map_count";
+
+// Los IDs se comparan hasta la longitud que guarda medication_t: un UUID
+// completo recibido por MQTT coincide con su versión almacenada
+#define ID_LEN ((int)sizeof(((medication_t *)0)->id))
+
+// Tabla abierta de IDs: potencia de 2 y al menos el doble de la capacidad
+#if MEDICATION_INDEX_CAPACITY <= 32
+#define ID_SLOTS 64
+#elif MEDICATION_INDEX_CAPACITY <= 64
+#define ID_SLOTS 128
+#else
+#define ID_SLOTS 256
+#endif
+_Static_assert((ID_SLOTS & (ID_SLOTS - 1)) == 0, "ID_SLOTS debe ser potencia de 2");
+_Static_assert(ID_SLOTS >= 2 * MEDICATION_INDEX_CAPACITY, "ID_SLOTS demasiado pequeño");
+_Static_assert(MEDICATION_INDEX_CAPACITY < 0xFF, "Los handles se guardan en un byte");
+
+#define NO_ROW 0xFF
+
+static nvs_handle_t index_nvs = 0;
+static bool index_changed = false;
+
+// Un ID por handle ("" = libre); este arreglo es lo que se persiste
+static char interned_ids[MEDICATION_INDEX_CAPACITY][ID_LEN];
+static uint32_t interned_hash[MEDICATION_INDEX_CAPACITY];
+static uint8_t id_slots[ID_SLOTS];                  // handle + 1, 0 = vacío
+static uint8_t handle_rows[MEDICATION_INDEX_CAPACITY];
+
+// Tabla abierta de horarios del arreglo activo, clave (medicamento, ID)
+typedef struct {
+    uint16_t tag;          // Parte alta del hash, evita comparar cadenas
+    uint8_t med_row;       // NO_ROW = vacío
+    uint8_t sched_index;
+} schedule_slot_t;
+
+static schedule_slot_t *schedule_slots = NULL;
+static uint32_t schedule_mask = 0;
+static const medication_t *bound_meds = NULL;
+static int bound_count = 0;
+
+// FNV-1a de 32 bits sobre la parte significativa del ID
+static uint32_t hash_id(const char *id) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < ID_LEN - 1 && id[i]; i++) {
+        hash ^= (uint8_t)id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t schedule_hash(int med_row, const char *schedule_id) {
+    return hash_id(schedule_id) ^ ((uint32_t)(med_row + 1) * 0x9E3779B1u);
+}
+
+static void insert_id_slot(medication_handle_t handle) {
+    uint32_t i = interned_hash[handle] & (ID_SLOTS - 1);
+    while (id_slots[i]) {
+        i = (i + 1) & (ID_SLOTS - 1);
+    }
+    id_slots[i] = handle + 1;
+}
+
+// Reconstruye la tabla abierta tras liberar handles (evita tumbas)
+static void rehash_ids(void) {
+    memset(id_slots, 0, sizeof(id_slots));
+    for (int h = 0; h < MEDICATION_INDEX_CAPACITY; h++) {
+        if (interned_ids[h][0]) {
+            insert_id_slot(h);
+        }
+    }
+}
+
+static void reset_ids(void) {
+    memset(interned_ids, 0, sizeof(interned_ids));
+    memset(interned_hash, 0, sizeof(interned_hash));
+    memset(id_slots, 0, sizeof(id_slots));
+    memset(handle_rows, NO_ROW, sizeof(handle_rows));
+}
+
+static bool assign_handle(medication_handle_t handle, const char *id) {
+    if (handle >= MEDICATION_INDEX_CAPACITY || interned_ids[handle][0] || !id[0]) {
+        return false;
+    }
+    strncpy(interned_ids[handle], id, ID_LEN - 1);
+    interned_ids[handle][ID_LEN - 1] = '\0';
+    interned_hash[handle] = hash_id(interned_ids[handle]);
+    insert_id_slot(handle);
+    return true;
+}
+
+// Convierte los mapeos JSON de versiones anteriores ({"long", "short": "med_N"}).
+// Se conserva N como handle para que los registros sigan en la misma clave.
+static int migrate_legacy_mappings(void) {
+    uint32_t count = 0;
+    if (nvs_get_u32(index_nvs, NVS_LEGACY_MAP_COUNT_KEY, &count) != ESP_OK) {
+        return 0;
+    }
+
+    int migrated = 0;
+    for (uint32_t i = 0; i < count && i < MEDICATION_INDEX_CAPACITY; i++) {
+        char map_key[16];
+        snprintf(map_key, sizeof(map_key), "map_%lu", (unsigned long)i);
+
+        char map_json[128];
+        size_t length = sizeof(map_json);
+        if (nvs_get_str(index_nvs, map_key, map_json, &length) != ESP_OK) {
+            continue;
+        }
+
+        cJSON *map_obj = cJSON_Parse(map_json);
+        if (!map_obj) {
+            continue;
+        }
+
+        cJSON *long_id = cJSON_GetObjectItem(map_obj, "long");
+        cJSON *short_key = cJSON_GetObjectItem(map_obj, "short");
+        unsigned int handle = 0;
+
+        if (cJSON_IsString(long_id) && cJSON_IsString(short_key) &&
+            medication_index_lookup(long_id->valuestring) == MEDICATION_HANDLE_INVALID) {
+            // Claves duplicadas por el antiguo contador se quedan en el primer ID;
+            // el resto recibe un handle nuevo al guardarse
+            if (sscanf(short_key->valuestring, "med_%u", &handle) == 1 &&
+                assign_handle(handle, long_id->valuestring)) {
+                migrated++;
+            }
+        }
+
+        cJSON_Delete(map_obj);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        char map_key[16];
+        snprintf(map_key, sizeof(map_key), "map_%lu", (unsigned long)i);
+        nvs_erase_key(index_nvs, map_key);
+    }
+    nvs_erase_key(index_nvs, NVS_LEGACY_MAP_COUNT_KEY);
+
+    index_changed = true;
+    return migrated;
+}
+
+esp_err_t medication_index_load(nvs_handle_t handle) {
+    index_nvs = handle;
+    index_changed = false;
+    reset_ids();
+
+    size_t length = sizeof(interned_ids);
+    esp_err_t err = nvs_get_blob(index_nvs, NVS_INDEX_KEY, interned_ids, &length);
+    if (err == ESP_OK && length == sizeof(interned_ids)) {
+        for (int h = 0; h < MEDICATION_INDEX_CAPACITY; h++) {
+            interned_ids[h][ID_LEN - 1] = '\0';
+            if (interned_ids[h][0]) {
+                interned_hash[h] = hash_id(interned_ids[h]);
+                insert_id_slot(h);
+            }
+        }
+        return ESP_OK;
+    }
+
+    reset_ids();
+    if (err == ESP_OK) {
+        ESP_LOGW(TAG, "Tabla de IDs con tamaño inesperado, se descarta");
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error reading id index: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int migrated = migrate_legacy_mappings();
+    if (migrated > 0) {
+        ESP_LOGI(TAG, "Migrados %d mapeos de ID al índice", migrated);
+    }
+    return ESP_OK;
+}
+
+esp_err_t medication_index_save_if_changed(void) {
+    if (!index_changed) {
+        return ESP_OK;
+    }
+    if (!index_nvs) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = nvs_set_blob(index_nvs, NVS_INDEX_KEY, interned_ids, sizeof(interned_ids));
+    if (err == ESP_OK) {
+        err = nvs_commit(index_nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving id index: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    index_changed = false;
+    return ESP_OK;
+}
+
+medication_handle_t medication_index_lookup(const char *id) {
+    if (!id || !id[0]) {
+        return MEDICATION_HANDLE_INVALID;
+    }
+
+    uint32_t hash = hash_id(id);
+    for (uint32_t i = hash & (ID_SLOTS - 1); id_slots[i]; i = (i + 1) & (ID_SLOTS - 1)) {
+        medication_handle_t handle = id_slots[i] - 1;
+        if (interned_hash[handle] == hash &&
+            strncmp(interned_ids[handle], id, ID_LEN - 1) == 0) {
+            return handle;
+        }
+    }
+    return MEDICATION_HANDLE_INVALID;
+}
+
+medication_handle_t medication_index_intern(const char *id) {
+    medication_handle_t handle = medication_index_lookup(id);
+    if (handle != MEDICATION_HANDLE_INVALID || !id || !id[0]) {
+        return handle;
+    }
+
+    for (int h = 0; h < MEDICATION_INDEX_CAPACITY; h++) {
+        if (assign_handle(h, id)) {
+            index_changed = true;
+            return h;
+        }
+    }
+
+    ESP_LOGE(TAG, "No quedan handles libres para %s", id);
+    return MEDICATION_HANDLE_INVALID;
+}
+
+void medication_index_record_key(medication_handle_t handle, char *key, size_t size) {
+    snprintf(key, size, "med_%u", (unsigned int)handle);
+}
+
+esp_err_t medication_index_rebuild(const medication_t *meds, int count) {
+    memset(handle_rows, NO_ROW, sizeof(handle_rows));
+    bound_meds = meds;
+    bound_count = count;
+
+    int schedules = 0;
+    for (int i = 0; i < count; i++) {
+        medication_handle_t handle = medication_index_intern(meds[i].id);
+        if (handle != MEDICATION_HANDLE_INVALID) {
+            handle_rows[handle] = i;
+        }
+        schedules += meds[i].schedules_count;
+    }
+
+    // Tabla de horarios a no más de la mitad de ocupación
+    uint32_t capacity = 8;
+    while (capacity < (uint32_t)schedules * 2) {
+        capacity <<= 1;
+    }
+
+    free(schedule_slots);
+    schedule_slots = malloc(capacity * sizeof(schedule_slot_t));
+    if (!schedule_slots) {
+        ESP_LOGW(TAG, "Sin memoria para la tabla de horarios, búsqueda lineal");
+        schedule_mask = 0;
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(schedule_slots, NO_ROW, capacity * sizeof(schedule_slot_t));
+    schedule_mask = capacity - 1;
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < meds[i].schedules_count; j++) {
+            uint32_t hash = schedule_hash(i, meds[i].schedules[j].id);
+            uint32_t slot = hash & schedule_mask;
+            while (schedule_slots[slot].med_row != NO_ROW) {
+                slot = (slot + 1) & schedule_mask;
+            }
+            schedule_slots[slot].tag = hash >> 16;
+            schedule_slots[slot].med_row = i;
+            schedule_slots[slot].sched_index = j;
+        }
+    }
+
+    return ESP_OK;
+}
+
+int medication_index_release_unbound(void) {
+    int released = 0;
+    for (int h = 0; h < MEDICATION_INDEX_CAPACITY; h++) {
+        if (interned_ids[h][0] && handle_rows[h] == NO_ROW) {
+            interned_ids[h][0] = '\0';
+            interned_hash[h] = 0;
+            released++;
+        }
+    }
+
+    if (released > 0) {
+        rehash_ids();
+        index_changed = true;
+    }
+    return released;
+}
+
+int medication_index_row(medication_handle_t handle) {
+    if (handle >= MEDICATION_INDEX_CAPACITY || handle_rows[handle] == NO_ROW) {
+        return -1;
+    }
+    return handle_rows[handle];
+}
+
+int medication_index_find_medication(const char *id) {
+    return medication_index_row(medication_index_lookup(id));
+}
+
+int medication_index_find_schedule(int med_row, const char *schedule_id) {
+    if (!bound_meds || !schedule_id || med_row < 0 || med_row >= bound_count) {
+        return -1;
+    }
+
+    const medication_t *med = &bound_meds[med_row];
+
+    if (!schedule_slots) {
+        for (int j = 0; j < med->schedules_count; j++) {
+            if (strncmp(med->schedules[j].id, schedule_id, ID_LEN - 1) == 0) {
+                return j;
+            }
+        }
+        return -1;
+    }
+
+    uint32_t hash = schedule_hash(med_row, schedule_id);
+    uint16_t tag = hash >> 16;
+    for (uint32_t slot = hash & schedule_mask;
+         schedule_slots[slot].med_row != NO_ROW;
+         slot = (slot + 1) & schedule_mask) {
+        const schedule_slot_t *entry = &schedule_slots[slot];
+        if (entry->tag == tag && entry->med_row == med_row &&
+            strncmp(med->schedules[entry->sched_index].id, schedule_id, ID_LEN - 1) == 0) {
+            return entry->sched_index;
+        }
+    }
+    return -1;
+}
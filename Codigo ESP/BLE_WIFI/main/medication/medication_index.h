@@ -0,0 +1,88 @@
+#ifndef MEDICATION_INDEX_H
+#define MEDICATION_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "nvs.h"
+#include "medication_storage.h"
+
+// Medicamentos con handle asignado al mismo tiempo (menos de 255: los handles
+// se guardan en un byte). Se puede fijar al compilar; la tabla de IDs guardada
+// en NVS solo vale para la capacidad con la que se escribió.
+#ifndef MEDICATION_INDEX_CAPACITY
+#define MEDICATION_INDEX_CAPACITY 32
+#endif
+
+// medication_handle_t se asigna al ver un ID por primera vez, se conserva
+// entre reinicios y se libera cuando el medicamento deja de existir
+
+/**
+ * @brief Carga la tabla de IDs desde NVS (migra los mapeos antiguos "map_N")
+ * @param handle Handle NVS del almacenamiento de medicamentos
+ * @return ESP_OK si se cargó (o no había tabla guardada)
+ */
+esp_err_t medication_index_load(nvs_handle_t handle);
+
+/**
+ * @brief Guarda y confirma la tabla de IDs si cambió desde la última escritura
+ * @return ESP_OK si no había cambios o se guardó correctamente
+ */
+esp_err_t medication_index_save_if_changed(void);
+
+/**
+ * @brief Devuelve el handle de un ID, asignando uno libre si no lo tenía
+ * @return Handle, o MEDICATION_HANDLE_INVALID si la tabla está llena
+ */
+medication_handle_t medication_index_intern(const char *id);
+
+/**
+ * @brief Busca el handle de un ID sin asignarlo (O(1))
+ * @return Handle, o MEDICATION_HANDLE_INVALID si el ID no está registrado
+ */
+medication_handle_t medication_index_lookup(const char *id);
+
+/**
+ * @brief Escribe la clave NVS del registro de un medicamento ("med_<handle>")
+ */
+void medication_index_record_key(medication_handle_t handle, char *key, size_t size);
+
+/**
+ * @brief Asocia los handles y horarios al arreglo activo de medicamentos.
+ *        Debe llamarse cada vez que el arreglo cambia de posición o de orden.
+ *
+ * @param meds Arreglo activo
+ * @param count Número de medicamentos
+ * @return ESP_OK, o ESP_ERR_NO_MEM si no se pudo crear la tabla de horarios
+ *         (las búsquedas de horarios pasan entonces a ser lineales)
+ */
+esp_err_t medication_index_rebuild(const medication_t *meds, int count);
+
+/**
+ * @brief Libera los handles de los IDs que no están en el arreglo activo
+ * @return Número de handles liberados
+ */
+int medication_index_release_unbound(void);
+
+/**
+ * @brief Posición en el arreglo activo del medicamento con este handle
+ * @return Posición, o -1 si no está activo
+ */
+int medication_index_row(medication_handle_t handle);
+
+/**
+ * @brief Posición en el arreglo activo del medicamento con este ID (O(1))
+ * @return Posición, o -1 si no existe
+ */
+int medication_index_find_medication(const char *id);
+
+/**
+ * @brief Posición de un horario dentro de su medicamento (O(1))
+ *
+ * @param med_row Posición del medicamento en el arreglo activo
+ * @param schedule_id ID del horario
+ * @return Posición del horario, o -1 si no existe
+ */
+int medication_index_find_schedule(int med_row, const char *schedule_id);
+
+#endif /* MEDICATION_INDEX_H */
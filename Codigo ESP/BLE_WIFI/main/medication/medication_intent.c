@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "medication_intent.h"
+
+static const char *TAG = "MED_INTENT";
+
+static const char *NVS_INTENT_SLOT_PREFIX = "intent_";
+
+#define INTENT_RECORD_VERSION 1
+
+// Registro en NVS: una clave por ranura; una ranura libre no tiene clave
+typedef struct __attribute__((packed)) {
+    uint8_t  version;
+    uint8_t  state;
+    uint8_t  flags;
+    uint8_t  reserved;
+    uint16_t med_handle;
+    uint16_t med_tag;
+    uint16_t sched_tag;
+    int64_t  due_time;
+    int64_t  updated_time;
+} intent_record_t;
+
+_Static_assert(sizeof(intent_record_t) == 26, "Cambiar el layout requiere subir INTENT_RECORD_VERSION");
+
+static nvs_handle_t intent_handle = 0;
+
+// Copia en memoria de las ranuras. La tarea del dispensador abre intenciones y
+// la de dispensación las avanza y cierra: la ranura se reserva bajo el cerrojo
+// y después solo la toca su dueño.
+static medication_intent_t slots[MEDICATION_INTENT_SLOTS];
+static bool slot_reserved[MEDICATION_INTENT_SLOTS];
+static portMUX_TYPE intent_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void slot_key(int slot, char *key, size_t size) {
+    snprintf(key, size, "%s%d", NVS_INTENT_SLOT_PREFIX, slot);
+}
+
+static esp_err_t write_slot(int slot, const medication_intent_t *intent) {
+    intent_record_t rec = {
+        .version = INTENT_RECORD_VERSION,
+        .state = intent->state,
+        .flags = intent->flags,
+        .med_handle = intent->med_handle,
+        .med_tag = intent->med_tag,
+        .sched_tag = intent->sched_tag,
+        .due_time = intent->due_time,
+        .updated_time = intent->updated_time,
+    };
+
+    char key[16];
+    slot_key(slot, key, sizeof(key));
+
+    esp_err_t err = nvs_set_blob(intent_handle, key, &rec, sizeof(rec));
+    if (err == ESP_OK) {
+        err = nvs_commit(intent_handle);
+    }
+    return err;
+}
+
+esp_err_t medication_intent_init(nvs_handle_t handle) {
+    intent_handle = handle;
+    int open_count = 0;
+
+    for (int slot = 0; slot < MEDICATION_INTENT_SLOTS; slot++) {
+        char key[16];
+        slot_key(slot, key, sizeof(key));
+
+        intent_record_t rec;
+        size_t length = sizeof(rec);
+        esp_err_t err = nvs_get_blob(intent_handle, key, &rec, &length);
+
+        memset(&slots[slot], 0, sizeof(slots[slot]));
+        slot_reserved[slot] = false;
+
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            continue;
+        }
+        if (err != ESP_OK || length != sizeof(rec) || rec.version != INTENT_RECORD_VERSION ||
+            (rec.state != MEDICATION_INTENT_PENDING && rec.state != MEDICATION_INTENT_STARTED)) {
+            // Un registro ilegible no se puede resolver: se descarta
+            ESP_LOGW(TAG, "Intención %d ilegible, se descarta", slot);
+            nvs_erase_key(intent_handle, key);
+            continue;
+        }
+
+        slots[slot] = (medication_intent_t){
+            .state = rec.state,
+            .flags = rec.flags,
+            .med_handle = rec.med_handle,
+            .med_tag = rec.med_tag,
+            .sched_tag = rec.sched_tag,
+            .due_time = rec.due_time,
+            .updated_time = rec.updated_time,
+        };
+        slot_reserved[slot] = true;
+        open_count++;
+    }
+
+    if (open_count > 0) {
+        ESP_LOGW(TAG, "%d dispensaciones interrumpidas pendientes de resolver", open_count);
+    }
+    return ESP_OK;
+}
+
+esp_err_t medication_intent_open(const medication_intent_t *intent, int *slot) {
+    if (!intent || !slot || !intent_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int free_slot = -1;
+    portENTER_CRITICAL(&intent_lock);
+    for (int i = 0; i < MEDICATION_INTENT_SLOTS; i++) {
+        if (!slot_reserved[i]) {
+            slot_reserved[i] = true;
+            free_slot = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&intent_lock);
+
+    if (free_slot < 0) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = write_slot(free_slot, intent);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening dispense intent: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&intent_lock);
+        slot_reserved[free_slot] = false;
+        portEXIT_CRITICAL(&intent_lock);
+        return err;
+    }
+
+    portENTER_CRITICAL(&intent_lock);
+    slots[free_slot] = *intent;
+    portEXIT_CRITICAL(&intent_lock);
+
+    *slot = free_slot;
+    return ESP_OK;
+}
+
+esp_err_t medication_intent_set_started(int slot, int64_t time_ms) {
+    medication_intent_t intent;
+    if (!medication_intent_get(slot, &intent)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    intent.state = MEDICATION_INTENT_STARTED;
+    intent.updated_time = time_ms;
+
+    esp_err_t err = write_slot(slot, &intent);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error updating dispense intent: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    portENTER_CRITICAL(&intent_lock);
+    slots[slot] = intent;
+    portEXIT_CRITICAL(&intent_lock);
+    return ESP_OK;
+}
+
+esp_err_t medication_intent_close(int slot) {
+    if (slot < 0 || slot >= MEDICATION_INTENT_SLOTS || !intent_handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char key[16];
+    slot_key(slot, key, sizeof(key));
+
+    esp_err_t err = nvs_erase_key(intent_handle, key);
+    if (err == ESP_OK) {
+        err = nvs_commit(intent_handle);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+    if (err != ESP_OK) {
+        // La ranura sigue ocupada: se resolverá en el próximo arranque
+        ESP_LOGE(TAG, "Error closing dispense intent: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    portENTER_CRITICAL(&intent_lock);
+    memset(&slots[slot], 0, sizeof(slots[slot]));
+    slot_reserved[slot] = false;
+    portEXIT_CRITICAL(&intent_lock);
+    return ESP_OK;
+}
+
+int medication_intent_find(uint16_t med_handle, uint16_t sched_tag) {
+    int found = -1;
+
+    portENTER_CRITICAL(&intent_lock);
+    for (int i = 0; i < MEDICATION_INTENT_SLOTS; i++) {
+        if (slots[i].state != MEDICATION_INTENT_FREE &&
+            slots[i].med_handle == med_handle && slots[i].sched_tag == sched_tag) {
+            found = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&intent_lock);
+
+    return found;
+}
+
+bool medication_intent_get(int slot, medication_intent_t *out) {
+    if (slot < 0 || slot >= MEDICATION_INTENT_SLOTS || !out) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&intent_lock);
+    *out = slots[slot];
+    portEXIT_CRITICAL(&intent_lock);
+
+    return out->state != MEDICATION_INTENT_FREE;
+}
+
+int medication_intent_open_count(void) {
+    int count = 0;
+
+    portENTER_CRITICAL(&intent_lock);
+    for (int i = 0; i < MEDICATION_INTENT_SLOTS; i++) {
+        if (slots[i].state != MEDICATION_INTENT_FREE) {
+            count++;
+        }
+    }
+    portEXIT_CRITICAL(&intent_lock);
+
+    return count;
+}
@@ -0,0 +1,86 @@
+#ifndef MEDICATION_INTENT_H
+#define MEDICATION_INTENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "nvs.h"
+
+// Dispensaciones en curso que pueden quedar registradas a la vez
+#define MEDICATION_INTENT_SLOTS 8
+
+/**
+ * @brief Estado de una dispensación en curso
+ */
+typedef enum {
+    MEDICATION_INTENT_FREE = 0,
+    MEDICATION_INTENT_PENDING = 1,    // Dosis retirada del planificador; el hardware aún no se movió
+    MEDICATION_INTENT_STARTED = 2,    // El servo o la bomba ya se pusieron en marcha
+} medication_intent_state_t;
+
+#define MEDICATION_INTENT_FLAG_MANUAL 0x01    // Pedida por comando, no por horario
+
+/**
+ * @brief Intención de dispensar una dosis. Se confirma (se cierra) cuando la
+ *        dispensación queda registrada en el diario de dosis; si el equipo se
+ *        reinicia antes, la intención indica hasta dónde llegó el hardware.
+ */
+typedef struct {
+    uint8_t state;                // medication_intent_state_t
+    uint8_t flags;                // MEDICATION_INTENT_FLAG_*
+    uint16_t med_handle;          // Handle del medicamento (medication_index)
+    uint16_t med_tag;             // Huella del ID del medicamento
+    uint16_t sched_tag;           // Huella del ID del horario
+    int64_t due_time;             // Hora programada de la toma (0 si es manual)
+    int64_t updated_time;         // Momento de la última transición (ms)
+} medication_intent_t;
+
+/**
+ * @brief Carga las intenciones abiertas (lee como mucho MEDICATION_INTENT_SLOTS
+ *        entradas pequeñas de NVS)
+ * @param handle Handle NVS del almacenamiento de medicamentos
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_intent_init(nvs_handle_t handle);
+
+/**
+ * @brief Abre una intención en una ranura libre y la confirma en NVS
+ * @param intent Intención a registrar (state debe ser PENDING o STARTED)
+ * @param slot Recibe la ranura asignada
+ * @return ESP_OK si quedó persistida, ESP_ERR_NO_MEM si no hay ranuras libres
+ */
+esp_err_t medication_intent_open(const medication_intent_t *intent, int *slot);
+
+/**
+ * @brief Marca una intención como iniciada (el hardware va a moverse)
+ * @param slot Ranura devuelta por medication_intent_open()/find()
+ * @param time_ms Momento de la transición
+ * @return ESP_OK si quedó persistida
+ */
+esp_err_t medication_intent_set_started(int slot, int64_t time_ms);
+
+/**
+ * @brief Cierra una intención: su dispensación ya está registrada o descartada
+ * @param slot Ranura a liberar
+ * @return ESP_OK si se borró de NVS
+ */
+esp_err_t medication_intent_close(int slot);
+
+/**
+ * @brief Busca la intención abierta de un horario
+ * @return Ranura, o -1 si no hay ninguna
+ */
+int medication_intent_find(uint16_t med_handle, uint16_t sched_tag);
+
+/**
+ * @brief Copia una intención abierta
+ * @return true si la ranura está ocupada
+ */
+bool medication_intent_get(int slot, medication_intent_t *out);
+
+/**
+ * @brief Número de intenciones abiertas
+ */
+int medication_intent_open_count(void);
+
+#endif /* MEDICATION_INTENT_H */
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "medication_inventory.h"
+#include "medication_index.h"
+#include "medication_journal.h"
+#include "medication_clock.h"
+#include "../mqtt/mqtt_app.h"
+
+static const char *TAG = "MED_INVENTORY";
+
+#define MS_PER_DAY   (24 * 60 * 60 * 1000LL)
+#define MS_PER_WEEK  (7 * MS_PER_DAY)
+
+// Estado por handle de medicamento. El ritmo semanal depende solo de la
+// definición y se guarda; las dispensaciones solo mueven la fecha de agotamiento.
+typedef struct {
+    bool valid;
+    bool alerted;                 // Aviso de existencias bajas ya enviado
+    bool alert_pending;           // Aviso por publicar fuera del mutex del almacenamiento
+    uint16_t med_tag;             // Huella del ID: un handle reutilizado empieza de cero
+    int64_t treatment_end;        // Fin del último tratamiento, 0 si alguno no termina
+    int64_t rate_valid_until;     // Próximo fin de tratamiento que cambia el ritmo
+    medication_forecast_t forecast;
+} inventory_entry_t;
+
+static inventory_entry_t entries[MEDICATION_INDEX_CAPACITY];
+static portMUX_TYPE inventory_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Tomas por semana de los horarios aún activos: O(horarios del medicamento)
+static void compute_rate(const medication_t *med, int64_t now_ms, inventory_entry_t *entry) {
+    int doses = 0;
+    int64_t earliest_end = INT64_MAX;
+    int64_t latest_end = 0;
+    bool open_ended = false;
+
+    for (int i = 0; i < med->schedules_count; i++) {
+        const medication_schedule_t *schedule = &med->schedules[i];
+        if (schedule->treatment_end_date > 0 && schedule->treatment_end_date <= now_ms) {
+            continue;
+        }
+
+        if (schedule->interval_mode) {
+            doses += schedule->interval_hours > 0 ? (7 * 24) / schedule->interval_hours : 0;
+        } else {
+            doses += __builtin_popcount(schedule->days_mask & 0x7F);
+        }
+
+        if (schedule->treatment_end_date > 0) {
+            if (schedule->treatment_end_date < earliest_end) {
+                earliest_end = schedule->treatment_end_date;
+            }
+            if (schedule->treatment_end_date > latest_end) {
+                latest_end = schedule->treatment_end_date;
+            }
+        } else {
+            open_ended = true;
+        }
+    }
+
+    entry->forecast.doses_per_week = doses;
+    entry->forecast.pills_per_week = doses * med->pills_per_dose;
+    entry->treatment_end = open_ended ? 0 : latest_end;
+    entry->rate_valid_until = earliest_end;
+}
+
+static void compute_depletion(const medication_t *med, int64_t now_ms, inventory_entry_t *entry) {
+    medication_forecast_t *f = &entry->forecast;
+    f->total_pills = med->total_pills > 0 ? med->total_pills : 0;
+
+    if (f->pills_per_week <= 0) {
+        f->depletion_time = INT64_MAX;
+    } else {
+        f->depletion_time = now_ms + (int64_t)f->total_pills * MS_PER_WEEK / f->pills_per_week;
+    }
+
+    f->covers_treatment = f->depletion_time == INT64_MAX ||
+                          (entry->treatment_end > 0 && f->depletion_time >= entry->treatment_end);
+    f->low_stock = !f->covers_treatment &&
+                   f->depletion_time - now_ms < MEDICATION_LOW_STOCK_DAYS * MS_PER_DAY;
+
+    // Rearmar el aviso tras una reposición
+    if (entry->alerted && (f->covers_treatment ||
+        f->depletion_time - now_ms >= (MEDICATION_LOW_STOCK_DAYS + MEDICATION_LOW_STOCK_HYSTERESIS_DAYS) * MS_PER_DAY)) {
+        entry->alerted = false;
+    }
+}
+
+static void add_forecast(cJSON *obj, const medication_forecast_t *f, int64_t now_ms) {
+    cJSON_AddNumberToObject(obj, "totalPills", f->total_pills);
+    cJSON_AddNumberToObject(obj, "dosesPerDay", f->doses_per_week / 7.0);
+    cJSON_AddNumberToObject(obj, "pillsPerDay", f->pills_per_week / 7.0);
+    if (f->depletion_time == INT64_MAX) {
+        cJSON_AddNullToObject(obj, "daysRemaining");
+        cJSON_AddNullToObject(obj, "depletionTime");
+    } else {
+        cJSON_AddNumberToObject(obj, "daysRemaining", (double)((f->depletion_time - now_ms) / MS_PER_DAY));
+        cJSON_AddNumberToObject(obj, "depletionTime", f->depletion_time);
+    }
+    cJSON_AddBoolToObject(obj, "coversTreatment", f->covers_treatment);
+    cJSON_AddBoolToObject(obj, "lowStock", f->low_stock);
+}
+
+static bool publish_low_stock(const char *med_id, const char *name, const medication_forecast_t *f,
+                              int64_t now_ms) {
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return false;
+    }
+
+    cJSON_AddStringToObject(root, "type", "medication_low_stock");
+    cJSON_AddNumberToObject(root, "timestamp", now_ms);
+    cJSON_AddStringToObject(root, "medicationId", med_id);
+    cJSON_AddStringToObject(root, "name", name);
+    cJSON_AddNumberToObject(root, "thresholdDays", MEDICATION_LOW_STOCK_DAYS);
+    add_forecast(root, f, now_ms);
+
+    esp_err_t ret = ESP_FAIL;
+    char *json_str = cJSON_PrintUnformatted(root);
+    if (json_str) {
+        ret = mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
+        free(json_str);
+    }
+    cJSON_Delete(root);
+    return ret == ESP_OK;
+}
+
+// Recalcula una entrada; publish=false solo siembra el estado (arranque).
+// Se llama con el mutex del almacenamiento tomado, así que el aviso solo se
+// marca pendiente y lo publica medication_inventory_publish_alerts().
+static void update_entry(const medication_t *med, bool definition_changed, bool publish) {
+    if (!med || strcmp(med->type, "pill") != 0) {
+        return;
+    }
+
+    medication_handle_t handle = medication_storage_get_handle(med->id);
+    if (handle == MEDICATION_HANDLE_INVALID || handle >= MEDICATION_INDEX_CAPACITY) {
+        return;
+    }
+
+    int64_t now_ms = medication_clock_now_ms();
+    uint16_t tag = medication_journal_tag(med->id);
+
+    portENTER_CRITICAL(&inventory_lock);
+    inventory_entry_t entry = entries[handle];
+    portEXIT_CRITICAL(&inventory_lock);
+
+    if (!entry.valid || entry.med_tag != tag) {
+        memset(&entry, 0, sizeof(entry));
+        entry.valid = true;
+        entry.med_tag = tag;
+        definition_changed = true;
+    }
+    if (definition_changed || now_ms >= entry.rate_valid_until) {
+        compute_rate(med, now_ms, &entry);
+    }
+    compute_depletion(med, now_ms, &entry);
+
+    if (!entry.forecast.low_stock || entry.alerted) {
+        entry.alert_pending = false;
+    } else if (publish) {
+        entry.alert_pending = true;
+    } else {
+        entry.alerted = true;
+    }
+
+    portENTER_CRITICAL(&inventory_lock);
+    entries[handle] = entry;
+    portEXIT_CRITICAL(&inventory_lock);
+}
+
+static void storage_change_callback(const medication_t *medication, medication_storage_change_t change) {
+    update_entry(medication, change == MEDICATION_STORAGE_CHANGE_SYNCED, true);
+}
+
+esp_err_t medication_inventory_init(void) {
+    portENTER_CRITICAL(&inventory_lock);
+    memset(entries, 0, sizeof(entries));
+    portEXIT_CRITICAL(&inventory_lock);
+
+    // Única pasada completa: las existencias que ya estaban bajas antes del
+    // arranque se dan por avisadas
+    int count = 0;
+    medication_t *meds = medication_storage_get_all_medications(&count);
+    for (int i = 0; meds && i < count; i++) {
+        update_entry(&meds[i], true, false);
+    }
+
+    medication_storage_set_change_callback(storage_change_callback);
+    ESP_LOGI(TAG, "Previsión de existencias inicializada (%d medicamentos)", count);
+    return ESP_OK;
+}
+
+void medication_inventory_deinit(void) {
+    medication_storage_set_change_callback(NULL);
+}
+
+void medication_inventory_update(const medication_t *medication, bool definition_changed) {
+    update_entry(medication, definition_changed, true);
+}
+
+void medication_inventory_publish_alerts(void) {
+    for (medication_handle_t handle = 0; handle < MEDICATION_INDEX_CAPACITY; handle++) {
+        portENTER_CRITICAL(&inventory_lock);
+        bool pending = entries[handle].valid && entries[handle].alert_pending;
+        portEXIT_CRITICAL(&inventory_lock);
+        if (!pending) {
+            continue;
+        }
+
+        // Copiar lo necesario con el mutex tomado y publicar después
+        char med_id[sizeof(((medication_t *)0)->id)];
+        char name[sizeof(((medication_t *)0)->name)];
+        medication_forecast_t forecast;
+        medication_storage_lock();
+        const medication_t *med = medication_storage_get_medication_by_handle(handle);
+        portENTER_CRITICAL(&inventory_lock);
+        pending = entries[handle].alert_pending;
+        forecast = entries[handle].forecast;
+        portEXIT_CRITICAL(&inventory_lock);
+        if (med && pending) {
+            snprintf(med_id, sizeof(med_id), "%s", med->id);
+            snprintf(name, sizeof(name), "%s", med->name);
+        }
+        medication_storage_unlock();
+        if (!med || !pending) {
+            continue;
+        }
+
+        // Sin MQTT se vuelve a intentar en la siguiente pasada
+        if (!publish_low_stock(med_id, name, &forecast, medication_clock_now_ms())) {
+            continue;
+        }
+        ESP_LOGW(TAG, "Existencias bajas de %s: %ld pastillas", name, (long)forecast.total_pills);
+
+        portENTER_CRITICAL(&inventory_lock);
+        if (entries[handle].alert_pending) {
+            entries[handle].alert_pending = false;
+            entries[handle].alerted = true;
+        }
+        portEXIT_CRITICAL(&inventory_lock);
+    }
+}
+
+bool medication_inventory_get(medication_handle_t handle, medication_forecast_t *out) {
+    if (handle >= MEDICATION_INDEX_CAPACITY || !out) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&inventory_lock);
+    bool valid = entries[handle].valid;
+    *out = entries[handle].forecast;
+    portEXIT_CRITICAL(&inventory_lock);
+
+    return valid;
+}
+
+void medication_inventory_to_json(cJSON *parent) {
+    cJSON *inventory = parent ? cJSON_AddArrayToObject(parent, "inventory") : NULL;
+    if (!inventory) {
+        return;
+    }
+
+    int64_t now_ms = medication_clock_now_ms();
+    int count = 0;
+    medication_storage_lock();
+    medication_t *meds = medication_storage_get_all_medications(&count);
+
+    for (int i = 0; meds && i < count; i++) {
+        medication_forecast_t forecast;
+        if (!medication_inventory_get(medication_storage_get_handle(meds[i].id), &forecast)) {
+            continue;
+        }
+
+        cJSON *item = cJSON_CreateObject();
+        if (!item) {
+            break;
+        }
+        cJSON_AddStringToObject(item, "medicationId", meds[i].id);
+        add_forecast(item, &forecast, now_ms);
+        cJSON_AddItemToArray(inventory, item);
+    }
+    medication_storage_unlock();
+}
@@ -0,0 +1,69 @@
+#ifndef MEDICATION_INVENTORY_H
+#define MEDICATION_INVENTORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+#include "medication_storage.h"
+
+// Días de existencias por debajo de los cuales se avisa de que hay que reponer
+#define MEDICATION_LOW_STOCK_DAYS 5
+// El aviso se rearma cuando las existencias vuelven a superar el umbral en
+// este margen (evita avisos repetidos al rondar el límite)
+#define MEDICATION_LOW_STOCK_HYSTERESIS_DAYS 2
+
+/**
+ * @brief Previsión de agotamiento de un medicamento en pastillas
+ */
+typedef struct {
+    uint16_t doses_per_week;      // Tomas por semana según los horarios activos
+    int32_t pills_per_week;       // Pastillas por semana
+    int32_t total_pills;          // Existencias en el momento del cálculo
+    int64_t depletion_time;       // Momento estimado en que se agota (ms), INT64_MAX si nunca
+    bool covers_treatment;        // Las existencias alcanzan hasta el fin del tratamiento
+    bool low_stock;               // Por debajo del umbral de aviso
+} medication_forecast_t;
+
+/**
+ * @brief Calcula la previsión de todos los medicamentos y se suscribe a los
+ *        cambios del almacenamiento (dispensaciones y sincronizaciones)
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_inventory_init(void);
+
+/**
+ * @brief Deja de seguir los cambios del almacenamiento
+ */
+void medication_inventory_deinit(void);
+
+/**
+ * @brief Actualiza la previsión de un medicamento. Tras una dispensación
+ *        solo se recalcula la fecha de agotamiento (O(1)); el ritmo de tomas
+ *        se recalcula al cambiar la definición o al vencer un tratamiento.
+ *        Al cruzar el umbral deja pendiente un único aviso medication_low_stock.
+ *
+ * @param medication Medicamento cambiado
+ * @param definition_changed true si cambiaron sus horarios o su dosis (sincronización)
+ */
+void medication_inventory_update(const medication_t *medication, bool definition_changed);
+
+/**
+ * @brief Publica los avisos medication_low_stock pendientes. Se llama sin el
+ *        mutex del almacenamiento tomado; lo que no se pudo publicar se
+ *        reintenta en la siguiente llamada.
+ */
+void medication_inventory_publish_alerts(void);
+
+/**
+ * @brief Copia la previsión de un medicamento
+ * @return true si el medicamento tiene previsión (solo los de pastillas)
+ */
+bool medication_inventory_get(medication_handle_t handle, medication_forecast_t *out);
+
+/**
+ * @brief Añade a parent un arreglo "inventory" con la previsión de cada medicamento
+ */
+void medication_inventory_to_json(cJSON *parent);
+
+#endif /* MEDICATION_INVENTORY_H */
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "medication_journal.h"
+
+static const char *TAG = "MED_JOURNAL";
+
+static const char *NVS_JOURNAL_BASE_KEY = "jrnl_base";
+static const char *NVS_JOURNAL_SLOT_PREFIX = "jrnl_";
+
+#define JOURNAL_RECORD_VERSION 1
+
+// Registro en NVS: cada evento ocupa una ranura fija del anillo (seq % SLOTS)
+typedef struct __attribute__((packed)) {
+    uint32_t seq;
+    uint8_t  version;
+    uint8_t  type;
+    uint8_t  med_index;
+    uint8_t  sched_index;
+    uint16_t med_tag;
+    int32_t  total_pills;
+    int64_t  timestamp;
+    int64_t  next_dispense_time;
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) == 30, "Cambiar el layout requiere subir JOURNAL_RECORD_VERSION");
+
+static nvs_handle_t journal_handle = 0;
+static uint32_t base_seq = 0;   // Primer evento aún no incluido en los registros base
+static uint32_t next_seq = 0;   // Secuencia que recibirá el próximo evento
+
+static void slot_key(uint32_t seq, char *key, size_t size) {
+    snprintf(key, size, "%s%02lu", NVS_JOURNAL_SLOT_PREFIX,
+             (unsigned long)(seq % MEDICATION_JOURNAL_SLOTS));
+}
+
+static bool read_record(uint32_t seq, journal_record_t *rec) {
+    char key[16];
+    slot_key(seq, key, sizeof(key));
+
+    size_t length = sizeof(*rec);
+    if (nvs_get_blob(journal_handle, key, rec, &length) != ESP_OK || length != sizeof(*rec)) {
+        return false;
+    }
+    return rec->version == JOURNAL_RECORD_VERSION && rec->seq == seq;
+}
+
+esp_err_t medication_journal_init(nvs_handle_t handle) {
+    journal_handle = handle;
+    base_seq = 0;
+
+    esp_err_t err = nvs_get_u32(journal_handle, NVS_JOURNAL_BASE_KEY, &base_seq);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error reading journal base: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // Los eventos pendientes son consecutivos desde base_seq: la recuperación
+    // lee como mucho MEDICATION_JOURNAL_SLOTS ranuras
+    next_seq = base_seq;
+    journal_record_t rec;
+    while (next_seq - base_seq < MEDICATION_JOURNAL_SLOTS && read_record(next_seq, &rec)) {
+        next_seq++;
+    }
+
+    if (next_seq != base_seq) {
+        ESP_LOGI(TAG, "Diario con %lu eventos pendientes", (unsigned long)(next_seq - base_seq));
+    }
+    return ESP_OK;
+}
+
+esp_err_t medication_journal_append(const medication_journal_entry_t *entry) {
+    if (!entry || !journal_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (next_seq - base_seq >= MEDICATION_JOURNAL_SLOTS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    journal_record_t rec = {
+        .seq = next_seq,
+        .version = JOURNAL_RECORD_VERSION,
+        .type = entry->type,
+        .med_index = entry->med_index,
+        .sched_index = entry->sched_index,
+        .med_tag = entry->med_tag,
+        .total_pills = entry->total_pills,
+        .timestamp = entry->timestamp,
+        .next_dispense_time = entry->next_dispense_time,
+    };
+
+    char key[16];
+    slot_key(next_seq, key, sizeof(key));
+
+    esp_err_t err = nvs_set_blob(journal_handle, key, &rec, sizeof(rec));
+    if (err == ESP_OK) {
+        err = nvs_commit(journal_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error appending journal event: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    next_seq++;
+    return ESP_OK;
+}
+
+int medication_journal_pending(void) {
+    return (int)(next_seq - base_seq);
+}
+
+int medication_journal_replay(medication_journal_apply_cb_t apply) {
+    int replayed = 0;
+
+    for (uint32_t seq = base_seq; seq != next_seq; seq++) {
+        journal_record_t rec;
+        if (!read_record(seq, &rec)) {
+            ESP_LOGW(TAG, "Evento %lu ilegible, se detiene la recuperación", (unsigned long)seq);
+            break;
+        }
+
+        medication_journal_entry_t entry = {
+            .type = rec.type,
+            .med_index = rec.med_index,
+            .sched_index = rec.sched_index,
+            .med_tag = rec.med_tag,
+            .total_pills = rec.total_pills,
+            .timestamp = rec.timestamp,
+            .next_dispense_time = rec.next_dispense_time,
+        };
+        apply(&entry);
+        replayed++;
+    }
+
+    return replayed;
+}
+
+esp_err_t medication_journal_truncate(void) {
+    if (!journal_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (next_seq == base_seq) {
+        return ESP_OK;
+    }
+
+    // Basta con avanzar la base: las ranuras antiguas se sobrescriben después
+    esp_err_t err = nvs_set_u32(journal_handle, NVS_JOURNAL_BASE_KEY, next_seq);
+    if (err == ESP_OK) {
+        err = nvs_commit(journal_handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error truncating journal: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    base_seq = next_seq;
+    return ESP_OK;
+}
+
+uint16_t medication_journal_tag(const char *id) {
+    // FNV-1a de 32 bits plegado a 16
+    uint32_t hash = 2166136261u;
+    for (const char *p = id; p && *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619u;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
+}
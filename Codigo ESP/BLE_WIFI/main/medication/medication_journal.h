@@ -0,0 +1,78 @@
+#ifndef MEDICATION_JOURNAL_H
+#define MEDICATION_JOURNAL_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "nvs.h"
+
+// Eventos que admite el diario antes de tener que compactarse
+#define MEDICATION_JOURNAL_SLOTS 16
+
+/**
+ * @brief Tipos de evento de dosis
+ */
+typedef enum {
+    MEDICATION_JOURNAL_DISPENSED = 1,   // Dosis dispensada (actualiza recuento y próxima dosis)
+    MEDICATION_JOURNAL_TAKEN = 2,       // Dosis confirmada como tomada
+    MEDICATION_JOURNAL_FAILED = 3,      // Dosis que no se pudo dispensar (solo actualiza la próxima dosis)
+} medication_journal_event_t;
+
+/**
+ * @brief Evento de dosis. Guarda valores absolutos (no incrementos) para que
+ *        reproducir dos veces el mismo evento no altere el resultado.
+ */
+typedef struct {
+    uint8_t type;                 // medication_journal_event_t
+    uint8_t med_index;            // Posición del medicamento en el almacenamiento
+    uint8_t sched_index;          // Posición del horario dentro del medicamento
+    uint16_t med_tag;             // Huella del ID para validar el índice al reproducir
+    int32_t total_pills;          // Recuento de pastillas tras el evento
+    int64_t timestamp;            // Momento del evento (ms)
+    int64_t next_dispense_time;   // Próxima dispensación tras el evento (ms)
+} medication_journal_entry_t;
+
+/**
+ * @brief Callback que aplica un evento al estado en memoria durante la recuperación
+ */
+typedef void (*medication_journal_apply_cb_t)(const medication_journal_entry_t *entry);
+
+/**
+ * @brief Inicializa el diario sobre un handle NVS ya abierto
+ * @param handle Handle NVS del almacenamiento de medicamentos
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_journal_init(nvs_handle_t handle);
+
+/**
+ * @brief Añade un evento y lo confirma en NVS (O(1), una sola entrada pequeña)
+ * @param entry Evento a registrar
+ * @return ESP_OK si quedó persistido, ESP_ERR_NO_MEM si el diario está lleno
+ *         y debe compactarse antes
+ */
+esp_err_t medication_journal_append(const medication_journal_entry_t *entry);
+
+/**
+ * @brief Número de eventos registrados desde la última compactación
+ */
+int medication_journal_pending(void);
+
+/**
+ * @brief Reproduce en orden los eventos pendientes (como mucho MEDICATION_JOURNAL_SLOTS)
+ * @param apply Función que aplica cada evento
+ * @return Número de eventos reproducidos
+ */
+int medication_journal_replay(medication_journal_apply_cb_t apply);
+
+/**
+ * @brief Descarta los eventos pendientes. Debe llamarse solo después de haber
+ *        guardado y confirmado los registros base que los incluyen.
+ * @return ESP_OK si se actualizó correctamente
+ */
+esp_err_t medication_journal_truncate(void);
+
+/**
+ * @brief Calcula la huella de 16 bits de un ID de medicamento
+ */
+uint16_t medication_journal_tag(const char *id);
+
+#endif /* MEDICATION_JOURNAL_H */
@@ -0,0 +1,665 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "esp_log.h"
+#include "medication_storage.h"
+#include "medication_json_stream.h"
+
+static const char *TAG = "MED_JSON_STREAM";
+
+#define STREAM_MAX_DEPTH  8    // Anidamiento máximo admitido
+#define STREAM_KEY_LEN    24   // Claves más largas no coinciden con ningún campo
+#define STREAM_TEXT_LEN   64   // Cubre el campo más largo (nombre del medicamento)
+
+// Contexto semántico de cada contenedor abierto
+typedef enum {
+    CTX_SKIP = 0,         // Contenedor que no interesa
+    CTX_ROOT,             // Objeto raíz del mensaje
+    CTX_PAYLOAD,          // root.payload
+    CTX_MEDICATIONS,      // payload.medications[]
+    CTX_MEDICATION,       // Objeto de un medicamento
+    CTX_SCHEDULES,        // medication.schedules[]
+    CTX_SCHEDULE,         // Objeto de un horario
+    CTX_DAYS,             // schedule.days[]
+} stream_ctx_t;
+
+// Estado del analizador léxico
+typedef enum {
+    LEX_VALUE,            // Se espera un valor
+    LEX_KEY,              // Se espera una clave (o '}' si el objeto está vacío)
+    LEX_COLON,            // Se espera ':'
+    LEX_AFTER_VALUE,      // Se espera ',' o el cierre del contenedor
+    LEX_STRING,
+    LEX_NUMBER,
+    LEX_LITERAL,          // true, false o null
+    LEX_DONE,             // Objeto raíz cerrado
+    LEX_ERROR,
+} lex_state_t;
+
+typedef enum {
+    SCALAR_STRING,
+    SCALAR_NUMBER,
+    SCALAR_TRUE,
+    SCALAR_FALSE,
+    SCALAR_NULL,
+} scalar_kind_t;
+
+// Campos recibidos del medicamento/horario en construcción
+#define MED_FIELD_ID              0x01
+#define MED_FIELD_NAME            0x02
+#define MED_FIELD_TYPE            0x04
+#define MED_FIELD_COMPARTMENT     0x08
+#define MED_FIELD_PILLS_PER_DOSE  0x10
+#define MED_FIELD_TOTAL_PILLS     0x20
+#define MED_FIELDS_REQUIRED       (MED_FIELD_ID | MED_FIELD_NAME | MED_FIELD_TYPE | MED_FIELD_COMPARTMENT)
+
+#define SCHED_FIELD_ID              0x01
+#define SCHED_FIELD_TIME            0x02
+#define SCHED_FIELD_INTERVAL_HOURS  0x04
+#define SCHED_FIELD_TREATMENT_DAYS  0x08
+
+// Todo el estado es estático: el consumo de memoria no depende del mensaje
+static struct {
+    lex_state_t state;
+    esp_err_t error;
+
+    struct {
+        uint8_t ctx;
+        bool is_object;
+    } stack[STREAM_MAX_DEPTH];
+    int depth;
+    bool container_empty;
+
+    char text[STREAM_TEXT_LEN];
+    int text_len;
+    bool string_is_key;
+    uint8_t escape;               // 0: normal, 1: tras '\', 2-5: dígitos de \uXXXX
+    uint16_t unicode;
+
+    char key[STREAM_KEY_LEN];
+    bool key_truncated;
+
+    medication_json_envelope_t envelope;
+    int medications_parsed;
+
+    // Medicamento en construcción
+    medication_t med;
+    uint8_t med_fields;
+    double pills_per_dose;        // Sin truncar: en los líquidos son ml con decimales
+    int total_pills;
+    medication_schedule_t schedules[MEDICATION_MAX_SCHEDULES];
+    int schedules_count;
+
+    // Horario en construcción (schedules[schedules_count])
+    uint8_t sched_fields;
+    uint8_t days_mask;
+} stream;
+
+static void stream_fail(esp_err_t err, const char *reason) {
+    if (stream.state != LEX_ERROR) {
+        ESP_LOGE(TAG, "JSON inválido: %s", reason);
+        stream.error = err;
+        stream.state = LEX_ERROR;
+    }
+}
+
+static inline bool key_is(const char *name) {
+    return !stream.key_truncated && strcmp(stream.key, name) == 0;
+}
+
+// Conversión con la misma saturación que cJSON usa para valueint
+static int number_to_int(double value) {
+    if (value >= INT_MAX) return INT_MAX;
+    if (value <= (double)INT_MIN) return INT_MIN;
+    return (int)value;
+}
+
+// Copia el texto leído truncándolo al tamaño del campo
+static void copy_text(char *dst, size_t size) {
+    size_t len = (size_t)stream.text_len < size - 1 ? (size_t)stream.text_len : size - 1;
+    memcpy(dst, stream.text, len);
+    dst[len] = '\0';
+}
+
+static stream_ctx_t child_context(bool is_object) {
+    stream_ctx_t parent = stream.stack[stream.depth - 1].ctx;
+
+    switch (parent) {
+        case CTX_ROOT:
+            return (is_object && key_is("payload")) ? CTX_PAYLOAD : CTX_SKIP;
+        case CTX_PAYLOAD:
+            return (!is_object && key_is("medications")) ? CTX_MEDICATIONS : CTX_SKIP;
+        case CTX_MEDICATIONS:
+            return is_object ? CTX_MEDICATION : CTX_SKIP;
+        case CTX_MEDICATION:
+            return (!is_object && key_is("schedules")) ? CTX_SCHEDULES : CTX_SKIP;
+        case CTX_SCHEDULES:
+            if (!is_object) {
+                return CTX_SKIP;
+            }
+            if (stream.schedules_count >= MEDICATION_MAX_SCHEDULES) {
+                // Como el parser cJSON: guardar solo una parte dejaría el
+                // medicamento incompleto, así que se anula la sincronización
+                ESP_LOGE(TAG, "Medicamento %s con más de %d horarios",
+                         stream.med.id, MEDICATION_MAX_SCHEDULES);
+                stream_fail(ESP_ERR_INVALID_SIZE, "demasiados horarios");
+                return CTX_SKIP;
+            }
+            return CTX_SCHEDULE;
+        case CTX_SCHEDULE:
+            return (!is_object && key_is("days")) ? CTX_DAYS : CTX_SKIP;
+        default:
+            return CTX_SKIP;
+    }
+}
+
+static void on_container_open(stream_ctx_t ctx) {
+    if (ctx == CTX_MEDICATION) {
+        memset(&stream.med, 0, sizeof(stream.med));
+        stream.med_fields = 0;
+        stream.pills_per_dose = 0;
+        stream.total_pills = 0;
+        stream.schedules_count = 0;
+    } else if (ctx == CTX_SCHEDULE) {
+        memset(&stream.schedules[stream.schedules_count], 0, sizeof(medication_schedule_t));
+        stream.sched_fields = 0;
+        stream.days_mask = 0;
+    }
+}
+
+// Completa un horario con los mismos valores por defecto que el parser cJSON
+static void finish_schedule(void) {
+    int index = stream.schedules_count;
+    medication_schedule_t *schedule = &stream.schedules[index];
+
+    if (!(stream.sched_fields & SCHED_FIELD_ID)) {
+        snprintf(schedule->id, sizeof(schedule->id), "sched_%d", index);
+    }
+    if (!(stream.sched_fields & SCHED_FIELD_TIME)) {
+        schedule->time_in_minutes = 8 * 60;
+    }
+
+    if (schedule->interval_mode) {
+        if (!(stream.sched_fields & SCHED_FIELD_INTERVAL_HOURS)) {
+            schedule->interval_hours = 24;
+        }
+        if (!(stream.sched_fields & SCHED_FIELD_TREATMENT_DAYS)) {
+            schedule->treatment_days = 0;
+        }
+    } else {
+        schedule->interval_hours = 0;
+        schedule->treatment_days = 0;
+
+        uint8_t mask = stream.days_mask ? stream.days_mask : 0x7F;
+        schedule->days_count = 0;
+        for (int day = 1; day <= 7; day++) {
+            if (mask & (1 << (day - 1))) {
+                schedule->days[schedule->days_count++] = day;
+            }
+        }
+    }
+
+    stream.schedules_count++;
+}
+
+// Entrega el medicamento completo al almacenamiento
+static void finish_medication(void) {
+    if ((stream.med_fields & MED_FIELDS_REQUIRED) != MED_FIELDS_REQUIRED) {
+        ESP_LOGW(TAG, "Medication missing required fields, skipping");
+        return;
+    }
+
+    medication_t incoming = stream.med;
+
+    // En los líquidos la dosis va en ml (con decimales) y se guarda en µl;
+    // las existencias solo se cuentan en pastillas
+    bool is_pill = strcmp(incoming.type, "pill") == 0;
+    bool has_dose = (stream.med_fields & MED_FIELD_PILLS_PER_DOSE) != 0;
+    if (is_pill) {
+        incoming.pills_per_dose = has_dose ? number_to_int(stream.pills_per_dose) : 1;
+    } else if (strcmp(incoming.type, "liquid") == 0) {
+        incoming.dose_volume_ul = medication_storage_dose_volume_ul(has_dose ? stream.pills_per_dose : 1.0);
+    }
+    if (is_pill) {
+        incoming.total_pills = (stream.med_fields & MED_FIELD_TOTAL_PILLS) ? stream.total_pills : 0;
+    }
+
+    if (stream.schedules_count > 0) {
+        incoming.schedules = malloc(stream.schedules_count * sizeof(medication_schedule_t));
+        if (!incoming.schedules) {
+            stream_fail(ESP_ERR_NO_MEM, "sin memoria para horarios");
+            return;
+        }
+        memcpy(incoming.schedules, stream.schedules, stream.schedules_count * sizeof(medication_schedule_t));
+        incoming.schedules_count = stream.schedules_count;
+    }
+
+    esp_err_t err = medication_storage_sync_upsert(&incoming);
+    if (err != ESP_OK) {
+        stream_fail(err, "no se pudo incorporar el medicamento");
+        return;
+    }
+
+    stream.medications_parsed++;
+}
+
+static void on_container_close(stream_ctx_t ctx) {
+    switch (ctx) {
+        case CTX_SCHEDULE:
+            finish_schedule();
+            break;
+        case CTX_MEDICATION:
+            finish_medication();
+            break;
+        case CTX_MEDICATIONS:
+            stream.envelope.has_medications = true;
+            break;
+        default:
+            break;
+    }
+}
+
+static void on_scalar(scalar_kind_t kind) {
+    stream_ctx_t ctx = stream.stack[stream.depth - 1].ctx;
+    double number = 0;
+
+    if (kind == SCALAR_NUMBER) {
+        char *end = NULL;
+        number = strtod(stream.text, &end);
+        if (end != stream.text + stream.text_len) {
+            stream_fail(ESP_FAIL, "número mal formado");
+            return;
+        }
+    }
+
+    bool is_string = kind == SCALAR_STRING;
+    bool is_number = kind == SCALAR_NUMBER;
+
+    switch (ctx) {
+        case CTX_ROOT:
+            if (is_string && key_is("type")) {
+                copy_text(stream.envelope.type, sizeof(stream.envelope.type));
+            } else if (is_number && key_is("timestamp")) {
+                stream.envelope.timestamp = (int64_t)number;
+            }
+            break;
+
+        case CTX_PAYLOAD:
+            if (is_string && key_is("cmd")) {
+                copy_text(stream.envelope.cmd, sizeof(stream.envelope.cmd));
+            }
+            break;
+
+        case CTX_MEDICATION:
+            if (is_string && key_is("id")) {
+                copy_text(stream.med.id, sizeof(stream.med.id));
+                stream.med_fields |= MED_FIELD_ID;
+            } else if (is_string && key_is("name")) {
+                copy_text(stream.med.name, sizeof(stream.med.name));
+                stream.med_fields |= MED_FIELD_NAME;
+            } else if (is_string && key_is("type")) {
+                copy_text(stream.med.type, sizeof(stream.med.type));
+                stream.med_fields |= MED_FIELD_TYPE;
+            } else if (is_number && key_is("compartment")) {
+                stream.med.compartment = number_to_int(number);
+                stream.med_fields |= MED_FIELD_COMPARTMENT;
+            } else if (is_number && key_is("pillsPerDose")) {
+                stream.pills_per_dose = number;
+                stream.med_fields |= MED_FIELD_PILLS_PER_DOSE;
+            } else if (is_number && key_is("totalPills")) {
+                stream.total_pills = number_to_int(number);
+                stream.med_fields |= MED_FIELD_TOTAL_PILLS;
+            }
+            break;
+
+        case CTX_SCHEDULE: {
+            medication_schedule_t *schedule = &stream.schedules[stream.schedules_count];
+            if (is_string && key_is("id")) {
+                copy_text(schedule->id, sizeof(schedule->id));
+                stream.sched_fields |= SCHED_FIELD_ID;
+            } else if (is_number && key_is("time")) {
+                schedule->time_in_minutes = number_to_int(number);
+                stream.sched_fields |= SCHED_FIELD_TIME;
+            } else if (key_is("intervalMode")) {
+                schedule->interval_mode = kind == SCALAR_TRUE;
+            } else if (is_number && key_is("intervalHours")) {
+                schedule->interval_hours = number_to_int(number);
+                stream.sched_fields |= SCHED_FIELD_INTERVAL_HOURS;
+            } else if (is_number && key_is("treatmentDays")) {
+                schedule->treatment_days = number_to_int(number);
+                stream.sched_fields |= SCHED_FIELD_TREATMENT_DAYS;
+            }
+            break;
+        }
+
+        case CTX_DAYS:
+            if (is_number) {
+                int day = number_to_int(number);
+                if (day >= 1 && day <= 7) {
+                    stream.days_mask |= 1 << (day - 1);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void append_text(char c) {
+    if (stream.text_len < STREAM_TEXT_LEN - 1) {
+        stream.text[stream.text_len++] = c;
+        stream.text[stream.text_len] = '\0';
+    } else if (stream.string_is_key) {
+        stream.key_truncated = true;
+    }
+    // Los valores demasiado largos se truncan, igual que con strncpy
+}
+
+static void append_utf8(uint16_t code) {
+    if (code >= 0xD800 && code <= 0xDFFF) {
+        append_text('?');  // Pares sustitutos no se reconstruyen
+    } else if (code < 0x80) {
+        append_text((char)code);
+    } else if (code < 0x800) {
+        append_text((char)(0xC0 | (code >> 6)));
+        append_text((char)(0x80 | (code & 0x3F)));
+    } else {
+        append_text((char)(0xE0 | (code >> 12)));
+        append_text((char)(0x80 | ((code >> 6) & 0x3F)));
+        append_text((char)(0x80 | (code & 0x3F)));
+    }
+}
+
+static void start_text(lex_state_t state, bool is_key) {
+    stream.state = state;
+    stream.string_is_key = is_key;
+    stream.text_len = 0;
+    stream.text[0] = '\0';
+    stream.escape = 0;
+    if (is_key) {
+        stream.key_truncated = false;
+    }
+}
+
+static void value_done(void) {
+    stream.state = LEX_AFTER_VALUE;
+}
+
+static void open_container(bool is_object) {
+    stream_ctx_t ctx;
+
+    if (stream.depth == 0) {
+        if (!is_object) {
+            stream_fail(ESP_FAIL, "la raíz debe ser un objeto");
+            return;
+        }
+        ctx = CTX_ROOT;
+    } else {
+        ctx = child_context(is_object);
+        if (stream.state == LEX_ERROR) {
+            return;
+        }
+    }
+
+    if (stream.depth >= STREAM_MAX_DEPTH) {
+        stream_fail(ESP_ERR_INVALID_SIZE, "anidamiento excesivo");
+        return;
+    }
+
+    stream.stack[stream.depth].ctx = ctx;
+    stream.stack[stream.depth].is_object = is_object;
+    stream.depth++;
+    stream.container_empty = true;
+    stream.state = is_object ? LEX_KEY : LEX_VALUE;
+
+    on_container_open(ctx);
+}
+
+static void close_container(char c) {
+    if (stream.depth == 0 || (c == '}') != stream.stack[stream.depth - 1].is_object) {
+        stream_fail(ESP_FAIL, "cierre inesperado");
+        return;
+    }
+
+    stream.depth--;
+    stream.container_empty = false;
+    on_container_close(stream.stack[stream.depth].ctx);
+
+    if (stream.state == LEX_ERROR) {
+        return;
+    }
+    stream.state = stream.depth == 0 ? LEX_DONE : LEX_AFTER_VALUE;
+}
+
+static void finish_literal(void) {
+    scalar_kind_t kind;
+    if (strcmp(stream.text, "true") == 0) {
+        kind = SCALAR_TRUE;
+    } else if (strcmp(stream.text, "false") == 0) {
+        kind = SCALAR_FALSE;
+    } else if (strcmp(stream.text, "null") == 0) {
+        kind = SCALAR_NULL;
+    } else {
+        stream_fail(ESP_FAIL, "literal desconocido");
+        return;
+    }
+    on_scalar(kind);
+    if (stream.state != LEX_ERROR) {
+        value_done();
+    }
+}
+
+static void string_char(char c) {
+    if (stream.escape == 1) {
+        stream.escape = 0;
+        switch (c) {
+            case '"':  append_text('"');  break;
+            case '\\': append_text('\\'); break;
+            case '/':  append_text('/');  break;
+            case 'b':  append_text('\b'); break;
+            case 'f':  append_text('\f'); break;
+            case 'n':  append_text('\n'); break;
+            case 'r':  append_text('\r'); break;
+            case 't':  append_text('\t'); break;
+            case 'u':
+                stream.escape = 2;
+                stream.unicode = 0;
+                break;
+            default:
+                stream_fail(ESP_FAIL, "secuencia de escape inválida");
+                break;
+        }
+        return;
+    }
+
+    if (stream.escape >= 2) {
+        int nibble;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else {
+            stream_fail(ESP_FAIL, "escape \\u inválido");
+            return;
+        }
+        stream.unicode = (stream.unicode << 4) | nibble;
+        if (++stream.escape == 6) {
+            stream.escape = 0;
+            append_utf8(stream.unicode);
+        }
+        return;
+    }
+
+    if (c == '\\') {
+        stream.escape = 1;
+    } else if (c == '"') {
+        if (stream.string_is_key) {
+            if (stream.text_len >= STREAM_KEY_LEN) {
+                stream.key_truncated = true;
+            }
+            strncpy(stream.key, stream.text, STREAM_KEY_LEN - 1);
+            stream.key[STREAM_KEY_LEN - 1] = '\0';
+            stream.state = LEX_COLON;
+        } else {
+            on_scalar(SCALAR_STRING);
+            if (stream.state != LEX_ERROR) {
+                value_done();
+            }
+        }
+    } else {
+        append_text(c);
+    }
+}
+
+static void begin_value(char c) {
+    if (c == ']' && stream.depth > 0 && stream.container_empty &&
+        !stream.stack[stream.depth - 1].is_object) {
+        close_container(c);
+        return;
+    }
+
+    stream.container_empty = false;
+
+    if (c == '{' || c == '[') {
+        open_container(c == '{');
+    } else if (stream.depth == 0) {
+        stream_fail(ESP_FAIL, "la raíz debe ser un objeto");
+    } else if (c == '"') {
+        start_text(LEX_STRING, false);
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+        start_text(LEX_NUMBER, false);
+        append_text(c);
+    } else if (c == 't' || c == 'f' || c == 'n') {
+        start_text(LEX_LITERAL, false);
+        append_text(c);
+    } else {
+        stream_fail(ESP_FAIL, "valor inesperado");
+    }
+}
+
+// Procesa un carácter; devuelve false si debe volver a procesarse en el nuevo estado
+static bool stream_step(char c) {
+    switch (stream.state) {
+        case LEX_ERROR:
+            return true;
+
+        case LEX_STRING:
+            string_char(c);
+            return true;
+
+        case LEX_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+                if (stream.text_len >= STREAM_TEXT_LEN - 1) {
+                    stream_fail(ESP_FAIL, "número demasiado largo");
+                } else {
+                    append_text(c);
+                }
+                return true;
+            }
+            on_scalar(SCALAR_NUMBER);
+            if (stream.state != LEX_ERROR) {
+                value_done();
+            }
+            return false;
+
+        case LEX_LITERAL:
+            if (c >= 'a' && c <= 'z' && stream.text_len < 5) {
+                append_text(c);
+                return true;
+            }
+            finish_literal();
+            return false;
+
+        default:
+            break;
+    }
+
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        return true;
+    }
+
+    switch (stream.state) {
+        case LEX_VALUE:
+            begin_value(c);
+            break;
+
+        case LEX_KEY:
+            if (c == '"') {
+                stream.container_empty = false;
+                start_text(LEX_STRING, true);
+            } else if (c == '}' && stream.container_empty) {
+                close_container(c);
+            } else {
+                stream_fail(ESP_FAIL, "se esperaba una clave");
+            }
+            break;
+
+        case LEX_COLON:
+            if (c == ':') {
+                stream.state = LEX_VALUE;
+            } else {
+                stream_fail(ESP_FAIL, "se esperaba ':'");
+            }
+            break;
+
+        case LEX_AFTER_VALUE:
+            if (c == ',') {
+                stream.state = stream.stack[stream.depth - 1].is_object ? LEX_KEY : LEX_VALUE;
+            } else if (c == '}' || c == ']') {
+                close_container(c);
+            } else {
+                stream_fail(ESP_FAIL, "se esperaba ',' o cierre");
+            }
+            break;
+
+        case LEX_DONE:
+            stream_fail(ESP_FAIL, "datos tras el objeto raíz");
+            break;
+
+        default:
+            break;
+    }
+
+    return true;
+}
+
+void medication_json_stream_begin(void) {
+    memset(&stream, 0, sizeof(stream));
+    stream.state = LEX_VALUE;
+    stream.error = ESP_OK;
+
+    medication_storage_sync_begin();
+}
+
+esp_err_t medication_json_stream_feed(const char *data, size_t len) {
+    if (!data) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (size_t i = 0; i < len && stream.state != LEX_ERROR; ) {
+        if (stream_step(data[i])) {
+            i++;
+        }
+    }
+
+    return stream.error;
+}
+
+esp_err_t medication_json_stream_finish(medication_json_envelope_t *envelope) {
+    if (envelope) {
+        *envelope = stream.envelope;
+    }
+
+    if (stream.state == LEX_ERROR) {
+        return stream.error;
+    }
+
+    if (stream.state != LEX_DONE) {
+        ESP_LOGE(TAG, "Mensaje incompleto (profundidad %d)", stream.depth);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGI(TAG, "Mensaje analizado por flujo: %d medicamentos", stream.medications_parsed);
+    return ESP_OK;
+}
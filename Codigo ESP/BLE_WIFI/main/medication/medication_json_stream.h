@@ -0,0 +1,47 @@
+#ifndef MEDICATION_JSON_STREAM_H
+#define MEDICATION_JSON_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+/**
+ * @brief Campos del sobre del mensaje capturados durante el análisis
+ */
+typedef struct {
+    char type[16];                // "type" del mensaje (p. ej. "command")
+    char cmd[32];                 // "payload.cmd"
+    int64_t timestamp;            // "timestamp" (0 si no viene)
+    bool has_medications;         // Se recibió "payload.medications" completo
+} medication_json_envelope_t;
+
+/**
+ * @brief Inicia el análisis incremental de un mensaje de sincronización.
+ *        Abre una sincronización en el almacenamiento: cada medicamento se
+ *        incorpora en cuanto se cierra su objeto, sin construir un árbol cJSON.
+ *        La memoria usada es fija e independiente del tamaño del mensaje.
+ */
+void medication_json_stream_begin(void);
+
+/**
+ * @brief Procesa un fragmento del mensaje (puede cortar tokens en cualquier punto)
+ *
+ * @param data Fragmento recibido
+ * @param len Longitud del fragmento
+ * @return esp_err_t ESP_OK, o el primer error encontrado (los fragmentos
+ *         siguientes se ignoran)
+ */
+esp_err_t medication_json_stream_feed(const char *data, size_t len);
+
+/**
+ * @brief Termina el análisis y devuelve el sobre del mensaje. La sincronización
+ *        queda abierta: el llamador decide con medication_storage_sync_end()
+ *        si se aplica o se descarta.
+ *
+ * @param envelope Recibe los campos del sobre (puede ser NULL)
+ * @return esp_err_t ESP_OK si el documento llegó completo y bien formado
+ */
+esp_err_t medication_json_stream_finish(medication_json_envelope_t *envelope);
+
+#endif /* MEDICATION_JSON_STREAM_H */
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "medication_latency.h"
+
+// Límite superior (ms) de cada cubo; el último cubo recoge el resto. Cubre
+// desde el movimiento de un servo hasta la confirmación de una toma.
+static const uint32_t bucket_limits_ms[] = {
+    10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 300000, 1800000
+};
+#define LATENCY_BUCKETS ((int)(sizeof(bucket_limits_ms) / sizeof(bucket_limits_ms[0])) + 1)
+
+static const char *const phase_names[MEDICATION_LATENCY_PHASE_COUNT] = {
+    [MEDICATION_LATENCY_DUE_TO_PICKUP]      = "due_to_pickup",
+    [MEDICATION_LATENCY_PICKUP_TO_NOTIFY]   = "pickup_to_notify",
+    [MEDICATION_LATENCY_QUEUE_TO_CONTAINER] = "queue_to_container",
+    [MEDICATION_LATENCY_CONTAINER_TO_OPEN]  = "container_to_open",
+    [MEDICATION_LATENCY_OPEN_TO_RELEASED]   = "open_to_released",
+    [MEDICATION_LATENCY_RELEASED_TO_CLOSED] = "released_to_closed",
+    [MEDICATION_LATENCY_DISPENSED_TO_TAKEN] = "dispensed_to_taken",
+};
+
+typedef struct {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_ms;
+    uint64_t sum_ms;
+} latency_histogram_t;
+
+static latency_histogram_t histograms[MEDICATION_LATENCY_PHASE_COUNT][MEDICATION_LATENCY_COMPARTMENTS];
+static portMUX_TYPE latency_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline int bucket_for(uint32_t ms) {
+    int i = 0;
+    while (i < LATENCY_BUCKETS - 1 && ms > bucket_limits_ms[i]) {
+        i++;
+    }
+    return i;
+}
+
+int64_t medication_latency_now_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+void medication_latency_record(medication_latency_phase_t phase, uint8_t compartment, int64_t elapsed_ms) {
+    if (phase >= MEDICATION_LATENCY_PHASE_COUNT ||
+        compartment < 1 || compartment > MEDICATION_LATENCY_COMPARTMENTS) {
+        return;
+    }
+
+    uint32_t ms = elapsed_ms <= 0 ? 0 : (elapsed_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_ms);
+    int bucket = bucket_for(ms);
+
+    portENTER_CRITICAL(&latency_lock);
+    latency_histogram_t *h = &histograms[phase][compartment - 1];
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum_ms += ms;
+    if (ms > h->max_ms) {
+        h->max_ms = ms;
+    }
+    portEXIT_CRITICAL(&latency_lock);
+}
+
+void medication_latency_reset(void) {
+    portENTER_CRITICAL(&latency_lock);
+    memset(histograms, 0, sizeof(histograms));
+    portEXIT_CRITICAL(&latency_lock);
+}
+
+static void add_histogram(cJSON *obj, const latency_histogram_t *h) {
+    cJSON_AddNumberToObject(obj, "count", h->count);
+    cJSON_AddNumberToObject(obj, "avgMs", h->count ? (double)(h->sum_ms / h->count) : 0);
+    cJSON_AddNumberToObject(obj, "maxMs", h->max_ms);
+
+    cJSON *buckets = cJSON_AddArrayToObject(obj, "buckets");
+    for (int i = 0; buckets && i < LATENCY_BUCKETS; i++) {
+        cJSON_AddItemToArray(buckets, cJSON_CreateNumber(h->buckets[i]));
+    }
+}
+
+void medication_latency_to_json(cJSON *parent, bool reset) {
+    if (!parent) {
+        return;
+    }
+
+    // Copia bajo el cerrojo; el JSON se construye fuera de la sección crítica
+    static latency_histogram_t snapshot[MEDICATION_LATENCY_PHASE_COUNT][MEDICATION_LATENCY_COMPARTMENTS];
+    portENTER_CRITICAL(&latency_lock);
+    memcpy(snapshot, histograms, sizeof(snapshot));
+    if (reset) {
+        memset(histograms, 0, sizeof(histograms));
+    }
+    portEXIT_CRITICAL(&latency_lock);
+
+    cJSON *latency = cJSON_AddObjectToObject(parent, "latency");
+    if (!latency) {
+        return;
+    }
+
+    cJSON *limits = cJSON_AddArrayToObject(latency, "bucketLimitsMs");
+    for (int i = 0; limits && i < LATENCY_BUCKETS - 1; i++) {
+        cJSON_AddItemToArray(limits, cJSON_CreateNumber(bucket_limits_ms[i]));
+    }
+
+    for (int phase = 0; phase < MEDICATION_LATENCY_PHASE_COUNT; phase++) {
+        // Total de la fase: suma de los compartimentos
+        latency_histogram_t total = { 0 };
+        for (int c = 0; c < MEDICATION_LATENCY_COMPARTMENTS; c++) {
+            const latency_histogram_t *h = &snapshot[phase][c];
+            for (int i = 0; i < LATENCY_BUCKETS; i++) {
+                total.buckets[i] += h->buckets[i];
+            }
+            total.count += h->count;
+            total.sum_ms += h->sum_ms;
+            if (h->max_ms > total.max_ms) {
+                total.max_ms = h->max_ms;
+            }
+        }
+        if (total.count == 0) {
+            continue;
+        }
+
+        cJSON *phase_obj = cJSON_AddObjectToObject(latency, phase_names[phase]);
+        if (!phase_obj) {
+            continue;
+        }
+        add_histogram(phase_obj, &total);
+
+        cJSON *by_compartment = cJSON_AddObjectToObject(phase_obj, "byCompartment");
+        for (int c = 0; by_compartment && c < MEDICATION_LATENCY_COMPARTMENTS; c++) {
+            if (snapshot[phase][c].count == 0) {
+                continue;
+            }
+            char key[4];
+            snprintf(key, sizeof(key), "%d", c + 1);
+            cJSON *comp_obj = cJSON_AddObjectToObject(by_compartment, key);
+            if (comp_obj) {
+                add_histogram(comp_obj, &snapshot[phase][c]);
+            }
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef MEDICATION_LATENCY_H
+#define MEDICATION_LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cJSON.h"
+
+// Fases de una dispensación, medidas entre dos marcas consecutivas
+typedef enum {
+    MEDICATION_LATENCY_DUE_TO_PICKUP = 0,   // Hora programada -> la tarea del dispensador la atiende
+    MEDICATION_LATENCY_PICKUP_TO_NOTIFY,    // Atendida -> notificación MQTT publicada
+    MEDICATION_LATENCY_QUEUE_TO_CONTAINER,  // Trabajo encolado -> recipiente detectado
+    MEDICATION_LATENCY_CONTAINER_TO_OPEN,   // Recipiente listo -> servo abierto / bomba en marcha
+    MEDICATION_LATENCY_OPEN_TO_RELEASED,    // Abierto -> última píldora liberada / bombeo terminado
+    MEDICATION_LATENCY_RELEASED_TO_CLOSED,  // Liberada -> servo cerrado / bomba detenida
+    MEDICATION_LATENCY_DISPENSED_TO_TAKEN,  // Dispensada -> confirmación de toma recibida
+    MEDICATION_LATENCY_PHASE_COUNT
+} medication_latency_phase_t;
+
+// Histogramas por compartimento (1-4)
+#define MEDICATION_LATENCY_COMPARTMENTS 4
+
+/**
+ * @brief Registra una muestra. Coste constante (búsqueda del cubo y una
+ *        sección crítica corta): apto para dejarlo activo en producción.
+ *
+ * @param phase Fase medida
+ * @param compartment Compartimento 1-4 (otros valores se ignoran)
+ * @param elapsed_ms Duración de la fase en ms (negativos cuentan como 0)
+ */
+void medication_latency_record(medication_latency_phase_t phase, uint8_t compartment, int64_t elapsed_ms);
+
+/**
+ * @brief Marca de tiempo monotónica en ms para medir fases dentro del equipo
+ */
+int64_t medication_latency_now_ms(void);
+
+/**
+ * @brief Añade a parent un objeto "latency" con los histogramas de todas
+ *        las fases (total y por compartimento)
+ *
+ * @param parent Objeto JSON de la telemetría
+ * @param reset true para poner a cero los histogramas tras exportarlos
+ */
+void medication_latency_to_json(cJSON *parent, bool reset);
+
+/**
+ * @brief Pone a cero todos los histogramas
+ */
+void medication_latency_reset(void);
+
+#endif /* MEDICATION_LATENCY_H */
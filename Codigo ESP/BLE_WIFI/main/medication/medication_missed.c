@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "medication_storage.h"
+#include "medication_hardware.h"
+#include "medication_missed.h"
+#include "../mqtt/mqtt_app.h"
+#include "../nextion_driver.h"
+#include "../ntp_func.h"
+
+static const char *TAG = "MED_MISSED";
+
+// Componente de texto de la pantalla donde se muestran los avisos
+#define MISSED_DISPLAY_COMPONENT "tAlert"  // Ajustar al nombre real del componente
+
+// Política de escalado, relativa a la detección. Cada paso se ejecuta una
+// sola vez por dosis; al agotarse la dosis sigue perdida pero ya no se repite.
+static const medication_missed_step_t escalation_policy[] = {
+    { 0,                  MEDICATION_MISSED_ACTION_BUZZER | MEDICATION_MISSED_ACTION_DISPLAY |
+                          MEDICATION_MISSED_ACTION_NOTIFY },
+    { 15 * 60 * 1000,     MEDICATION_MISSED_ACTION_BUZZER | MEDICATION_MISSED_ACTION_DISPLAY },
+    { 60 * 60 * 1000,     MEDICATION_MISSED_ACTION_CAREGIVER },
+};
+#define ESCALATION_STEPS ((int)(sizeof(escalation_policy) / sizeof(escalation_policy[0])))
+
+// Estado de una fila de la tabla de horarios. La fila se identifica por su
+// medicamento, su horario y la dosis concreta (next_dispense_time): si
+// cualquiera cambia, el estado se descarta.
+typedef struct {
+    int64_t scheduled_time;   // Dosis a la que se refiere el estado
+    int64_t detected_at;      // Primera vez que se vio perdida
+    uint16_t med_index;
+    uint16_t sched_index;
+    uint8_t stage;            // Pasos de escalado ya ejecutados (0 = sin reportar)
+} missed_entry_t;
+
+static missed_entry_t *entries = NULL;
+static int entries_count = 0;
+// Filas con una dosis perdida sin resolver (un bit por fila)
+static uint32_t *active_rows = NULL;
+static int active_count = 0;
+
+// Dosis que el hardware no llegó a dispensar. No tienen fila propia: la de
+// su horario ya apunta a la dosis siguiente.
+typedef struct {
+    missed_entry_t state;     // scheduled_time, detected_at y stage
+    medication_handle_t med_handle;
+    char schedule_id[32];
+    bool used;
+} failed_dose_t;
+
+static failed_dose_t failed_doses[MEDICATION_MISSED_FAILED_SLOTS];
+
+// Acciones acumuladas de una pasada: se ejecutan una sola vez al final
+typedef struct {
+    uint8_t actions;
+    int newly_missed;
+    int caregiver_count;
+    cJSON *notify_doses;
+    cJSON *notify_root;
+    cJSON *caregiver_doses;
+    cJSON *caregiver_root;
+    char first_name[32];  // El aviso de pantalla recorta a 24 caracteres
+} missed_batch_t;
+
+#define BITSET_WORDS(n) (((n) + 31) / 32)
+
+static inline bool row_active(int row) {
+    return active_rows[row / 32] & (1u << (row % 32));
+}
+
+static inline void set_row_active(int row, bool active) {
+    if (active) {
+        active_rows[row / 32] |= (1u << (row % 32));
+    } else {
+        active_rows[row / 32] &= ~(1u << (row % 32));
+    }
+}
+
+// Devuelve el estado de una dosis perdida ("never_dispensed" o
+// "dispensed_not_taken"), o NULL si la dosis no está perdida
+static const char *missed_dose_status(int64_t next_dispense_time, int64_t last_dispensed_time,
+                                      int64_t last_taken_time, int64_t current_time) {
+    if (next_dispense_time <= 0 || next_dispense_time == INT64_MAX) {
+        return NULL;
+    }
+
+    bool should_have_been_dispensed = (next_dispense_time < current_time - MEDICATION_MISSED_THRESHOLD_MS);
+    bool was_dispensed = (last_dispensed_time >= next_dispense_time);
+    bool was_taken = (last_taken_time >= last_dispensed_time);
+
+    // Un medicamento se considera 'never_dispensed' si debió dispensarse pero no se hizo
+    if (should_have_been_dispensed && !was_dispensed) {
+        return "never_dispensed";
+    }
+    // Un medicamento se considera 'dispensed_not_taken' si fue dispensado pero no tomado
+    if (should_have_been_dispensed && was_dispensed && !was_taken) {
+        return "dispensed_not_taken";
+    }
+    return NULL;
+}
+
+static inline bool entry_matches(const missed_entry_t *entry, const medication_schedule_table_t *table, int row) {
+    return entry->med_index == table->med_index[row] &&
+           entry->sched_index == table->sched_index[row] &&
+           entry->scheduled_time == table->next_dispense_time[row];
+}
+
+// Ajusta el estado al número de filas actual. Tras una sincronización las
+// filas pueden moverse: se conserva el estado de las que siguen existiendo.
+static bool sync_entries(const medication_schedule_table_t *table) {
+    if (table->count == entries_count) {
+        return true;
+    }
+
+    missed_entry_t *new_entries = NULL;
+    uint32_t *new_active = NULL;
+    if (table->count > 0) {
+        new_entries = calloc(table->count, sizeof(missed_entry_t));
+        new_active = calloc(BITSET_WORDS(table->count), sizeof(uint32_t));
+        if (!new_entries || !new_active) {
+            ESP_LOGE(TAG, "Sin memoria para el seguimiento de dosis perdidas (%d horarios)", table->count);
+            free(new_entries);
+            free(new_active);
+            return false;
+        }
+    }
+
+    for (int row = 0; row < table->count; row++) {
+        for (int old = 0; old < entries_count; old++) {
+            if (entries[old].stage > 0 && entry_matches(&entries[old], table, row)) {
+                new_entries[row] = entries[old];
+                new_active[row / 32] |= (1u << (row % 32));
+                break;
+            }
+        }
+    }
+
+    free(entries);
+    free(active_rows);
+    entries = new_entries;
+    active_rows = new_active;
+    entries_count = table->count;
+    return true;
+}
+
+// Añade una dosis al arreglo de un mensaje agrupado
+static void add_missed_dose(cJSON *doses, const medication_t *med, const medication_schedule_t *schedule,
+                            const char *status, int64_t scheduled_time, int64_t last_dispensed_time) {
+    cJSON *dose = cJSON_CreateObject();
+    if (!dose) {
+        return;
+    }
+    cJSON_AddStringToObject(dose, "medicationId", med->id);
+    cJSON_AddStringToObject(dose, "name", med->name);
+    cJSON_AddStringToObject(dose, "scheduleId", schedule->id);
+    cJSON_AddStringToObject(dose, "status", status);
+    cJSON_AddNumberToObject(dose, "scheduledTime", scheduled_time);
+
+    // Solo añadir estos datos si es relevante
+    if (strcmp(status, "dispensed_not_taken") == 0) {
+        cJSON_AddNumberToObject(dose, "dispensedTime", last_dispensed_time);
+    }
+    cJSON_AddItemToArray(doses, dose);
+}
+
+static void publish_batch(cJSON *root) {
+    char *json_str = cJSON_PrintUnformatted(root);
+    if (json_str) {
+        mqtt_app_publish(MQTT_TOPIC_DEVICE_TELEMETRY, json_str, 0, 1, false);
+        free(json_str);
+    }
+}
+
+static cJSON *create_batch(const char *type, int64_t now_ms, cJSON **doses) {
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "type", type);
+    cJSON_AddNumberToObject(root, "currentTime", now_ms);
+    *doses = cJSON_AddArrayToObject(root, "doses");
+    if (!*doses) {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+// Ejecuta los pasos de la política que ya vencieron para una dosis
+static void escalate(missed_batch_t *batch, missed_entry_t *entry, const medication_t *med,
+                     const medication_schedule_t *schedule, const char *status,
+                     int64_t last_dispensed_time, int64_t now_ms) {
+    while (entry->stage < ESCALATION_STEPS &&
+           now_ms - entry->detected_at >= escalation_policy[entry->stage].delay_ms) {
+        uint8_t step_actions = escalation_policy[entry->stage].actions;
+        batch->actions |= step_actions;
+
+        if (entry->stage == 0) {
+            char next_time_str[32];
+            format_time(entry->scheduled_time, next_time_str, sizeof(next_time_str));
+            ESP_LOGW(TAG, "¡Medicamento no tomado detectado! %s, horario %s (%s), programado para %s",
+                     med->name, schedule->id, status, next_time_str);
+            batch->newly_missed++;
+            if (!batch->first_name[0]) {
+                snprintf(batch->first_name, sizeof(batch->first_name), "%.24s", med->name);
+            }
+        } else {
+            ESP_LOGW(TAG, "Escalado %d de la dosis perdida de %s (horario %s)",
+                     entry->stage, med->name, schedule->id);
+        }
+
+        if (step_actions & MEDICATION_MISSED_ACTION_NOTIFY) {
+            if (!batch->notify_root) {
+                batch->notify_root = create_batch("medication_missed", now_ms, &batch->notify_doses);
+            }
+            if (batch->notify_root) {
+                add_missed_dose(batch->notify_doses, med, schedule, status, entry->scheduled_time,
+                                last_dispensed_time);
+            }
+        }
+        if (step_actions & MEDICATION_MISSED_ACTION_CAREGIVER) {
+            if (!batch->caregiver_root) {
+                batch->caregiver_root = create_batch("medication_missed_caregiver", now_ms,
+                                                     &batch->caregiver_doses);
+            }
+            if (batch->caregiver_root) {
+                add_missed_dose(batch->caregiver_doses, med, schedule, status, entry->scheduled_time,
+                                last_dispensed_time);
+                batch->caregiver_count++;
+            }
+        }
+        entry->stage++;
+    }
+}
+
+// Una dosis fallida queda resuelta si su horario desapareció, se confirmó la
+// toma o el horario se dispensó después del fallo
+static const medication_schedule_t *failed_dose_schedule(const failed_dose_t *dose, medication_t **med_out) {
+    medication_t *med = medication_storage_get_medication_by_handle(dose->med_handle);
+    medication_schedule_t *schedule = med ? medication_storage_get_schedule(med, dose->schedule_id) : NULL;
+    if (!schedule || schedule->last_taken_time >= dose->state.scheduled_time ||
+        schedule->last_dispensed_time >= dose->state.detected_at) {
+        return NULL;
+    }
+    *med_out = med;
+    return schedule;
+}
+
+esp_err_t medication_missed_init(void) {
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+    return sync_entries(&table) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+void medication_missed_deinit(void) {
+    free(entries);
+    free(active_rows);
+    entries = NULL;
+    active_rows = NULL;
+    entries_count = 0;
+    active_count = 0;
+    memset(failed_doses, 0, sizeof(failed_doses));
+}
+
+void medication_missed_report_failed(medication_handle_t med_handle, const char *schedule_id,
+                                     int64_t scheduled_time, int64_t now_ms) {
+    if (!schedule_id) {
+        return;
+    }
+
+    // Una ranura libre o, si no la hay, la del fallo más antiguo
+    failed_dose_t *dose = &failed_doses[0];
+    for (int i = 0; i < MEDICATION_MISSED_FAILED_SLOTS; i++) {
+        if (!failed_doses[i].used) {
+            dose = &failed_doses[i];
+            break;
+        }
+        if (failed_doses[i].state.detected_at < dose->state.detected_at) {
+            dose = &failed_doses[i];
+        }
+    }
+
+    memset(dose, 0, sizeof(*dose));
+    dose->state.scheduled_time = scheduled_time;
+    dose->state.detected_at = now_ms;
+    dose->med_handle = med_handle;
+    snprintf(dose->schedule_id, sizeof(dose->schedule_id), "%s", schedule_id);
+    dose->used = true;
+}
+
+int medication_missed_check(int64_t now_ms) {
+    // La tabla apunta al almacenamiento: se recorre con el mutex tomado y las
+    // acciones (zumbador, pantalla, MQTT) se ejecutan después de soltarlo
+    medication_storage_lock();
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+
+    if (!sync_entries(&table)) {
+        medication_storage_unlock();
+        return active_count;
+    }
+
+    int count = 0;
+    medication_t *meds = medication_storage_get_all_medications(&count);
+
+    missed_batch_t batch = { 0 };
+    active_count = 0;
+
+    for (int row = 0; row < table.count; row++) {
+        missed_entry_t *entry = &entries[row];
+        int64_t next_dispense_time = table.next_dispense_time[row];
+
+        const char *status = missed_dose_status(next_dispense_time, table.last_dispensed_time[row],
+                                                table.last_taken_time[row], now_ms);
+
+        // Dosis resuelta (tomada, dispensada o reprogramada): olvidar su estado
+        if (!status || (row_active(row) && !entry_matches(entry, &table, row))) {
+            if (row_active(row)) {
+                ESP_LOGI(TAG, "Dosis perdida resuelta (fila %d)", row);
+            }
+            memset(entry, 0, sizeof(*entry));
+            set_row_active(row, false);
+            if (!status) {
+                continue;
+            }
+        }
+
+        if (!row_active(row)) {
+            entry->scheduled_time = next_dispense_time;
+            entry->detected_at = now_ms;
+            entry->med_index = table.med_index[row];
+            entry->sched_index = table.sched_index[row];
+            entry->stage = 0;
+            set_row_active(row, true);
+        }
+        active_count++;
+
+        escalate(&batch, entry, &meds[table.med_index[row]], &table.schedules[row], status,
+                 table.last_dispensed_time[row], now_ms);
+    }
+
+    // Dosis que el hardware no llegó a dispensar
+    for (int i = 0; i < MEDICATION_MISSED_FAILED_SLOTS; i++) {
+        failed_dose_t *dose = &failed_doses[i];
+        if (!dose->used) {
+            continue;
+        }
+
+        medication_t *med = NULL;
+        const medication_schedule_t *schedule = failed_dose_schedule(dose, &med);
+        if (!schedule) {
+            ESP_LOGI(TAG, "Dosis fallida resuelta (horario %s)", dose->schedule_id);
+            dose->used = false;
+            continue;
+        }
+        active_count++;
+
+        escalate(&batch, &dose->state, med, schedule, "dispense_failed",
+                 schedule->last_dispensed_time, now_ms);
+    }
+    medication_storage_unlock();
+
+    if (batch.actions & MEDICATION_MISSED_ACTION_BUZZER) {
+        medication_hardware_alert_missed();
+    }
+
+    if (batch.actions & MEDICATION_MISSED_ACTION_DISPLAY) {
+        // El comando de Nextion admite 64 bytes en total
+        char text[44];
+        if (active_count == 1 && batch.first_name[0]) {
+            snprintf(text, sizeof(text), "Dosis no tomada: %.24s", batch.first_name);
+        } else {
+            snprintf(text, sizeof(text), "%d dosis no tomadas", active_count);
+        }
+        nextion_set_component_value(MISSED_DISPLAY_COMPONENT, text);
+    }
+
+    if (batch.notify_root) {
+        cJSON_AddNumberToObject(batch.notify_root, "pending", active_count);
+        publish_batch(batch.notify_root);
+        cJSON_Delete(batch.notify_root);
+    }
+
+    if (batch.caregiver_root) {
+        ESP_LOGW(TAG, "Avisando al cuidador de %d dosis perdidas", batch.caregiver_count);
+        publish_batch(batch.caregiver_root);
+        cJSON_Delete(batch.caregiver_root);
+    }
+
+    if (batch.newly_missed > 0) {
+        ESP_LOGW(TAG, "%d dosis perdidas nuevas, %d sin resolver", batch.newly_missed, active_count);
+    }
+    return active_count;
+}
+
+int64_t medication_missed_next_check(int64_t now_ms) {
+    medication_storage_lock();
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+    bool tracked = (table.count == entries_count);
+
+    int64_t next_check = INT64_MAX;
+    for (int row = 0; row < table.count; row++) {
+        int64_t next_dispense_time = table.next_dispense_time[row];
+        if (next_dispense_time <= 0 || next_dispense_time == INT64_MAX) {
+            continue;
+        }
+
+        int64_t when;
+        if (tracked && row_active(row) && entry_matches(&entries[row], &table, row)) {
+            // Ya reportada: solo queda el siguiente paso de escalado
+            const missed_entry_t *entry = &entries[row];
+            if (entry->stage >= ESCALATION_STEPS) {
+                continue;
+            }
+            when = entry->detected_at + escalation_policy[entry->stage].delay_ms;
+        } else {
+            when = next_dispense_time + MEDICATION_MISSED_THRESHOLD_MS;
+            if (when <= now_ms) {
+                // Umbral superado: comprobar ya si está perdida y sin reportar
+                if (!missed_dose_status(next_dispense_time, table.last_dispensed_time[row],
+                                        table.last_taken_time[row], now_ms)) {
+                    continue;
+                }
+                when = now_ms;
+            }
+        }
+
+        if (when < next_check) {
+            next_check = when;
+        }
+    }
+
+    // Dosis fallidas: el primer paso vence en cuanto se registran
+    for (int i = 0; i < MEDICATION_MISSED_FAILED_SLOTS; i++) {
+        const missed_entry_t *entry = &failed_doses[i].state;
+        if (!failed_doses[i].used || entry->stage >= ESCALATION_STEPS) {
+            continue;
+        }
+        int64_t when = entry->detected_at + escalation_policy[entry->stage].delay_ms;
+        if (when < next_check) {
+            next_check = when;
+        }
+    }
+    medication_storage_unlock();
+    return next_check;
+}
+
+int medication_missed_active(void) {
+    return active_count;
+}
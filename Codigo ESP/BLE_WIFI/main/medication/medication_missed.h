@@ -0,0 +1,79 @@
+#ifndef MEDICATION_MISSED_H
+#define MEDICATION_MISSED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "medication_storage.h"
+
+// Tiempo tras la hora programada a partir del cual una dosis se considera perdida
+#define MEDICATION_MISSED_THRESHOLD_MS (30 * 60 * 1000LL)
+
+// Dosis fallidas que se siguen a la vez; al llenarse se reemplaza la más antigua
+#define MEDICATION_MISSED_FAILED_SLOTS 8
+
+// Acciones de un paso de escalado
+#define MEDICATION_MISSED_ACTION_BUZZER     (1 << 0)  // Alerta sonora
+#define MEDICATION_MISSED_ACTION_DISPLAY    (1 << 1)  // Aviso en la pantalla Nextion
+#define MEDICATION_MISSED_ACTION_NOTIFY     (1 << 2)  // Mensaje medication_missed
+#define MEDICATION_MISSED_ACTION_CAREGIVER  (1 << 3)  // Mensaje al cuidador
+
+/**
+ * @brief Paso de la política de escalado: qué hacer y cuánto después de
+ *        detectar la dosis perdida
+ */
+typedef struct {
+    uint32_t delay_ms;
+    uint8_t actions;
+} medication_missed_step_t;
+
+/**
+ * @brief Inicializa el seguimiento de dosis perdidas
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_missed_init(void);
+
+/**
+ * @brief Libera el estado del seguimiento
+ */
+void medication_missed_deinit(void);
+
+/**
+ * @brief Evalúa todos los horarios. Cada dosis perdida se reporta una sola vez
+ *        y después avanza por la política de escalado; todas las dosis de una
+ *        misma pasada se agrupan en un único mensaje por tipo.
+ *
+ * @param now_ms Hora actual (ms)
+ * @return Número de dosis perdidas sin resolver
+ */
+int medication_missed_check(int64_t now_ms);
+
+/**
+ * @brief Registra una dosis programada que el hardware no llegó a dispensar.
+ *        Se reporta en la siguiente comprobación, sin esperar al umbral, y
+ *        sigue la misma política de escalado hasta que se confirma la toma o
+ *        el horario vuelve a dispensarse.
+ *
+ * @param med_handle Handle del medicamento
+ * @param schedule_id ID del horario
+ * @param scheduled_time Hora programada de la dosis (ms)
+ * @param now_ms Momento del fallo (ms)
+ */
+void medication_missed_report_failed(medication_handle_t med_handle, const char *schedule_id,
+                                     int64_t scheduled_time, int64_t now_ms);
+
+/**
+ * @brief Próximo momento en que medication_missed_check() tiene algo que
+ *        hacer: una dosis que cruza el umbral o un paso de escalado pendiente
+ *
+ * @param now_ms Hora actual (ms)
+ * @return Timestamp en ms, o INT64_MAX si no hay nada pendiente
+ */
+int64_t medication_missed_next_check(int64_t now_ms);
+
+/**
+ * @brief Número de dosis perdidas sin resolver desde la última comprobación
+ */
+int medication_missed_active(void);
+
+#endif /* MEDICATION_MISSED_H */
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "medication_presence.h"
+#include "medication_ultrasonic.h"
+#include "medication_clock.h"
+
+static const char *TAG = "MED_PRESENCE";
+
+#define PRESENCE_TASK_STACK         3072
+#define PRESENCE_TASK_PRIORITY      4
+#define PRESENCE_STOP_TIMEOUT_MS    500
+#define PRESENCE_REPORT_SAMPLES     16    // Lecturas en telemetría y en el log
+
+// Un bit por estado filtrado; solo uno activo cuando hay estado estable
+#define PRESENCE_BIT_PRESENT  BIT0
+#define PRESENCE_BIT_ABSENT   BIT1
+#define PRESENCE_BIT_ERROR    BIT2
+#define PRESENCE_BIT_STOPPED  BIT3
+#define PRESENCE_STATE_BITS   (PRESENCE_BIT_PRESENT | PRESENCE_BIT_ABSENT | PRESENCE_BIT_ERROR)
+
+static TaskHandle_t presence_task_handle = NULL;
+// Se crea una vez y no se borra: puede haber tareas esperando al parar
+static EventGroupHandle_t presence_events = NULL;
+static volatile bool stop_requested = false;
+
+static uint32_t active_period_ms = MEDICATION_PRESENCE_ACTIVE_PERIOD_MS;
+static uint32_t idle_period_ms = MEDICATION_PRESENCE_IDLE_PERIOD_MS;
+
+// Estado del filtro e historial circular (protegidos por presence_lock)
+static sensor_state_t filtered_state = SENSOR_ERROR;
+static bool state_known = false;
+static sensor_state_t candidate_state = SENSOR_ERROR;
+static uint8_t candidate_count = 0;
+static uint32_t state_changes = 0;
+static int waiters = 0;
+static medication_presence_sample_t history[MEDICATION_PRESENCE_HISTORY];
+static int history_head = 0;
+static int history_count = 0;
+static portMUX_TYPE presence_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static EventBits_t state_bit(sensor_state_t state) {
+    switch (state) {
+        case OBJECT_PRESENT:     return PRESENCE_BIT_PRESENT;
+        case OBJECT_NOT_PRESENT: return PRESENCE_BIT_ABSENT;
+        default:                 return PRESENCE_BIT_ERROR;
+    }
+}
+
+static const char *state_name(sensor_state_t state) {
+    switch (state) {
+        case OBJECT_PRESENT:     return "present";
+        case OBJECT_NOT_PRESENT: return "absent";
+        default:                 return "error";
+    }
+}
+
+// Clasifica una lectura con histéresis y aplica el antirrebote
+static void process_sample(esp_err_t err, float distance_cm) {
+    bool changed = false;
+    sensor_state_t new_state;
+
+    portENTER_CRITICAL(&presence_lock);
+    sensor_state_t raw;
+    if (err != ESP_OK) {
+        raw = SENSOR_ERROR;
+    } else if (distance_cm < MEDICATION_PRESENCE_PRESENT_CM) {
+        raw = OBJECT_PRESENT;
+    } else if (distance_cm > MEDICATION_PRESENCE_ABSENT_CM) {
+        raw = OBJECT_NOT_PRESENT;
+    } else {
+        // Dentro de la banda se mantiene el estado anterior
+        raw = (filtered_state == OBJECT_PRESENT) ? OBJECT_PRESENT : OBJECT_NOT_PRESENT;
+    }
+
+    if (raw == candidate_state) {
+        if (candidate_count < UINT8_MAX) {
+            candidate_count++;
+        }
+    } else {
+        candidate_state = raw;
+        candidate_count = 1;
+    }
+
+    int needed = (raw == SENSOR_ERROR) ? MEDICATION_PRESENCE_ERROR_SAMPLES
+                                       : MEDICATION_PRESENCE_DEBOUNCE_SAMPLES;
+    if ((!state_known || raw != filtered_state) && candidate_count >= needed) {
+        filtered_state = raw;
+        state_known = true;
+        state_changes++;
+        changed = true;
+    }
+    new_state = filtered_state;
+
+    medication_presence_sample_t *sample = &history[history_head];
+    sample->time_ms = medication_clock_now_ms();
+    sample->distance_mm = (err == ESP_OK && distance_cm * 10 < MEDICATION_PRESENCE_NO_READING)
+                          ? (uint16_t)(distance_cm * 10) : MEDICATION_PRESENCE_NO_READING;
+    sample->raw = raw;
+    sample->state = state_known ? filtered_state : SENSOR_ERROR;
+    history_head = (history_head + 1) % MEDICATION_PRESENCE_HISTORY;
+    if (history_count < MEDICATION_PRESENCE_HISTORY) {
+        history_count++;
+    }
+    portEXIT_CRITICAL(&presence_lock);
+
+    if (changed) {
+        xEventGroupClearBits(presence_events, PRESENCE_STATE_BITS);
+        xEventGroupSetBits(presence_events, state_bit(new_state));
+        ESP_LOGI(TAG, "Recipiente: %s", state_name(new_state));
+    }
+}
+
+static void presence_task(void *pvParameters) {
+    while (!stop_requested) {
+        float distance = 0;
+        esp_err_t err = medication_ultrasonic_read(&distance);
+        process_sample(err, distance);
+
+        portENTER_CRITICAL(&presence_lock);
+        uint32_t period_ms = waiters > 0 ? active_period_ms : idle_period_ms;
+        portEXIT_CRITICAL(&presence_lock);
+
+        // Una tarea que empieza a esperar despierta el muestreo
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(period_ms));
+    }
+
+    xEventGroupSetBits(presence_events, PRESENCE_BIT_STOPPED);
+    vTaskDelete(NULL);
+}
+
+esp_err_t medication_presence_start(void) {
+    if (presence_task_handle) {
+        return ESP_OK;
+    }
+
+    if (!presence_events) {
+        presence_events = xEventGroupCreate();
+        if (!presence_events) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xEventGroupClearBits(presence_events, PRESENCE_STATE_BITS | PRESENCE_BIT_STOPPED);
+
+    portENTER_CRITICAL(&presence_lock);
+    filtered_state = SENSOR_ERROR;
+    state_known = false;
+    candidate_state = SENSOR_ERROR;
+    candidate_count = 0;
+    portEXIT_CRITICAL(&presence_lock);
+
+    stop_requested = false;
+    BaseType_t created = xTaskCreate(presence_task, "med_presence", PRESENCE_TASK_STACK,
+                                     NULL, PRESENCE_TASK_PRIORITY, &presence_task_handle);
+    if (created != pdPASS) {
+        ESP_LOGE(TAG, "Error al crear la tarea de presencia");
+        presence_task_handle = NULL;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Servicio de presencia iniciado (%lu/%lu ms)",
+             (unsigned long)active_period_ms, (unsigned long)idle_period_ms);
+    return ESP_OK;
+}
+
+void medication_presence_stop(void) {
+    if (!presence_task_handle) {
+        return;
+    }
+
+    // La tarea termina sola para no dejar el sensor bloqueado a mitad de lectura
+    stop_requested = true;
+    xTaskNotifyGive(presence_task_handle);
+    if (!(xEventGroupWaitBits(presence_events, PRESENCE_BIT_STOPPED, pdTRUE, pdFALSE,
+                              pdMS_TO_TICKS(PRESENCE_STOP_TIMEOUT_MS)) & PRESENCE_BIT_STOPPED)) {
+        ESP_LOGW(TAG, "La tarea de presencia no terminó a tiempo");
+    }
+    presence_task_handle = NULL;
+
+    portENTER_CRITICAL(&presence_lock);
+    state_known = false;
+    filtered_state = SENSOR_ERROR;
+    portEXIT_CRITICAL(&presence_lock);
+    xEventGroupClearBits(presence_events, PRESENCE_STATE_BITS);
+}
+
+bool medication_presence_running(void) {
+    return presence_task_handle != NULL;
+}
+
+void medication_presence_set_period(uint32_t active_ms, uint32_t idle_ms) {
+    portENTER_CRITICAL(&presence_lock);
+    if (active_ms > 0) {
+        active_period_ms = active_ms;
+    }
+    if (idle_ms > 0) {
+        idle_period_ms = idle_ms;
+    }
+    portEXIT_CRITICAL(&presence_lock);
+}
+
+sensor_state_t medication_presence_get(void) {
+    portENTER_CRITICAL(&presence_lock);
+    sensor_state_t state = state_known ? filtered_state : SENSOR_ERROR;
+    portEXIT_CRITICAL(&presence_lock);
+    return state;
+}
+
+sensor_state_t medication_presence_wait(sensor_state_t wanted, uint32_t timeout_ms) {
+    TaskHandle_t task = presence_task_handle;
+    if (!task) {
+        return SENSOR_ERROR;
+    }
+
+    portENTER_CRITICAL(&presence_lock);
+    waiters++;
+    portEXIT_CRITICAL(&presence_lock);
+
+    xTaskNotifyGive(task);
+    xEventGroupWaitBits(presence_events, state_bit(wanted), pdFALSE, pdFALSE, pdMS_TO_TICKS(timeout_ms));
+
+    portENTER_CRITICAL(&presence_lock);
+    waiters--;
+    portEXIT_CRITICAL(&presence_lock);
+
+    return medication_presence_get();
+}
+
+uint32_t medication_presence_changes(void) {
+    portENTER_CRITICAL(&presence_lock);
+    uint32_t changes = state_changes;
+    portEXIT_CRITICAL(&presence_lock);
+    return changes;
+}
+
+int medication_presence_get_history(medication_presence_sample_t *samples, int max_samples) {
+    if (!samples || max_samples <= 0) {
+        return 0;
+    }
+
+    portENTER_CRITICAL(&presence_lock);
+    int count = history_count < max_samples ? history_count : max_samples;
+    int start = (history_head - count + MEDICATION_PRESENCE_HISTORY) % MEDICATION_PRESENCE_HISTORY;
+    for (int i = 0; i < count; i++) {
+        samples[i] = history[(start + i) % MEDICATION_PRESENCE_HISTORY];
+    }
+    portEXIT_CRITICAL(&presence_lock);
+
+    return count;
+}
+
+void medication_presence_log_history(int max_samples) {
+    medication_presence_sample_t samples[PRESENCE_REPORT_SAMPLES];
+    if (max_samples > PRESENCE_REPORT_SAMPLES) {
+        max_samples = PRESENCE_REPORT_SAMPLES;
+    }
+
+    int count = medication_presence_get_history(samples, max_samples);
+    ESP_LOGW(TAG, "Últimas %d lecturas del sensor:", count);
+    for (int i = 0; i < count; i++) {
+        if (samples[i].distance_mm == MEDICATION_PRESENCE_NO_READING) {
+            ESP_LOGW(TAG, "  %lld: sin lectura -> %s", (long long)samples[i].time_ms, state_name(samples[i].state));
+        } else {
+            ESP_LOGW(TAG, "  %lld: %u mm (%s) -> %s", (long long)samples[i].time_ms, samples[i].distance_mm,
+                     state_name(samples[i].raw), state_name(samples[i].state));
+        }
+    }
+}
+
+void medication_presence_to_json(cJSON *parent) {
+    cJSON *presence = parent ? cJSON_AddObjectToObject(parent, "presence") : NULL;
+    if (!presence) {
+        return;
+    }
+
+    cJSON_AddStringToObject(presence, "state", medication_presence_running()
+                            ? state_name(medication_presence_get()) : "stopped");
+    cJSON_AddNumberToObject(presence, "changes", medication_presence_changes());
+
+    medication_presence_sample_t samples[PRESENCE_REPORT_SAMPLES];
+    int count = medication_presence_get_history(samples, PRESENCE_REPORT_SAMPLES);
+
+    cJSON *items = cJSON_AddArrayToObject(presence, "history");
+    for (int i = 0; items && i < count; i++) {
+        cJSON *item = cJSON_CreateObject();
+        if (!item) {
+            break;
+        }
+        cJSON_AddNumberToObject(item, "time", samples[i].time_ms);
+        if (samples[i].distance_mm == MEDICATION_PRESENCE_NO_READING) {
+            cJSON_AddNullToObject(item, "distanceMm");
+        } else {
+            cJSON_AddNumberToObject(item, "distanceMm", samples[i].distance_mm);
+        }
+        cJSON_AddStringToObject(item, "state", state_name(samples[i].state));
+        cJSON_AddItemToArray(items, item);
+    }
+}
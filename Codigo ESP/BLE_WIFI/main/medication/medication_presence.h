@@ -0,0 +1,95 @@
+#ifndef MEDICATION_PRESENCE_H
+#define MEDICATION_PRESENCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+#include "medication_hardware.h"
+
+// Periodo de muestreo mientras alguien espera un cambio y en reposo (ms)
+#define MEDICATION_PRESENCE_ACTIVE_PERIOD_MS   100
+#define MEDICATION_PRESENCE_IDLE_PERIOD_MS     1000
+// Umbrales con histéresis: presente por debajo de PRESENT_CM, ausente por
+// encima de ABSENT_CM; entre ambos se mantiene el estado
+#define MEDICATION_PRESENCE_PRESENT_CM         5.0f
+#define MEDICATION_PRESENCE_ABSENT_CM          7.0f
+// Lecturas consecutivas necesarias para cambiar de estado
+#define MEDICATION_PRESENCE_DEBOUNCE_SAMPLES   3
+#define MEDICATION_PRESENCE_ERROR_SAMPLES      10
+// Lecturas que se guardan para diagnóstico
+#define MEDICATION_PRESENCE_HISTORY            64
+
+#define MEDICATION_PRESENCE_NO_READING         0xFFFF
+
+/**
+ * @brief Lectura del historial del sensor de presencia
+ */
+typedef struct {
+    int64_t time_ms;              // Hora de la lectura
+    uint16_t distance_mm;         // MEDICATION_PRESENCE_NO_READING si falló
+    int8_t raw;                   // sensor_state_t de esta lectura (con histéresis)
+    int8_t state;                 // sensor_state_t filtrado tras la lectura
+} medication_presence_sample_t;
+
+/**
+ * @brief Arranca la tarea que muestrea el sensor ultrasónico en segundo plano
+ * @return ESP_OK si se inició correctamente
+ */
+esp_err_t medication_presence_start(void);
+
+/**
+ * @brief Detiene la tarea de muestreo (espera a que suelte el sensor)
+ */
+void medication_presence_stop(void);
+
+/**
+ * @brief Indica si el servicio está muestreando
+ */
+bool medication_presence_running(void);
+
+/**
+ * @brief Cambia los periodos de muestreo
+ * @param active_ms Periodo mientras hay tareas esperando un estado
+ * @param idle_ms Periodo en reposo
+ */
+void medication_presence_set_period(uint32_t active_ms, uint32_t idle_ms);
+
+/**
+ * @brief Estado filtrado actual, sin acceder al sensor
+ * @return SENSOR_ERROR mientras no haya un estado estable
+ */
+sensor_state_t medication_presence_get(void);
+
+/**
+ * @brief Espera a que el estado filtrado sea el indicado. Mientras espera,
+ *        el sensor se muestrea al periodo activo y vuelve en cuanto cambia.
+ * @param wanted Estado esperado
+ * @param timeout_ms Tiempo máximo de espera
+ * @return Estado filtrado al volver (wanted si se alcanzó)
+ */
+sensor_state_t medication_presence_wait(sensor_state_t wanted, uint32_t timeout_ms);
+
+/**
+ * @brief Número de cambios de estado filtrado desde el arranque
+ */
+uint32_t medication_presence_changes(void);
+
+/**
+ * @brief Copia las últimas lecturas, de la más antigua a la más reciente
+ * @return Número de lecturas copiadas
+ */
+int medication_presence_get_history(medication_presence_sample_t *samples, int max_samples);
+
+/**
+ * @brief Registra en el log las últimas lecturas (diagnóstico de esperas de
+ *        recipiente); como mucho 16
+ */
+void medication_presence_log_history(int max_samples);
+
+/**
+ * @brief Añade a parent un objeto "presence" con el estado y las últimas lecturas
+ */
+void medication_presence_to_json(cJSON *parent);
+
+#endif /* MEDICATION_PRESENCE_H */
@@ -0,0 +1,287 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "medication_pump.h"
+
+static const char *TAG = "MED_PUMP";
+
+static const char *NVS_PUMP_NAMESPACE = "pump";
+static const char *NVS_PUMP_CAL_KEY = "cal";
+
+#define PUMP_CAL_RECORD_VERSION 1
+
+// Duty cycles de la tabla y caudal de fábrica de cada uno (bomba peristáltica
+// de 12 V; por debajo del primer punto puede no arrancar con carga)
+static const uint8_t cal_duties[MEDICATION_PUMP_CAL_POINTS] = { 30, 45, 60, 80 };
+static const uint16_t factory_ul_per_s[MEDICATION_PUMP_CAL_POINTS] = { 350, 700, 1050, 1500 };
+
+// Registro en NVS: los duty cycles los fija el firmware, solo se guarda el caudal
+typedef struct __attribute__((packed)) {
+    uint8_t  version;
+    uint8_t  calibrated_mask;     // Bit i: punto i medido en este equipo
+    uint16_t ul_per_s[MEDICATION_PUMP_CAL_POINTS];
+} pump_cal_record_t;
+
+_Static_assert(sizeof(pump_cal_record_t) == 10, "Cambiar el layout requiere subir PUMP_CAL_RECORD_VERSION");
+
+static medication_pump_point_t table[MEDICATION_PUMP_CAL_POINTS];
+static nvs_handle_t pump_handle = 0;
+static portMUX_TYPE pump_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void load_factory_table(void) {
+    portENTER_CRITICAL(&pump_lock);
+    for (int i = 0; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        table[i] = (medication_pump_point_t){
+            .duty = cal_duties[i],
+            .ul_per_s = factory_ul_per_s[i],
+            .calibrated = false,
+        };
+    }
+    portEXIT_CRITICAL(&pump_lock);
+}
+
+static int cal_index(uint8_t duty) {
+    for (int i = 0; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        if (cal_duties[i] == duty) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t pump_nvs_open(void) {
+    if (pump_handle) {
+        return ESP_OK;
+    }
+    return nvs_open(NVS_PUMP_NAMESPACE, NVS_READWRITE, &pump_handle);
+}
+
+esp_err_t medication_pump_init(void) {
+    load_factory_table();
+
+    esp_err_t err = pump_nvs_open();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "NVS no disponible (%s): caudal de fábrica", esp_err_to_name(err));
+        return ESP_OK;
+    }
+
+    pump_cal_record_t rec;
+    size_t length = sizeof(rec);
+    err = nvs_get_blob(pump_handle, NVS_PUMP_CAL_KEY, &rec, &length);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "Bomba sin calibrar: caudal de fábrica");
+        return ESP_OK;
+    }
+    if (err != ESP_OK || length != sizeof(rec) || rec.version != PUMP_CAL_RECORD_VERSION) {
+        ESP_LOGW(TAG, "Calibración de la bomba ilegible, se descarta");
+        nvs_erase_key(pump_handle, NVS_PUMP_CAL_KEY);
+        nvs_commit(pump_handle);
+        return ESP_OK;
+    }
+
+    portENTER_CRITICAL(&pump_lock);
+    for (int i = 0; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        if ((rec.calibrated_mask & (1u << i)) && rec.ul_per_s[i] > 0) {
+            table[i].ul_per_s = rec.ul_per_s[i];
+            table[i].calibrated = true;
+        }
+    }
+    portEXIT_CRITICAL(&pump_lock);
+
+    ESP_LOGI(TAG, "Calibración de la bomba cargada (puntos medidos: 0x%x)", rec.calibrated_mask);
+    return ESP_OK;
+}
+
+// Interpolación lineal entre los puntos vecinos; se llama con pump_lock tomado
+static uint32_t flow_locked(uint8_t duty) {
+    if (duty < table[0].duty) {
+        return 0;
+    }
+    for (int i = 1; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        if (duty <= table[i].duty) {
+            const medication_pump_point_t *lo = &table[i - 1];
+            const medication_pump_point_t *hi = &table[i];
+            int32_t span = (int32_t)hi->ul_per_s - lo->ul_per_s;
+            return lo->ul_per_s + span * (duty - lo->duty) / (hi->duty - lo->duty);
+        }
+    }
+    return table[MEDICATION_PUMP_CAL_POINTS - 1].ul_per_s;
+}
+
+uint32_t medication_pump_flow(uint8_t duty) {
+    portENTER_CRITICAL(&pump_lock);
+    uint32_t flow = flow_locked(duty);
+    portEXIT_CRITICAL(&pump_lock);
+    return flow;
+}
+
+static uint8_t ramp_duty(uint8_t base, uint8_t peak, uint8_t steps, uint8_t step) {
+    return (uint8_t)(base + (uint32_t)(peak - base) * step / steps);
+}
+
+uint8_t medication_pump_ramp_duty(const medication_pump_plan_t *plan, uint8_t step) {
+    if (!plan || step >= plan->ramp_steps) {
+        return plan ? plan->peak_duty : 0;
+    }
+    return ramp_duty(cal_duties[0], plan->peak_duty, plan->ramp_steps, step);
+}
+
+esp_err_t medication_pump_plan(uint32_t volume_ul, uint8_t max_duty, medication_pump_plan_t *plan) {
+    if (!plan || volume_ul == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const uint8_t base = cal_duties[0];
+    uint64_t volume_nl = (uint64_t)volume_ul * 1000;
+
+    medication_pump_plan_t p = { 0 };
+    uint64_t ramp_nl = 0;
+    uint32_t peak_flow = 0;
+
+    portENTER_CRITICAL(&pump_lock);
+    // Del duty más alto hacia abajo: el primero cuyas rampas no se pasen del
+    // volumen da el perfil más corto. Las dosis muy pequeñas acaban a duty
+    // base sin rampa.
+    for (int peak = max_duty; ; peak -= MEDICATION_PUMP_RAMP_DUTY_STEP) {
+        if (peak <= base) {
+            p.peak_duty = base;
+            p.ramp_steps = 0;
+            ramp_nl = 0;
+            break;
+        }
+
+        p.peak_duty = (uint8_t)peak;
+        p.ramp_steps = (uint8_t)((peak - base + MEDICATION_PUMP_RAMP_DUTY_STEP - 1) / MEDICATION_PUMP_RAMP_DUTY_STEP);
+        // Subida y bajada recorren los mismos escalones: µl/s * ms = nl
+        ramp_nl = 0;
+        for (uint8_t i = 0; i < p.ramp_steps; i++) {
+            ramp_nl += 2ULL * flow_locked(ramp_duty(base, p.peak_duty, p.ramp_steps, i)) *
+                       MEDICATION_PUMP_RAMP_STEP_MS;
+        }
+        if (ramp_nl <= volume_nl) {
+            break;
+        }
+    }
+    peak_flow = flow_locked(p.peak_duty);
+    portEXIT_CRITICAL(&pump_lock);
+
+    if (max_duty < base || peak_flow == 0) {
+        ESP_LOGE(TAG, "La tabla de calibración no da caudal a %d%%", max_duty);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint64_t hold_ms = (volume_nl - ramp_nl + peak_flow / 2) / peak_flow;
+    uint64_t total_ms = hold_ms + 2ULL * p.ramp_steps * MEDICATION_PUMP_RAMP_STEP_MS;
+    if (total_ms > MEDICATION_PUMP_MAX_RUN_MS) {
+        ESP_LOGE(TAG, "Dosis de %lu µl: %llu ms de bomba superan el máximo de %d ms",
+                 (unsigned long)volume_ul, (unsigned long long)total_ms, MEDICATION_PUMP_MAX_RUN_MS);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    p.hold_ms = (uint32_t)hold_ms;
+    p.total_ms = (uint32_t)total_ms;
+    p.volume_ul = (uint32_t)((ramp_nl + (uint64_t)peak_flow * p.hold_ms) / 1000);
+    *plan = p;
+    return ESP_OK;
+}
+
+bool medication_pump_is_cal_duty(uint8_t duty) {
+    return cal_index(duty) >= 0;
+}
+
+static esp_err_t save_table(void) {
+    pump_cal_record_t rec = { .version = PUMP_CAL_RECORD_VERSION };
+
+    portENTER_CRITICAL(&pump_lock);
+    for (int i = 0; i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        rec.ul_per_s[i] = table[i].ul_per_s;
+        if (table[i].calibrated) {
+            rec.calibrated_mask |= 1u << i;
+        }
+    }
+    portEXIT_CRITICAL(&pump_lock);
+
+    esp_err_t err = pump_nvs_open();
+    if (err == ESP_OK) {
+        err = nvs_set_blob(pump_handle, NVS_PUMP_CAL_KEY, &rec, sizeof(rec));
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(pump_handle);
+    }
+    return err;
+}
+
+esp_err_t medication_pump_calibrate_point(uint8_t duty, uint32_t run_ms, uint32_t measured_ul) {
+    int index = cal_index(duty);
+    if (index < 0 || run_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint64_t ul_per_s = ((uint64_t)measured_ul * 1000 + run_ms / 2) / run_ms;
+    if (ul_per_s == 0 || ul_per_s > UINT16_MAX) {
+        ESP_LOGW(TAG, "Caudal fuera de rango a %d%%: %llu µl/s", duty, (unsigned long long)ul_per_s);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&pump_lock);
+    table[index].ul_per_s = (uint16_t)ul_per_s;
+    table[index].calibrated = true;
+    portEXIT_CRITICAL(&pump_lock);
+
+    ESP_LOGI(TAG, "Bomba a %d%%: %llu µl/s (%lu µl en %lu ms)", duty, (unsigned long long)ul_per_s,
+             (unsigned long)measured_ul, (unsigned long)run_ms);
+
+    esp_err_t err = save_table();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error guardando la calibración: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t medication_pump_reset_calibration(void) {
+    load_factory_table();
+
+    esp_err_t err = pump_nvs_open();
+    if (err == ESP_OK) {
+        err = nvs_erase_key(pump_handle, NVS_PUMP_CAL_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(pump_handle);
+    }
+    return err;
+}
+
+void medication_pump_get_table(medication_pump_point_t *points) {
+    if (!points) {
+        return;
+    }
+    portENTER_CRITICAL(&pump_lock);
+    memcpy(points, table, sizeof(table));
+    portEXIT_CRITICAL(&pump_lock);
+}
+
+void medication_pump_to_json(cJSON *parent) {
+    if (!parent) {
+        return;
+    }
+
+    medication_pump_point_t points[MEDICATION_PUMP_CAL_POINTS];
+    medication_pump_get_table(points);
+
+    cJSON *pump = cJSON_AddObjectToObject(parent, "pump");
+    cJSON *items = pump ? cJSON_AddArrayToObject(pump, "calibration") : NULL;
+    for (int i = 0; items && i < MEDICATION_PUMP_CAL_POINTS; i++) {
+        cJSON *item = cJSON_CreateObject();
+        if (!item) {
+            break;
+        }
+        cJSON_AddNumberToObject(item, "duty", points[i].duty);
+        cJSON_AddNumberToObject(item, "ulPerS", points[i].ul_per_s);
+        cJSON_AddBoolToObject(item, "calibrated", points[i].calibrated);
+        cJSON_AddItemToArray(items, item);
+    }
+}
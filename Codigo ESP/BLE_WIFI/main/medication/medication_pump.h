@@ -0,0 +1,107 @@
+#ifndef MEDICATION_PUMP_H
+#define MEDICATION_PUMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+// Modelo de caudal de la bomba de líquidos: una tabla de calibración con el
+// caudal medido a varios duty cycles, guardada en NVS. Una dosis en µl se
+// convierte en una rampa de subida, un tramo a duty constante y una rampa de
+// bajada cuyo volumen total coincide con el pedido.
+
+#define MEDICATION_PUMP_CAL_POINTS      4       // Duty cycles calibrados
+#define MEDICATION_PUMP_CAL_RUN_MS      10000   // Duración de cada pasada de calibración
+#define MEDICATION_PUMP_RAMP_STEP_MS    25      // Duración de cada escalón de la rampa
+#define MEDICATION_PUMP_RAMP_DUTY_STEP  10      // Subida máxima de duty por escalón (%)
+#define MEDICATION_PUMP_MAX_RUN_MS      30000   // Una dosis nunca tiene la bomba más tiempo en marcha
+#define MEDICATION_PUMP_MIN_DOSE_UL     500     // Límites de una dosis de líquido
+#define MEDICATION_PUMP_MAX_DOSE_UL     30000
+
+/**
+ * @brief Un punto de la tabla de calibración
+ */
+typedef struct {
+    uint8_t duty;                 // Duty cycle (%)
+    uint16_t ul_per_s;            // Caudal a ese duty (µl/s)
+    bool calibrated;              // Medido en este equipo (si no, valor de fábrica)
+} medication_pump_point_t;
+
+/**
+ * @brief Perfil de bombeo de una dosis
+ *
+ * La rampa de subida recorre ramp_steps escalones de MEDICATION_PUMP_RAMP_STEP_MS
+ * desde el primer punto de la tabla hasta peak_duty; la de bajada, los mismos
+ * escalones en orden inverso.
+ */
+typedef struct {
+    uint8_t peak_duty;            // Duty del tramo constante
+    uint8_t ramp_steps;           // Escalones de cada rampa (0 = arranque directo)
+    uint32_t hold_ms;             // Duración del tramo constante
+    uint32_t total_ms;            // Tiempo total con la bomba en marcha
+    uint32_t volume_ul;           // Volumen previsto según la calibración
+} medication_pump_plan_t;
+
+/**
+ * @brief Carga la calibración de NVS; sin calibración guardada usa los
+ *        valores de fábrica
+ * @return ESP_OK (con valores de fábrica si NVS no está disponible)
+ */
+esp_err_t medication_pump_init(void);
+
+/**
+ * @brief Caudal a un duty cycle, interpolado entre los puntos de la tabla
+ * @return µl/s; 0 por debajo del primer punto (la bomba puede no arrancar)
+ */
+uint32_t medication_pump_flow(uint8_t duty);
+
+/**
+ * @brief Calcula el perfil más corto que entrega volume_ul sin pasar de max_duty
+ *
+ * @param volume_ul Volumen de la dosis
+ * @param max_duty Duty cycle máximo permitido
+ * @param plan Perfil calculado
+ * @return ESP_OK, ESP_ERR_INVALID_ARG si el volumen es 0, ESP_ERR_INVALID_STATE
+ *         si la tabla no da caudal a max_duty, ESP_ERR_INVALID_SIZE si la
+ *         dosis necesita más de MEDICATION_PUMP_MAX_RUN_MS
+ */
+esp_err_t medication_pump_plan(uint32_t volume_ul, uint8_t max_duty, medication_pump_plan_t *plan);
+
+/**
+ * @brief Duty cycle del escalón step de la rampa de subida (0..ramp_steps-1)
+ */
+uint8_t medication_pump_ramp_duty(const medication_pump_plan_t *plan, uint8_t step);
+
+/**
+ * @brief Indica si duty es uno de los puntos de la tabla
+ */
+bool medication_pump_is_cal_duty(uint8_t duty);
+
+/**
+ * @brief Guarda el volumen medido tras una pasada de calibración
+ *
+ * @param duty Punto de la tabla calibrado
+ * @param run_ms Duración de la pasada
+ * @param measured_ul Volumen recogido
+ * @return ESP_OK, ESP_ERR_INVALID_ARG si duty no es un punto de la tabla o
+ *         el caudal resultante no cabe, o el error de NVS
+ */
+esp_err_t medication_pump_calibrate_point(uint8_t duty, uint32_t run_ms, uint32_t measured_ul);
+
+/**
+ * @brief Vuelve a los valores de fábrica y borra la calibración de NVS
+ */
+esp_err_t medication_pump_reset_calibration(void);
+
+/**
+ * @brief Copia la tabla de calibración (MEDICATION_PUMP_CAL_POINTS puntos)
+ */
+void medication_pump_get_table(medication_pump_point_t *points);
+
+/**
+ * @brief Añade a parent un objeto "pump" con la tabla de calibración
+ */
+void medication_pump_to_json(cJSON *parent);
+
+#endif /* MEDICATION_PUMP_H */
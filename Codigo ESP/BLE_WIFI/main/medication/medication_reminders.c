@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "medication_storage.h"
+#include "medication_reminders.h"
+#include "medication_clock.h"
+
+static const char *TAG = "MED_REMINDERS";
+
+// Entrada de la cola: hora del recordatorio de un horario
+typedef struct {
+    int64_t remind_at;
+    uint16_t med_index;
+    uint16_t sched_index;
+} reminder_entry_t;
+
+// Cola ordenada por remind_at; la capacidad cubre todos los horarios, así que
+// solo se reserva memoria al reconstruirla
+static reminder_entry_t *queue = NULL;
+static int queue_count = 0;
+static int queue_capacity = 0;
+static portMUX_TYPE queue_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t reminder_timer = NULL;
+static medication_reminders_due_cb_t due_callback = NULL;
+
+static void arm_reminder_timer(void);
+
+// Hora del recordatorio de una dosis, o 0 si no hay que programarlo
+static inline int64_t reminder_time_for(int64_t next_dispense_time, int64_t now) {
+    if (next_dispense_time <= 0 || next_dispense_time == INT64_MAX) {
+        return 0;
+    }
+    int64_t remind_at = next_dispense_time - MEDICATION_REMINDER_ADVANCE_MS;
+    // Si la hora del recordatorio ya pasó se omite, como antes
+    return remind_at > now ? remind_at : 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const reminder_entry_t *ea = a;
+    const reminder_entry_t *eb = b;
+    return (ea->remind_at > eb->remind_at) - (ea->remind_at < eb->remind_at);
+}
+
+static int queue_find(int med_index, int sched_index) {
+    for (int i = 0; i < queue_count; i++) {
+        if (queue[i].med_index == med_index && queue[i].sched_index == sched_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void queue_remove_at(int i) {
+    queue_count--;
+    memmove(&queue[i], &queue[i + 1], (queue_count - i) * sizeof(reminder_entry_t));
+}
+
+static void queue_insert(const reminder_entry_t *entry) {
+    int pos = queue_count;
+    while (pos > 0 && queue[pos - 1].remind_at > entry->remind_at) {
+        pos--;
+    }
+    memmove(&queue[pos + 1], &queue[pos], (queue_count - pos) * sizeof(reminder_entry_t));
+    queue[pos] = *entry;
+    queue_count++;
+}
+
+// Callback del temporizador: avisa si el primer recordatorio ya venció y si
+// no, rearma
+static void reminder_timer_callback(void *arg) {
+    bool due = false;
+    int64_t now = medication_clock_now_ms();
+
+    portENTER_CRITICAL(&queue_lock);
+    due = queue_count > 0 && queue[0].remind_at <= now;
+    portEXIT_CRITICAL(&queue_lock);
+
+    if (due) {
+        if (due_callback) {
+            due_callback();
+        }
+        // medication_reminders_pop_due() rearmará el temporizador
+        return;
+    }
+
+    arm_reminder_timer();
+}
+
+// Arma el único temporizador one-shot para el primer recordatorio de la cola
+static void arm_reminder_timer(void) {
+    if (!reminder_timer) {
+        return;
+    }
+
+    int64_t remind_at = 0;
+    bool pending = false;
+
+    portENTER_CRITICAL(&queue_lock);
+    if (queue_count > 0) {
+        remind_at = queue[0].remind_at;
+        pending = true;
+    }
+    portEXIT_CRITICAL(&queue_lock);
+
+    esp_timer_stop(reminder_timer);
+    if (!pending) {
+        ESP_LOGD(TAG, "No hay recordatorios pendientes");
+        return;
+    }
+
+    int64_t delay_ms = remind_at - medication_clock_now_ms();
+    if (delay_ms < 0) {
+        delay_ms = 0;
+    }
+
+    esp_err_t err = esp_timer_start_once(reminder_timer, (uint64_t)delay_ms * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error armando temporizador de recordatorios: %s", esp_err_to_name(err));
+    }
+}
+
+esp_err_t medication_reminders_init(medication_reminders_due_cb_t due_cb) {
+    if (reminder_timer) {
+        due_callback = due_cb;
+        arm_reminder_timer();
+        return ESP_OK;
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = reminder_timer_callback,
+        .name = "med_reminder"
+    };
+
+    esp_err_t err = esp_timer_create(&timer_args, &reminder_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error creando temporizador de recordatorios: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    due_callback = due_cb;
+    medication_reminders_rebuild();
+
+    ESP_LOGI(TAG, "Recordatorios inicializados con %d pendientes", queue_count);
+    return ESP_OK;
+}
+
+void medication_reminders_deinit(void) {
+    if (reminder_timer) {
+        esp_timer_stop(reminder_timer);
+        esp_timer_delete(reminder_timer);
+        reminder_timer = NULL;
+    }
+    due_callback = NULL;
+
+    portENTER_CRITICAL(&queue_lock);
+    reminder_entry_t *old_queue = queue;
+    queue = NULL;
+    queue_count = 0;
+    queue_capacity = 0;
+    portEXIT_CRITICAL(&queue_lock);
+
+    free(old_queue);
+}
+
+void medication_reminders_rebuild(void) {
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+
+    reminder_entry_t *new_queue = NULL;
+    if (table.count > 0) {
+        new_queue = malloc(table.count * sizeof(reminder_entry_t));
+        if (!new_queue) {
+            ESP_LOGE(TAG, "Sin memoria para la cola de recordatorios (%d horarios)", table.count);
+            return;
+        }
+    }
+
+    int64_t now = medication_clock_now_ms();
+    int new_count = 0;
+    for (int row = 0; row < table.count; row++) {
+        int64_t remind_at = reminder_time_for(table.next_dispense_time[row], now);
+        if (!remind_at) {
+            continue;
+        }
+        new_queue[new_count].remind_at = remind_at;
+        new_queue[new_count].med_index = table.med_index[row];
+        new_queue[new_count].sched_index = table.sched_index[row];
+        new_count++;
+    }
+    if (new_count > 1) {
+        qsort(new_queue, new_count, sizeof(reminder_entry_t), compare_entries);
+    }
+
+    portENTER_CRITICAL(&queue_lock);
+    reminder_entry_t *old_queue = queue;
+    queue = new_queue;
+    queue_count = new_count;
+    queue_capacity = table.count;
+    portEXIT_CRITICAL(&queue_lock);
+
+    free(old_queue);
+    ESP_LOGD(TAG, "Cola de recordatorios reconstruida: %d pendientes", new_count);
+    arm_reminder_timer();
+}
+
+void medication_reminders_update(int med_index, int sched_index, int64_t next_dispense_time) {
+    reminder_entry_t entry = {
+        .remind_at = reminder_time_for(next_dispense_time, medication_clock_now_ms()),
+        .med_index = med_index,
+        .sched_index = sched_index,
+    };
+    bool needs_rebuild = false;
+
+    portENTER_CRITICAL(&queue_lock);
+    int pos = queue_find(med_index, sched_index);
+    if (pos >= 0) {
+        queue_remove_at(pos);
+    }
+    if (entry.remind_at) {
+        if (queue_count < queue_capacity) {
+            queue_insert(&entry);
+        } else {
+            needs_rebuild = true;
+        }
+    }
+    portEXIT_CRITICAL(&queue_lock);
+
+    if (needs_rebuild) {
+        // El horario no estaba contemplado en la última reconstrucción
+        medication_reminders_rebuild();
+        return;
+    }
+
+    arm_reminder_timer();
+}
+
+bool medication_reminders_pop_due(int64_t now_ms, int *med_index, int *sched_index) {
+    bool popped = false;
+
+    portENTER_CRITICAL(&queue_lock);
+    if (queue_count > 0 && queue[0].remind_at <= now_ms) {
+        if (med_index) *med_index = queue[0].med_index;
+        if (sched_index) *sched_index = queue[0].sched_index;
+        queue_remove_at(0);
+        popped = true;
+    }
+    portEXIT_CRITICAL(&queue_lock);
+
+    if (popped) {
+        arm_reminder_timer();
+    }
+    return popped;
+}
+
+int medication_reminders_pending(void) {
+    portENTER_CRITICAL(&queue_lock);
+    int pending = queue_count;
+    portEXIT_CRITICAL(&queue_lock);
+    return pending;
+}
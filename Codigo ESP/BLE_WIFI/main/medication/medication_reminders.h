@@ -0,0 +1,61 @@
+#ifndef MEDICATION_REMINDERS_H
+#define MEDICATION_REMINDERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Anticipación del recordatorio respecto a la dosis (ms)
+#define MEDICATION_REMINDER_ADVANCE_MS (5 * 60 * 1000)
+
+/**
+ * @brief Callback invocado (desde el temporizador) cuando el primer
+ *        recordatorio de la cola ya venció. Solo debe avisar a la tarea que
+ *        los atiende con medication_reminders_pop_due().
+ */
+typedef void (*medication_reminders_due_cb_t)(void);
+
+/**
+ * @brief Inicializa los recordatorios (cola ordenada por hora con un único
+ *        temporizador one-shot armado para el primero)
+ * @param due_cb Función a invocar cuando vence el primer recordatorio
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_reminders_init(medication_reminders_due_cb_t due_cb);
+
+/**
+ * @brief Detiene el temporizador y libera la cola
+ */
+void medication_reminders_deinit(void);
+
+/**
+ * @brief Reconstruye la cola a partir de la tabla de horarios.
+ *        Debe llamarse cuando cambia el arreglo de medicamentos o de horarios.
+ */
+void medication_reminders_rebuild(void);
+
+/**
+ * @brief Reprograma el recordatorio de un horario tras cambiar su próxima dosis
+ * @param med_index Índice del medicamento en el almacenamiento
+ * @param sched_index Índice del horario dentro del medicamento
+ * @param next_dispense_time Próxima dosis en ms (<= 0 o INT64_MAX lo quita de la cola)
+ */
+void medication_reminders_update(int med_index, int sched_index, int64_t next_dispense_time);
+
+/**
+ * @brief Retira de la cola el primer recordatorio si ya venció y rearma el
+ *        temporizador para el siguiente
+ *
+ * @param now_ms Hora actual (ms)
+ * @param med_index Índice del medicamento
+ * @param sched_index Índice del horario
+ * @return true si se retiró un recordatorio
+ */
+bool medication_reminders_pop_due(int64_t now_ms, int *med_index, int *sched_index);
+
+/**
+ * @brief Número de recordatorios pendientes en la cola
+ */
+int medication_reminders_pending(void);
+
+#endif /* MEDICATION_REMINDERS_H */
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "medication_storage.h"
+#include "medication_scheduler.h"
+#include "medication_clock.h"
+
+static const char *TAG = "MED_SCHEDULER";
+
+// Entrada de la cola: vencimiento de un horario identificado por sus índices
+typedef struct {
+    int64_t deadline;
+    uint16_t med_index;
+    uint16_t sched_index;
+} scheduler_entry_t;
+
+// Min-heap ordenado por vencimiento
+static scheduler_entry_t *heap = NULL;
+static int heap_count = 0;
+static int heap_capacity = 0;
+static portMUX_TYPE heap_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t deadline_timer = NULL;
+static medication_scheduler_due_cb_t due_callback = NULL;
+
+static void arm_deadline_timer(void);
+
+static inline bool is_schedulable(int64_t deadline) {
+    return deadline > 0 && deadline != INT64_MAX;
+}
+
+static void heap_swap(int a, int b) {
+    scheduler_entry_t tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+}
+
+static void sift_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent].deadline <= heap[i].deadline) {
+            break;
+        }
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void sift_down(int i) {
+    while (true) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+
+        if (left < heap_count && heap[left].deadline < heap[smallest].deadline) {
+            smallest = left;
+        }
+        if (right < heap_count && heap[right].deadline < heap[smallest].deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+// Busca la posición de un horario en la cola (lineal: la cola es pequeña y
+// solo se consulta cuando cambia un horario, no en cada verificación)
+static int heap_find(int med_index, int sched_index) {
+    for (int i = 0; i < heap_count; i++) {
+        if (heap[i].med_index == med_index && heap[i].sched_index == sched_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void heap_remove_at(int i) {
+    heap_count--;
+    if (i == heap_count) {
+        return;
+    }
+    heap[i] = heap[heap_count];
+    sift_up(i);
+    sift_down(i);
+}
+
+// Callback del temporizador: avisa si la dosis más próxima ya venció y rearma
+static void deadline_timer_callback(void *arg) {
+    int64_t deadline = 0;
+
+    if (medication_scheduler_peek(&deadline, NULL, NULL) && deadline <= medication_clock_now_ms()) {
+        if (due_callback) {
+            due_callback();
+        }
+        // El dispensador actualizará el horario y rearmará el temporizador
+        return;
+    }
+
+    arm_deadline_timer();
+}
+
+// Arma el único temporizador one-shot para la dosis más próxima
+static void arm_deadline_timer(void) {
+    if (!deadline_timer) {
+        return;
+    }
+
+    int64_t deadline = 0;
+    bool pending = medication_scheduler_peek(&deadline, NULL, NULL);
+
+    esp_timer_stop(deadline_timer);
+    if (!pending) {
+        ESP_LOGI(TAG, "No hay dosis programadas, temporizador detenido");
+        return;
+    }
+
+    int64_t delay_ms = deadline - medication_clock_now_ms();
+    if (delay_ms < 0) {
+        delay_ms = 0;
+    }
+
+    esp_err_t err = esp_timer_start_once(deadline_timer, (uint64_t)delay_ms * 1000);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error armando temporizador de dosis: %s", esp_err_to_name(err));
+        return;
+    }
+
+    ESP_LOGD(TAG, "Temporizador armado para dentro de %lld ms", (long long)delay_ms);
+}
+
+esp_err_t medication_scheduler_init(medication_scheduler_due_cb_t due_cb) {
+    if (deadline_timer) {
+        due_callback = due_cb;
+        arm_deadline_timer();
+        return ESP_OK;
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = deadline_timer_callback,
+        .name = "med_deadline"
+    };
+
+    esp_err_t err = esp_timer_create(&timer_args, &deadline_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error creando temporizador de dosis: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    due_callback = due_cb;
+    medication_scheduler_rebuild();
+
+    ESP_LOGI(TAG, "Planificador de dosis inicializado con %d horarios", heap_count);
+    return ESP_OK;
+}
+
+void medication_scheduler_deinit(void) {
+    if (deadline_timer) {
+        esp_timer_stop(deadline_timer);
+        esp_timer_delete(deadline_timer);
+        deadline_timer = NULL;
+    }
+    due_callback = NULL;
+
+    portENTER_CRITICAL(&heap_lock);
+    scheduler_entry_t *old_heap = heap;
+    heap = NULL;
+    heap_count = 0;
+    heap_capacity = 0;
+    portEXIT_CRITICAL(&heap_lock);
+
+    free(old_heap);
+}
+
+void medication_scheduler_rebuild(void) {
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+
+    // La capacidad cubre todos los horarios para que las actualizaciones
+    // incrementales nunca necesiten reservar memoria
+    int total_schedules = table.count;
+
+    scheduler_entry_t *new_heap = NULL;
+    if (total_schedules > 0) {
+        new_heap = malloc(total_schedules * sizeof(scheduler_entry_t));
+        if (!new_heap) {
+            ESP_LOGE(TAG, "Sin memoria para la cola de dosis (%d horarios)", total_schedules);
+            return;
+        }
+    }
+
+    int new_count = 0;
+    for (int row = 0; row < table.count; row++) {
+        int64_t deadline = table.next_dispense_time[row];
+        if (!is_schedulable(deadline)) {
+            continue;
+        }
+        new_heap[new_count].deadline = deadline;
+        new_heap[new_count].med_index = table.med_index[row];
+        new_heap[new_count].sched_index = table.sched_index[row];
+        new_count++;
+    }
+
+    portENTER_CRITICAL(&heap_lock);
+    scheduler_entry_t *old_heap = heap;
+    heap = new_heap;
+    heap_count = new_count;
+    heap_capacity = total_schedules;
+    // Heapify en O(n)
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        sift_down(i);
+    }
+    portEXIT_CRITICAL(&heap_lock);
+
+    free(old_heap);
+    arm_deadline_timer();
+}
+
+void medication_scheduler_update(int med_index, int sched_index, int64_t next_dispense_time) {
+    bool schedulable = is_schedulable(next_dispense_time);
+    bool needs_rebuild = false;
+
+    portENTER_CRITICAL(&heap_lock);
+    int pos = heap_find(med_index, sched_index);
+    if (pos >= 0) {
+        if (schedulable) {
+            int64_t old_deadline = heap[pos].deadline;
+            heap[pos].deadline = next_dispense_time;
+            if (next_dispense_time < old_deadline) {
+                sift_up(pos);
+            } else {
+                sift_down(pos);
+            }
+        } else {
+            heap_remove_at(pos);
+        }
+    } else if (schedulable) {
+        if (heap_count < heap_capacity) {
+            heap[heap_count].deadline = next_dispense_time;
+            heap[heap_count].med_index = med_index;
+            heap[heap_count].sched_index = sched_index;
+            heap_count++;
+            sift_up(heap_count - 1);
+        } else {
+            needs_rebuild = true;
+        }
+    }
+    portEXIT_CRITICAL(&heap_lock);
+
+    if (needs_rebuild) {
+        // El horario no estaba contemplado en la última reconstrucción
+        medication_scheduler_rebuild();
+        return;
+    }
+
+    arm_deadline_timer();
+}
+
+bool medication_scheduler_peek(int64_t *deadline, int *med_index, int *sched_index) {
+    bool found = false;
+
+    portENTER_CRITICAL(&heap_lock);
+    if (heap_count > 0) {
+        if (deadline) *deadline = heap[0].deadline;
+        if (med_index) *med_index = heap[0].med_index;
+        if (sched_index) *sched_index = heap[0].sched_index;
+        found = true;
+    }
+    portEXIT_CRITICAL(&heap_lock);
+
+    return found;
+}
@@ -0,0 +1,49 @@
+#ifndef MEDICATION_SCHEDULER_H
+#define MEDICATION_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+/**
+ * @brief Callback invocado cuando la dosis más próxima ya está vencida
+ */
+typedef void (*medication_scheduler_due_cb_t)(void);
+
+/**
+ * @brief Inicializa el planificador de dosis (cola de prioridad por vencimiento
+ *        con un único temporizador one-shot armado para la dosis más próxima)
+ * @param due_cb Función a invocar cuando vence la dosis más próxima
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_scheduler_init(medication_scheduler_due_cb_t due_cb);
+
+/**
+ * @brief Detiene el temporizador y libera los recursos del planificador
+ */
+void medication_scheduler_deinit(void);
+
+/**
+ * @brief Reconstruye la cola completa a partir del almacenamiento de medicamentos.
+ *        Debe llamarse cuando cambia el arreglo de medicamentos o de horarios.
+ */
+void medication_scheduler_rebuild(void);
+
+/**
+ * @brief Actualiza el vencimiento de un horario concreto de forma incremental
+ * @param med_index Índice del medicamento en el almacenamiento
+ * @param sched_index Índice del horario dentro del medicamento
+ * @param next_dispense_time Nuevo vencimiento en ms (<= 0 o INT64_MAX lo quita de la cola)
+ */
+void medication_scheduler_update(int med_index, int sched_index, int64_t next_dispense_time);
+
+/**
+ * @brief Consulta la dosis más próxima sin retirarla de la cola
+ * @param deadline Vencimiento en ms (puede ser NULL)
+ * @param med_index Índice del medicamento (puede ser NULL)
+ * @param sched_index Índice del horario (puede ser NULL)
+ * @return true si hay alguna dosis programada
+ */
+bool medication_scheduler_peek(int64_t *deadline, int *med_index, int *sched_index);
+
+#endif /* MEDICATION_SCHEDULER_H */
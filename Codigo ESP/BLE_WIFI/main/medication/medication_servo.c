@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "driver/mcpwm_prelude.h"
+#include "medication_servo.h"
+
+static const char *TAG = "MED_SERVO";
+
+#define SERVO_GROUP_ID          0
+#define SERVO_RESOLUTION_HZ     1000000  // 1 tick = 1 us
+#define SERVO_PERIOD_TICKS      20000    // 50 Hz
+#define SERVO_FRAME_MS          20
+#define SERVO_SETTLE_FRAMES     ((MEDICATION_SERVO_SETTLE_MS + SERVO_FRAME_MS - 1) / SERVO_FRAME_MS)
+#define RAMP_ONE                1024     // 1.0 en punto fijo para la rampa
+
+// Trayectoria de un canal. La planifica medication_servo_move() y la avanza
+// la interrupción de fin de periodo del temporizador.
+typedef struct {
+    mcpwm_oper_handle_t oper;
+    mcpwm_cmpr_handle_t comparator;
+    mcpwm_gen_handle_t generator;
+    uint32_t pulse_us;            // Pulso aplicado
+    uint32_t start_us;
+    uint32_t target_us;
+    uint16_t frame;               // Paso actual de la trayectoria
+    uint16_t frames;              // Pasos totales
+    uint8_t settle;               // Periodos de asentamiento pendientes
+    bool active;
+} servo_channel_t;
+
+static servo_channel_t channels[MEDICATION_SERVO_CHANNELS];
+static int channel_count = 0;
+static mcpwm_timer_handle_t servo_timer = NULL;
+static EventGroupHandle_t servo_events = NULL;
+static portMUX_TYPE servo_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t clamp_pulse(uint32_t pulse_us) {
+    if (pulse_us < MEDICATION_SERVO_MIN_US) return MEDICATION_SERVO_MIN_US;
+    if (pulse_us > MEDICATION_SERVO_MAX_US) return MEDICATION_SERVO_MAX_US;
+    return pulse_us;
+}
+
+// Perfil suave (smoothstep): arranca y frena despacio para limitar los picos
+// de corriente. Solo enteros: se ejecuta en la interrupción.
+static uint32_t IRAM_ATTR ramp_position(const servo_channel_t *ch) {
+    int64_t x = (int64_t)ch->frame * RAMP_ONE / ch->frames;
+    int64_t s = x * x * (3 * RAMP_ONE - 2 * x) / ((int64_t)RAMP_ONE * RAMP_ONE);
+    int64_t delta = (int64_t)ch->target_us - (int64_t)ch->start_us;
+    return (uint32_t)((int64_t)ch->start_us + delta * s / RAMP_ONE);
+}
+
+static bool IRAM_ATTR servo_frame(mcpwm_timer_handle_t timer, const mcpwm_timer_event_data_t *edata,
+                                  void *user_ctx) {
+    uint32_t pulses[MEDICATION_SERVO_CHANNELS];
+    uint32_t update_mask = 0;
+    EventBits_t done = 0;
+
+    portENTER_CRITICAL_ISR(&servo_lock);
+    for (int i = 0; i < channel_count; i++) {
+        servo_channel_t *ch = &channels[i];
+        if (!ch->active) {
+            continue;
+        }
+        if (ch->frame < ch->frames) {
+            ch->frame++;
+            ch->pulse_us = ramp_position(ch);
+            pulses[i] = ch->pulse_us;
+            update_mask |= 1u << i;
+        } else if (ch->settle > 0) {
+            ch->settle--;
+        } else {
+            ch->active = false;
+            done |= 1u << i;
+        }
+    }
+    portEXIT_CRITICAL_ISR(&servo_lock);
+
+    // El comparador se actualiza en el siguiente inicio de periodo
+    for (int i = 0; i < channel_count; i++) {
+        if (update_mask & (1u << i)) {
+            mcpwm_comparator_set_compare_value(channels[i].comparator, pulses[i]);
+        }
+    }
+
+    BaseType_t task_woken = pdFALSE;
+    if (done) {
+        xEventGroupSetBitsFromISR(servo_events, done, &task_woken);
+    }
+    return task_woken == pdTRUE;
+}
+
+static esp_err_t create_channel(int index, int gpio, uint32_t initial_us) {
+    servo_channel_t *ch = &channels[index];
+
+    mcpwm_operator_config_t operator_config = {
+        .group_id = SERVO_GROUP_ID,
+    };
+    esp_err_t err = mcpwm_new_operator(&operator_config, &ch->oper);
+    if (err == ESP_OK) {
+        err = mcpwm_operator_connect_timer(ch->oper, servo_timer);
+    }
+
+    mcpwm_comparator_config_t comparator_config = {
+        .flags.update_cmp_on_tez = true,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_new_comparator(ch->oper, &comparator_config, &ch->comparator);
+    }
+
+    mcpwm_generator_config_t generator_config = {
+        .gen_gpio_num = gpio,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_new_generator(ch->oper, &generator_config, &ch->generator);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_comparator_set_compare_value(ch->comparator, initial_us);
+    }
+
+    // Pulso alto desde el inicio del periodo hasta el valor del comparador
+    if (err == ESP_OK) {
+        err = mcpwm_generator_set_action_on_timer_event(ch->generator,
+                MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH));
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_generator_set_action_on_compare_event(ch->generator,
+                MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, ch->comparator, MCPWM_GEN_ACTION_LOW));
+    }
+
+    ch->pulse_us = initial_us;
+    ch->target_us = initial_us;
+    ch->active = false;
+    return err;
+}
+
+static uint32_t busy_channels(uint32_t channel_mask) {
+    uint32_t busy = 0;
+
+    portENTER_CRITICAL(&servo_lock);
+    for (int i = 0; i < channel_count; i++) {
+        if ((channel_mask & (1u << i)) && channels[i].active) {
+            busy |= 1u << i;
+        }
+    }
+    portEXIT_CRITICAL(&servo_lock);
+
+    return busy;
+}
+
+esp_err_t medication_servo_init(const int *gpios, int count, uint32_t initial_us) {
+    if (servo_timer) {
+        return ESP_OK;
+    }
+    if (!gpios || count <= 0 || count > MEDICATION_SERVO_CHANNELS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!servo_events) {
+        servo_events = xEventGroupCreate();
+        if (!servo_events) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    // Sin movimientos en curso todos los canales están "terminados"
+    xEventGroupSetBits(servo_events, MEDICATION_SERVO_ALL);
+
+    initial_us = clamp_pulse(initial_us);
+    memset(channels, 0, sizeof(channels));
+    channel_count = 0;
+
+    mcpwm_timer_config_t timer_config = {
+        .group_id = SERVO_GROUP_ID,
+        .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
+        .resolution_hz = SERVO_RESOLUTION_HZ,
+        .period_ticks = SERVO_PERIOD_TICKS,
+        .count_mode = MCPWM_TIMER_COUNT_MODE_UP,
+    };
+    esp_err_t err = mcpwm_new_timer(&timer_config, &servo_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error creando temporizador MCPWM: %s", esp_err_to_name(err));
+        servo_timer = NULL;
+        return err;
+    }
+
+    for (int i = 0; i < count && err == ESP_OK; i++) {
+        err = create_channel(i, gpios[i], initial_us);
+        channel_count = i + 1;
+    }
+
+    mcpwm_timer_event_callbacks_t callbacks = {
+        .on_empty = servo_frame,
+    };
+    if (err == ESP_OK) {
+        err = mcpwm_timer_register_event_callbacks(servo_timer, &callbacks, NULL);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_timer_enable(servo_timer);
+    }
+    if (err == ESP_OK) {
+        err = mcpwm_timer_start_stop(servo_timer, MCPWM_TIMER_START_NO_STOP);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error configurando servos: %s", esp_err_to_name(err));
+        medication_servo_deinit();
+        return err;
+    }
+
+    ESP_LOGI(TAG, "%d servos en MCPWM%d (recorrido completo %d ms)", count, SERVO_GROUP_ID,
+             MEDICATION_SERVO_FULL_TRAVEL_MS);
+    return ESP_OK;
+}
+
+void medication_servo_deinit(void) {
+    if (!servo_timer) {
+        return;
+    }
+
+    mcpwm_timer_start_stop(servo_timer, MCPWM_TIMER_STOP_EMPTY);
+    mcpwm_timer_disable(servo_timer);
+
+    for (int i = 0; i < channel_count; i++) {
+        servo_channel_t *ch = &channels[i];
+        if (ch->generator) mcpwm_del_generator(ch->generator);
+        if (ch->comparator) mcpwm_del_comparator(ch->comparator);
+        if (ch->oper) mcpwm_del_operator(ch->oper);
+    }
+    mcpwm_del_timer(servo_timer);
+    servo_timer = NULL;
+
+    portENTER_CRITICAL(&servo_lock);
+    memset(channels, 0, sizeof(channels));
+    channel_count = 0;
+    portEXIT_CRITICAL(&servo_lock);
+
+    // Nadie debe quedarse esperando un movimiento que ya no avanzará
+    xEventGroupSetBits(servo_events, MEDICATION_SERVO_ALL);
+}
+
+esp_err_t medication_servo_move(int channel, uint32_t pulse_us, uint32_t duration_ms) {
+    if (!servo_timer) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (channel < 0 || channel >= channel_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pulse_us = clamp_pulse(pulse_us);
+    bool moving = false;
+
+    portENTER_CRITICAL(&servo_lock);
+    servo_channel_t *ch = &channels[channel];
+    uint32_t distance = pulse_us > ch->pulse_us ? pulse_us - ch->pulse_us : ch->pulse_us - pulse_us;
+    if (distance > 0) {
+        uint32_t ms = duration_ms ? duration_ms
+                                  : distance * MEDICATION_SERVO_FULL_TRAVEL_MS /
+                                    (MEDICATION_SERVO_MAX_US - MEDICATION_SERVO_MIN_US);
+        uint32_t frames = (ms + SERVO_FRAME_MS - 1) / SERVO_FRAME_MS;
+        ch->start_us = ch->pulse_us;
+        ch->target_us = pulse_us;
+        ch->frame = 0;
+        ch->frames = frames > 0 ? (frames < UINT16_MAX ? frames : UINT16_MAX) : 1;
+        ch->settle = SERVO_SETTLE_FRAMES;
+        ch->active = true;
+        moving = true;
+    } else if (ch->active) {
+        // Ya está en el destino pedido: se termina aquí el movimiento en curso
+        ch->start_us = pulse_us;
+        ch->target_us = pulse_us;
+        ch->frame = ch->frames;
+    }
+    portEXIT_CRITICAL(&servo_lock);
+
+    if (moving) {
+        xEventGroupClearBits(servo_events, 1u << channel);
+    }
+    return ESP_OK;
+}
+
+esp_err_t medication_servo_wait(uint32_t channel_mask, uint32_t timeout_ms) {
+    channel_mask &= MEDICATION_SERVO_ALL;
+    if (!servo_events || !channel_mask) {
+        return ESP_OK;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+
+    while (1) {
+        uint32_t busy = busy_channels(channel_mask);
+        if (!busy) {
+            return ESP_OK;
+        }
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            return ESP_ERR_TIMEOUT;
+        }
+        xEventGroupWaitBits(servo_events, busy, pdFALSE, pdTRUE, timeout - elapsed);
+
+        // Un aviso de fin de un movimiento anterior puede llegar después de
+        // planificar el siguiente: se descarta y se vuelve a comprobar
+        busy = busy_channels(channel_mask);
+        if (busy) {
+            xEventGroupClearBits(servo_events, busy);
+        }
+    }
+}
+
+bool medication_servo_busy(int channel) {
+    if (channel < 0 || channel >= MEDICATION_SERVO_CHANNELS) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&servo_lock);
+    bool busy = channels[channel].active;
+    portEXIT_CRITICAL(&servo_lock);
+    return busy;
+}
+
+uint32_t medication_servo_position(int channel) {
+    if (channel < 0 || channel >= MEDICATION_SERVO_CHANNELS) {
+        return 0;
+    }
+
+    portENTER_CRITICAL(&servo_lock);
+    uint32_t pulse = channels[channel].pulse_us;
+    portEXIT_CRITICAL(&servo_lock);
+    return pulse;
+}
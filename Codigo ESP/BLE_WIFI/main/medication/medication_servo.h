@@ -0,0 +1,65 @@
+#ifndef MEDICATION_SERVO_H
+#define MEDICATION_SERVO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Canales de servo (uno por compartimento de píldoras)
+#define MEDICATION_SERVO_CHANNELS     3
+// Límites del pulso de los servos (0 y 180 grados)
+#define MEDICATION_SERVO_MIN_US       500
+#define MEDICATION_SERVO_MAX_US       2500
+// Duración de un recorrido completo (MIN a MAX); los recorridos más cortos
+// tardan proporcionalmente menos
+#define MEDICATION_SERVO_FULL_TRAVEL_MS  400
+// Margen tras alcanzar el destino para que el servo se asiente
+#define MEDICATION_SERVO_SETTLE_MS    60
+
+#define MEDICATION_SERVO_ALL          ((1u << MEDICATION_SERVO_CHANNELS) - 1)
+
+/**
+ * @brief Configura un temporizador MCPWM de 50 Hz y un generador por servo.
+ *        Las trayectorias avanzan un paso en cada periodo PWM (20 ms).
+ * @param gpios Pin de cada canal
+ * @param count Número de canales (como mucho MEDICATION_SERVO_CHANNELS)
+ * @param initial_us Pulso inicial de todos los canales
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_servo_init(const int *gpios, int count, uint32_t initial_us);
+
+/**
+ * @brief Detiene el PWM y libera el temporizador y los generadores
+ */
+void medication_servo_deinit(void);
+
+/**
+ * @brief Inicia un movimiento con rampa de aceleración y frenado; vuelve de
+ *        inmediato. Sustituye al movimiento en curso del mismo canal, que
+ *        continúa desde la posición actual.
+ * @param channel Canal (0..MEDICATION_SERVO_CHANNELS-1)
+ * @param pulse_us Pulso de destino (se limita a MIN/MAX)
+ * @param duration_ms Duración del recorrido, 0 para la velocidad por defecto
+ * @return ESP_OK si el movimiento quedó planificado
+ */
+esp_err_t medication_servo_move(int channel, uint32_t pulse_us, uint32_t duration_ms);
+
+/**
+ * @brief Espera a que terminen los movimientos de los canales indicados
+ * @param channel_mask Bit n para el canal n
+ * @param timeout_ms Tiempo máximo de espera
+ * @return ESP_OK si todos terminaron, ESP_ERR_TIMEOUT si no
+ */
+esp_err_t medication_servo_wait(uint32_t channel_mask, uint32_t timeout_ms);
+
+/**
+ * @brief Indica si un canal sigue en movimiento (o asentándose)
+ */
+bool medication_servo_busy(int channel);
+
+/**
+ * @brief Pulso que se está aplicando ahora mismo a un canal
+ */
+uint32_t medication_servo_position(int channel);
+
+#endif /* MEDICATION_SERVO_H */
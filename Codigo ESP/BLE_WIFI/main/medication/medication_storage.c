@@ -8,8 +8,19 @@
 #include "nvs.h"
 #include "cJSON.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "medication_storage.h"
+#include "medication_scheduler.h"
+#include "medication_reminders.h"
+#include "medication_journal.h"
+#include "medication_index.h"
+#include "medication_calendar.h"
+#include "medication_intent.h"
+#include "medication_missed.h"
 #include "../ntp_func.h"  // Para acceder a format_time()
+#include "medication_clock.h"
 
 // Define the maximum length for medication ID
 
@@ -18,23 +29,34 @@ static const char *TAG = "MEDICATION_STORAGE";
 static const char *NVS_NAMESPACE = "medications";
 static const char *NVS_MED_COUNT_KEY = "med_count";
 static const char *NVS_MED_INDEX_PREFIX = "med_idx_";
+// Copia del registro que se está migrando del formato JSON (uno cada vez)
+static const char *NVS_MED_MIGRATION_KEY = "med_migrate";
 
 static nvs_handle_t med_nvs_handle = 0;
 static medication_t *medications = NULL;
 static int medications_count = 0;
 
-// Añadir después de las declaraciones de variables
+// Todo el almacén vive en un único bloque: los horarios de todos los
+// medicamentos son contiguos y los campos que recorren las verificaciones
+// periódicas se replican en tablas paralelas (una fila por horario)
+static void *arena_block = NULL;
+static medication_schedule_t *arena_schedules = NULL;
+static int arena_schedules_count = 0;
+static int64_t *hot_next_dispense = NULL;
+static int64_t *hot_last_dispensed = NULL;
+static int64_t *hot_last_taken = NULL;
+static uint16_t *hot_med_index = NULL;
+static uint16_t *hot_sched_index = NULL;
 
-#define LRU_CACHE_SIZE 3  // Pequeña caché para los medicamentos más usados
-static struct {
-    char id[MEDICATION_ID_MAX_LEN];
-    medication_t *med_ptr;
-    uint32_t last_access;
-} lru_cache[LRU_CACHE_SIZE] = {0};
-static uint32_t access_counter = 0;
+// Referencia de hora local para calcular las próximas dosis
+static medication_calendar_t calendar = {0};
+
+// Aviso de cambios para los módulos que derivan datos de un medicamento
+static medication_storage_change_cb_t change_callback = NULL;
 
-// Añadir estas variables estáticas al inicio del archivo, junto con las otras variables globales
-static int id_counter = 0;  // Contador para generar claves cortas
+// Dispensador, trabajos de dispensación y MQTT modifican el almacén desde
+// tareas distintas; las funciones públicas que lo cambian toman este mutex
+static SemaphoreHandle_t storage_mutex = NULL;
 
 // Declaraciones de funciones auxiliares
 static esp_err_t save_medication_to_nvs(const medication_t *medication);
@@ -42,160 +64,202 @@ static esp_err_t load_medications_from_nvs(void);
 static esp_err_t save_medications_index(void);
 static int64_t calculate_next_dispense_time(medication_schedule_t *schedule);
 static int64_t get_current_time_ms(void);
+static esp_err_t compact_journal(void);
+static esp_err_t flush_all_records(void);
+static esp_err_t record_dose_event(int med_index, int sched_index, medication_journal_event_t type);
+static int64_t calculate_next_dispense_time_at(medication_schedule_t *schedule, int64_t now_ms);
 
-// Añadir estas funciones a tu archivo
+#define MAX_MEDICATIONS MEDICATION_INDEX_CAPACITY
 
-// Corregir la función create_short_key
-static char* create_short_key(const char* medication_id) {
-    static char short_key[16];  // Buffer para almacenar la clave corta
-    
-    // Opciones para generar claves cortas:
-    
-    // Opción 1: Usar un contador simple (med_0, med_1, etc.)
-    snprintf(short_key, sizeof(short_key), "med_%d", id_counter++);
-    
-    // Opción 2: Usar los primeros caracteres del ID
-    // strncpy(short_key, medication_id, 10);
-    // short_key[10] = '\0';
-    // strncat(short_key, "_m", 2);
-    
-    return short_key;  // Asegurar que se retorne el valor
+// Medicamentos con eventos en el diario que aún no están en su registro base
+// (un bit por medicamento; la capacidad del índice se fija al compilar)
+static uint32_t journal_dirty_mask[(MAX_MEDICATIONS + 31) / 32];
+
+static inline bool journal_dirty(int med_index) {
+    return journal_dirty_mask[med_index / 32] & (1UL << (med_index % 32));
 }
 
-// Estructura para mapear IDs largos a claves cortas
-typedef struct {
-    char long_id[37];  // Tamaño suficiente para UUID
-    char short_key[16]; // 15 caracteres + NULL
-} id_mapping_t;
+static inline void set_journal_dirty(int med_index, bool dirty) {
+    if (dirty) {
+        journal_dirty_mask[med_index / 32] |= 1UL << (med_index % 32);
+    } else {
+        journal_dirty_mask[med_index / 32] &= ~(1UL << (med_index % 32));
+    }
+}
 
-#define MAX_MEDICATIONS 32
-static id_mapping_t id_map[MAX_MEDICATIONS];
-static int id_map_count = 0;
+// Dosis resueltas en el arranque, pendientes de notificar
+static medication_recovered_dose_t recovered_doses[MEDICATION_INTENT_SLOTS];
+static int recovered_count = 0;
+// Ranuras ya resueltas en memoria cuyo cierre en NVS quedó aplazado, y de
+// ellas las que además deben anotarse en el diario como dispensadas
+static uint32_t recovery_deferred_mask = 0;
+static uint32_t recovery_journal_mask = 0;
+// Tras la primera pasada, las intenciones abiertas son de dispensaciones en curso
+static bool recovery_ran = false;
+// Se arrancó sin hora fiable: los próximos tiempos guardados siguen sin recalcular
+static bool next_times_deferred = false;
+_Static_assert(MEDICATION_INTENT_SLOTS <= 32, "recovery_deferred_mask usa un bit por ranura");
 
-static bool mapping_changed = false;  // Para reducir escrituras NVS
+// Libera un arreglo de medicamentos con horarios reservados por separado
+static void free_loose_medications(medication_t *meds, int count) {
+    for (int i = 0; meds && i < count; i++) {
+        free(meds[i].schedules);
+    }
+    free(meds);
+}
 
-// Función para obtener la clave corta a partir de un ID largo
-static const char* get_short_key(const char* long_id) {
-    // Primero buscar si ya existe un mapeo
-    for (int i = 0; i < id_map_count; i++) {
-        if (strcmp(id_map[i].long_id, long_id) == 0) {
-            return id_map[i].short_key;
+// Copia los medicamentos de src a un bloque nuevo y lo activa. src no se
+// modifica; el bloque anterior se devuelve para que el llamador lo libere
+// cuando ya no necesite consultar el arreglo antiguo.
+static esp_err_t arena_install(const medication_t *src, int count, void **old_block) {
+    int schedules = 0;
+    for (int i = 0; i < count; i++) {
+        schedules += src[i].schedules_count;
+    }
+    
+    // Orden del bloque: primero los tipos con mayor alineación
+    size_t sched_bytes = schedules * sizeof(medication_schedule_t);
+    size_t times_bytes = schedules * sizeof(int64_t);
+    size_t meds_bytes = count * sizeof(medication_t);
+    size_t index_bytes = schedules * sizeof(uint16_t);
+    size_t total = sched_bytes + 3 * times_bytes + meds_bytes + 2 * index_bytes;
+    
+    uint8_t *block = NULL;
+    if (total > 0) {
+        block = malloc(total);
+        if (!block) {
+            ESP_LOGE(TAG, "Memory allocation failed for medication arena (%u bytes)", (unsigned)total);
+            return ESP_ERR_NO_MEM;
         }
     }
     
-    // Si no existe, crear uno nuevo (si hay espacio)
-    if (id_map_count < MAX_MEDICATIONS) {
-        strncpy(id_map[id_map_count].long_id, long_id, sizeof(id_map[id_map_count].long_id) - 1);
-        id_map[id_map_count].long_id[sizeof(id_map[id_map_count].long_id) - 1] = '\0';
-        
-        char* short_key = create_short_key(long_id);
-        strncpy(id_map[id_map_count].short_key, short_key, sizeof(id_map[id_map_count].short_key) - 1);
-        id_map[id_map_count].short_key[sizeof(id_map[id_map_count].short_key) - 1] = '\0';
+    uint8_t *p = block;
+    medication_schedule_t *new_schedules = (medication_schedule_t *)p;  p += sched_bytes;
+    int64_t *new_next = (int64_t *)p;                                   p += times_bytes;
+    int64_t *new_dispensed = (int64_t *)p;                              p += times_bytes;
+    int64_t *new_taken = (int64_t *)p;                                  p += times_bytes;
+    medication_t *new_meds = (medication_t *)p;                         p += meds_bytes;
+    uint16_t *new_med_index = (uint16_t *)p;                            p += index_bytes;
+    uint16_t *new_sched_index = (uint16_t *)p;
+    
+    int row = 0;
+    for (int i = 0; i < count; i++) {
+        new_meds[i] = src[i];
+        new_meds[i].schedules = src[i].schedules_count > 0 ? &new_schedules[row] : NULL;
         
-        id_map_count++;
-        mapping_changed = true;  // Marcar que hay cambios pendientes
-        
-        return id_map[id_map_count - 1].short_key;
+        for (int j = 0; j < src[i].schedules_count; j++, row++) {
+            new_schedules[row] = src[i].schedules[j];
+            medication_calendar_compile(&new_schedules[row]);
+            new_next[row] = new_schedules[row].next_dispense_time;
+            new_dispensed[row] = new_schedules[row].last_dispensed_time;
+            new_taken[row] = new_schedules[row].last_taken_time;
+            new_med_index[row] = i;
+            new_sched_index[row] = j;
+        }
+    }
+    
+    if (old_block) {
+        *old_block = arena_block;
+    } else {
+        free(arena_block);
     }
     
-    // Si no hay espacio, devolver un valor predeterminado seguro
-    return "med_err";
+    arena_block = block;
+    arena_schedules = block ? new_schedules : NULL;
+    arena_schedules_count = schedules;
+    hot_next_dispense = new_next;
+    hot_last_dispensed = new_dispensed;
+    hot_last_taken = new_taken;
+    hot_med_index = new_med_index;
+    hot_sched_index = new_sched_index;
+    medications = count > 0 ? new_meds : NULL;
+    medications_count = count;
+    
+    // Las posiciones del índice se refieren al bloque activo
+    medication_index_rebuild(medications, medications_count);
+    return ESP_OK;
 }
 
-// Función para cargar los mapeos desde NVS durante la inicialización
-static void load_id_mappings(void) {
-    id_map_count = 0;
-    
-    uint32_t count = 0;
-    esp_err_t err = nvs_get_u32(med_nvs_handle, "map_count", &count);
-    if (err == ESP_OK && count > 0) {
-        // Limitar al máximo soportado
-        if (count > MAX_MEDICATIONS) {
-            count = MAX_MEDICATIONS;
-        }
-        
-        for (uint32_t i = 0; i < count; i++) {
-            char map_key[16];
-            snprintf(map_key, sizeof(map_key), "map_%lu", (unsigned long)i);
-            
-            size_t required_size = 0;
-            err = nvs_get_str(med_nvs_handle, map_key, NULL, &required_size);
-            if (err != ESP_OK) {
-                continue;
-            }
-            
-            char *map_json = malloc(required_size);
-            if (!map_json) {
-                continue;
-            }
-            
-            err = nvs_get_str(med_nvs_handle, map_key, map_json, &required_size);
-            if (err != ESP_OK) {
-                free(map_json);
-                continue;
-            }
-            
-            cJSON *map_obj = cJSON_Parse(map_json);
-            free(map_json);
-            
-            if (!map_obj) {
-                continue;
-            }
-            
-            cJSON *long_id = cJSON_GetObjectItem(map_obj, "long");
-            cJSON *short_key = cJSON_GetObjectItem(map_obj, "short");
-            
-            if (long_id && cJSON_IsString(long_id) && short_key && cJSON_IsString(short_key)) {
-                strncpy(id_map[id_map_count].long_id, long_id->valuestring, sizeof(id_map[id_map_count].long_id) - 1);
-                id_map[id_map_count].long_id[sizeof(id_map[id_map_count].long_id) - 1] = '\0';
-                
-                strncpy(id_map[id_map_count].short_key, short_key->valuestring, sizeof(id_map[id_map_count].short_key) - 1);
-                id_map[id_map_count].short_key[sizeof(id_map[id_map_count].short_key) - 1] = '\0';
-                
-                id_map_count++;
-            }
-            
-            cJSON_Delete(map_obj);
-        }
+// Actualiza la fila de la tabla de horarios tras modificar un horario
+static void schedule_row_refresh(const medication_t *med, int sched_idx) {
+    if (!arena_schedules || !med->schedules) {
+        return;
     }
+    int row = (med->schedules - arena_schedules) + sched_idx;
+    hot_next_dispense[row] = med->schedules[sched_idx].next_dispense_time;
+    hot_last_dispensed[row] = med->schedules[sched_idx].last_dispensed_time;
+    hot_last_taken[row] = med->schedules[sched_idx].last_taken_time;
 }
 
-// Añadir esta función después de load_id_mappings()
-
-// Añadir una nueva función para guardar los mapeos de forma diferida
-static void save_id_mappings_if_changed(void) {
-    if (!mapping_changed) {
-        return;  // No hay cambios para guardar
+static void schedule_table_refresh_all(void) {
+    for (int row = 0; row < arena_schedules_count; row++) {
+        hot_next_dispense[row] = arena_schedules[row].next_dispense_time;
+        hot_last_dispensed[row] = arena_schedules[row].last_dispensed_time;
+        hot_last_taken[row] = arena_schedules[row].last_taken_time;
     }
-    
-    ESP_LOGI(TAG, "Guardando mapeos ID-clave actualizados");
-    
-    // Actualizar contador primero
-    nvs_set_u32(med_nvs_handle, "map_count", id_map_count);
-    
-    // Guardar cada mapeo
-    for (int i = 0; i < id_map_count; i++) {
-        char map_key[16];
-        snprintf(map_key, sizeof(map_key), "map_%d", i);
-        
-        cJSON *map_obj = cJSON_CreateObject();
-        cJSON_AddStringToObject(map_obj, "long", id_map[i].long_id);
-        cJSON_AddStringToObject(map_obj, "short", id_map[i].short_key);
-        char *map_json = cJSON_Print(map_obj);
-        
-        if (map_json) {
-            nvs_set_str(med_nvs_handle, map_key, map_json);
-            free(map_json);
-        }
-        
-        cJSON_Delete(map_obj);
+}
+
+// Formato binario de los registros de medicamentos en NVS (blob de tamaño fijo
+// por horario). Sustituye al texto cJSON de versiones anteriores, que se sigue
+// leyendo una única vez para migrarlo.
+#define MED_RECORD_MAGIC          0x4D52  // "MR"
+#define MED_RECORD_VERSION        2
+#define MED_RECORD_MAX_SCHEDULES  MEDICATION_MAX_SCHEDULES
+#define MED_RECORD_FLAG_INTERVAL  0x01    // Horario en modo intervalo
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  schedules_count;
+    char     id[32];
+    char     name[64];
+    char     type[16];
+    uint8_t  compartment;
+    int16_t  pills_per_dose;
+    int32_t  total_pills;
+    int32_t  dose_volume_ul;      // Desde la versión 2; en la 1 la dosis líquida iba en ml enteros
+} med_record_header_t;
+
+// Los registros de la versión 1 tienen la misma cabecera sin dose_volume_ul
+#define MED_RECORD_V1_HEADER_SIZE (sizeof(med_record_header_t) - sizeof(int32_t))
+
+typedef struct __attribute__((packed)) {
+    char     id[32];
+    uint16_t time_in_minutes;
+    uint8_t  flags;               // MED_RECORD_FLAG_*
+    uint8_t  interval_hours;
+    uint8_t  treatment_days;
+    uint8_t  days_mask;           // Bit (d-1) activo para el día d (1=lunes, 7=domingo)
+    int64_t  treatment_end_date;
+    int64_t  next_dispense_time;
+    int64_t  last_dispensed_time;
+    int64_t  last_taken_time;
+} med_record_schedule_t;
+
+_Static_assert(sizeof(med_record_header_t) == 127, "Cambiar el layout requiere subir MED_RECORD_VERSION");
+_Static_assert(sizeof(med_record_schedule_t) == 70, "Cambiar el layout requiere subir MED_RECORD_VERSION");
+_Static_assert(sizeof(((medication_t *)0)->id) == sizeof(((med_record_header_t *)0)->id), "id de medicamento");
+_Static_assert(sizeof(((medication_t *)0)->name) == sizeof(((med_record_header_t *)0)->name), "nombre de medicamento");
+_Static_assert(sizeof(((medication_t *)0)->type) == sizeof(((med_record_header_t *)0)->type), "tipo de medicamento");
+_Static_assert(sizeof(((medication_schedule_t *)0)->id) == sizeof(((med_record_schedule_t *)0)->id), "id de horario");
+
+#define MED_RECORD_MAX_SIZE (sizeof(med_record_header_t) + \
+                             MED_RECORD_MAX_SCHEDULES * sizeof(med_record_schedule_t))
+
+// Buffer único para serializar/deserializar registros (sin asignaciones dinámicas)
+static uint8_t record_buffer[MED_RECORD_MAX_SIZE];
+
+// Clave NVS del registro de un medicamento, según su handle en el índice
+static bool medication_record_key(const char *med_id, char *key, size_t size) {
+    medication_handle_t handle = medication_index_intern(med_id);
+    if (handle == MEDICATION_HANDLE_INVALID) {
+        return false;
     }
-    
-    nvs_commit(med_nvs_handle);
-    mapping_changed = false;
+    medication_index_record_key(handle, key, size);
+    return true;
 }
 
-esp_err_t medication_storage_init(void) {
+static esp_err_t storage_init(void) {
     esp_err_t err;
     
     // Inicializar NVS
@@ -215,8 +279,28 @@ esp_err_t medication_storage_init(void) {
         return err;
     }
     
-    // Cargar mapeos de IDs
-    load_id_mappings();
+    // Cargar el índice de IDs (las claves de los registros dependen de él)
+    err = medication_index_load(med_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Could not load id index: %s", esp_err_to_name(err));
+    }
+    
+    // Localizar los eventos de dosis pendientes de compactar
+    memset(journal_dirty_mask, 0, sizeof(journal_dirty_mask));
+    err = medication_journal_init(med_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Could not open dose journal: %s", esp_err_to_name(err));
+    }
+    
+    // Dispensaciones que estaban en curso al apagarse el equipo
+    recovered_count = 0;
+    recovery_deferred_mask = 0;
+    recovery_journal_mask = 0;
+    recovery_ran = false;
+    err = medication_intent_init(med_nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Could not open dispense intents: %s", esp_err_to_name(err));
+    }
     
     // Cargar medicamentos almacenados
     err = load_medications_from_nvs();
@@ -225,375 +309,877 @@ esp_err_t medication_storage_init(void) {
         // No retornamos error, ya que podría ser la primera ejecución
     }
     
+    // Resolver las dispensaciones interrumpidas antes de que arranque el
+    // planificador, con un tiempo acotado
+    medication_storage_recover_dispenses(MEDICATION_RECOVERY_BUDGET_MS);
+    
+    // Sin medicamentos cargados los eventos pendientes no tienen a quién aplicarse
+    if (medications_count == 0) {
+        medication_journal_truncate();
+    }
+    
     ESP_LOGI(TAG, "Medication storage initialized with %d medications", medications_count);
     return ESP_OK;
 }
 
-esp_err_t medication_storage_process_json(const char* json_str) {
-    if (json_str == NULL) {
-        ESP_LOGE(TAG, "Received NULL JSON string");
-        return ESP_ERR_INVALID_ARG;
+esp_err_t medication_storage_init(void) {
+    // Se crea antes de que arranquen las demás tareas
+    if (!storage_mutex) {
+        storage_mutex = xSemaphoreCreateRecursiveMutex();
     }
     
-    ESP_LOGI(TAG, "Processing medication JSON: %s", json_str);
-    
-    // Parsear JSON
-    cJSON *root = cJSON_Parse(json_str);
-    if (!root) {
-        ESP_LOGE(TAG, "Error parsing JSON: %s", cJSON_GetErrorPtr());
-        return ESP_FAIL;
+    medication_storage_lock();
+    esp_err_t err = storage_init();
+    medication_storage_unlock();
+    return err;
+}
+
+void medication_storage_lock(void) {
+    if (storage_mutex) {
+        xSemaphoreTakeRecursive(storage_mutex, portMAX_DELAY);
     }
-    
-    // Obtener el objeto "payload"
-    cJSON *payload = cJSON_GetObjectItem(root, "payload");
-    if (!payload) {
-        ESP_LOGE(TAG, "No 'payload' field in JSON");
-        cJSON_Delete(root);
-        return ESP_FAIL;
+}
+
+void medication_storage_unlock(void) {
+    if (storage_mutex) {
+        xSemaphoreGiveRecursive(storage_mutex);
     }
-    
-    // Obtener el array "medications"
-    cJSON *medications_array = cJSON_GetObjectItem(payload, "medications");
-    if (!medications_array || !cJSON_IsArray(medications_array)) {
-        ESP_LOGE(TAG, "No 'medications' array in payload");
-        cJSON_Delete(root);
-        return ESP_FAIL;
+}
+
+void medication_storage_set_change_callback(medication_storage_change_cb_t cb) {
+    change_callback = cb;
+}
+
+// Estado de una sincronización en curso: los medicamentos recibidos se van
+// acumulando aquí y solo reemplazan al arreglo activo al confirmar
+static struct {
+    medication_t *meds;
+    int count;
+    int capacity;
+    bool changed[MAX_MEDICATIONS];  // Registros que deben reescribirse en NVS
+    int added;
+    int updated;
+    int unchanged;
+} sync_state = {0};
+
+// Compara la definición de un horario (lo que envía el backend), sin historial
+static bool schedule_definition_equal(const medication_schedule_t *a, const medication_schedule_t *b) {
+    if (a->time_in_minutes != b->time_in_minutes ||
+        a->interval_mode != b->interval_mode) {
+        return false;
     }
     
-    // Liberar medicamentos anteriores si existen
-    if (medications != NULL) {
-        for (int i = 0; i < medications_count; i++) {
-            if (medications[i].schedules != NULL) {
-                free(medications[i].schedules);
-            }
-        }
-        free(medications);
-        medications = NULL;
-        medications_count = 0;
+    if (a->interval_mode) {
+        return a->interval_hours == b->interval_hours &&
+               a->treatment_days == b->treatment_days;
     }
     
-    // Contar número de medicamentos
-    medications_count = cJSON_GetArraySize(medications_array);
-    if (medications_count <= 0) {
-        ESP_LOGW(TAG, "Empty medications array received");
-        cJSON_Delete(root);
-        return ESP_OK; // No es un error, simplemente no hay medicamentos
+    return a->days_count == b->days_count &&
+           memcmp(a->days, b->days, a->days_count) == 0;
+}
+
+// Compara los datos básicos de un medicamento, sin los horarios
+static bool medication_definition_equal(const medication_t *a, const medication_t *b) {
+    return strcmp(a->name, b->name) == 0 &&
+           strcmp(a->type, b->type) == 0 &&
+           a->compartment == b->compartment &&
+           a->pills_per_dose == b->pills_per_dose &&
+           a->dose_volume_ul == b->dose_volume_ul &&
+           a->total_pills == b->total_pills &&
+           a->schedules_count == b->schedules_count;
+}
+
+// Posición de un horario de un medicamento del arreglo activo (O(1) con el índice)
+static int find_schedule_index(const medication_t *med, const char *schedule_id) {
+    if (!medications || med < medications || med >= medications + medications_count) {
+        return -1;
+    }
+    return medication_index_find_schedule(med - medications, schedule_id);
+}
+
+static void sync_abort(void) {
+    free_loose_medications(sync_state.meds, sync_state.count);
+    memset(&sync_state, 0, sizeof(sync_state));
+}
+
+static void storage_sync_begin(void) {
+    // Descarta una sincronización anterior que no llegó a cerrarse
+    sync_abort();
+}
+
+void medication_storage_sync_begin(void) {
+    medication_storage_lock();
+    storage_sync_begin();
+    medication_storage_unlock();
+}
+
+// Los horarios sin cambios conservan su historial y su próxima dispensación;
+// solo se recalculan los nuevos o modificados.
+static esp_err_t storage_sync_upsert(medication_t *incoming) {
+    for (int i = 0; i < sync_state.count; i++) {
+        if (strcmp(sync_state.meds[i].id, incoming->id) == 0) {
+            ESP_LOGW(TAG, "Medicamento %s duplicado en la sincronización, se ignora", incoming->id);
+            free(incoming->schedules);
+            return ESP_OK;
+        }
     }
     
-    // Asignar memoria para los medicamentos
-    medications = calloc(medications_count, sizeof(medication_t));
-    if (!medications) {
-        ESP_LOGE(TAG, "Memory allocation failed for medications");
-        medications_count = 0;
-        cJSON_Delete(root);
+    if (sync_state.count >= MAX_MEDICATIONS) {
+        ESP_LOGE(TAG, "Se superó el máximo de %d medicamentos", MAX_MEDICATIONS);
+        free(incoming->schedules);
         return ESP_ERR_NO_MEM;
     }
     
-    // Procesar cada medicamento
-    int med_index = 0;
-    cJSON *medication_item;
-    cJSON_ArrayForEach(medication_item, medications_array) {
-        if (!cJSON_IsObject(medication_item)) {
-            ESP_LOGW(TAG, "Item in medications array is not an object, skipping");
-            continue;
+    if (sync_state.count == sync_state.capacity) {
+        int new_capacity = sync_state.capacity ? sync_state.capacity * 2 : 4;
+        if (new_capacity > MAX_MEDICATIONS) {
+            new_capacity = MAX_MEDICATIONS;
         }
-        
-        // Obtener datos básicos del medicamento
-        cJSON *id = cJSON_GetObjectItem(medication_item, "id");
-        cJSON *name = cJSON_GetObjectItem(medication_item, "name");
-        cJSON *compartment = cJSON_GetObjectItem(medication_item, "compartment");
-        cJSON *type = cJSON_GetObjectItem(medication_item, "type");
-        cJSON *pills_per_dose = cJSON_GetObjectItem(medication_item, "pillsPerDose");
-        cJSON *total_pills = cJSON_GetObjectItem(medication_item, "totalPills");
-        
-        // Verificar campos obligatorios
-        if (!id || !cJSON_IsString(id) || !name || !cJSON_IsString(name) || 
-            !compartment || !cJSON_IsNumber(compartment) || !type || !cJSON_IsString(type)) {
-            ESP_LOGW(TAG, "Medication missing required fields, skipping");
-            continue;
+        medication_t *grown = realloc(sync_state.meds, new_capacity * sizeof(medication_t));
+        if (!grown) {
+            ESP_LOGE(TAG, "Memory allocation failed for medications");
+            free(incoming->schedules);
+            return ESP_ERR_NO_MEM;
         }
+        sync_state.meds = grown;
+        sync_state.capacity = new_capacity;
+    }
+    
+    int64_t now = get_current_time_ms();
+    medication_t *current = medication_storage_get_medication(incoming->id);
+    
+    bool changed = !current || !medication_definition_equal(current, incoming);
+    
+    for (int j = 0; j < incoming->schedules_count; j++) {
+        medication_schedule_t *schedule = &incoming->schedules[j];
+        medication_calendar_compile(schedule);
+        int previous_idx = current ? find_schedule_index(current, schedule->id) : -1;
+        medication_schedule_t *previous = previous_idx >= 0 ? &current->schedules[previous_idx] : NULL;
         
-        // Copiar datos básicos
-        medication_t *med = &medications[med_index];
-        strncpy(med->id, id->valuestring, sizeof(med->id) - 1);
-        strncpy(med->name, name->valuestring, sizeof(med->name) - 1);
-        med->compartment = compartment->valueint;
-        strncpy(med->type, type->valuestring, sizeof(med->type) - 1);
-        
-        // Campos opcionales según tipo
-        if (strcmp(med->type, "pill") == 0) {
-            if (pills_per_dose && cJSON_IsNumber(pills_per_dose)) {
-                med->pills_per_dose = pills_per_dose->valueint;
-            } else {
-                med->pills_per_dose = 1; // Valor por defecto
-            }
+        if (previous) {
+            // El historial pertenece al horario aunque cambie su definición:
+            // conservarlo evita dispensar de nuevo una dosis ya entregada
+            schedule->last_dispensed_time = previous->last_dispensed_time;
+            schedule->last_taken_time = previous->last_taken_time;
             
-            if (total_pills && cJSON_IsNumber(total_pills)) {
-                med->total_pills = total_pills->valueint;
-            } else {
-                med->total_pills = 0;
-            }
-        }
-        
-        // Procesar horarios
-        cJSON *schedules_array = cJSON_GetObjectItem(medication_item, "schedules");
-        if (schedules_array && cJSON_IsArray(schedules_array)) {
-            int schedules_count = cJSON_GetArraySize(schedules_array);
-            if (schedules_count > 0) {
-                med->schedules = calloc(schedules_count, sizeof(medication_schedule_t));
-                if (!med->schedules) {
-                    ESP_LOGE(TAG, "Memory allocation failed for schedules");
-                    // Continuar con el siguiente medicamento
-                    continue;
-                }
-                
-                med->schedules_count = 0; // Inicializar contador de horarios válidos
-                
-                // Procesar cada horario
-                cJSON *schedule_item;
-                int sched_index = 0;
-                cJSON_ArrayForEach(schedule_item, schedules_array) {
-                    if (!cJSON_IsObject(schedule_item)) {
-                        continue;
-                    }
-                    
-                    medication_schedule_t *schedule = &med->schedules[sched_index];
-                    
-                    // Obtener ID del horario
-                    cJSON *sched_id = cJSON_GetObjectItem(schedule_item, "id");
-                    if (sched_id && cJSON_IsString(sched_id)) {
-                        strncpy(schedule->id, sched_id->valuestring, sizeof(schedule->id) - 1);
-                    } else {
-                        // Generar ID si no existe
-                        snprintf(schedule->id, sizeof(schedule->id), "sched_%d", sched_index);
-                    }
-                    
-                    // Hora en minutos
-                    cJSON *time = cJSON_GetObjectItem(schedule_item, "time");
-                    if (time && cJSON_IsNumber(time)) {
-                        schedule->time_in_minutes = time->valueint;
-                    } else {
-                        // Si no tiene hora, usar 8:00 AM como predeterminado
-                        schedule->time_in_minutes = 8 * 60;
-                    }
-                    
-                    // Modo de intervalo
-                    cJSON *interval_mode = cJSON_GetObjectItem(schedule_item, "intervalMode");
-                    schedule->interval_mode = interval_mode && cJSON_IsTrue(interval_mode);
-                    
-                    if (schedule->interval_mode) {
-                        // Modo intervalo
-                        cJSON *interval_hours = cJSON_GetObjectItem(schedule_item, "intervalHours");
-                        if (interval_hours && cJSON_IsNumber(interval_hours)) {
-                            schedule->interval_hours = interval_hours->valueint;
-                        } else {
-                            schedule->interval_hours = 24; // Por defecto, cada 24 horas
-                        }
-                        
-                        cJSON *treatment_days = cJSON_GetObjectItem(schedule_item, "treatmentDays");
-                        if (treatment_days && cJSON_IsNumber(treatment_days)) {
-                            schedule->treatment_days = treatment_days->valueint;
-                            
-                            // Calcular fecha de fin de tratamiento
-                            int64_t now = get_current_time_ms();
-                            schedule->treatment_end_date = now + (int64_t)schedule->treatment_days * 24 * 60 * 60 * 1000;
-                        } else {
-                            schedule->treatment_days = 0; // Sin fin definido
-                            schedule->treatment_end_date = 0;
-                        }
-                    } else {
-                        // Modo días de semana
-                        cJSON *days_array = cJSON_GetObjectItem(schedule_item, "days");
-                        
-                        // Versión optimizada para recuperar días de la semana
-                        if (days_array && cJSON_IsArray(days_array)) {
-                            int days_count = cJSON_GetArraySize(days_array);
-                            schedule->days_count = 0;
-                            
-                            // Reservar espacio para todos los días posibles
-                            uint8_t valid_days[7] = {0};
-                            int valid_count = 0;
-                            
-                            // Obtener días en un solo paso
-                            for (int i = 0; i < days_count && i < 7; i++) {
-                                cJSON *day_item = cJSON_GetArrayItem(days_array, i);
-                                if (day_item && cJSON_IsNumber(day_item)) {
-                                    int day = day_item->valueint;
-                                    if (day >= 1 && day <= 7 && !valid_days[day-1]) {
-                                        valid_days[day-1] = 1;
-                                        valid_count++;
-                                    }
-                                }
-                            }
-                            
-                            // Ahora copiar todos los días válidos de una vez
-                            if (valid_count > 0) {
-                                for (int i = 0, j = 0; i < 7; i++) {
-                                    if (valid_days[i]) {
-                                        schedule->days[j++] = i + 1;
-                                    }
-                                }
-                                schedule->days_count = valid_count;
-                            }
-                        }
-                        
-                        if (schedule->days_count == 0) {
-                            // Si no hay días seleccionados, usar todos los días
-                            for (int i = 1; i <= 7; i++) {
-                                schedule->days[i-1] = i;
-                            }
-                            schedule->days_count = 7;
-                        }
-                    }
-                    
-                    // Inicializar tiempos de dispensación
-                    schedule->next_dispense_time = 0;
-                    schedule->last_dispensed_time = 0;
-                    
-                    sched_index++;
-                    med->schedules_count = sched_index;
+            if (schedule_definition_equal(previous, schedule)) {
+                schedule->treatment_end_date = previous->treatment_end_date;
+                schedule->next_dispense_time = previous->next_dispense_time;
+                if (previous_idx != j) {
+                    changed = true;  // Mismo horario en otra posición del registro
                 }
+                continue;
             }
         }
         
-        // Guardar medicamento en NVS
-        save_medication_to_nvs(med);
+        if (schedule->interval_mode && schedule->treatment_days > 0) {
+            schedule->treatment_end_date = now + (int64_t)schedule->treatment_days * 24 * 60 * 60 * 1000;
+        }
+        schedule->next_dispense_time = calculate_next_dispense_time(schedule);
+        changed = true;
         
-        med_index++;
+#if CONFIG_LOG_DEFAULT_LEVEL >= ESP_LOG_INFO
+        char time_buffer[32];
+        format_time(schedule->next_dispense_time, time_buffer, sizeof(time_buffer));
+        ESP_LOGI(TAG, "Next dispense for %s (schedule %s): %s",
+                incoming->name, schedule->id, time_buffer);
+#endif
     }
     
-    // Actualizar el conteo real de medicamentos
-    medications_count = med_index;
-    
-    // Guardar índice de medicamentos
-    save_medications_index();
-    
-    // Calcular próximas dispensaciones
-    medication_storage_update_next_dispense_times();
-    
-    // Guardar mapeos si hubo cambios
-    save_id_mappings_if_changed();
+    if (!current) {
+        sync_state.added++;
+    } else if (changed) {
+        sync_state.updated++;
+    } else {
+        sync_state.unchanged++;
+    }
     
-    ESP_LOGI(TAG, "Successfully processed %d medications", medications_count);
+    sync_state.changed[sync_state.count] = changed;
+    sync_state.meds[sync_state.count++] = *incoming;
     return ESP_OK;
 }
 
-static esp_err_t save_medication_to_nvs(const medication_t *medication) {
-    if (!medication || !med_nvs_handle) {
-        return ESP_ERR_INVALID_ARG;
+esp_err_t medication_storage_sync_upsert(medication_t *incoming) {
+    medication_storage_lock();
+    esp_err_t err = storage_sync_upsert(incoming);
+    medication_storage_unlock();
+    return err;
+}
+
+// Una sincronización por partes llega en varios eventos MQTT y entre ellos
+// el dispensador puede haber entregado dosis: el historial se vuelve a tomar
+// del arreglo activo justo antes de reemplazarlo
+static void refresh_sync_history(medication_t *incoming) {
+    medication_t *current = medication_storage_get_medication(incoming->id);
+    if (!current) {
+        return;
     }
     
-    // Crear objeto JSON para el medicamento
-    cJSON *med_obj = cJSON_CreateObject();
-    if (!med_obj) {
-        return ESP_ERR_NO_MEM;
+    for (int j = 0; j < incoming->schedules_count; j++) {
+        medication_schedule_t *schedule = &incoming->schedules[j];
+        int previous_idx = find_schedule_index(current, schedule->id);
+        if (previous_idx < 0) {
+            continue;
+        }
+        const medication_schedule_t *previous = &current->schedules[previous_idx];
+        schedule->last_dispensed_time = previous->last_dispensed_time;
+        schedule->last_taken_time = previous->last_taken_time;
+        if (schedule_definition_equal(previous, schedule)) {
+            schedule->next_dispense_time = previous->next_dispense_time;
+        }
+    }
+}
+
+// Sustituye el arreglo activo por el sincronizado y persiste solo las diferencias
+static esp_err_t sync_commit(void) {
+    // Los eventos del diario se refieren a posiciones del arreglo actual:
+    // se integran en los registros base antes de reordenarlo
+    if (compact_journal() != ESP_OK) {
+        ESP_LOGW(TAG, "No se pudo compactar el diario antes de sincronizar");
     }
     
-    // Añadir propiedades básicas
-    cJSON_AddStringToObject(med_obj, "id", medication->id);
-    cJSON_AddStringToObject(med_obj, "name", medication->name);
-    cJSON_AddNumberToObject(med_obj, "compartment", medication->compartment);
-    cJSON_AddStringToObject(med_obj, "type", medication->type);
-    cJSON_AddNumberToObject(med_obj, "pillsPerDose", medication->pills_per_dose);
-    cJSON_AddNumberToObject(med_obj, "totalPills", medication->total_pills);
-    
-    // Añadir horarios
-    cJSON *schedules_array = cJSON_AddArrayToObject(med_obj, "schedules");
-    if (medication->schedules) {
-        for (int i = 0; i < medication->schedules_count; i++) {
-            medication_schedule_t *schedule = &medication->schedules[i];
-            cJSON *sched_obj = cJSON_CreateObject();
-            
-            cJSON_AddStringToObject(sched_obj, "id", schedule->id);
-            cJSON_AddNumberToObject(sched_obj, "timeInMinutes", schedule->time_in_minutes);
-            cJSON_AddBoolToObject(sched_obj, "intervalMode", schedule->interval_mode);
-            cJSON_AddNumberToObject(sched_obj, "intervalHours", schedule->interval_hours);
-            cJSON_AddNumberToObject(sched_obj, "treatmentDays", schedule->treatment_days);
-            cJSON_AddNumberToObject(sched_obj, "treatmentEndDate", (double)schedule->treatment_end_date);
-            cJSON_AddNumberToObject(sched_obj, "nextDispenseTime", (double)schedule->next_dispense_time);
-            cJSON_AddNumberToObject(sched_obj, "lastDispensedTime", (double)schedule->last_dispensed_time);
-            
-            // Añadir días seleccionados
-            cJSON *days_array = cJSON_AddArrayToObject(sched_obj, "days");
-            for (int j = 0; j < schedule->days_count; j++) {
-                cJSON_AddItemToArray(days_array, cJSON_CreateNumber(schedule->days[j]));
-            }
-            
-            cJSON_AddItemToArray(schedules_array, sched_obj);
-        }
+    for (int i = 0; i < sync_state.count; i++) {
+        refresh_sync_history(&sync_state.meds[i]);
     }
     
-    // Convertir a string JSON - Versión optimizada
-    #define JSON_BUFFER_SIZE 2048  // Tamaño adecuado para almacenar un medicamento
-    static char json_buffer[JSON_BUFFER_SIZE];
-    if (cJSON_PrintPreallocated(med_obj, json_buffer, JSON_BUFFER_SIZE, false)) {
-        // Guardar en NVS usando la clave corta
-        const char* short_key = get_short_key(medication->id);
-        esp_err_t err = nvs_set_str(med_nvs_handle, short_key, json_buffer);
-        
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error saving medication to NVS: %s", esp_err_to_name(err));
-            cJSON_Delete(med_obj);
-            return err;
+    // Activar el nuevo bloque; el anterior sigue accesible hasta liberarlo
+    medication_t *old_meds = medications;
+    int old_count = medications_count;
+    void *old_block = NULL;
+    
+    esp_err_t err = arena_install(sync_state.meds, sync_state.count, &old_block);
+    if (err != ESP_OK) {
+        sync_abort();
+        return err;
+    }
+    
+    // Los medicamentos que ya no llegan se eliminan de NVS y liberan su handle
+    int removed = 0;
+    for (int i = 0; i < old_count; i++) {
+        medication_handle_t handle = medication_index_lookup(old_meds[i].id);
+        if (handle == MEDICATION_HANDLE_INVALID || medication_index_row(handle) >= 0) {
+            continue;
         }
-        
-        // Confirmar escritura solo cuando sea necesario
-        static uint8_t write_count = 0;
-        if (++write_count >= 5) {  // Hacer commit cada 5 escrituras
-            err = nvs_commit(med_nvs_handle);
-            write_count = 0;
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Error committing to NVS: %s", esp_err_to_name(err));
-                cJSON_Delete(med_obj);
-                return err;
-            }
+        char key[16];
+        medication_index_record_key(handle, key, sizeof(key));
+        err = nvs_erase_key(med_nvs_handle, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Error erasing medication %s: %s", old_meds[i].id, esp_err_to_name(err));
         }
-        
-        cJSON_Delete(med_obj);
-        return ESP_OK;
-    } else {
-        ESP_LOGE(TAG, "Error printing JSON, fallback to dynamic allocation");
-        // Si falla, usar el método original como fallback
-        char *json_str = cJSON_Print(med_obj);
-        cJSON_Delete(med_obj);
-        
-        if (!json_str) {
-            return ESP_ERR_NO_MEM;
+        removed++;
+    }
+    
+    // Los IDs nuevos se asignaron mientras los eliminados aún tenían handle:
+    // si la tabla se llenó, los que se quedaron sin él lo reciben ahora
+    if (medication_index_release_unbound() > 0) {
+        medication_index_rebuild(medications, medications_count);
+    }
+    
+    // El índice de IDs se confirma antes que los registros que dependen de él
+    medication_index_save_if_changed();
+    
+    // El índice solo se reescribe si cambió la lista o el orden de los IDs
+    bool index_changed = medications_count != old_count;
+    for (int i = 0; !index_changed && i < medications_count; i++) {
+        index_changed = strcmp(old_meds[i].id, medications[i].id) != 0;
+    }
+    
+    free(old_block);
+    free_loose_medications(sync_state.meds, sync_state.count);
+    sync_state.meds = NULL;
+    
+    esp_err_t result = ESP_OK;
+    for (int i = 0; i < medications_count; i++) {
+        if (!sync_state.changed[i]) {
+            continue;
         }
-        
-        // Obtener la clave corta para el medicamento
-        const char* short_key = get_short_key(medication->id);
-        esp_err_t err = nvs_set_str(med_nvs_handle, short_key, json_str);
-        free(json_str);
-        
+        err = save_medication_to_nvs(&medications[i]);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error saving medication to NVS: %s", esp_err_to_name(err));
-            return err;
+            result = err;
         }
-        
+    }
+    
+    if (index_changed) {
+        err = save_medications_index();
+        if (err != ESP_OK) {
+            result = err;
+        }
+    } else if (sync_state.added + sync_state.updated + removed > 0) {
         err = nvs_commit(med_nvs_handle);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Error committing to NVS: %s", esp_err_to_name(err));
-            return err;
+            result = err;
         }
-        
+    }
+    
+    ESP_LOGI(TAG, "Sincronización: %d nuevos, %d modificados, %d eliminados, %d sin cambios",
+             sync_state.added, sync_state.updated, removed, sync_state.unchanged);
+    
+    // Solo se avisa de los medicamentos que cambiaron
+    for (int i = 0; change_callback && i < medications_count; i++) {
+        if (sync_state.changed[i]) {
+            change_callback(&medications[i], MEDICATION_STORAGE_CHANGE_SYNCED);
+        }
+    }
+    
+    memset(&sync_state, 0, sizeof(sync_state));
+    
+    // Los índices de la cola apuntaban al arreglo anterior
+    medication_scheduler_rebuild();
+    medication_reminders_rebuild();
+    return result;
+}
+
+static esp_err_t storage_sync_end(bool apply) {
+    if (!apply) {
+        sync_abort();
         return ESP_OK;
     }
+    return sync_commit();
 }
 
-static esp_err_t save_medications_index(void) {
-    if (!med_nvs_handle) {
-        return ESP_ERR_INVALID_STATE;
+esp_err_t medication_storage_sync_end(bool apply) {
+    medication_storage_lock();
+    esp_err_t err = storage_sync_end(apply);
+    medication_storage_unlock();
+    return err;
+}
+
+// Rellena un medicamento (sin historial) a partir de su objeto JSON
+static esp_err_t parse_medication_json(const cJSON *medication_item, medication_t *med) {
+    memset(med, 0, sizeof(*med));
+    
+    if (!cJSON_IsObject(medication_item)) {
+        ESP_LOGW(TAG, "Item in medications array is not an object, skipping");
+        return ESP_ERR_INVALID_ARG;
     }
     
-    // Guardar conteo de medicamentos
-    esp_err_t err = nvs_set_u32(med_nvs_handle, NVS_MED_COUNT_KEY, medications_count);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error saving medications count: %s", esp_err_to_name(err));
-        return err;
+    // Obtener datos básicos del medicamento
+    cJSON *id = cJSON_GetObjectItem(medication_item, "id");
+    cJSON *name = cJSON_GetObjectItem(medication_item, "name");
+    cJSON *compartment = cJSON_GetObjectItem(medication_item, "compartment");
+    cJSON *type = cJSON_GetObjectItem(medication_item, "type");
+    cJSON *pills_per_dose = cJSON_GetObjectItem(medication_item, "pillsPerDose");
+    cJSON *total_pills = cJSON_GetObjectItem(medication_item, "totalPills");
+    
+    // Verificar campos obligatorios
+    if (!id || !cJSON_IsString(id) || !name || !cJSON_IsString(name) || 
+        !compartment || !cJSON_IsNumber(compartment) || !type || !cJSON_IsString(type)) {
+        ESP_LOGW(TAG, "Medication missing required fields, skipping");
+        return ESP_ERR_INVALID_ARG;
     }
     
-    // Guardar índice de medicamentos
+    // Copiar datos básicos
+    strncpy(med->id, id->valuestring, sizeof(med->id) - 1);
+    strncpy(med->name, name->valuestring, sizeof(med->name) - 1);
+    med->compartment = compartment->valueint;
+    strncpy(med->type, type->valuestring, sizeof(med->type) - 1);
+    
+    // Campos opcionales según tipo; en los líquidos la dosis va en ml y
+    // admite decimales, así que se guarda aparte en µl
+    bool is_pill = strcmp(med->type, "pill") == 0;
+    bool has_dose = pills_per_dose && cJSON_IsNumber(pills_per_dose);
+    if (is_pill) {
+        med->pills_per_dose = has_dose ? pills_per_dose->valueint : 1; // 1 por defecto
+    } else if (strcmp(med->type, "liquid") == 0) {
+        med->dose_volume_ul = medication_storage_dose_volume_ul(has_dose ? pills_per_dose->valuedouble : 1.0);
+    }
+    
+    if (is_pill) {
+        if (total_pills && cJSON_IsNumber(total_pills)) {
+            med->total_pills = total_pills->valueint;
+        } else {
+            med->total_pills = 0;
+        }
+    }
+    
+    // Procesar horarios
+    cJSON *schedules_array = cJSON_GetObjectItem(medication_item, "schedules");
+    if (!schedules_array || !cJSON_IsArray(schedules_array)) {
+        return ESP_OK;
+    }
+    
+    int schedules_count = cJSON_GetArraySize(schedules_array);
+    if (schedules_count <= 0) {
+        return ESP_OK;
+    }
+    
+    // El registro binario guarda como mucho MEDICATION_MAX_SCHEDULES: un
+    // medicamento con más no se puede guardar entero y anula la sincronización
+    int schedule_objects = 0;
+    cJSON *schedule_item;
+    cJSON_ArrayForEach(schedule_item, schedules_array) {
+        if (cJSON_IsObject(schedule_item)) {
+            schedule_objects++;
+        }
+    }
+    if (schedule_objects > MEDICATION_MAX_SCHEDULES) {
+        ESP_LOGE(TAG, "Medication %s has %d schedules (max %d), sync rejected",
+                 med->id, schedule_objects, MEDICATION_MAX_SCHEDULES);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    
+    med->schedules = calloc(schedules_count, sizeof(medication_schedule_t));
+    if (!med->schedules) {
+        ESP_LOGE(TAG, "Memory allocation failed for schedules");
+        return ESP_ERR_NO_MEM;
+    }
+    
+    // Procesar cada horario
+    int sched_index = 0;
+    cJSON_ArrayForEach(schedule_item, schedules_array) {
+        if (!cJSON_IsObject(schedule_item)) {
+            continue;
+        }
+        
+        medication_schedule_t *schedule = &med->schedules[sched_index];
+        
+        // Obtener ID del horario
+        cJSON *sched_id = cJSON_GetObjectItem(schedule_item, "id");
+        if (sched_id && cJSON_IsString(sched_id)) {
+            strncpy(schedule->id, sched_id->valuestring, sizeof(schedule->id) - 1);
+        } else {
+            // Generar ID si no existe
+            snprintf(schedule->id, sizeof(schedule->id), "sched_%d", sched_index);
+        }
+        
+        // Hora en minutos
+        cJSON *time = cJSON_GetObjectItem(schedule_item, "time");
+        if (time && cJSON_IsNumber(time)) {
+            schedule->time_in_minutes = time->valueint;
+        } else {
+            // Si no tiene hora, usar 8:00 AM como predeterminado
+            schedule->time_in_minutes = 8 * 60;
+        }
+        
+        // Modo de intervalo
+        cJSON *interval_mode = cJSON_GetObjectItem(schedule_item, "intervalMode");
+        schedule->interval_mode = interval_mode && cJSON_IsTrue(interval_mode);
+        
+        if (schedule->interval_mode) {
+            // Modo intervalo
+            cJSON *interval_hours = cJSON_GetObjectItem(schedule_item, "intervalHours");
+            if (interval_hours && cJSON_IsNumber(interval_hours)) {
+                schedule->interval_hours = interval_hours->valueint;
+            } else {
+                schedule->interval_hours = 24; // Por defecto, cada 24 horas
+            }
+            
+            // La fecha de fin se fija al incorporar el horario
+            cJSON *treatment_days = cJSON_GetObjectItem(schedule_item, "treatmentDays");
+            if (treatment_days && cJSON_IsNumber(treatment_days)) {
+                schedule->treatment_days = treatment_days->valueint;
+            } else {
+                schedule->treatment_days = 0; // Sin fin definido
+            }
+        } else {
+            // Modo días de semana
+            cJSON *days_array = cJSON_GetObjectItem(schedule_item, "days");
+            
+            if (days_array && cJSON_IsArray(days_array)) {
+                // Marcar días válidos sin duplicados
+                uint8_t valid_days[7] = {0};
+                int valid_count = 0;
+                
+                cJSON *day_item;
+                cJSON_ArrayForEach(day_item, days_array) {
+                    if (cJSON_IsNumber(day_item)) {
+                        int day = day_item->valueint;
+                        if (day >= 1 && day <= 7 && !valid_days[day-1]) {
+                            valid_days[day-1] = 1;
+                            valid_count++;
+                        }
+                    }
+                }
+                
+                // Copiar días en orden para que la comparación sea estable
+                for (int i = 0, j = 0; i < 7; i++) {
+                    if (valid_days[i]) {
+                        schedule->days[j++] = i + 1;
+                    }
+                }
+                schedule->days_count = valid_count;
+            }
+            
+            if (schedule->days_count == 0) {
+                // Si no hay días seleccionados, usar todos los días
+                for (int i = 1; i <= 7; i++) {
+                    schedule->days[i-1] = i;
+                }
+                schedule->days_count = 7;
+            }
+        }
+        
+        sched_index++;
+    }
+    med->schedules_count = sched_index;
+    
+    return ESP_OK;
+}
+
+static esp_err_t storage_apply_sync(const cJSON *payload) {
+    if (!payload) {
+        ESP_LOGE(TAG, "No 'payload' field in JSON");
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    // Obtener el array "medications"
+    cJSON *medications_array = cJSON_GetObjectItem(payload, "medications");
+    if (!medications_array || !cJSON_IsArray(medications_array)) {
+        ESP_LOGE(TAG, "No 'medications' array in payload");
+        return ESP_FAIL;
+    }
+    
+    // Aplicar la sincronización como diferencia sobre el estado actual
+    medication_storage_sync_begin();
+    
+    cJSON *medication_item;
+    cJSON_ArrayForEach(medication_item, medications_array) {
+        medication_t incoming;
+        esp_err_t err = parse_medication_json(medication_item, &incoming);
+        if (err == ESP_ERR_INVALID_ARG) {
+            continue;
+        }
+        if (err == ESP_OK) {
+            err = medication_storage_sync_upsert(&incoming);
+        }
+        if (err != ESP_OK) {
+            // Sin memoria o con demasiados horarios: el estado actual se mantiene intacto
+            medication_storage_sync_end(false);
+            return err;
+        }
+    }
+    
+    esp_err_t err = medication_storage_sync_end(true);
+    
+    ESP_LOGI(TAG, "Successfully processed %d medications", medications_count);
+    return err;
+}
+
+esp_err_t medication_storage_apply_sync(const cJSON *payload) {
+    medication_storage_lock();
+    esp_err_t err = storage_apply_sync(payload);
+    medication_storage_unlock();
+    return err;
+}
+
+esp_err_t medication_storage_process_json(const char* json_str) {
+    if (json_str == NULL) {
+        ESP_LOGE(TAG, "Received NULL JSON string");
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    ESP_LOGD(TAG, "Processing medication JSON: %s", json_str);
+    
+    // Parsear JSON
+    cJSON *root = cJSON_Parse(json_str);
+    if (!root) {
+        ESP_LOGE(TAG, "Error parsing JSON: %s", cJSON_GetErrorPtr());
+        return ESP_FAIL;
+    }
+    
+    esp_err_t err = medication_storage_apply_sync(cJSON_GetObjectItem(root, "payload"));
+    cJSON_Delete(root);
+    return err;
+}
+
+// Serializa un medicamento en record_buffer; devuelve el tamaño del registro
+static size_t encode_medication_record(const medication_t *medication) {
+    med_record_header_t *hdr = (med_record_header_t *)record_buffer;
+    memset(hdr, 0, sizeof(*hdr));
+    
+    int schedules_count = medication->schedules ? medication->schedules_count : 0;
+    // La sincronización ya rechaza los medicamentos con más horarios
+    if (schedules_count > MED_RECORD_MAX_SCHEDULES) {
+        ESP_LOGW(TAG, "Medication %s has %d schedules, only %d will be stored",
+                 medication->id, schedules_count, MED_RECORD_MAX_SCHEDULES);
+        schedules_count = MED_RECORD_MAX_SCHEDULES;
+    }
+    
+    hdr->magic = MED_RECORD_MAGIC;
+    hdr->version = MED_RECORD_VERSION;
+    hdr->schedules_count = schedules_count;
+    memcpy(hdr->id, medication->id, sizeof(hdr->id));
+    memcpy(hdr->name, medication->name, sizeof(hdr->name));
+    memcpy(hdr->type, medication->type, sizeof(hdr->type));
+    hdr->compartment = medication->compartment;
+    hdr->pills_per_dose = medication->pills_per_dose;
+    hdr->total_pills = medication->total_pills;
+    hdr->dose_volume_ul = medication->dose_volume_ul;
+    
+    med_record_schedule_t *rec = (med_record_schedule_t *)(record_buffer + sizeof(*hdr));
+    for (int i = 0; i < schedules_count; i++, rec++) {
+        const medication_schedule_t *schedule = &medication->schedules[i];
+        
+        memcpy(rec->id, schedule->id, sizeof(rec->id));
+        rec->time_in_minutes = schedule->time_in_minutes;
+        rec->flags = schedule->interval_mode ? MED_RECORD_FLAG_INTERVAL : 0;
+        rec->interval_hours = schedule->interval_hours;
+        rec->treatment_days = schedule->treatment_days;
+        rec->days_mask = 0;
+        for (int j = 0; j < schedule->days_count && j < 7; j++) {
+            if (schedule->days[j] >= 1 && schedule->days[j] <= 7) {
+                rec->days_mask |= 1 << (schedule->days[j] - 1);
+            }
+        }
+        rec->treatment_end_date = schedule->treatment_end_date;
+        rec->next_dispense_time = schedule->next_dispense_time;
+        rec->last_dispensed_time = schedule->last_dispensed_time;
+        rec->last_taken_time = schedule->last_taken_time;
+    }
+    
+    return sizeof(*hdr) + schedules_count * sizeof(med_record_schedule_t);
+}
+
+// Reconstruye un medicamento desde un registro binario leído en record_buffer
+static esp_err_t decode_medication_record(size_t length, medication_t *med) {
+    const med_record_header_t *hdr = (const med_record_header_t *)record_buffer;
+    
+    if (length < MED_RECORD_V1_HEADER_SIZE || hdr->magic != MED_RECORD_MAGIC) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (hdr->version != MED_RECORD_VERSION && hdr->version != 1) {
+        ESP_LOGE(TAG, "Unsupported medication record version %d", hdr->version);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    size_t header_size = hdr->version == 1 ? MED_RECORD_V1_HEADER_SIZE : sizeof(*hdr);
+    if (hdr->schedules_count > MED_RECORD_MAX_SCHEDULES ||
+        length != header_size + hdr->schedules_count * sizeof(med_record_schedule_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    
+    memcpy(med->id, hdr->id, sizeof(med->id));
+    memcpy(med->name, hdr->name, sizeof(med->name));
+    memcpy(med->type, hdr->type, sizeof(med->type));
+    med->id[sizeof(med->id) - 1] = '\0';
+    med->name[sizeof(med->name) - 1] = '\0';
+    med->type[sizeof(med->type) - 1] = '\0';
+    med->compartment = hdr->compartment;
+    med->pills_per_dose = hdr->pills_per_dose;
+    med->total_pills = hdr->total_pills;
+    if (hdr->version == 1) {
+        // La versión 1 guardaba la dosis líquida como ml enteros en pills_per_dose
+        bool is_liquid = strcmp(med->type, "liquid") == 0;
+        med->dose_volume_ul = is_liquid ? medication_storage_dose_volume_ul(hdr->pills_per_dose) : 0;
+        if (is_liquid) {
+            med->pills_per_dose = 0;
+        }
+    } else {
+        med->dose_volume_ul = hdr->dose_volume_ul;
+    }
+    med->schedules = NULL;
+    med->schedules_count = 0;
+    
+    if (hdr->schedules_count == 0) {
+        return ESP_OK;
+    }
+    
+    med->schedules = calloc(hdr->schedules_count, sizeof(medication_schedule_t));
+    if (!med->schedules) {
+        ESP_LOGE(TAG, "Memory allocation failed for schedules");
+        return ESP_ERR_NO_MEM;
+    }
+    
+    const med_record_schedule_t *rec = (const med_record_schedule_t *)(record_buffer + header_size);
+    for (int i = 0; i < hdr->schedules_count; i++, rec++) {
+        medication_schedule_t *schedule = &med->schedules[i];
+        
+        memcpy(schedule->id, rec->id, sizeof(schedule->id));
+        schedule->id[sizeof(schedule->id) - 1] = '\0';
+        schedule->time_in_minutes = rec->time_in_minutes;
+        schedule->interval_mode = (rec->flags & MED_RECORD_FLAG_INTERVAL) != 0;
+        schedule->interval_hours = rec->interval_hours;
+        schedule->treatment_days = rec->treatment_days;
+        schedule->days_count = 0;
+        for (int d = 1; d <= 7; d++) {
+            if (rec->days_mask & (1 << (d - 1))) {
+                schedule->days[schedule->days_count++] = d;
+            }
+        }
+        schedule->treatment_end_date = rec->treatment_end_date;
+        schedule->next_dispense_time = rec->next_dispense_time;
+        schedule->last_dispensed_time = rec->last_dispensed_time;
+        schedule->last_taken_time = rec->last_taken_time;
+    }
+    med->schedules_count = hdr->schedules_count;
+    
+    return ESP_OK;
+}
+
+static esp_err_t save_medication_to_nvs(const medication_t *medication) {
+    if (!medication || !med_nvs_handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    size_t record_size = encode_medication_record(medication);
+    
+    // Guardar en NVS usando la clave del handle
+    // (el commit lo hace quien llama, una vez por lote de registros)
+    char key[16];
+    if (!medication_record_key(medication->id, key, sizeof(key))) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = nvs_set_blob(med_nvs_handle, key, record_buffer, record_size);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving medication to NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    return ESP_OK;
+}
+
+// Integra los eventos del diario en los registros base y lo vacía
+static esp_err_t compact_journal(void) {
+    if (medication_journal_pending() == 0) {
+        return ESP_OK;
+    }
+    
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < medications_count; i++) {
+        if (journal_dirty(i)) {
+            esp_err_t save_err = save_medication_to_nvs(&medications[i]);
+            if (save_err != ESP_OK) {
+                err = save_err;
+            }
+        }
+    }
+    
+    if (err == ESP_OK) {
+        err = nvs_commit(med_nvs_handle);
+    }
+    if (err != ESP_OK) {
+        // El diario se conserva: sus eventos siguen siendo recuperables
+        ESP_LOGE(TAG, "Error compacting dose journal: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    memset(journal_dirty_mask, 0, sizeof(journal_dirty_mask));
+    return medication_journal_truncate();
+}
+
+// Reescribe todos los registros base; el diario queda vacío
+static esp_err_t flush_all_records(void) {
+    esp_err_t err = ESP_OK;
+    
+    for (int i = 0; i < medications_count; i++) {
+        esp_err_t save_err = save_medication_to_nvs(&medications[i]);
+        if (save_err != ESP_OK) {
+            ESP_LOGW(TAG, "Error al guardar medicamento %s: %s", 
+                     medications[i].name, esp_err_to_name(save_err));
+            err = save_err;  // Guardar el último error pero continuar con los demás
+        }
+    }
+    
+    esp_err_t commit_err = nvs_commit(med_nvs_handle);
+    if (commit_err != ESP_OK) {
+        ESP_LOGE(TAG, "Error al hacer commit de los cambios: %s", esp_err_to_name(commit_err));
+        return commit_err;  // Priorizar el error de commit
+    }
+    
+    if (err == ESP_OK) {
+        memset(journal_dirty_mask, 0, sizeof(journal_dirty_mask));
+        medication_journal_truncate();
+    }
+    
+    return err;
+}
+
+// Registra un evento de dosis en el diario en lugar de reescribir el registro
+static esp_err_t record_dose_event(int med_index, int sched_index, medication_journal_event_t type) {
+    medication_t *med = &medications[med_index];
+    medication_schedule_t *schedule = &med->schedules[sched_index];
+    
+    if (med_index < MAX_MEDICATIONS && sched_index <= UINT8_MAX) {
+        if (medication_journal_pending() >= MEDICATION_JOURNAL_SLOTS) {
+            compact_journal();
+        }
+        
+        int64_t timestamp = schedule->last_dispensed_time;
+        if (type == MEDICATION_JOURNAL_TAKEN) {
+            timestamp = schedule->last_taken_time;
+        } else if (type == MEDICATION_JOURNAL_FAILED) {
+            timestamp = get_current_time_ms();
+        }
+        
+        medication_journal_entry_t entry = {
+            .type = type,
+            .med_index = med_index,
+            .sched_index = sched_index,
+            .med_tag = medication_journal_tag(med->id),
+            .total_pills = med->total_pills,
+            .timestamp = timestamp,
+            .next_dispense_time = schedule->next_dispense_time,
+        };
+        
+        if (medication_journal_append(&entry) == ESP_OK) {
+            set_journal_dirty(med_index, true);
+            return ESP_OK;
+        }
+    }
+    
+    // Sin diario: guardar el registro completo. Se compacta a la vez para que
+    // ningún evento anterior se reproduzca sobre un registro más reciente.
+    esp_err_t err = save_medication_to_nvs(med);
+    if (err == ESP_OK) {
+        err = nvs_commit(med_nvs_handle);
+    }
+    if (err == ESP_OK) {
+        if (med_index < MAX_MEDICATIONS) {
+            set_journal_dirty(med_index, false);
+        }
+        err = compact_journal();
+    }
+    return err;
+}
+
+// Aplica un evento del diario durante la carga
+static void apply_journal_entry(const medication_journal_entry_t *entry) {
+    if (entry->med_index >= medications_count) {
+        return;
+    }
+    
+    medication_t *med = &medications[entry->med_index];
+    if (medication_journal_tag(med->id) != entry->med_tag ||
+        entry->sched_index >= med->schedules_count) {
+        ESP_LOGW(TAG, "Evento del diario no corresponde a ningún horario, se descarta");
+        return;
+    }
+    
+    // El registro base aún no incluye el evento: la compactación lo guardará
+    set_journal_dirty(entry->med_index, true);
+    
+    medication_schedule_t *schedule = &med->schedules[entry->sched_index];
+    switch (entry->type) {
+        case MEDICATION_JOURNAL_DISPENSED:
+            schedule->last_dispensed_time = entry->timestamp;
+            schedule->next_dispense_time = entry->next_dispense_time;
+            med->total_pills = entry->total_pills;
+            break;
+        case MEDICATION_JOURNAL_TAKEN:
+            schedule->last_taken_time = entry->timestamp;
+            break;
+        case MEDICATION_JOURNAL_FAILED:
+            // La dosis fallida no cuenta como dispensada: solo avanza el horario
+            schedule->next_dispense_time = entry->next_dispense_time;
+            break;
+        default:
+            break;
+    }
+}
+
+static esp_err_t save_medications_index(void) {
+    if (!med_nvs_handle) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    // Guardar conteo de medicamentos
+    esp_err_t err = nvs_set_u32(med_nvs_handle, NVS_MED_COUNT_KEY, medications_count);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving medications count: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    // Guardar índice de medicamentos
     for (int i = 0; i < medications_count; i++) {
         char key[32];
         snprintf(key, sizeof(key), "%s%d", NVS_MED_INDEX_PREFIX, i);
@@ -615,382 +1201,353 @@ static esp_err_t save_medications_index(void) {
     return ESP_OK;
 }
 
+// Decodifica un registro en el formato JSON anterior (solo para migración)
+static esp_err_t decode_legacy_json_record(const char *json_str, medication_t *med) {
+    cJSON *med_obj = cJSON_Parse(json_str);
+    if (!med_obj) {
+        return ESP_FAIL;
+    }
+    
+    cJSON *name = cJSON_GetObjectItem(med_obj, "name");
+    if (name && cJSON_IsString(name)) {
+        strncpy(med->name, name->valuestring, sizeof(med->name) - 1);
+    }
+    
+    cJSON *compartment = cJSON_GetObjectItem(med_obj, "compartment");
+    if (compartment && cJSON_IsNumber(compartment)) {
+        med->compartment = compartment->valueint;
+    }
+    
+    cJSON *type = cJSON_GetObjectItem(med_obj, "type");
+    if (type && cJSON_IsString(type)) {
+        strncpy(med->type, type->valuestring, sizeof(med->type) - 1);
+    }
+    
+    cJSON *pills_per_dose = cJSON_GetObjectItem(med_obj, "pillsPerDose");
+    if (pills_per_dose && cJSON_IsNumber(pills_per_dose)) {
+        if (strcmp(med->type, "liquid") == 0) {
+            med->dose_volume_ul = medication_storage_dose_volume_ul(pills_per_dose->valuedouble);
+        } else {
+            med->pills_per_dose = pills_per_dose->valueint;
+        }
+    }
+    
+    cJSON *total_pills = cJSON_GetObjectItem(med_obj, "totalPills");
+    if (total_pills && cJSON_IsNumber(total_pills)) {
+        med->total_pills = total_pills->valueint;
+    }
+    
+    // Horarios
+    cJSON *schedules_array = cJSON_GetObjectItem(med_obj, "schedules");
+    if (schedules_array && cJSON_IsArray(schedules_array)) {
+        int schedules_count = cJSON_GetArraySize(schedules_array);
+        if (schedules_count > 0) {
+            med->schedules = calloc(schedules_count, sizeof(medication_schedule_t));
+            if (!med->schedules) {
+                ESP_LOGE(TAG, "Memory allocation failed for schedules");
+                cJSON_Delete(med_obj);
+                return ESP_ERR_NO_MEM;
+            }
+            
+            // Cargar cada horario
+            int valid_scheds = 0;
+            cJSON *sched_item;
+            cJSON_ArrayForEach(sched_item, schedules_array) {
+                if (valid_scheds >= schedules_count) break;
+                
+                medication_schedule_t *schedule = &med->schedules[valid_scheds];
+                
+                cJSON *sched_id = cJSON_GetObjectItem(sched_item, "id");
+                if (sched_id && cJSON_IsString(sched_id)) {
+                    strncpy(schedule->id, sched_id->valuestring, sizeof(schedule->id) - 1);
+                } else {
+                    snprintf(schedule->id, sizeof(schedule->id), "sched_%d", valid_scheds);
+                }
+                
+                cJSON *time = cJSON_GetObjectItem(sched_item, "timeInMinutes");
+                if (time && cJSON_IsNumber(time)) {
+                    schedule->time_in_minutes = time->valueint;
+                }
+                
+                cJSON *interval_mode = cJSON_GetObjectItem(sched_item, "intervalMode");
+                schedule->interval_mode = interval_mode && cJSON_IsTrue(interval_mode);
+                
+                cJSON *interval_hours = cJSON_GetObjectItem(sched_item, "intervalHours");
+                if (interval_hours && cJSON_IsNumber(interval_hours)) {
+                    schedule->interval_hours = interval_hours->valueint;
+                }
+                
+                cJSON *treatment_days = cJSON_GetObjectItem(sched_item, "treatmentDays");
+                if (treatment_days && cJSON_IsNumber(treatment_days)) {
+                    schedule->treatment_days = treatment_days->valueint;
+                }
+                
+                cJSON *treatment_end_date = cJSON_GetObjectItem(sched_item, "treatmentEndDate");
+                if (treatment_end_date && cJSON_IsNumber(treatment_end_date)) {
+                    schedule->treatment_end_date = (int64_t)treatment_end_date->valuedouble;
+                }
+                
+                cJSON *next_dispense_time = cJSON_GetObjectItem(sched_item, "nextDispenseTime");
+                if (next_dispense_time && cJSON_IsNumber(next_dispense_time)) {
+                    schedule->next_dispense_time = (int64_t)next_dispense_time->valuedouble;
+                }
+                
+                cJSON *last_dispensed_time = cJSON_GetObjectItem(sched_item, "lastDispensedTime");
+                if (last_dispensed_time && cJSON_IsNumber(last_dispensed_time)) {
+                    schedule->last_dispensed_time = (int64_t)last_dispensed_time->valuedouble;
+                }
+                
+                schedule->days_count = 0;
+                cJSON *days_array = cJSON_GetObjectItem(sched_item, "days");
+                if (days_array && cJSON_IsArray(days_array)) {
+                    int days_count = cJSON_GetArraySize(days_array);
+                    for (int j = 0; j < days_count && j < 7; j++) {
+                        cJSON *day_item = cJSON_GetArrayItem(days_array, j);
+                        if (day_item && cJSON_IsNumber(day_item)) {
+                            int day = day_item->valueint;
+                            if (day >= 1 && day <= 7) {
+                                schedule->days[schedule->days_count++] = day;
+                            }
+                        }
+                    }
+                }
+                
+                valid_scheds++;
+            }
+            
+            med->schedules_count = valid_scheds;
+        }
+    }
+    
+    cJSON_Delete(med_obj);
+    return ESP_OK;
+}
+
+// Lee el registro de un medicamento; si aún está en formato JSON lo decodifica
+// y marca *legacy para que el llamador lo reescriba en binario
+static esp_err_t load_medication_record(const char *short_key, const char *med_id,
+                                        medication_t *med, bool *legacy) {
+    *legacy = false;
+    
+    size_t length = sizeof(record_buffer);
+    esp_err_t err = nvs_get_blob(med_nvs_handle, short_key, record_buffer, &length);
+    if (err == ESP_OK) {
+        return decode_medication_record(length, med);
+    }
+    if (err != ESP_ERR_NVS_NOT_FOUND && err != ESP_ERR_NVS_TYPE_MISMATCH) {
+        return err;
+    }
+    
+    // Registro en formato anterior (cadena JSON)
+    size_t required_size = 0;
+    err = nvs_get_str(med_nvs_handle, short_key, NULL, &required_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // Una migración interrumpida dejó el registro solo en la clave temporal
+        length = sizeof(record_buffer);
+        if (nvs_get_blob(med_nvs_handle, NVS_MED_MIGRATION_KEY, record_buffer, &length) != ESP_OK ||
+            length < MED_RECORD_V1_HEADER_SIZE ||
+            strncmp(((const med_record_header_t *)record_buffer)->id, med_id,
+                    sizeof(((med_record_header_t *)0)->id) - 1) != 0) {
+            return err;
+        }
+        err = decode_medication_record(length, med);
+        *legacy = (err == ESP_OK);
+        return err;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    
+    char *json_str = malloc(required_size);
+    if (!json_str) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    err = nvs_get_str(med_nvs_handle, short_key, json_str, &required_size);
+    if (err == ESP_OK) {
+        err = decode_legacy_json_record(json_str, med);
+    }
+    free(json_str);
+    
+    *legacy = (err == ESP_OK);
+    return err;
+}
+
+// Pasa un registro JSON al formato binario sin que el medicamento deje de
+// estar en NVS en ningún momento: el blob se escribe antes en una clave
+// temporal, que load_medication_record() consulta si el corte llega entre
+// el borrado del JSON y la escritura definitiva
+static esp_err_t migrate_legacy_record(const char *record_key, const medication_t *med) {
+    size_t record_size = encode_medication_record(med);
+    
+    esp_err_t err = nvs_set_blob(med_nvs_handle, NVS_MED_MIGRATION_KEY, record_buffer, record_size);
+    if (err == ESP_OK) {
+        err = nvs_commit(med_nvs_handle);
+    }
+    if (err != ESP_OK) {
+        // El registro JSON sigue intacto: se vuelve a intentar en el próximo arranque
+        ESP_LOGE(TAG, "Error staging migration of %s: %s", med->id, esp_err_to_name(err));
+        return err;
+    }
+    
+    err = nvs_erase_key(med_nvs_handle, record_key);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error erasing legacy record of %s: %s", med->id, esp_err_to_name(err));
+        return err;
+    }
+    
+    // record_buffer conserva el registro codificado
+    err = nvs_set_blob(med_nvs_handle, record_key, record_buffer, record_size);
+    if (err == ESP_OK) {
+        err = nvs_commit(med_nvs_handle);
+    }
+    if (err != ESP_OK) {
+        // La copia temporal se recupera en el próximo arranque
+        ESP_LOGE(TAG, "Error saving migrated record of %s: %s", med->id, esp_err_to_name(err));
+        return err;
+    }
+    
+    nvs_erase_key(med_nvs_handle, NVS_MED_MIGRATION_KEY);
+    return nvs_commit(med_nvs_handle);
+}
+
 static esp_err_t load_medications_from_nvs(void) {
     if (!med_nvs_handle) {
         return ESP_ERR_INVALID_STATE;
     }
     
     // Obtener conteo de medicamentos
-    esp_err_t err = nvs_get_u32(med_nvs_handle, NVS_MED_COUNT_KEY, (uint32_t*)&medications_count);
+    uint32_t stored_count = 0;
+    esp_err_t err = nvs_get_u32(med_nvs_handle, NVS_MED_COUNT_KEY, &stored_count);
     if (err != ESP_OK) {
         if (err == ESP_ERR_NVS_NOT_FOUND) {
             // No hay medicamentos guardados
-            medications_count = 0;
             return ESP_OK;
         }
         ESP_LOGE(TAG, "Error getting medications count: %s", esp_err_to_name(err));
         return err;
     }
     
-    if (medications_count <= 0) {
+    if (stored_count == 0) {
         // No hay medicamentos
         return ESP_OK;
     }
     
-    // Asignar memoria para medicamentos
-    medications = calloc(medications_count, sizeof(medication_t));
-    if (!medications) {
+    // Los registros se leen a un arreglo temporal y luego se agrupan en el bloque
+    medication_t *loaded = calloc(stored_count, sizeof(medication_t));
+    if (!loaded) {
         ESP_LOGE(TAG, "Memory allocation failed for medications");
-        medications_count = 0;
         return ESP_ERR_NO_MEM;
     }
     
-    int valid_meds = 0;  // Añadir esta declaración
+    int valid_meds = 0;
+    int migrated_meds = 0;
     
     // Para cada medicamento en el índice
-    for (int i = 0; i < medications_count; i++) {
+    for (int i = 0; i < (int)stored_count; i++) {
         char key[32];
         snprintf(key, sizeof(key), "%s%d", NVS_MED_INDEX_PREFIX, i);
         
         // Obtener ID del medicamento (será el ID largo)
-        size_t required_size = 0;
-        err = nvs_get_str(med_nvs_handle, key, NULL, &required_size);
-        if (err != ESP_OK) {
-            ESP_LOGW(TAG, "Error getting medication ID size at index %d: %s", i, esp_err_to_name(err));
-            continue;
-        }
-        
-        char *med_id = malloc(required_size);
-        if (!med_id) {
-            ESP_LOGE(TAG, "Memory allocation failed for medication ID");
-            continue;
-        }
-        
+        char med_id[MEDICATION_ID_MAX_LEN];
+        size_t required_size = sizeof(med_id);
         err = nvs_get_str(med_nvs_handle, key, med_id, &required_size);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting medication ID at index %d: %s", i, esp_err_to_name(err));
-            free(med_id);
+            ESP_LOGW(TAG, "Error getting medication ID at index %d: %s", i, esp_err_to_name(err));
             continue;
         }
         
-        // Obtener la clave corta para este ID
-        const char* short_key = get_short_key(med_id);
-        
-        // Obtener datos del medicamento usando la clave corta
-        required_size = 0;
-        err = nvs_get_str(med_nvs_handle, short_key, NULL, &required_size);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting medication data size for %s: %s", med_id, esp_err_to_name(err));
-            free(med_id);
-            continue;
-        }
-        
-        char *json_str = malloc(required_size);
-        if (!json_str) {
-            ESP_LOGE(TAG, "Memory allocation failed for medication data");
-            free(med_id);
+        // Obtener la clave del registro a partir del handle del ID
+        char record_key[16];
+        if (!medication_record_key(med_id, record_key, sizeof(record_key))) {
             continue;
         }
+        medication_t *med = &loaded[valid_meds];
+        bool legacy = false;
         
-        err = nvs_get_str(med_nvs_handle, short_key, json_str, &required_size);
+        err = load_medication_record(record_key, med_id, med, &legacy);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error getting medication data for %s: %s", med_id, esp_err_to_name(err));
-            free(med_id);
-            free(json_str);
+            ESP_LOGE(TAG, "Error loading medication %s: %s", med_id, esp_err_to_name(err));
+            free(med->schedules);
+            memset(med, 0, sizeof(*med));
             continue;
         }
         
-        // Parsear JSON
-        cJSON *med_obj = cJSON_Parse(json_str);
-        free(json_str);
+        // El índice es la fuente del ID largo
+        size_t id_len = strnlen(med_id, sizeof(med->id) - 1);
+        memcpy(med->id, med_id, id_len);
+        med->id[id_len] = '\0';
         
-        if (!med_obj) {
-            ESP_LOGE(TAG, "Error parsing JSON for medication %s", med_id);
-            free(med_id);
-            continue;
+        // Migrar registros JSON al formato binario (una sola vez)
+        if (legacy && migrate_legacy_record(record_key, med) == ESP_OK) {
+            migrated_meds++;
         }
         
-        // Copiar datos al medicamento
-        medication_t *med = &medications[valid_meds];
-        
-        // ID y campos básicos
-        strncpy(med->id, med_id, sizeof(med->id) - 1);
-        free(med_id);
-        
-        cJSON *name = cJSON_GetObjectItem(med_obj, "name");
-        if (name && cJSON_IsString(name)) {
-            strncpy(med->name, name->valuestring, sizeof(med->name) - 1);
-        }
-        
-        cJSON *compartment = cJSON_GetObjectItem(med_obj, "compartment");
-        if (compartment && cJSON_IsNumber(compartment)) {
-            med->compartment = compartment->valueint;
-        }
-        
-        cJSON *type = cJSON_GetObjectItem(med_obj, "type");
-        if (type && cJSON_IsString(type)) {
-            strncpy(med->type, type->valuestring, sizeof(med->type) - 1);
-        }
-        
-        cJSON *pills_per_dose = cJSON_GetObjectItem(med_obj, "pillsPerDose");
-        if (pills_per_dose && cJSON_IsNumber(pills_per_dose)) {
-            med->pills_per_dose = pills_per_dose->valueint;
-        }
-        
-        cJSON *total_pills = cJSON_GetObjectItem(med_obj, "totalPills");
-        if (total_pills && cJSON_IsNumber(total_pills)) {
-            med->total_pills = total_pills->valueint;
-        }
-        
-        // Horarios
-        cJSON *schedules_array = cJSON_GetObjectItem(med_obj, "schedules");
-        if (schedules_array && cJSON_IsArray(schedules_array)) {
-            int schedules_count = cJSON_GetArraySize(schedules_array);
-            if (schedules_count > 0) {
-                med->schedules = calloc(schedules_count, sizeof(medication_schedule_t));
-                if (!med->schedules) {
-                    ESP_LOGE(TAG, "Memory allocation failed for schedules");
-                    cJSON_Delete(med_obj);
-                    continue;
-                }
-                
-                // Cargar cada horario
-                int valid_scheds = 0;
-                cJSON *sched_item;
-                int index = 0;
-                cJSON_ArrayForEach(sched_item, schedules_array) {
-                    if (index >= schedules_count) break;
-                    
-                    medication_schedule_t *schedule = &med->schedules[valid_scheds];
-                    
-                    // ID del horario
-                    cJSON *sched_id = cJSON_GetObjectItem(sched_item, "id");
-                    if (sched_id && cJSON_IsString(sched_id)) {
-                        strncpy(schedule->id, sched_id->valuestring, sizeof(schedule->id) - 1);
-                    } else {
-                        snprintf(schedule->id, sizeof(schedule->id), "sched_%d", index);
-                    }
-                    
-                    // Hora en minutos
-                    cJSON *time = cJSON_GetObjectItem(sched_item, "timeInMinutes");
-                    if (time && cJSON_IsNumber(time)) {
-                        schedule->time_in_minutes = time->valueint;
-                    }
-                    
-                    // Modo intervalo
-                    cJSON *interval_mode = cJSON_GetObjectItem(sched_item, "intervalMode");
-                    schedule->interval_mode = interval_mode && cJSON_IsTrue(interval_mode);
-                    
-                    // Horas de intervalo
-                    cJSON *interval_hours = cJSON_GetObjectItem(sched_item, "intervalHours");
-                    if (interval_hours && cJSON_IsNumber(interval_hours)) {
-                        schedule->interval_hours = interval_hours->valueint;
-                    }
-                    
-                    // Días de tratamiento
-                    cJSON *treatment_days = cJSON_GetObjectItem(sched_item, "treatmentDays");
-                    if (treatment_days && cJSON_IsNumber(treatment_days)) {
-                        schedule->treatment_days = treatment_days->valueint;
-                    }
-                    
-                    // Fecha fin tratamiento
-                    cJSON *treatment_end_date = cJSON_GetObjectItem(sched_item, "treatmentEndDate");
-                    if (treatment_end_date && cJSON_IsNumber(treatment_end_date)) {
-                        schedule->treatment_end_date = (int64_t)treatment_end_date->valuedouble;
-                    }
-                    
-                    // Próxima dispensación
-                    cJSON *next_dispense_time = cJSON_GetObjectItem(sched_item, "nextDispenseTime");
-                    if (next_dispense_time && cJSON_IsNumber(next_dispense_time)) {
-                        schedule->next_dispense_time = (int64_t)next_dispense_time->valuedouble;
-                    }
-                    
-                    // Última dispensación
-                    cJSON *last_dispensed_time = cJSON_GetObjectItem(sched_item, "lastDispensedTime");
-                    if (last_dispensed_time && cJSON_IsNumber(last_dispensed_time)) {
-                        schedule->last_dispensed_time = (int64_t)last_dispensed_time->valuedouble;
-                    }
-                    
-                    // Días seleccionados
-                    schedule->days_count = 0;
-                    cJSON *days_array = cJSON_GetObjectItem(sched_item, "days");
-                    if (days_array && cJSON_IsArray(days_array)) {
-                        int days_count = cJSON_GetArraySize(days_array);
-                        for (int j = 0; j < days_count && j < 7; j++) {
-                            cJSON *day_item = cJSON_GetArrayItem(days_array, j);
-                            if (day_item && cJSON_IsNumber(day_item)) {
-                                int day = day_item->valueint;
-                                if (day >= 1 && day <= 7) {
-                                    schedule->days[schedule->days_count++] = day;
-                                }
-                            }
-                        }
-                    }
-                    
-                    valid_scheds++;
-                    index++;
-                }
-                
-                med->schedules_count = valid_scheds;
-            }
-        }
-        
-        cJSON_Delete(med_obj);
         valid_meds++;
     }
     
-    // Actualizar el contador real
-    medications_count = valid_meds;
+    // Agrupar medicamentos y horarios en un único bloque
+    err = arena_install(loaded, valid_meds, NULL);
+    free_loose_medications(loaded, valid_meds);
+    if (err != ESP_OK) {
+        return err;
+    }
     
-    // Calcular próximas dispensaciones
-    medication_storage_update_next_dispense_times();
+    // Los handles de registros que ya no están en el índice quedan libres
+    medication_index_release_unbound();
+    medication_index_save_if_changed();
+    
+    if (migrated_meds > 0) {
+        ESP_LOGI(TAG, "Migrated %d medication records from JSON to binary format", migrated_meds);
+    }
+    
+    // Recuperar los eventos de dosis posteriores a los registros base
+    // (acotado: como mucho MEDICATION_JOURNAL_SLOTS eventos)
+    int replayed = medication_journal_replay(apply_journal_entry);
+    if (replayed > 0) {
+        ESP_LOGI(TAG, "Recovered %d dose events from journal", replayed);
+    }
+    
+    // Calcular próximas dispensaciones, solo en memoria: la recuperación de
+    // dispensaciones corre después y no debe encontrar los registros
+    // reescritos. Sin NTP el reloj sigue en 1970: se conservan los tiempos
+    // guardados hasta medication_storage_resume_schedule()
+    if (medication_clock_is_reliable()) {
+        medication_storage_update_next_dispense_times();
+    } else {
+        ESP_LOGW(TAG, "Hora no fiable: próximas dispensaciones aplazadas");
+        next_times_deferred = true;
+    }
     
     return ESP_OK;
 }
 
-// Obtener la hora actual en milisegundos desde EPOCH
+// Obtener la hora actual en milisegundos desde EPOCH (reloj sustituible)
 static int64_t get_current_time_ms(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (int64_t)tv.tv_sec * 1000 + (tv.tv_usec / 1000);
+    return medication_clock_now_ms();
 }
 
 // Calcular la próxima dispensación para un horario
-static int64_t calculate_next_dispense_time(medication_schedule_t *schedule) {
+// Próxima toma vista desde now_ms (la hora programada, si la dosis se adelantó)
+static int64_t calculate_next_dispense_time_at(medication_schedule_t *schedule, int64_t now_ms) {
     if (!schedule) return 0;
     
-    // Cachear el tiempo actual para evitar múltiples llamadas
-    static time_t last_time_check = 0;
-    static struct tm cached_timeinfo;
-    static int64_t cached_now_ms = 0;
-    static int cached_time_mins = 0;
-    static int cached_weekday = 0;
-    
-    time_t now_secs;
-    time(&now_secs);
-    
-    // Solo recalcular si pasó al menos 1 segundo desde la última llamada
-    if (now_secs != last_time_check) {
-        last_time_check = now_secs;
-        localtime_r(&now_secs, &cached_timeinfo);
-        cached_now_ms = get_current_time_ms();
-        cached_time_mins = cached_timeinfo.tm_hour * 60 + cached_timeinfo.tm_min;
-        cached_weekday = cached_timeinfo.tm_wday == 0 ? 7 : cached_timeinfo.tm_wday;
-    }
-    
-    // Usar valores cacheados
-    int64_t now_ms = cached_now_ms;
-    int current_time_mins = cached_time_mins;
-    int current_weekday = cached_weekday;
-    struct tm timeinfo = cached_timeinfo;
-    
-    // Resto de la función igual...
-
-    // Si el tratamiento ha finalizado
-    if (schedule->treatment_end_date > 0 && now_ms >= schedule->treatment_end_date) {
-        return INT64_MAX; // No más dispensaciones
-    }
-    
-    // MODO INTERVALO
-    if (schedule->interval_mode) {
-        // Si la hora del día no ha pasado
-        if (schedule->time_in_minutes > current_time_mins) {
-            // Programar para hoy
-            struct tm dispense_time = timeinfo;
-            dispense_time.tm_hour = schedule->time_in_minutes / 60;
-            dispense_time.tm_min = schedule->time_in_minutes % 60;
-            dispense_time.tm_sec = 0;
-            
-            time_t dispense_time_t = mktime(&dispense_time);
-            return (int64_t)dispense_time_t * 1000;
-        }
-        
-        // Si es la primera dispensación o la última ya pasó
-        if (schedule->last_dispensed_time == 0 || 
-            now_ms - schedule->last_dispensed_time >= (int64_t)schedule->interval_hours * 60 * 60 * 1000) {
-            
-            // Calcular para mañana a la hora programada
-            struct tm next_time = timeinfo;
-            next_time.tm_mday += 1; // Mañana
-            next_time.tm_hour = schedule->time_in_minutes / 60;
-            next_time.tm_min = schedule->time_in_minutes % 60;
-            next_time.tm_sec = 0;
-            
-            time_t next_time_t = mktime(&next_time);
-            int64_t next_ms = (int64_t)next_time_t * 1000;
-            
-            // Verificar si excede el fin de tratamiento
-            if (schedule->treatment_end_date > 0 && next_ms > schedule->treatment_end_date) {
-                return INT64_MAX;
-            }
-            
-            return next_ms;
-        }
-        
-        // Calcular próxima dispensación en base a la última más el intervalo
-        int64_t next_interval_ms = schedule->last_dispensed_time + 
-                                  (int64_t)schedule->interval_hours * 60 * 60 * 1000;
-        
-        // Verificar fin de tratamiento
-        if (schedule->treatment_end_date > 0 && next_interval_ms > schedule->treatment_end_date) {
-            return INT64_MAX;
-        }
-        
-        return next_interval_ms;
+    // Se trabaja sobre una copia: otra tarea puede estar calculando a la vez
+    medication_calendar_t cal = calendar;
+    if (medication_calendar_refresh(&cal, now_ms)) {
+        calendar = cal;
     }
     
-    // MODO DÍAS DE SEMANA
-    else {
-        // Comprobar si hoy es un día seleccionado y la hora aún no ha pasado
-        bool is_today_selected = false;
-        for (int i = 0; i < schedule->days_count; i++) {
-            if (schedule->days[i] == current_weekday) {
-                is_today_selected = true;
-                break;
-            }
-        }
-        
-        if (is_today_selected && schedule->time_in_minutes > current_time_mins) {
-            // Programar para hoy
-            struct tm dispense_time = timeinfo;
-            dispense_time.tm_hour = schedule->time_in_minutes / 60;
-            dispense_time.tm_min = schedule->time_in_minutes % 60;
-            dispense_time.tm_sec = 0;
-            
-            time_t dispense_time_t = mktime(&dispense_time);
-            return (int64_t)dispense_time_t * 1000;
-        }
-        
-        // Buscar el próximo día seleccionado
-        int days_ahead = 1;
-        while (days_ahead <= 7) {
-            int next_day = current_weekday + days_ahead;
-            if (next_day > 7) next_day -= 7;
-            
-            for (int i = 0; i < schedule->days_count; i++) {
-                if (schedule->days[i] == next_day) {
-                    // Encontrado próximo día
-                    struct tm next_time = timeinfo;
-                    next_time.tm_mday += days_ahead;
-                    next_time.tm_hour = schedule->time_in_minutes / 60;
-                    next_time.tm_min = schedule->time_in_minutes % 60;
-                    next_time.tm_sec = 0;
-                    
-                    time_t next_time_t = mktime(&next_time);
-                    return (int64_t)next_time_t * 1000;
-                }
-            }
-            
-            days_ahead++;
-        }
-        
-        // No se encontró ningún día válido (no debería ocurrir)
-        return INT64_MAX;
-    }
+    return medication_calendar_next(&cal, schedule, now_ms);
+}
+
+static int64_t calculate_next_dispense_time(medication_schedule_t *schedule) {
+    return calculate_next_dispense_time_at(schedule, get_current_time_ms());
 }
 
 // Actualizar todos los tiempos de dispensación
-void medication_storage_update_next_dispense_times(void) {
+static void storage_update_next_dispense_times(void) {
+    next_times_deferred = false;
     if (!medications || medications_count == 0) {
         return;
     }
@@ -1014,53 +1571,100 @@ void medication_storage_update_next_dispense_times(void) {
             }
 #endif
         }
-        
-        // Guardar cambios en NVS
-        save_medication_to_nvs(med);
     }
+    
+    schedule_table_refresh_all();
+    
+    // Sin escribir en NVS: los tiempos se recalculan en cada arranque, así que
+    // basta con tenerlos en memoria. Los registros los recogen la próxima vez
+    // que se guardan (compactación del diario, sincronización).
+    
+    // Reconstruir la cola de vencimientos con los nuevos tiempos
+    medication_scheduler_rebuild();
+    medication_reminders_rebuild();
+}
+
+void medication_storage_update_next_dispense_times(void) {
+    medication_storage_lock();
+    storage_update_next_dispense_times();
+    medication_storage_unlock();
+}
+
+void medication_storage_resume_schedule(void) {
+    medication_storage_lock();
+    if (next_times_deferred && medication_clock_is_reliable()) {
+        ESP_LOGI(TAG, "Hora fiable: calculando las próximas dispensaciones aplazadas");
+        storage_update_next_dispense_times();
+    }
+    medication_storage_unlock();
+}
+
+int32_t medication_storage_dose_volume_ul(double ml) {
+    if (!(ml > 0)) {
+        return 0;
+    }
+    // Más que cualquier dosis que admita la bomba; solo evita el desbordamiento
+    if (ml >= INT32_MAX / 1000) {
+        return INT32_MAX;
+    }
+    return (int32_t)(ml * 1000.0 + 0.5);
 }
 
-// Modificar medication_storage_get_medication para usar la caché
 medication_t* medication_storage_get_medication(const char* med_id) {
     if (!med_id || !medications) {
         return NULL;
     }
     
-    access_counter++;
-    
-    // Primero buscar en la caché
-    int lru_idx = -1;
-    uint32_t oldest_access = UINT32_MAX;
-    
-    for (int i = 0; i < LRU_CACHE_SIZE; i++) {
-        if (lru_cache[i].med_ptr && strcmp(lru_cache[i].id, med_id) == 0) {
-            // Encontrado en caché, actualizar tiempo de acceso
-            lru_cache[i].last_access = access_counter;
-            return lru_cache[i].med_ptr;
-        }
-        
-        // Encontrar el elemento menos usado recientemente
-        if (lru_cache[i].last_access < oldest_access) {
-            oldest_access = lru_cache[i].last_access;
-            lru_idx = i;
-        }
+    int row = medication_index_find_medication(med_id);
+    return (row >= 0 && row < medications_count) ? &medications[row] : NULL;
+}
+
+medication_t* medication_storage_get_medication_by_handle(medication_handle_t handle) {
+    int row = medication_index_row(handle);
+    return (medications && row >= 0 && row < medications_count) ? &medications[row] : NULL;
+}
+
+medication_handle_t medication_storage_get_handle(const char* med_id) {
+    return medication_index_lookup(med_id);
+}
+
+medication_schedule_t* medication_storage_get_schedule(medication_t *med, const char* schedule_id) {
+    if (!med || !schedule_id) {
+        return NULL;
     }
     
-    // No encontrado en caché, buscar en la lista principal
-    for (int i = 0; i < medications_count; i++) {
-        if (strcmp(medications[i].id, med_id) == 0) {
-            // Actualizar caché con este medicamento
-            if (lru_idx >= 0) {
-                strncpy(lru_cache[lru_idx].id, med_id, MEDICATION_ID_MAX_LEN - 1);
-                lru_cache[lru_idx].id[MEDICATION_ID_MAX_LEN - 1] = '\0';
-                lru_cache[lru_idx].med_ptr = &medications[i];
-                lru_cache[lru_idx].last_access = access_counter;
-            }
-            return &medications[i];
-        }
+    int sched_idx = find_schedule_index(med, schedule_id);
+    return sched_idx >= 0 ? &med->schedules[sched_idx] : NULL;
+}
+
+void medication_storage_get_schedule_table(medication_schedule_table_t *table) {
+    if (!table) {
+        return;
     }
     
-    return NULL;
+    table->count = arena_schedules_count;
+    table->schedules = arena_schedules;
+    table->next_dispense_time = hot_next_dispense;
+    table->last_dispensed_time = hot_last_dispensed;
+    table->last_taken_time = hot_last_taken;
+    table->med_index = hot_med_index;
+    table->sched_index = hot_sched_index;
+}
+
+static int storage_get_upcoming(medication_upcoming_dose_t *doses, int max_doses) {
+    medication_schedule_table_t table;
+    medication_storage_get_schedule_table(&table);
+    
+    medication_calendar_t cal = calendar;
+    medication_calendar_refresh(&cal, get_current_time_ms());
+    return medication_calendar_project(&cal, &table, doses, max_doses);
+}
+
+int medication_storage_get_upcoming(medication_upcoming_dose_t *doses, int max_doses) {
+    medication_storage_lock();
+    int count = storage_get_upcoming(doses, max_doses);
+    medication_storage_unlock();
+    return count;
 }
 
 medication_t* medication_storage_get_all_medications(int* count) {
@@ -1072,94 +1676,178 @@ medication_t* medication_storage_get_all_medications(int* count) {
     return medications;
 }
 
-medication_t* medication_storage_check_dispense(int64_t current_time) {
-    if (!medications || medications_count == 0) {
-        ESP_LOGW(TAG, "No hay medicamentos registrados para verificar dispensación");
-        return NULL;
+// Persiste la intención de dispensar una dosis antes de que el hardware se mueva
+static esp_err_t open_dispense_intent(const medication_t *med, const medication_schedule_t *schedule,
+                                      medication_intent_state_t state, uint8_t flags,
+                                      int64_t due_time, int64_t now_ms) {
+    medication_intent_t intent = {
+        .state = state,
+        .flags = flags,
+        .med_handle = medication_storage_get_handle(med->id),
+        .med_tag = medication_journal_tag(med->id),
+        .sched_tag = medication_journal_tag(schedule->id),
+        .due_time = due_time,
+        .updated_time = now_ms,
+    };
+    int slot;
+    return medication_intent_open(&intent, &slot);
+}
+
+// Horario de un medicamento por la huella de su ID (como mucho MEDICATION_MAX_SCHEDULES)
+static int find_schedule_index_by_tag(const medication_t *med, uint16_t sched_tag) {
+    for (int i = 0; i < med->schedules_count; i++) {
+        if (medication_journal_tag(med->schedules[i].id) == sched_tag) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Cierra la intención abierta de un horario, si la hay
+static void close_dispense_intent(medication_handle_t handle, const char *schedule_id) {
+    int slot = medication_intent_find(handle, medication_journal_tag(schedule_id));
+    if (slot >= 0) {
+        medication_intent_close(slot);
+    }
+}
+
+// Retira la dosis de un horario vencido y lo reprograma. La dosis queda como
+// intención; el recuento y el diario se actualizan al confirmarla con
+// medication_storage_mark_dispensed()
+static void take_due_dose(int med_idx, int sched_idx, int64_t current_time, int64_t due_time) {
+    medication_t *next_med = &medications[med_idx];
+    medication_schedule_t *schedule = &next_med->schedules[sched_idx];
+    
+    // Recalcular próximo tiempo de dispensación; una dosis adelantada no
+    // debe volver a programarse para su propia hora. El intervalo cuenta
+    // desde esta toma, pero la última dispensación no cambia hasta que el
+    // hardware la confirme: si falla, la dosis no consta como dispensada.
+    int64_t last_dispensed_time = schedule->last_dispensed_time;
+    schedule->last_dispensed_time = current_time;
+    schedule->next_dispense_time = calculate_next_dispense_time_at(schedule,
+                                                                   due_time > current_time ? due_time : current_time);
+    schedule->last_dispensed_time = last_dispensed_time;
+    schedule_row_refresh(next_med, sched_idx);
+    medication_scheduler_update(med_idx, sched_idx, schedule->next_dispense_time);
+    medication_reminders_update(med_idx, sched_idx, schedule->next_dispense_time);
+    
+    char next_time_str[32];
+    format_time(schedule->next_dispense_time, next_time_str, sizeof(next_time_str));
+    ESP_LOGI(TAG, "Próxima dispensación programada para: %s", next_time_str);
+    
+    // Sin intención se registra ya como dispensada: tras un corte la toma se
+    // pierde, pero nunca se repite
+    if (open_dispense_intent(next_med, schedule, MEDICATION_INTENT_PENDING, 0,
+                             due_time, current_time) != ESP_OK) {
+        ESP_LOGW(TAG, "Sin intención de dispensación para %s, se registra por adelantado", schedule->id);
+        schedule->last_dispensed_time = current_time;
+        schedule_row_refresh(next_med, sched_idx);
+        record_dose_event(med_idx, sched_idx, MEDICATION_JOURNAL_DISPENSED);
     }
     
-    char current_time_str[32];
-    format_time(current_time, current_time_str, sizeof(current_time_str));
-    ESP_LOGI(TAG, "Verificando dispensación a las %s", current_time_str);
+    ESP_LOGI(TAG, "✅ Medicamento %s listo para dispensar desde compartimento %d", 
+            next_med->name, next_med->compartment);
+}
+
+static int storage_collect_due(int64_t current_time, int64_t window_ms,
+                               medication_due_dose_t *doses, int max_doses) {
+    if (!doses || max_doses <= 0) {
+        return 0;
+    }
     
-    medication_t *next_med = NULL;
-    int64_t soonest_time = INT64_MAX;
-    int soonest_sched_idx = -1;
+    if (!medications || medications_count == 0) {
+        ESP_LOGW(TAG, "No hay medicamentos registrados para verificar dispensación");
+        return 0;
+    }
     
-    // Buscar el medicamento más próximo a dispensar
-    for (int i = 0; i < medications_count; i++) {
-        medication_t *med = &medications[i];
-        
-        ESP_LOGI(TAG, "Revisando medicamento: %s (%d horarios)", med->name, med->schedules_count);
-        
-        for (int j = 0; j < med->schedules_count; j++) {
-            medication_schedule_t *schedule = &med->schedules[j];
-            
-            char next_time_str[32];
-            format_time(schedule->next_dispense_time, next_time_str, sizeof(next_time_str));
-            
-            ESP_LOGI(TAG, "  - Horario %s: próxima dispensación %s", 
-                    schedule->id, next_time_str);
-            
-            // Si está programado para dispensar y es el más cercano
-            if (schedule->next_dispense_time > 0 && 
-                schedule->next_dispense_time <= current_time &&
-                schedule->next_dispense_time < soonest_time) {
-                
-                ESP_LOGI(TAG, "    ✓ Horario elegible para dispensación");
-                next_med = med;
-                soonest_time = schedule->next_dispense_time;
-                soonest_sched_idx = j;
-            } else {
-                if (schedule->next_dispense_time <= 0) {
-                    ESP_LOGI(TAG, "    ✗ Horario no programado (next_dispense_time <= 0)");
-                } else if (schedule->next_dispense_time > current_time) {
-                    ESP_LOGI(TAG, "    ✗ Horario programado para el futuro (%lld ms después)", 
-                            schedule->next_dispense_time - current_time);
-                } else {
-                    ESP_LOGI(TAG, "    ✗ No es el horario más cercano");
-                }
-            }
-        }
+    // Sin hora fiable no se entrega nada: cualquier vencimiento parecería pasado
+    if (current_time < MEDICATION_CLOCK_RELIABLE_MS) {
+        return 0;
     }
     
-    // Si encontramos un medicamento a dispensar
-    if (next_med && soonest_sched_idx >= 0) {
-        // Actualizar último tiempo de dispensación
-        medication_schedule_t *schedule = &next_med->schedules[soonest_sched_idx];
-        schedule->last_dispensed_time = current_time;
-        
-        // Actualizar recuento de pastillas
-        if (strcmp(next_med->type, "pill") == 0) {
-            next_med->total_pills -= next_med->pills_per_dose;
-            if (next_med->total_pills < 0) {
-                next_med->total_pills = 0;
-            }
-            ESP_LOGI(TAG, "Actualizado recuento de pastillas: %d restantes", next_med->total_pills);
+    int64_t horizon = current_time + (window_ms > 0 ? window_ms : 0);
+    int count = 0;
+    
+    // La cola de vencimientos da los horarios en orden; cada uno se reprograma
+    // al retirarlo, así que basta con volver a consultar la cabeza
+    while (count < max_doses) {
+        int64_t soonest_time = 0;
+        int med_idx = -1;
+        int sched_idx = -1;
+        if (!medication_scheduler_peek(&soonest_time, &med_idx, &sched_idx) ||
+            soonest_time > horizon) {
+            break;
         }
         
-        // Recalcular próximo tiempo de dispensación
-        schedule->next_dispense_time = calculate_next_dispense_time(schedule);
-        
-        char next_time_str[32];
-        format_time(schedule->next_dispense_time, next_time_str, sizeof(next_time_str));
-        ESP_LOGI(TAG, "Próxima dispensación programada para: %s", next_time_str);
+        if (med_idx >= medications_count || sched_idx >= medications[med_idx].schedules_count) {
+            ESP_LOGW(TAG, "Cola de vencimientos desactualizada, reconstruyendo");
+            medication_scheduler_rebuild();
+            medication_reminders_rebuild();
+            break;
+        }
         
-        // Guardar cambios
-        save_medication_to_nvs(next_med);
+        // Un vencimiento anterior a la hora fiable se calculó con el reloj
+        // en 1970 (sincronización antes del NTP): se reprograma, no se entrega
+        medication_schedule_t *schedule = &medications[med_idx].schedules[sched_idx];
+        if (soonest_time < MEDICATION_CLOCK_RELIABLE_MS) {
+            ESP_LOGW(TAG, "Vencimiento de %s anterior a la hora fiable, se reprograma", schedule->id);
+            schedule->next_dispense_time = calculate_next_dispense_time_at(schedule, current_time);
+            schedule_row_refresh(&medications[med_idx], sched_idx);
+            medication_scheduler_update(med_idx, sched_idx, schedule->next_dispense_time);
+            medication_reminders_update(med_idx, sched_idx, schedule->next_dispense_time);
+            continue;
+        }
         
-        ESP_LOGI(TAG, "✅ Medicamento %s listo para dispensar desde compartimento %d", 
-                next_med->name, next_med->compartment);
+        // Un horario de intervalo corto podría volver a caer en la ventana
+        bool repeated = false;
+        for (int i = 0; i < count && !repeated; i++) {
+            repeated = (doses[i].schedule == schedule);
+        }
+        if (repeated) {
+            break;
+        }
         
-        return next_med;
+        take_due_dose(med_idx, sched_idx, current_time, soonest_time);
+        doses[count].medication = &medications[med_idx];
+        doses[count].schedule = schedule;
+        doses[count].due_time = soonest_time;
+        count++;
     }
     
-    ESP_LOGI(TAG, "No se encontró ningún medicamento para dispensar ahora");
-    return NULL;
+    if (count == 0) {
+        ESP_LOGD(TAG, "No se encontró ningún medicamento para dispensar ahora");
+    }
+    return count;
 }
 
-// Marcar un medicamento como dispensado
-esp_err_t medication_storage_mark_dispensed(const char* med_id, const char* schedule_id) {
+int medication_storage_collect_due(int64_t current_time, int64_t window_ms,
+                                   medication_due_dose_t *doses, int max_doses) {
+    medication_storage_lock();
+    int count = storage_collect_due(current_time, window_ms, doses, max_doses);
+    medication_storage_unlock();
+    return count;
+}
+
+medication_t* medication_storage_check_dispense(int64_t current_time, medication_schedule_t **schedule_out) {
+    medication_due_dose_t dose;
+    
+    if (schedule_out) {
+        *schedule_out = NULL;
+    }
+    
+    if (medication_storage_collect_due(current_time, 0, &dose, 1) == 0) {
+        return NULL;
+    }
+    
+    if (schedule_out) {
+        *schedule_out = dose.schedule;
+    }
+    return dose.medication;
+}
+
+// Marcar un medicamento como dispensado. Una dosis manual no pasó por
+// collect_due, así que es ella la que reprograma el horario.
+static esp_err_t storage_mark_dispensed(const char* med_id, const char* schedule_id, bool manual) {
     if (!med_id || !schedule_id) {
         return ESP_ERR_INVALID_ARG;
     }
@@ -1171,14 +1859,7 @@ esp_err_t medication_storage_mark_dispensed(const char* med_id, const char* sche
     }
     
     // Buscar el horario
-    int sched_idx = -1;
-    for (int i = 0; i < med->schedules_count; i++) {
-        if (strcmp(med->schedules[i].id, schedule_id) == 0) {
-            sched_idx = i;
-            break;
-        }
-    }
-    
+    int sched_idx = find_schedule_index(med, schedule_id);
     if (sched_idx < 0) {
         ESP_LOGW(TAG, "Schedule %s not found for medication %s", schedule_id, med_id);
         return ESP_ERR_NOT_FOUND;
@@ -1197,50 +1878,384 @@ esp_err_t medication_storage_mark_dispensed(const char* med_id, const char* sche
         }
     }
     
-    // Recalcular próximo tiempo de dispensación
-    schedule->next_dispense_time = calculate_next_dispense_time(schedule);
+    if (manual) {
+        // Cerca de la dosis programada, la manual la sustituye y el horario
+        // sigue como si se hubiera dado a su hora; si no, el intervalo vuelve
+        // a contar desde ahora
+        int64_t from_ms = current_time;
+        if (schedule->next_dispense_time > current_time &&
+            schedule->next_dispense_time - current_time <= MEDICATION_MANUAL_DOSE_ADVANCE_MS) {
+            from_ms = schedule->next_dispense_time;
+        }
+        schedule->last_dispensed_time = from_ms;
+        schedule->next_dispense_time = calculate_next_dispense_time_at(schedule, from_ms);
+        schedule->last_dispensed_time = current_time;
+        int med_idx = med - medications;
+        medication_scheduler_update(med_idx, sched_idx, schedule->next_dispense_time);
+        medication_reminders_update(med_idx, sched_idx, schedule->next_dispense_time);
+    }
+    // Si no, la próxima dosis no se toca: collect_due ya la reprogramó al retirar
+    // ésta (una dosis adelantada por la ventana de grupo volvería a su hora)
+    schedule_row_refresh(med, sched_idx);
     
-    // Guardar cambios
-    esp_err_t err = save_medication_to_nvs(med);
+    // Registrar el evento en el diario (confirmación de la dispensación)
+    esp_err_t err = record_dose_event(med - medications, sched_idx, MEDICATION_JOURNAL_DISPENSED);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error saving medication after dispensing: %s", esp_err_to_name(err));
         return err;
     }
     
+    // Ya consta en el diario: la intención deja de hacer falta. Si el equipo
+    // se apaga antes de cerrarla, la recuperación ve que ya estaba confirmada.
+    close_dispense_intent(medication_storage_get_handle(med->id), schedule_id);
+    
+    if (change_callback) {
+        change_callback(med, MEDICATION_STORAGE_CHANGE_DISPENSED);
+    }
+    
     ESP_LOGI(TAG, "Medication %s (schedule %s) marked as dispensed", med->name, schedule_id);
     return ESP_OK;
 }
 
-// Guardar todos los medicamentos en almacenamiento
-esp_err_t medication_storage_save(void) {
-    if (!medications || medications_count <= 0 || !med_nvs_handle) {
-        ESP_LOGW(TAG, "No hay medicamentos para guardar o NVS no inicializado");
-        return ESP_ERR_INVALID_STATE;
+esp_err_t medication_storage_mark_dispensed(const char* med_id, const char* schedule_id) {
+    medication_storage_lock();
+    esp_err_t err = storage_mark_dispensed(med_id, schedule_id, false);
+    medication_storage_unlock();
+    return err;
+}
+
+esp_err_t medication_storage_mark_manual_dispensed(const char* med_id, const char* schedule_id) {
+    medication_storage_lock();
+    esp_err_t err = storage_mark_dispensed(med_id, schedule_id, true);
+    medication_storage_unlock();
+    return err;
+}
+
+// Registrar una dosis que el hardware no llegó a dispensar
+static esp_err_t storage_mark_failed(const char* med_id, const char* schedule_id, int64_t *due_time) {
+    if (!med_id || !schedule_id) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    ESP_LOGI(TAG, "Guardando todos los medicamentos en almacenamiento");
+    medication_t *med = medication_storage_get_medication(med_id);
+    if (!med) {
+        ESP_LOGW(TAG, "Medication %s not found", med_id);
+        return ESP_ERR_NOT_FOUND;
+    }
     
-    esp_err_t err = ESP_OK;
+    int sched_idx = find_schedule_index(med, schedule_id);
+    if (sched_idx < 0) {
+        ESP_LOGW(TAG, "Schedule %s not found for medication %s", schedule_id, med_id);
+        return ESP_ERR_NOT_FOUND;
+    }
     
-    // Guardar cada medicamento
-    for (int i = 0; i < medications_count; i++) {
-        esp_err_t temp_err = save_medication_to_nvs(&medications[i]);
-        if (temp_err != ESP_OK) {
-            ESP_LOGW(TAG, "Error al guardar medicamento %s: %s", 
-                     medications[i].name, esp_err_to_name(temp_err));
-            err = temp_err;  // Guardar el último error pero continuar con los demás
+    // La hora programada sale de la intención (0 si la dosis era manual)
+    medication_intent_t intent;
+    int slot = medication_intent_find(medication_storage_get_handle(med->id),
+                                      medication_journal_tag(schedule_id));
+    if (due_time) {
+        *due_time = (slot >= 0 && medication_intent_get(slot, &intent)) ? intent.due_time : 0;
+    }
+    
+    // Sin descontar pastillas ni tocar la última dispensación: el diario solo
+    // guarda la próxima dosis, que collect_due ya reprogramó
+    esp_err_t err = record_dose_event(med - medications, sched_idx, MEDICATION_JOURNAL_FAILED);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error saving failed dose: %s", esp_err_to_name(err));
+        return err;
+    }
+    
+    // Registrada como fallida: tras un corte no se da por dispensada
+    if (slot >= 0) {
+        medication_intent_close(slot);
+    }
+    
+    ESP_LOGW(TAG, "Medication %s (schedule %s) marked as failed", med->name, schedule_id);
+    return ESP_OK;
+}
+
+esp_err_t medication_storage_mark_failed(const char* med_id, const char* schedule_id, int64_t *due_time) {
+    medication_storage_lock();
+    esp_err_t err = storage_mark_failed(med_id, schedule_id, due_time);
+    medication_storage_unlock();
+    return err;
+}
+
+// Marcar una dosis como tomada
+static esp_err_t storage_mark_taken(const char* med_id, const char* schedule_id, int64_t taken_time) {
+    if (!med_id || !schedule_id) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    medication_t *med = medication_storage_get_medication(med_id);
+    if (!med) {
+        ESP_LOGW(TAG, "Medication %s not found", med_id);
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    int sched_idx = find_schedule_index(med, schedule_id);
+    if (sched_idx < 0) {
+        ESP_LOGW(TAG, "Schedule %s not found for medication %s", schedule_id, med_id);
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    med->schedules[sched_idx].last_taken_time = taken_time;
+    schedule_row_refresh(med, sched_idx);
+    return record_dose_event(med - medications, sched_idx, MEDICATION_JOURNAL_TAKEN);
+}
+
+esp_err_t medication_storage_mark_taken(const char* med_id, const char* schedule_id, int64_t taken_time) {
+    medication_storage_lock();
+    esp_err_t err = storage_mark_taken(med_id, schedule_id, taken_time);
+    medication_storage_unlock();
+    return err;
+}
+
+static esp_err_t storage_dispense_started(medication_handle_t handle, const char* schedule_id) {
+    medication_t *med = medication_storage_get_medication_by_handle(handle);
+    medication_schedule_t *schedule = med ? medication_storage_get_schedule(med, schedule_id) : NULL;
+    if (!schedule) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    int64_t now_ms = get_current_time_ms();
+    int slot = medication_intent_find(handle, medication_journal_tag(schedule_id));
+    if (slot >= 0) {
+        return medication_intent_set_started(slot, now_ms);
+    }
+    
+    // Dispensación manual o registrada por adelantado: no pasó por una intención pendiente
+    return open_dispense_intent(med, schedule, MEDICATION_INTENT_STARTED, MEDICATION_INTENT_FLAG_MANUAL,
+                                0, now_ms);
+}
+
+esp_err_t medication_storage_dispense_started(medication_handle_t handle, const char* schedule_id) {
+    medication_storage_lock();
+    esp_err_t err = storage_dispense_started(handle, schedule_id);
+    medication_storage_unlock();
+    return err;
+}
+
+static void storage_dispense_discard(medication_handle_t handle, const char* schedule_id) {
+    if (schedule_id) {
+        close_dispense_intent(handle, schedule_id);
+    }
+}
+
+void medication_storage_dispense_discard(medication_handle_t handle, const char* schedule_id) {
+    medication_storage_lock();
+    storage_dispense_discard(handle, schedule_id);
+    medication_storage_unlock();
+}
+
+static void add_recovered(const medication_t *med, const medication_schedule_t *schedule,
+                          int64_t due_time, medication_recovery_outcome_t outcome) {
+    if (recovered_count >= MEDICATION_INTENT_SLOTS) {
+        return;
+    }
+    medication_recovered_dose_t *dose = &recovered_doses[recovered_count++];
+    memset(dose, 0, sizeof(*dose));
+    snprintf(dose->medication_id, sizeof(dose->medication_id), "%s", med->id);
+    snprintf(dose->schedule_id, sizeof(dose->schedule_id), "%s", schedule->id);
+    dose->due_time = due_time;
+    dose->outcome = outcome;
+}
+
+// Resuelve una intención abierta al arrancar. Nunca vuelve a dispensar una
+// dosis con la que el hardware llegó a moverse. Devuelve false si la
+// confirmación en NVS se aplaza por falta de presupuesto.
+static bool resolve_intent(int slot, const medication_intent_t *intent, int64_t now_ms, bool persist) {
+    medication_t *med = medication_storage_get_medication_by_handle(intent->med_handle);
+    int med_idx = med ? (int)(med - medications) : -1;
+    int sched_idx = (med && medication_journal_tag(med->id) == intent->med_tag)
+        ? find_schedule_index_by_tag(med, intent->sched_tag) : -1;
+    
+    if (sched_idx < 0) {
+        // Una sincronización eliminó el horario: no hay nada que registrar
+        ESP_LOGW(TAG, "Intención %d sin horario asociado, se descarta", slot);
+        if (!persist) {
+            recovery_deferred_mask |= 1UL << slot;
+            return false;
         }
+        medication_intent_close(slot);
+        return true;
     }
     
-    // Forzar un commit final para asegurar que todos los cambios se guarden
-    esp_err_t commit_err = nvs_commit(med_nvs_handle);
-    if (commit_err != ESP_OK) {
-        ESP_LOGE(TAG, "Error al hacer commit de los cambios: %s", esp_err_to_name(commit_err));
-        return commit_err;  // Priorizar el error de commit
+    medication_schedule_t *schedule = &med->schedules[sched_idx];
+    
+    // Confirmada antes del corte: solo faltaba cerrar la intención
+    bool committed = intent->state == MEDICATION_INTENT_STARTED
+        ? schedule->last_dispensed_time >= intent->updated_time
+        : schedule->last_dispensed_time > intent->updated_time;
+    if (committed) {
+        if (!persist) {
+            recovery_deferred_mask |= 1UL << slot;
+            return false;
+        }
+        medication_intent_close(slot);
+        return true;
+    }
+    
+    if (intent->state == MEDICATION_INTENT_STARTED) {
+        // El servo o la bomba llegaron a moverse: la dosis se da por dispensada
+        schedule->last_dispensed_time = intent->updated_time;
+        if (strcmp(med->type, "pill") == 0) {
+            med->total_pills -= med->pills_per_dose;
+            if (med->total_pills < 0) {
+                med->total_pills = 0;
+            }
+        }
+        int64_t from_ms = intent->due_time > now_ms ? intent->due_time : now_ms;
+        schedule->next_dispense_time = calculate_next_dispense_time_at(schedule, from_ms);
+        schedule_row_refresh(med, sched_idx);
+        medication_scheduler_update(med_idx, sched_idx, schedule->next_dispense_time);
+        medication_reminders_update(med_idx, sched_idx, schedule->next_dispense_time);
+        add_recovered(med, schedule, intent->due_time, MEDICATION_RECOVERY_ASSUMED_DISPENSED);
+        
+        ESP_LOGW(TAG, "Dispensación de %s interrumpida con el hardware en marcha: se registra como dispensada",
+                 schedule->id);
+        if (!persist) {
+            recovery_deferred_mask |= 1UL << slot;
+            recovery_journal_mask |= 1UL << slot;
+            return false;
+        }
+        if (record_dose_event(med_idx, sched_idx, MEDICATION_JOURNAL_DISPENSED) == ESP_OK) {
+            medication_intent_close(slot);
+        }
+        return true;
+    }
+    
+    // El hardware no llegó a moverse: la dosis no se dio. Solo se repite si
+    // aún no cuenta como perdida y la intención se puede cerrar antes.
+    bool retry = persist && !(intent->flags & MEDICATION_INTENT_FLAG_MANUAL) &&
+                 now_ms - intent->due_time < MEDICATION_MISSED_THRESHOLD_MS;
+    if (retry && medication_intent_close(slot) == ESP_OK) {
+        schedule->next_dispense_time = intent->due_time;
+        schedule_row_refresh(med, sched_idx);
+        medication_scheduler_update(med_idx, sched_idx, schedule->next_dispense_time);
+        medication_reminders_update(med_idx, sched_idx, schedule->next_dispense_time);
+        add_recovered(med, schedule, intent->due_time, MEDICATION_RECOVERY_RETRIED);
+        ESP_LOGW(TAG, "Dispensación de %s interrumpida antes de mover el hardware: se repite", schedule->id);
+        return true;
+    }
+    
+    if (!(intent->flags & MEDICATION_INTENT_FLAG_MANUAL)) {
+        add_recovered(med, schedule, intent->due_time, MEDICATION_RECOVERY_SKIPPED);
+    }
+    ESP_LOGW(TAG, "Dispensación de %s interrumpida antes de mover el hardware: no se repite", schedule->id);
+    if (!persist) {
+        recovery_deferred_mask |= 1UL << slot;
+        return false;
+    }
+    medication_intent_close(slot);
+    return true;
+}
+
+static int storage_recover_dispenses(int64_t budget_ms) {
+    int64_t start_us = esp_timer_get_time();
+    int64_t now_ms = get_current_time_ms();
+    int resolved = 0;
+    int deferred = 0;
+    
+    for (int slot = 0; slot < MEDICATION_INTENT_SLOTS; slot++) {
+        medication_intent_t intent;
+        if (!medication_intent_get(slot, &intent)) {
+            continue;
+        }
+        
+        bool is_deferred = recovery_deferred_mask & (1UL << slot);
+        if (recovery_ran && !is_deferred) {
+            continue;
+        }
+        
+        bool persist = budget_ms <= 0 || (esp_timer_get_time() - start_us) / 1000 < budget_ms;
+        
+        // Ya resuelta en memoria en una llamada anterior: solo falta confirmarla
+        if (is_deferred) {
+            medication_t *med = medication_storage_get_medication_by_handle(intent.med_handle);
+            int sched_idx = med ? find_schedule_index_by_tag(med, intent.sched_tag) : -1;
+            bool journal = (recovery_journal_mask & (1UL << slot)) && sched_idx >= 0;
+            if (!persist || (journal && record_dose_event(med - medications, sched_idx,
+                                                          MEDICATION_JOURNAL_DISPENSED) != ESP_OK)) {
+                deferred++;
+                continue;
+            }
+            recovery_deferred_mask &= ~(1UL << slot);
+            recovery_journal_mask &= ~(1UL << slot);
+            medication_intent_close(slot);
+            resolved++;
+            continue;
+        }
+        
+        if (resolve_intent(slot, &intent, now_ms, persist)) {
+            resolved++;
+        } else {
+            deferred++;
+        }
+    }
+    
+    recovery_ran = true;
+    
+    if (resolved > 0 || deferred > 0) {
+        ESP_LOGI(TAG, "Recuperación de dispensaciones: %d resueltas, %d aplazadas en %lld ms",
+                 resolved, deferred, (long long)((esp_timer_get_time() - start_us) / 1000));
+    }
+    return deferred;
+}
+
+int medication_storage_recover_dispenses(int64_t budget_ms) {
+    medication_storage_lock();
+    int deferred = storage_recover_dispenses(budget_ms);
+    medication_storage_unlock();
+    return deferred;
+}
+
+static int storage_get_recovered(medication_recovered_dose_t *doses, int max_doses) {
+    int count = 0;
+    for (int i = 0; doses && i < recovered_count && count < max_doses; i++) {
+        doses[count++] = recovered_doses[i];
+    }
+    return count;
+}
+
+int medication_storage_get_recovered(medication_recovered_dose_t *doses, int max_doses) {
+    medication_storage_lock();
+    int count = storage_get_recovered(doses, max_doses);
+    medication_storage_unlock();
+    return count;
+}
+
+static void storage_clear_recovered(void) {
+    recovered_count = 0;
+}
+
+void medication_storage_clear_recovered(void) {
+    medication_storage_lock();
+    storage_clear_recovered();
+    medication_storage_unlock();
+}
+
+// Guardar todos los medicamentos en almacenamiento
+static esp_err_t storage_save(void) {
+    if (!medications || medications_count <= 0 || !med_nvs_handle) {
+        ESP_LOGW(TAG, "No hay medicamentos para guardar o NVS no inicializado");
+        return ESP_ERR_INVALID_STATE;
     }
     
-    // Guardar mapeos ID si hubo cambios
-    save_id_mappings_if_changed();
+    ESP_LOGI(TAG, "Guardando todos los medicamentos en almacenamiento");
+    
+    // Guardar cada medicamento con un commit final; el diario queda vacío
+    esp_err_t err = flush_all_records();
+    
+    // Guardar el índice de IDs si hubo cambios
+    medication_index_save_if_changed();
     
+    return err;
+}
+
+esp_err_t medication_storage_save(void) {
+    medication_storage_lock();
+    esp_err_t err = storage_save();
+    medication_storage_unlock();
     return err;
 }
\ No newline at end of file
@@ -5,6 +5,16 @@
 #include "cJSON.h"
 
 #define MEDICATION_ID_MAX_LEN 64
+#define MEDICATION_MAX_SCHEDULES 24   // Horarios máximos por medicamento
+
+/**
+ * @brief Handle corto de un medicamento (ver medication_index.h). Estable
+ *        mientras el medicamento exista; sustituye al ID en las referencias
+ *        que se guardan en memoria.
+ */
+typedef uint16_t medication_handle_t;
+#define MEDICATION_HANDLE_INVALID 0xFFFF
+
 /**
  * @brief Estructura para representar un horario de medicamento
  */
@@ -16,7 +26,7 @@ typedef struct {
     uint8_t treatment_days;       // Días totales de tratamiento (modo intervalo)
     uint8_t days_count;           // Número de días seleccionados (0-7)
     uint8_t days[7];              // Días de la semana: 1=lunes, 7=domingo
-    uint8_t _padding;             // Para alineación
+    uint8_t days_mask;            // days[] compilado: bit (d-1) para el día d
     int64_t treatment_end_date;   // Fecha fin del tratamiento (timestamp en ms)
     int64_t next_dispense_time;   // Próxima dispensación programada (timestamp en ms)
     int64_t last_dispensed_time;  // Última dispensación (timestamp en ms)
@@ -31,12 +41,89 @@ typedef struct {
     char name[64];
     int compartment;             // 1-4
     char type[16];               // "pill" o "liquid"
-    int pills_per_dose;          // Pastillas por dosis
+    int pills_per_dose;          // Pastillas por dosis (solo pastillas)
+    int32_t dose_volume_ul;      // Volumen por dosis en µl (solo líquidos)
     int total_pills;             // Total de pastillas restantes
     medication_schedule_t *schedules; // Arreglo de horarios
     int schedules_count;         // Número de horarios
 } medication_t;
 
+/**
+ * @brief Vista por columnas de todos los horarios (una fila por horario).
+ *        Permite recorrer los tiempos de dispensación sin visitar cada
+ *        medicamento; los datos completos de la fila i están en schedules[i].
+ *        Solo es válida hasta la siguiente sincronización.
+ */
+typedef struct {
+    int count;                            // Número total de horarios
+    const medication_schedule_t *schedules;
+    const int64_t *next_dispense_time;
+    const int64_t *last_dispensed_time;
+    const int64_t *last_taken_time;
+    const uint16_t *med_index;            // Medicamento al que pertenece la fila
+    const uint16_t *sched_index;          // Posición del horario en su medicamento
+} medication_schedule_table_t;
+
+/**
+ * @brief Próxima toma de un horario dentro de la agenda
+ */
+typedef struct {
+    int64_t time;                 // Momento de la toma (timestamp en ms)
+    uint16_t med_index;           // Posición del medicamento
+    uint16_t sched_index;         // Posición del horario en su medicamento
+} medication_upcoming_dose_t;
+
+/**
+ * @brief Dosis vencida retirada de la cola por medication_storage_collect_due()
+ */
+typedef struct {
+    medication_t *medication;
+    medication_schedule_t *schedule;
+    int64_t due_time;             // Hora programada de la toma (ms)
+} medication_due_dose_t;
+
+/**
+ * @brief Motivo por el que cambió un medicamento
+ */
+typedef enum {
+    MEDICATION_STORAGE_CHANGE_DISPENSED = 0,    // Dispensación confirmada (recuento de pastillas)
+    MEDICATION_STORAGE_CHANGE_SYNCED,           // Definición nueva o modificada por una sincronización
+} medication_storage_change_t;
+
+/**
+ * @brief Callback de cambios de un medicamento. Se ejecuta en la tarea que
+ *        hizo el cambio (dispensador o MQTT) con el mutex del almacenamiento
+ *        tomado; no debe bloquear ni publicar por MQTT.
+ */
+typedef void (*medication_storage_change_cb_t)(const medication_t *medication, medication_storage_change_t change);
+
+// Una dosis manual dada como mucho este tiempo antes de la programada del
+// mismo horario ocupa su lugar: la programada ya no se dispensa
+#define MEDICATION_MANUAL_DOSE_ADVANCE_MS (30 * 60 * 1000LL)
+
+// Tiempo máximo que la recuperación de dispensaciones interrumpidas puede
+// dedicar a NVS durante el arranque
+#define MEDICATION_RECOVERY_BUDGET_MS 100
+
+/**
+ * @brief Cómo se resolvió en el arranque una dispensación interrumpida
+ */
+typedef enum {
+    MEDICATION_RECOVERY_ASSUMED_DISPENSED = 0,  // El hardware llegó a moverse: se registra como dispensada
+    MEDICATION_RECOVERY_RETRIED,                // No se movió: la dosis vuelve a la cola
+    MEDICATION_RECOVERY_SKIPPED,                // No se movió y ya cuenta como perdida: no se repite
+} medication_recovery_outcome_t;
+
+/**
+ * @brief Dosis resuelta por medication_storage_recover_dispenses()
+ */
+typedef struct {
+    char medication_id[32];
+    char schedule_id[32];
+    int64_t due_time;             // Hora programada de la toma (0 si era manual)
+    uint8_t outcome;              // medication_recovery_outcome_t
+} medication_recovered_dose_t;
+
 /**
  * @brief Inicializa el sistema de almacenamiento de medicamentos
  * 
@@ -44,6 +131,27 @@ typedef struct {
  */
 esp_err_t medication_storage_init(void);
 
+/**
+ * @brief Toma el mutex del almacenamiento (recursivo). Las funciones que lo
+ *        modifican lo toman solas; quien use punteros devueltos por
+ *        medication_storage_get_*() o medication_storage_collect_due() entre
+ *        varias llamadas debe tenerlo tomado mientras tanto, porque una
+ *        sincronización libera el arreglo anterior.
+ *        No se debe publicar por MQTT con el mutex tomado: la tarea MQTT lo
+ *        espera mientras retiene el cliente.
+ */
+void medication_storage_lock(void);
+
+/**
+ * @brief Suelta el mutex tomado con medication_storage_lock()
+ */
+void medication_storage_unlock(void);
+
+/**
+ * @brief Registra el callback de cambios de medicamentos (uno solo; NULL lo quita)
+ */
+void medication_storage_set_change_callback(medication_storage_change_cb_t cb);
+
 /**
  * @brief Procesa un mensaje JSON con datos de medicamentos
  * 
@@ -52,6 +160,38 @@ esp_err_t medication_storage_init(void);
  */
 esp_err_t medication_storage_process_json(const char* json_str);
 
+/**
+ * @brief Aplica una sincronización a partir de un documento ya parseado
+ * 
+ * @param payload Objeto "payload" del mensaje, con el array "medications"
+ * @return esp_err_t ESP_OK si se procesó correctamente
+ */
+esp_err_t medication_storage_apply_sync(const cJSON *payload);
+
+/**
+ * @brief Inicia una sincronización incremental. Los medicamentos se acumulan con
+ *        medication_storage_sync_upsert() y solo sustituyen al estado actual al
+ *        llamar a medication_storage_sync_end(true).
+ */
+void medication_storage_sync_begin(void);
+
+/**
+ * @brief Incorpora un medicamento recibido a la sincronización en curso
+ * 
+ * @param incoming Medicamento sin historial; la función toma posesión de
+ *                 incoming->schedules (también si devuelve error)
+ * @return esp_err_t ESP_OK si se incorporó (los IDs duplicados se ignoran)
+ */
+esp_err_t medication_storage_sync_upsert(medication_t *incoming);
+
+/**
+ * @brief Cierra la sincronización en curso
+ * 
+ * @param apply true para aplicar las diferencias y persistirlas, false para descartarla
+ * @return esp_err_t ESP_OK si se aplicó correctamente
+ */
+esp_err_t medication_storage_sync_end(bool apply);
+
 /**
  * @brief Obtiene un medicamento por su ID
  * 
@@ -60,6 +200,38 @@ esp_err_t medication_storage_process_json(const char* json_str);
  */
 medication_t* medication_storage_get_medication(const char* med_id);
 
+/**
+ * @brief Convierte el pillsPerDose de un líquido, en ml y con decimales
+ *        (2.5 ml), a µl redondeados
+ * @return Volumen en µl; 0 si ml no es positivo
+ */
+int32_t medication_storage_dose_volume_ul(double ml);
+
+/**
+ * @brief Obtiene el handle de un medicamento a partir de su ID
+ * 
+ * @param med_id ID del medicamento
+ * @return medication_handle_t Handle o MEDICATION_HANDLE_INVALID si no existe
+ */
+medication_handle_t medication_storage_get_handle(const char* med_id);
+
+/**
+ * @brief Obtiene un medicamento por su handle
+ * 
+ * @param handle Handle devuelto por medication_storage_get_handle()
+ * @return medication_t* Puntero al medicamento o NULL si ya no existe
+ */
+medication_t* medication_storage_get_medication_by_handle(medication_handle_t handle);
+
+/**
+ * @brief Busca un horario de un medicamento por su ID (tiempo constante)
+ * 
+ * @param med Medicamento obtenido del almacenamiento
+ * @param schedule_id ID del horario
+ * @return medication_schedule_t* Puntero al horario o NULL si no existe
+ */
+medication_schedule_t* medication_storage_get_schedule(medication_t *med, const char* schedule_id);
+
 /**
  * @brief Obtiene la lista de todos los medicamentos
  * 
@@ -68,21 +240,62 @@ medication_t* medication_storage_get_medication(const char* med_id);
  */
 medication_t* medication_storage_get_all_medications(int* count);
 
+/**
+ * @brief Calcula la agenda: las próximas tomas de todos los horarios,
+ *        ordenadas por hora (hasta 7 días vista)
+ * 
+ * @param doses Arreglo de salida
+ * @param max_doses Número máximo de tomas a devolver
+ * @return int Número de tomas escritas
+ */
+int medication_storage_get_upcoming(medication_upcoming_dose_t *doses, int max_doses);
+
+/**
+ * @brief Obtiene la tabla de horarios para recorridos rápidos
+ * 
+ * @param table Estructura a rellenar
+ */
+void medication_storage_get_schedule_table(medication_schedule_table_t *table);
+
 /**
  * @brief Calcula la próxima dispensación para todos los medicamentos
  */
 void medication_storage_update_next_dispense_times(void);
 
+/**
+ * @brief Calcula las próximas dispensaciones que el arranque aplazó por no
+ *        tener hora fiable. Sin nada aplazado, o sin hora fiable aún, no hace nada.
+ */
+void medication_storage_resume_schedule(void);
+
 /**
  * @brief Verifica si hay medicamentos que deben dispensarse
  * 
  * @param current_time Tiempo actual en milisegundos
+ * @param schedule_out Si no es NULL, recibe el horario que venció
  * @return medication_t* Medicamento que debe dispensarse, NULL si no hay ninguno
  */
-medication_t* medication_storage_check_dispense(int64_t current_time);
+medication_t* medication_storage_check_dispense(int64_t current_time, medication_schedule_t **schedule_out);
+
+/**
+ * @brief Retira de la cola todas las dosis que vencen hasta current_time + window_ms
+ *        para dispensarlas en una sola sesión. Cada dosis queda registrada como
+ *        en medication_storage_check_dispense(); las que vencen dentro de la
+ *        ventana se adelantan y su siguiente toma se calcula desde su hora.
+ * 
+ * @param current_time Tiempo actual en milisegundos
+ * @param window_ms Adelanto máximo respecto a current_time
+ * @param doses Arreglo de salida, ordenado por hora programada
+ * @param max_doses Capacidad de doses; las que no caben siguen en la cola
+ * @return int Número de dosis escritas
+ */
+int medication_storage_collect_due(int64_t current_time, int64_t window_ms,
+                                   medication_due_dose_t *doses, int max_doses);
 
 /**
- * @brief Marca un medicamento como dispensado
+ * @brief Marca un medicamento como dispensado: descuenta la dosis, la anota
+ *        en el diario y cierra su intención. La próxima dispensación no
+ *        cambia; la reprograma medication_storage_collect_due().
  * 
  * @param med_id ID del medicamento
  * @param schedule_id ID del horario
@@ -90,6 +303,84 @@ medication_t* medication_storage_check_dispense(int64_t current_time);
  */
 esp_err_t medication_storage_mark_dispensed(const char* med_id, const char* schedule_id);
 
+/**
+ * @brief Marca como dispensada una dosis pedida por comando. Como
+ *        medication_storage_mark_dispensed(), pero además reprograma el
+ *        horario desde ahora: si la dosis programada vence en menos de
+ *        MEDICATION_MANUAL_DOSE_ADVANCE_MS, la manual la sustituye.
+ * 
+ * @param med_id ID del medicamento
+ * @param schedule_id ID del horario
+ * @return esp_err_t ESP_OK si se actualizó correctamente
+ */
+esp_err_t medication_storage_mark_manual_dispensed(const char* med_id, const char* schedule_id);
+
+/**
+ * @brief Registra una dosis que el hardware no llegó a dispensar: la anota en
+ *        el diario como fallida y cierra su intención. No descuenta la dosis
+ *        ni cambia la última dispensación.
+ * 
+ * @param med_id ID del medicamento
+ * @param schedule_id ID del horario
+ * @param due_time Recibe la hora programada de la dosis (0 si era manual); puede ser NULL
+ * @return esp_err_t ESP_OK si se actualizó correctamente
+ */
+esp_err_t medication_storage_mark_failed(const char* med_id, const char* schedule_id, int64_t *due_time);
+
+/**
+ * @brief Anota que el hardware va a empezar a dispensar una dosis. A partir de
+ *        aquí, si el equipo se reinicia antes de medication_storage_mark_dispensed(),
+ *        la dosis se da por dispensada y no se repite.
+ * 
+ * @param handle Handle del medicamento
+ * @param schedule_id ID del horario
+ * @return esp_err_t ESP_OK si quedó persistido
+ */
+esp_err_t medication_storage_dispense_started(medication_handle_t handle, const char* schedule_id);
+
+/**
+ * @brief Descarta la dispensación en curso de un horario sin registrarla
+ *        (por ejemplo, si una sincronización eliminó el horario)
+ */
+void medication_storage_dispense_discard(medication_handle_t handle, const char* schedule_id);
+
+/**
+ * @brief Resuelve las dispensaciones que quedaron a medias al apagarse el
+ *        equipo. Visita como mucho MEDICATION_INTENT_SLOTS intenciones sin
+ *        recorrer ni reescribir el resto de medicamentos. Se llama en
+ *        medication_storage_init(); las llamadas posteriores solo confirman
+ *        lo que quedó aplazado.
+ * 
+ * @param budget_ms Tiempo máximo de escritura en NVS (0 = sin límite). Lo que
+ *                  no cabe queda resuelto en memoria y se confirma después.
+ * @return int Número de resoluciones aplazadas
+ */
+int medication_storage_recover_dispenses(int64_t budget_ms);
+
+/**
+ * @brief Copia las dosis resueltas en el arranque que aún no se han notificado
+ * 
+ * @param doses Arreglo de salida
+ * @param max_doses Capacidad de doses
+ * @return int Número de dosis copiadas
+ */
+int medication_storage_get_recovered(medication_recovered_dose_t *doses, int max_doses);
+
+/**
+ * @brief Olvida las dosis recuperadas una vez notificadas
+ */
+void medication_storage_clear_recovered(void);
+
+/**
+ * @brief Registra que una dosis fue tomada (se anota en el diario de dosis)
+ * 
+ * @param med_id ID del medicamento
+ * @param schedule_id ID del horario
+ * @param taken_time Momento de la toma en ms
+ * @return esp_err_t ESP_OK si se registró correctamente
+ */
+esp_err_t medication_storage_mark_taken(const char* med_id, const char* schedule_id, int64_t taken_time);
+
 /**
  * @brief Guarda el estado actual del almacenamiento de medicamentos
  * 
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "medication_ultrasonic.h"
+#include "medication_hal.h"
+
+static const char *TAG = "MED_ULTRASONIC";
+
+#define ULTRASONIC_ECHO_MIN_US        116      // ~2 cm, mínimo del sensor
+#define ULTRASONIC_ECHO_MAX_US        12000    // ~2 m, máximo del sensor
+#define ULTRASONIC_READ_TIMEOUT_MS    50       // Disparo + eco máximo + reposo
+#define MIN_TIME_BETWEEN_READINGS_US  60000    // Intervalo mínimo entre disparos (60ms)
+#define ULTRASONIC_US_TO_CM           (0.034f / 2)
+
+static const medication_hal_t *const hal = &medication_hal_platform;
+
+static SemaphoreHandle_t sensor_mutex = NULL;
+static bool sensor_ready = false;
+static int64_t last_trigger_time = 0;
+
+static esp_err_t read_locked(float *distance_cm) {
+    // Respetar el intervalo del sensor sin ocupar la CPU
+    int64_t elapsed = hal->now_us() - last_trigger_time;
+    if (elapsed < MIN_TIME_BETWEEN_READINGS_US) {
+        uint32_t wait_ms = (MIN_TIME_BETWEEN_READINGS_US - elapsed + 999) / 1000;
+        hal->delay_ms(wait_ms + portTICK_PERIOD_MS);
+    }
+
+    uint32_t width = 0;
+    last_trigger_time = hal->now_us();
+    esp_err_t err = hal->echo_capture(&width, ULTRASONIC_READ_TIMEOUT_MS);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (width < ULTRASONIC_ECHO_MIN_US || width > ULTRASONIC_ECHO_MAX_US) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *distance_cm = width * ULTRASONIC_US_TO_CM;
+    return ESP_OK;
+}
+
+esp_err_t medication_ultrasonic_init(int trigger_pin, int echo_pin) {
+    if (sensor_ready) {
+        return ESP_OK;
+    }
+
+    sensor_mutex = xSemaphoreCreateMutex();
+    if (!sensor_mutex) {
+        ESP_LOGE(TAG, "No hay memoria para el sensor ultrasónico");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = hal->echo_init(trigger_pin, echo_pin);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error configurando el sensor ultrasónico: %s", esp_err_to_name(err));
+        medication_ultrasonic_deinit();
+        return err;
+    }
+
+    sensor_ready = true;
+    last_trigger_time = 0;
+    ESP_LOGI(TAG, "Sensor ultrasónico en %s (TRIG %d, ECHO %d)", hal->name, trigger_pin, echo_pin);
+    return ESP_OK;
+}
+
+void medication_ultrasonic_deinit(void) {
+    if (sensor_ready) {
+        hal->echo_deinit();
+        sensor_ready = false;
+    }
+    if (sensor_mutex) {
+        vSemaphoreDelete(sensor_mutex);
+        sensor_mutex = NULL;
+    }
+}
+
+esp_err_t medication_ultrasonic_read(float *distance_cm) {
+    if (!distance_cm) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!sensor_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(sensor_mutex, portMAX_DELAY);
+    esp_err_t err = read_locked(distance_cm);
+    xSemaphoreGive(sensor_mutex);
+
+    return err;
+}
+
+esp_err_t medication_ultrasonic_measure(ultrasonic_measurement_t *out) {
+    if (!out) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(out, 0, sizeof(*out));
+    if (!sensor_ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    float samples[ULTRASONIC_SAMPLES];
+    int valid = 0;
+
+    xSemaphoreTake(sensor_mutex, portMAX_DELAY);
+    for (int i = 0; i < ULTRASONIC_SAMPLES; i++) {
+        float distance;
+        if (read_locked(&distance) == ESP_OK) {
+            // Inserción ordenada: la mediana sale directamente
+            int j = valid++;
+            while (j > 0 && samples[j - 1] > distance) {
+                samples[j] = samples[j - 1];
+                j--;
+            }
+            samples[j] = distance;
+        }
+        // Sin lecturas suficientes posibles no merece la pena seguir
+        if (valid + (ULTRASONIC_SAMPLES - 1 - i) < ULTRASONIC_MIN_VALID_SAMPLES) {
+            break;
+        }
+    }
+    xSemaphoreGive(sensor_mutex);
+
+    out->valid_samples = valid;
+    if (valid == 0) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    float median = (valid % 2) ? samples[valid / 2]
+                               : (samples[valid / 2 - 1] + samples[valid / 2]) / 2;
+    for (int i = 0; i < valid; i++) {
+        float diff = samples[i] - median;
+        if (diff >= -ULTRASONIC_OUTLIER_CM && diff <= ULTRASONIC_OUTLIER_CM) {
+            out->inlier_samples++;
+        }
+    }
+    out->distance_cm = median;
+
+    return out->inlier_samples >= ULTRASONIC_MIN_VALID_SAMPLES ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
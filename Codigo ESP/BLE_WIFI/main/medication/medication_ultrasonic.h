@@ -0,0 +1,54 @@
+#ifndef MEDICATION_ULTRASONIC_H
+#define MEDICATION_ULTRASONIC_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Lecturas que se filtran en cada medida (mediana)
+#define ULTRASONIC_SAMPLES            5
+// Lecturas coherentes con la mediana necesarias para aceptar la medida
+#define ULTRASONIC_MIN_VALID_SAMPLES  3
+// Distancia a la mediana a partir de la cual una lectura es un valor atípico
+#define ULTRASONIC_OUTLIER_CM         3.0f
+
+/**
+ * @brief Medida filtrada del sensor ultrasónico
+ */
+typedef struct {
+    float distance_cm;            // Mediana de las lecturas válidas
+    uint8_t valid_samples;        // Lecturas dentro del rango del sensor
+    uint8_t inlier_samples;       // Lecturas cercanas a la mediana
+} ultrasonic_measurement_t;
+
+/**
+ * @brief Configura el disparo y la captura del eco (RMT en el ESP32)
+ * @param trigger_pin Pin TRIG del sensor
+ * @param echo_pin Pin ECHO del sensor
+ * @return ESP_OK si se inicializó correctamente
+ */
+esp_err_t medication_ultrasonic_init(int trigger_pin, int echo_pin);
+
+/**
+ * @brief Libera el canal de captura
+ */
+void medication_ultrasonic_deinit(void);
+
+/**
+ * @brief Toma una sola lectura. El ancho del eco lo mide el periférico y la
+ *        tarea queda bloqueada (sin consumir CPU) hasta que termina.
+ * @param distance_cm Recibe la distancia en cm
+ * @return ESP_OK, ESP_ERR_TIMEOUT si no hubo eco o ESP_ERR_INVALID_SIZE si
+ *         la distancia está fuera del rango del sensor
+ */
+esp_err_t medication_ultrasonic_read(float *distance_cm);
+
+/**
+ * @brief Toma ULTRASONIC_SAMPLES lecturas respetando el intervalo mínimo del
+ *        sensor y devuelve su mediana descartando valores atípicos
+ * @param out Recibe la medida filtrada
+ * @return ESP_OK si hubo al menos ULTRASONIC_MIN_VALID_SAMPLES lecturas
+ *         coherentes, ESP_ERR_INVALID_RESPONSE si no
+ */
+esp_err_t medication_ultrasonic_measure(ultrasonic_measurement_t *out);
+
+#endif /* MEDICATION_ULTRASONIC_H */
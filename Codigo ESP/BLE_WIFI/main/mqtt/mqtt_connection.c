@@ -23,13 +23,11 @@ static esp_timer_handle_t reconnect_timer = NULL;
 static int mqtt_retry_count = 0;
 static bool mqtt_connected = false;
 static char device_ip[16] = "0.0.0.0"; // Default IP
+static bool receiving_command = false;  // El mensaje en curso es del tópico de comandos
 
 // Declaración de la función publish_json_status que no estaba definida
 static void publish_json_status(const char* status);
 
-// Declaración de la función process_json_command que debería estar en mqtt_subscription.c
-extern void process_json_command(const char* json_str);
-
 // Declaraciones adelantadas para las funciones privadas
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
 
@@ -182,18 +180,18 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
             printf("DATA=%.*s\r\n", event->data_len, event->data);
             
-            // Crear una copia terminada en NULL del mensaje
-            char *data_copy = malloc(event->data_len + 1);
-            if (data_copy) {
-                memcpy(data_copy, event->data, event->data_len);
-                data_copy[event->data_len] = '\0';
-                
-                // Procesar como JSON para cualquier tópico relacionado con comandos
-                if (strncmp(event->topic, MQTT_TOPIC_DEVICE_COMMANDS, strlen(MQTT_TOPIC_DEVICE_COMMANDS)) == 0) {
-                    process_json_command(data_copy);
-                }
-                
-                free(data_copy);
+            // Los mensajes grandes llegan en varios eventos; solo el primero
+            // trae el tópico, así que se recuerda para los fragmentos siguientes
+            if (event->current_data_offset == 0) {
+                receiving_command = event->topic &&
+                    strncmp(event->topic, MQTT_TOPIC_DEVICE_COMMANDS, strlen(MQTT_TOPIC_DEVICE_COMMANDS)) == 0;
+            }
+            
+            // Procesar como JSON para cualquier tópico relacionado con comandos.
+            // Se parsea directamente el buffer del evento, sin copiarlo.
+            if (receiving_command) {
+                process_json_command_fragment(event->data, event->data_len,
+                                              event->current_data_offset, event->total_data_len);
             }
             break;
             
@@ -1,4 +1,4 @@
-#include <string.h>         // Para strcmp, strstr
+#include <string.h>         // Para strcmp
 #include <stdio.h>          // Para funciones de E/S
 #include "mqtt_subscription.h"
 #include "mqtt_connection.h"
@@ -13,6 +13,13 @@
 #include "mqtt_client.h"    // Para esp_mqtt_client_handle_t y funciones MQTT
 #include "medication/medication_storage.h" // Incluir el encabezado de gestión de medicamentos
 #include "medication/medication_dispenser.h"
+#include "medication/medication_json_stream.h"
+#include "medication/medication_latency.h"
+#include "medication/medication_inventory.h"
+#include "medication/medication_presence.h"
+#include "medication/medication_boot.h"
+#include "medication/medication_dispense_job.h"
+#include "medication/medication_pump.h"
 #include "../ntp_func.h"  // Para acceder a las funciones de tiempo NTP
 
 static const char *TAG = "MQTT_SUB";
@@ -20,6 +27,10 @@ static const char *TAG = "MQTT_SUB";
 // Definir para usar respuestas ultra rápidas a ping
 #define MQTT_USE_FAST_PING_RESPONSE true
 
+// Mensajes mayores que esto (o fragmentados por el cliente MQTT) se analizan
+// por flujo en lugar de construir el árbol cJSON completo
+#define MQTT_STREAM_THRESHOLD 2048
+
 // Declaración externa para la función de procesamiento de comandos LED
 extern void process_led_command(char command);
 
@@ -50,72 +61,344 @@ char* mqtt_sub_get_device_ip(void) {
     return device_ip_buffer;
 }
 
-void process_json_command(const char* json_str) {
-    if (!json_str) {
-        ESP_LOGE(TAG, "JSON string is null");
+// Manejador de un comando: recibe el documento ya parseado y su "payload"
+typedef void (*command_handler_t)(const cJSON *root, const cJSON *payload);
+
+static void handle_led_a(const cJSON *root, const cJSON *payload) {
+    process_led_command('A');
+}
+
+static void handle_led_b(const cJSON *root, const cJSON *payload) {
+    process_led_command('B');
+}
+
+static void handle_led_c(const cJSON *root, const cJSON *payload) {
+    process_led_command('C');
+}
+
+static void publish_sync_result(esp_err_t result, int64_t timestamp) {
+    // Enviar confirmación según resultado
+    if (result == ESP_OK) {
+        mqtt_app_publish_med_confirmation(true, 
+            "Sincronización de medicamentos completada con éxito", 
+            timestamp);
+    } else {
+        char error_msg[100];
+        snprintf(error_msg, sizeof(error_msg), 
+            "Error al procesar medicamentos: %s", esp_err_to_name(result));
+        mqtt_app_publish_med_confirmation(false, error_msg, timestamp);
+    }
+}
+
+static void handle_sync_schedules(const cJSON *root, const cJSON *payload) {
+    ESP_LOGI(TAG, "Procesando sincronización de medicamentos");
+    
+    // Obtener timestamp original si existe
+    int64_t timestamp = 0;
+    cJSON *ts = cJSON_GetObjectItem(root, "timestamp");
+    if (ts && cJSON_IsNumber(ts)) {
+        timestamp = (int64_t)ts->valuedouble;
+    }
+    
+    // El almacenamiento trabaja sobre el mismo árbol, sin volver a parsear
+    esp_err_t result = medication_storage_apply_sync(payload);
+    medication_dispenser_notify_schedule_changed();
+    publish_sync_result(result, timestamp);
+}
+
+static void handle_get_telemetry(const cJSON *root, const cJSON *payload) {
+    // Solicitud de telemetría bajo demanda
+    cJSON *telemetry = cJSON_CreateObject();
+    cJSON_AddNumberToObject(telemetry, "uptime_s", esp_timer_get_time() / 1000000);
+    cJSON_AddNumberToObject(telemetry, "free_heap", esp_get_free_heap_size());
+    cJSON_AddNumberToObject(telemetry, "active_led", mqtt_app_get_active_led());
+    
+    // Histogramas de latencia por fase de dispensación; "resetLatency"
+    // empieza una nueva ventana de medida tras exportarlos
+    cJSON *reset = cJSON_GetObjectItem(payload, "resetLatency");
+    medication_latency_to_json(telemetry, reset && cJSON_IsTrue(reset));
+    
+    // Previsión de agotamiento de cada medicamento
+    medication_inventory_to_json(telemetry);
+    
+    // Estado del recipiente y últimas lecturas del sensor
+    medication_presence_to_json(telemetry);
+    
+    // Tiempo hasta estar listo tras el último reinicio y resultado del autotest
+    medication_boot_to_json(telemetry);
+    
+    // Tabla de caudal de la bomba de líquidos
+    medication_pump_to_json(telemetry);
+    mqtt_pub_telemetry(telemetry);
+}
+
+// Agenda de las próximas tomas para la app
+#define AGENDA_DEFAULT_DOSES 10
+#define AGENDA_MAX_DOSES 24
+
+static void handle_get_agenda(const cJSON *root, const cJSON *payload) {
+    int max_doses = AGENDA_DEFAULT_DOSES;
+    cJSON *count = cJSON_GetObjectItem(payload, "count");
+    if (count && cJSON_IsNumber(count) && count->valueint > 0) {
+        max_doses = count->valueint < AGENDA_MAX_DOSES ? count->valueint : AGENDA_MAX_DOSES;
+    }
+    
+    cJSON *agenda = cJSON_CreateObject();
+    if (!agenda) {
         return;
     }
     
-    cJSON *root = cJSON_Parse(json_str);
-    if (!root) {
-        ESP_LOGE(TAG, "Error parsing JSON: %s", cJSON_GetErrorPtr());
+    // El JSON se construye con el almacenamiento bloqueado y se publica después
+    medication_storage_lock();
+    medication_upcoming_dose_t doses[AGENDA_MAX_DOSES];
+    int found = medication_storage_get_upcoming(doses, max_doses);
+    
+    int med_count;
+    medication_t *meds = medication_storage_get_all_medications(&med_count);
+    
+    cJSON_AddStringToObject(agenda, "kind", "agenda");
+    cJSON *items = cJSON_AddArrayToObject(agenda, "doses");
+    
+    for (int i = 0; i < found && items; i++) {
+        const medication_t *med = &meds[doses[i].med_index];
+        cJSON *item = cJSON_CreateObject();
+        if (!item) {
+            break;
+        }
+        cJSON_AddStringToObject(item, "medicationId", med->id);
+        cJSON_AddStringToObject(item, "name", med->name);
+        cJSON_AddStringToObject(item, "scheduleId", med->schedules[doses[i].sched_index].id);
+        cJSON_AddNumberToObject(item, "time", (double)doses[i].time);
+        cJSON_AddItemToArray(items, item);
+    }
+    medication_storage_unlock();
+    
+    mqtt_pub_telemetry(agenda);
+}
+
+static void handle_dispense_medication(const cJSON *root, const cJSON *payload) {
+    // Comando para dispensar manualmente un medicamento
+    cJSON *med_id = cJSON_GetObjectItem(payload, "medication_id");
+    cJSON *sched_id = cJSON_GetObjectItem(payload, "schedule_id");
+    
+    if (!med_id || !cJSON_IsString(med_id) || !sched_id || !cJSON_IsString(sched_id)) {
+        ESP_LOGW(TAG, "Faltan parámetros para dispensar medicamento");
         return;
     }
     
-    // Validar timestamp para asegurarnos de que NTP está sincronizado
-    int64_t current_time = get_time_ms();
-    if (current_time < 1577836800000) { // 01/01/2020 como mínimo
-        ESP_LOGW(TAG, "Tiempo no sincronizado correctamente, comandos pueden ser rechazados");
+    ESP_LOGI(TAG, "Dispensando medicamento %s (schedule %s) manualmente", 
+            med_id->valuestring, sched_id->valuestring);
+    
+    // Llamar a la función de dispensación manual
+    esp_err_t result = medication_dispenser_manual_dispense(med_id->valuestring, sched_id->valuestring);
+    
+    // Si se encoló, la confirmación se envía al terminar la dispensación
+    if (result != ESP_OK) {
+        mqtt_app_publish_med_confirmation(false, "Error al dispensar medicamento", 0);
+    }
+}
+
+static void handle_set_auto_dispense(const cJSON *root, const cJSON *payload) {
+    // Comando para configurar dispensación automática
+    cJSON *enabled = cJSON_GetObjectItem(payload, "enabled");
+    
+    if (!enabled || !cJSON_IsBool(enabled)) {
+        ESP_LOGW(TAG, "Parámetro inválido para set_auto_dispense");
+        return;
+    }
+    
+    bool auto_enabled = cJSON_IsTrue(enabled);
+    medication_dispenser_set_auto_dispense(auto_enabled);
+    mqtt_app_publish_med_confirmation(true, 
+        auto_enabled ? "Dispensación automática activada" : "Dispensación automática desactivada", 0);
+}
+
+static void handle_set_dose_group_window(const cJSON *root, const cJSON *payload) {
+    // Comando para configurar la ventana de agrupación de dosis
+    cJSON *window = cJSON_GetObjectItem(payload, "window_seconds");
+    
+    if (!window || !cJSON_IsNumber(window) || window->valueint < 0 || window->valueint > 3600) {
+        ESP_LOGW(TAG, "Parámetro inválido para set_dose_group_window");
+        return;
+    }
+    
+    medication_dispenser_set_dose_group_window((uint32_t)window->valueint * 1000);
+    mqtt_app_publish_med_confirmation(true, "Ventana de agrupación de dosis actualizada", 0);
+}
+
+static void handle_run_self_test(const cJSON *root, const cJSON *payload) {
+    // Autotest del hardware en la tarea de dispensación, sin adelantarse a
+    // ninguna dosis; el resultado se consulta con get_telemetry
+    esp_err_t result = medication_dispense_job_request_self_test(medication_boot_self_test_done);
+    mqtt_app_publish_med_confirmation(result == ESP_OK,
+        result == ESP_OK ? "Autotest del hardware programado" : "No se pudo programar el autotest", 0);
+}
+
+// Fin de la pasada de calibración, en la tarea de dispensación
+static void pump_calibration_done(esp_err_t result, uint8_t duty, uint32_t run_ms) {
+    char msg[96];
+    if (result == ESP_OK) {
+        snprintf(msg, sizeof(msg), "Bomba a %d%% durante %lu ms: envíe el volumen recogido",
+                 duty, (unsigned long)run_ms);
+    } else {
+        snprintf(msg, sizeof(msg), "Error en la calibración de la bomba: %s", esp_err_to_name(result));
+    }
+    mqtt_app_publish_med_confirmation(result == ESP_OK, msg, 0);
+}
+
+static void handle_calibrate_pump(const cJSON *root, const cJSON *payload) {
+    // Pasada de calibración: la bomba funciona a "duty" un tiempo fijo con un
+    // vaso medidor debajo; el volumen se envía después con set_pump_calibration
+    cJSON *duty = cJSON_GetObjectItem(payload, "duty");
+    
+    if (!duty || !cJSON_IsNumber(duty) || !medication_pump_is_cal_duty((uint8_t)duty->valueint)) {
+        ESP_LOGW(TAG, "Parámetro inválido para calibrate_pump");
+        mqtt_app_publish_med_confirmation(false, "Duty cycle fuera de la tabla de calibración", 0);
+        return;
     }
     
-    // Reemplazar la sección de detección de ping
+    esp_err_t result = medication_dispense_job_request_pump_calibration((uint8_t)duty->valueint,
+                                                                        pump_calibration_done);
+    if (result != ESP_OK) {
+        mqtt_app_publish_med_confirmation(false, "No se pudo programar la calibración de la bomba", 0);
+    }
+}
+
+static void handle_set_pump_calibration(const cJSON *root, const cJSON *payload) {
+    // Volumen recogido en la última pasada a "duty", o "reset" para volver al
+    // caudal de fábrica
+    cJSON *reset = cJSON_GetObjectItem(payload, "reset");
+    if (reset && cJSON_IsTrue(reset)) {
+        esp_err_t result = medication_pump_reset_calibration();
+        mqtt_app_publish_med_confirmation(result == ESP_OK,
+            result == ESP_OK ? "Calibración de la bomba restablecida" : "Error al restablecer la calibración", 0);
+        return;
+    }
+    
+    cJSON *duty = cJSON_GetObjectItem(payload, "duty");
+    cJSON *ml = cJSON_GetObjectItem(payload, "ml");
+    if (!duty || !cJSON_IsNumber(duty) || !ml || !cJSON_IsNumber(ml) || ml->valuedouble <= 0) {
+        ESP_LOGW(TAG, "Parámetros inválidos para set_pump_calibration");
+        return;
+    }
+    
+    esp_err_t result = medication_pump_calibrate_point((uint8_t)duty->valueint, MEDICATION_PUMP_CAL_RUN_MS,
+                                                       (uint32_t)(ml->valuedouble * 1000 + 0.5));
+    mqtt_app_publish_med_confirmation(result == ESP_OK,
+        result == ESP_OK ? "Calibración de la bomba guardada" : "Error al guardar la calibración", 0);
+}
+
+static const struct {
+    const char *cmd;
+    command_handler_t handler;
+} command_table[] = {
+    { "led_a",               handle_led_a },
+    { "led_b",               handle_led_b },
+    { "led_c",               handle_led_c },
+    { "syncSchedules",       handle_sync_schedules },
+    { "get_telemetry",       handle_get_telemetry },
+    { "get_agenda",          handle_get_agenda },
+    { "dispense_medication", handle_dispense_medication },
+    { "set_auto_dispense",   handle_set_auto_dispense },
+    { "set_dose_group_window", handle_set_dose_group_window },
+    { "run_self_test",       handle_run_self_test },
+    { "calibrate_pump",      handle_calibrate_pump },
+    { "set_pump_calibration", handle_set_pump_calibration },
+};
 
 #if MQTT_USE_FAST_PING_RESPONSE
-    if (strstr(json_str, "\"type\":\"ping\"") != NULL) {
-        ESP_LOGI(TAG, "Ping detectado, respondiendo rápidamente");
-        
-        // Usar cJSON para extraer el clientId de forma más robusta
-        cJSON *ping_obj = cJSON_Parse(json_str);
-        if (ping_obj) {
-            cJSON *client_id_obj = cJSON_GetObjectItem(ping_obj, "clientId");
-            const char *client_id = "";
-            
-            if (client_id_obj && cJSON_IsString(client_id_obj)) {
-                client_id = client_id_obj->valuestring;
-            }
-            
-            char pong_buffer[256];
-            snprintf(pong_buffer, sizeof(pong_buffer), 
-                    "{\"type\":\"pong\",\"status\":\"online\",\"ip\":\"%s\",\"uptime\":%llu,\"clientId\":\"%s\",\"timestamp\":%llu,\"payload\":{}}", 
-                    mqtt_sub_get_device_ip(), 
-                    esp_timer_get_time() / 1000000,
-                    client_id,
-                    esp_timer_get_time() / 1000);
-            
-            esp_mqtt_client_handle_t client = mqtt_connect_get_client();
-            if (client != NULL) {
-                ESP_LOGI(TAG, "Enviando pong al tópico: %s", MQTT_TOPIC_DEVICE_STATUS);
-                int msg_id = esp_mqtt_client_publish(client, MQTT_TOPIC_DEVICE_STATUS, pong_buffer, 0, 0, false);
-                if (msg_id >= 0) {
-                    ESP_LOGI(TAG, "Respuesta pong enviada correctamente, msg_id=%d", msg_id);
-                } else {
-                    ESP_LOGW(TAG, "Error enviando respuesta pong");
-                }
-            }
-            
-            cJSON_Delete(ping_obj);
+// Respuesta mínima a ping construida sin crear otro árbol cJSON
+static void send_fast_pong(const cJSON *root) {
+    ESP_LOGI(TAG, "Ping detectado, respondiendo rápidamente");
+    
+    const char *client_id = "";
+    cJSON *client_id_obj = cJSON_GetObjectItem(root, "clientId");
+    if (client_id_obj && cJSON_IsString(client_id_obj)) {
+        client_id = client_id_obj->valuestring;
+    }
+    
+    char pong_buffer[256];
+    snprintf(pong_buffer, sizeof(pong_buffer), 
+            "{\"type\":\"pong\",\"status\":\"online\",\"ip\":\"%s\",\"uptime\":%llu,\"clientId\":\"%s\",\"timestamp\":%llu,\"payload\":{}}", 
+            mqtt_sub_get_device_ip(), 
+            esp_timer_get_time() / 1000000,
+            client_id,
+            esp_timer_get_time() / 1000);
+    
+    esp_mqtt_client_handle_t client = mqtt_connect_get_client();
+    if (client != NULL) {
+        ESP_LOGI(TAG, "Enviando pong al tópico: %s", MQTT_TOPIC_DEVICE_STATUS);
+        int msg_id = esp_mqtt_client_publish(client, MQTT_TOPIC_DEVICE_STATUS, pong_buffer, 0, 0, false);
+        if (msg_id >= 0) {
+            ESP_LOGI(TAG, "Respuesta pong enviada correctamente, msg_id=%d", msg_id);
+        } else {
+            ESP_LOGW(TAG, "Error enviando respuesta pong");
+        }
+    }
+}
+#else
+// Respuesta detallada a ping
+static void send_detailed_pong(const cJSON *root) {
+    ESP_LOGI(TAG, "Recibido ping, respondiendo con pong");
+    
+    // Crear mensaje pong completo
+    cJSON *pong = cJSON_CreateObject();
+    cJSON_AddStringToObject(pong, "type", "pong");
+    cJSON_AddStringToObject(pong, "status", "online");
+    cJSON_AddStringToObject(pong, "ip", mqtt_sub_get_device_ip());
+    cJSON_AddNumberToObject(pong, "uptime", esp_timer_get_time() / 1000000);
+    cJSON_AddNumberToObject(pong, "free_heap", esp_get_free_heap_size());
+    cJSON_AddNumberToObject(pong, "active_led", mqtt_app_get_active_led());
+    
+    // Obtener payload del ping si existe
+    cJSON *ping_payload = cJSON_GetObjectItem(root, "payload");
+    if (ping_payload && cJSON_IsObject(ping_payload)) {
+        // Extraer cualquier información relevante del ping
+        cJSON *ping_id = cJSON_GetObjectItem(ping_payload, "id");
+        if (ping_id && cJSON_IsNumber(ping_id)) {
+            cJSON_AddNumberToObject(pong, "ping_id", ping_id->valueint);
         }
         
-        // Continuamos con el procesamiento normal por si hay más comandos
+        cJSON *timestamp = cJSON_GetObjectItem(ping_payload, "timestamp");
+        if (timestamp && cJSON_IsNumber(timestamp)) {
+            cJSON_AddNumberToObject(pong, "ping_timestamp", timestamp->valueint);
+            // Calcular latencia si se proporciona timestamp
+            cJSON_AddNumberToObject(pong, "response_time_ms", (esp_timer_get_time() / 1000) - timestamp->valueint);
+        }
     }
+    
+    // Publicar respuesta en el tópico de estado
+    char *pong_str = cJSON_Print(pong);
+    if (pong_str) {
+        esp_mqtt_client_handle_t client = mqtt_connect_get_client();
+        if (client != NULL) {
+            esp_mqtt_client_publish(client, MQTT_TOPIC_DEVICE_STATUS, pong_str, 0, 0, false);
+        }
+        free(pong_str);
+    }
+    cJSON_Delete(pong);
+}
 #endif
 
-    // Procesamiento JSON normal
+void process_json_command(const char* data, size_t len) {
+    if (!data || len == 0) {
+        ESP_LOGE(TAG, "JSON string is null");
+        return;
+    }
+    
+    // Único parseo del mensaje: todos los manejadores reciben este árbol
+    cJSON *root = cJSON_ParseWithLength(data, len);
     if (!root) {
-        ESP_LOGE(TAG, "Error al analizar JSON: %s", json_str);
+        ESP_LOGE(TAG, "Error parsing JSON: %s", cJSON_GetErrorPtr());
         return;
     }
     
+    // Validar timestamp para asegurarnos de que NTP está sincronizado
+    int64_t current_time = get_time_ms();
+    if (current_time < 1577836800000) { // 01/01/2020 como mínimo
+        ESP_LOGW(TAG, "Tiempo no sincronizado correctamente, comandos pueden ser rechazados");
+    }
+    
     // Extraer el tipo de mensaje
     cJSON *type_obj = cJSON_GetObjectItem(root, "type");
     if (!type_obj || !cJSON_IsString(type_obj)) {
@@ -126,51 +409,15 @@ void process_json_command(const char* json_str) {
     
     const char *type = type_obj->valuestring;
     
-    // Respuesta detallada a ping (solo si no estamos usando la respuesta rápida)
-#if !MQTT_USE_FAST_PING_RESPONSE
     if (strcmp(type, "ping") == 0) {
-        ESP_LOGI(TAG, "Recibido ping, respondiendo con pong");
-        
-        // Crear mensaje pong completo
-        cJSON *pong = cJSON_CreateObject();
-        cJSON_AddStringToObject(pong, "type", "pong");
-        cJSON_AddStringToObject(pong, "status", "online");
-        cJSON_AddStringToObject(pong, "ip", mqtt_sub_get_device_ip());
-        cJSON_AddNumberToObject(pong, "uptime", esp_timer_get_time() / 1000000);
-        cJSON_AddNumberToObject(pong, "free_heap", esp_get_free_heap_size());
-        cJSON_AddNumberToObject(pong, "active_led", mqtt_app_get_active_led());
-        
-        // Obtener payload del ping si existe
-        cJSON *ping_payload = cJSON_GetObjectItem(root, "payload");
-        if (ping_payload && cJSON_IsObject(ping_payload)) {
-            // Extraer cualquier información relevante del ping
-            cJSON *ping_id = cJSON_GetObjectItem(ping_payload, "id");
-            if (ping_id && cJSON_IsNumber(ping_id)) {
-                cJSON_AddNumberToObject(pong, "ping_id", ping_id->valueint);
-            }
-            
-            cJSON *timestamp = cJSON_GetObjectItem(ping_payload, "timestamp");
-            if (timestamp && cJSON_IsNumber(timestamp)) {
-                cJSON_AddNumberToObject(pong, "ping_timestamp", timestamp->valueint);
-                // Calcular latencia si se proporciona timestamp
-                cJSON_AddNumberToObject(pong, "response_time_ms", (esp_timer_get_time() / 1000) - timestamp->valueint);
-            }
-        }
-        
-        // Publicar respuesta en el tópico de estado
-        char *pong_str = cJSON_Print(pong);
-        if (pong_str) {
-            esp_mqtt_client_handle_t client = mqtt_connect_get_client();
-            if (client != NULL) {
-                esp_mqtt_client_publish(client, MQTT_TOPIC_DEVICE_STATUS, pong_str, 0, 0, false);
-            }
-            free(pong_str);
-        }
-        cJSON_Delete(pong);
+#if MQTT_USE_FAST_PING_RESPONSE
+        send_fast_pong(root);
+#else
+        send_detailed_pong(root);
+#endif
         cJSON_Delete(root);
         return;
     }
-#endif
     
     // Procesar comandos normales
     if (strcmp(type, MQTT_MSG_TYPE_COMMAND) == 0) {
@@ -181,91 +428,19 @@ void process_json_command(const char* json_str) {
             return;
         }
         
-        // Procesar comandos específicos
         cJSON *cmd = cJSON_GetObjectItem(payload, "cmd");
         if (cmd && cJSON_IsString(cmd)) {
             ESP_LOGI(TAG, "Comando recibido: %s", cmd->valuestring);
             
-            // Comandos LED
-            if (strcmp(cmd->valuestring, "led_a") == 0) {
-                process_led_command('A');
-            } 
-            else if (strcmp(cmd->valuestring, "led_b") == 0) {
-                process_led_command('B');
-            }
-            else if (strcmp(cmd->valuestring, "led_c") == 0) {
-                process_led_command('C');
-            }
-            // NUEVO: Procesamiento de comando de sincronización de medicamentos
-            else if (strcmp(cmd->valuestring, "syncSchedules") == 0) {
-                ESP_LOGI(TAG, "Procesando sincronización de medicamentos");
-                
-                // Obtener timestamp original si existe
-                int64_t timestamp = 0;
-                cJSON *ts = cJSON_GetObjectItem(root, "timestamp");
-                if (ts && cJSON_IsNumber(ts)) {
-                    timestamp = (int64_t)ts->valuedouble;
-                }
-                
-                // Procesar el JSON de medicamentos
-                esp_err_t result = medication_storage_process_json(json_str);
-                
-                // Enviar confirmación según resultado
-                if (result == ESP_OK) {
-                    mqtt_app_publish_med_confirmation(true, 
-                        "Sincronización de medicamentos completada con éxito", 
-                        timestamp);
-                } else {
-                    char error_msg[100];
-                    snprintf(error_msg, sizeof(error_msg), 
-                        "Error al procesar medicamentos: %s", esp_err_to_name(result));
-                    mqtt_app_publish_med_confirmation(false, error_msg, timestamp);
-                }
-            }
-            else if (strcmp(cmd->valuestring, "get_telemetry") == 0) {
-                // Solicitud de telemetría bajo demanda
-                cJSON *telemetry = cJSON_CreateObject();
-                cJSON_AddNumberToObject(telemetry, "uptime_s", esp_timer_get_time() / 1000000);
-                cJSON_AddNumberToObject(telemetry, "free_heap", esp_get_free_heap_size());
-                cJSON_AddNumberToObject(telemetry, "active_led", mqtt_app_get_active_led());
-                mqtt_pub_telemetry(telemetry);
-            }
-            else if (strcmp(cmd->valuestring, "dispense_medication") == 0) {
-                // Comando para dispensar manualmente un medicamento
-                cJSON *med_id = cJSON_GetObjectItem(payload, "medication_id");
-                cJSON *sched_id = cJSON_GetObjectItem(payload, "schedule_id");
-                
-                if (med_id && cJSON_IsString(med_id) && sched_id && cJSON_IsString(sched_id)) {
-                    ESP_LOGI(TAG, "Dispensando medicamento %s (schedule %s) manualmente", 
-                            med_id->valuestring, sched_id->valuestring);
-                    
-                    // Llamar a la función de dispensación manual
-                    esp_err_t result = medication_dispenser_manual_dispense(med_id->valuestring, sched_id->valuestring);
-                    
-                    // Enviar confirmación
-                    if (result == ESP_OK) {
-                        mqtt_app_publish_med_confirmation(true, "Medicamento dispensado manualmente", 0);
-                    } else {
-                        mqtt_app_publish_med_confirmation(false, "Error al dispensar medicamento", 0);
-                    }
-                } else {
-                    ESP_LOGW(TAG, "Faltan parámetros para dispensar medicamento");
+            size_t i;
+            for (i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
+                if (strcmp(cmd->valuestring, command_table[i].cmd) == 0) {
+                    command_table[i].handler(root, payload);
+                    break;
                 }
             }
-            else if (strcmp(cmd->valuestring, "set_auto_dispense") == 0) {
-                // Comando para configurar dispensación automática
-                cJSON *enabled = cJSON_GetObjectItem(payload, "enabled");
-                
-                if (enabled && cJSON_IsBool(enabled)) {
-                    bool auto_enabled = cJSON_IsTrue(enabled);
-                    medication_dispenser_set_auto_dispense(auto_enabled);
-                    mqtt_app_publish_med_confirmation(true, 
-                        auto_enabled ? "Dispensación automática activada" : "Dispensación automática desactivada", 0);
-                } else {
-                    ESP_LOGW(TAG, "Parámetro inválido para set_auto_dispense");
-                }
-            }
-            else {
+            
+            if (i == sizeof(command_table) / sizeof(command_table[0])) {
                 ESP_LOGW(TAG, "Comando desconocido: %s", cmd->valuestring);
             }
         }
@@ -274,6 +449,53 @@ void process_json_command(const char* json_str) {
     cJSON_Delete(root);
 }
 
+void process_json_command_fragment(const char* data, size_t len, size_t offset, size_t total_len) {
+    // Mensaje pequeño y completo: camino habitual con árbol cJSON
+    if (offset == 0 && len == total_len && total_len <= MQTT_STREAM_THRESHOLD) {
+        process_json_command(data, len);
+        return;
+    }
+    
+    // Mensaje grande: solo syncSchedules puede ser tan extenso, se analiza
+    // por flujo a medida que llegan los fragmentos
+    if (offset == 0) {
+        ESP_LOGI(TAG, "Mensaje de %u bytes, analizando por flujo", (unsigned)total_len);
+        medication_json_stream_begin();
+    }
+    
+    medication_json_stream_feed(data, len);
+    
+    if (offset + len < total_len) {
+        return;
+    }
+    
+    medication_json_envelope_t envelope;
+    esp_err_t result = medication_json_stream_finish(&envelope);
+    
+    bool is_sync = strcmp(envelope.type, MQTT_MSG_TYPE_COMMAND) == 0 &&
+                   strcmp(envelope.cmd, "syncSchedules") == 0;
+    if (!is_sync) {
+        ESP_LOGW(TAG, "Mensaje grande descartado: comando '%s' no admitido por flujo", envelope.cmd);
+        medication_storage_sync_end(false);
+        return;
+    }
+    
+    if (result == ESP_OK && !envelope.has_medications) {
+        ESP_LOGE(TAG, "No 'medications' array in payload");
+        result = ESP_FAIL;
+    }
+    
+    // Solo se aplica la sincronización si el documento llegó completo
+    if (result == ESP_OK) {
+        result = medication_storage_sync_end(true);
+        medication_dispenser_notify_schedule_changed();
+    } else {
+        medication_storage_sync_end(false);
+    }
+    
+    publish_sync_result(result, envelope.timestamp);
+}
+
 esp_err_t mqtt_sub_subscribe(const char *topic, int qos) {
     esp_mqtt_client_handle_t client = mqtt_connect_get_client();
     
@@ -3,13 +3,28 @@
 
 #include <esp_err.h>
 #include <stdbool.h>  // Para el tipo bool
+#include <stddef.h>
 
 /**
- * @brief Procesa un comando JSON recibido
+ * @brief Procesa un comando JSON recibido. El mensaje se parsea una sola vez
+ *        y el árbol resultante se entrega al manejador del comando.
  * 
- * @param json_str Cadena JSON recibida
+ * @param data Datos JSON recibidos (no necesitan terminar en NULL)
+ * @param len Longitud de los datos en bytes
  */
-void process_json_command(const char* json_str);
+void process_json_command(const char* data, size_t len);
+
+/**
+ * @brief Procesa un fragmento de un comando recibido. Los mensajes pequeños y
+ *        completos se delegan en process_json_command(); los grandes o
+ *        fragmentados se analizan por flujo con memoria acotada.
+ * 
+ * @param data Datos del fragmento
+ * @param len Longitud del fragmento
+ * @param offset Posición del fragmento dentro del mensaje
+ * @param total_len Longitud total del mensaje
+ */
+void process_json_command_fragment(const char* data, size_t len, size_t offset, size_t total_len);
 
 /**
  * @brief Suscribe al cliente a un tópico MQTT
@@ -9,6 +9,7 @@
 #include "esp_log.h"
 #include <string.h>
 #include <stdlib.h>
+#include "medication/medication_hal.h"
 
 static const char *TAG = "NEXTION";
 static const char *TAG_TIME = "NEXTION_TIME";
@@ -17,7 +18,7 @@ static char *current_user_name = NULL;
 static bool nextion_initialized = false;
 
 // Variables globales
-static QueueHandle_t nextion_uart_queue;
+static const medication_hal_t *const hal = &medication_hal_platform;
 static TaskHandle_t nextion_rx_task_handle = NULL;
 void nextion_time_updater_stop(void);
 bool nextion_time_updater_start(const char *user_name);
@@ -74,39 +75,10 @@ bool nextion_init(void) {
         return true;
     }
     
-    // Intentar desinstalar el driver primero por si acaso está en uso
-    uart_driver_delete(NEXTION_UART_NUM);
-    
-    // Configuración del UART
-    uart_config_t uart_config = {
-        .baud_rate = NEXTION_UART_BAUD_RATE,
-        .data_bits = UART_DATA_8_BITS,
-        .parity    = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
-    
-    // Configurar UART
-    esp_err_t ret = uart_param_config(NEXTION_UART_NUM, &uart_config);
+    // Configurar el UART de la pantalla
+    esp_err_t ret = hal->display_init(NEXTION_UART_TX_PIN, NEXTION_UART_RX_PIN, NEXTION_UART_BAUD_RATE);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error configurando parámetros UART: %d (%s)", ret, esp_err_to_name(ret));
-        return false;
-    }
-    
-    // Configurar los pines
-    ret = uart_set_pin(NEXTION_UART_NUM, NEXTION_UART_TX_PIN, NEXTION_UART_RX_PIN, 
-                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error configurando pines UART: %d (%s)", ret, esp_err_to_name(ret));
-        return false;
-    }
-    
-    // Instalar el driver
-    ret = uart_driver_install(NEXTION_UART_NUM, NEXTION_UART_BUFFER_SIZE, 
-                           NEXTION_UART_BUFFER_SIZE, 10, &nextion_uart_queue, 0);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Error instalando driver UART: %d (%s)", ret, esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Error configurando UART: %d (%s)", ret, esp_err_to_name(ret));
         return false;
     }
     
@@ -140,7 +112,7 @@ bool nextion_send_cmd(const char *cmd) {
     sprintf(full_cmd, "%s%s", cmd, NEXTION_CMD_END);
     
     // Enviar el comando
-    int sent = uart_write_bytes(NEXTION_UART_NUM, full_cmd, strlen(full_cmd));
+    int sent = hal->display_write(full_cmd, strlen(full_cmd));
     free(full_cmd);
     
     if (sent < 0) {
@@ -277,7 +249,7 @@ static void nextion_uart_rx_task(void *pvParameters) {
     
     while (1) {
         // Leer datos del UART
-        int len = uart_read_bytes(NEXTION_UART_NUM, data, sizeof(data), pdMS_TO_TICKS(100));
+        int len = hal->display_read(data, sizeof(data), 100);
         
         if (len > 0) {
             // Procesar datos recibidos
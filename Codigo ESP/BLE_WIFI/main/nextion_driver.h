@@ -7,16 +7,13 @@
 #include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
-#include "driver/uart.h"
 #include "esp_log.h"
 
-// Definiciones para la comunicación con Nextion
-#define NEXTION_UART_NUM           UART_NUM_2    // Puerto UART a usar
+// Definiciones para la comunicación con Nextion (el puerto UART lo elige
+// la plataforma, ver medication_hal.h)
 #define NEXTION_UART_BAUD_RATE     9600          // Velocidad de comunicación
 #define NEXTION_UART_TX_PIN        17            // GPIO para TX (ajustar según tu hardware)
 #define NEXTION_UART_RX_PIN        16            // GPIO para RX (ajustar según tu hardware)
-#define NEXTION_UART_BUFFER_SIZE   1024           // Tamaño del buffer
 
 // Comandos terminadores para Nextion
 #define NEXTION_CMD_END            "\xFF\xFF\xFF"